@@ -95,3 +95,10 @@ void dispmodeHMD::get_frustum(float result[6], int viewportID)
 	result[4] = nearPlane;
 	result[5] = farPlane;
 }
+
+/** Both eyes are side-by-side in the same window, so they can be
+ * drawn at the same time. */
+int dispmodeHMD::single_pass_stereo()
+{
+	return 1;
+}
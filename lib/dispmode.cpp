@@ -158,3 +158,15 @@ void dispmode::end_eye(int viewportID)
 {
 
 }
+
+/** Checks if all of the viewports can be drawn at the same time with
+ * viewmat_begin_stereo(). This requires that the viewports are in the
+ * same framebuffer and that begin_eye() and end_eye() don't do
+ * anything.
+ *
+ * @return 1 if the viewports can be drawn at once, 0 otherwise.
+ */
+int dispmode::single_pass_stereo()
+{
+	return 0;
+}
@@ -19,5 +19,6 @@ public:
 	virtual void end_frame();
 	virtual void begin_eye(int viewportID);
 	virtual void end_eye(int viewportID);
+	virtual int single_pass_stereo();
 
 };
@@ -58,7 +58,7 @@ int font_info_new(font_info* info, const GLuint program, const char* fontFile, c
 	return 0;
 	#else
 	// Set up the shader program
-	glUseProgram(program);
+	kuhl_gl_use_program(program);
 	kuhl_errorcheck();
 	
 	// Make sure it's got the right variables
@@ -75,9 +75,8 @@ int font_info_new(font_info* info, const GLuint program, const char* fontFile, c
 		return 0;
 	}
 
-	glActiveTexture(GL_TEXTURE0);
 	glGenTextures(1, &info->tex);
-	glBindTexture(GL_TEXTURE_2D, info->tex);
+	kuhl_gl_bind_texture(0, info->tex);
 	glUniform1i(info->uniform_tex, 0);
 	kuhl_errorcheck();
 	
@@ -91,7 +90,7 @@ int font_info_new(font_info* info, const GLuint program, const char* fontFile, c
 
 	glGenVertexArrays(1, &info->vao);
 	kuhl_errorcheck();
-	glBindVertexArray(info->vao);
+	kuhl_gl_bind_vertex_array(info->vao);
 	kuhl_errorcheck();
 	
 	glGenBuffers(1, &info->vbo);
@@ -138,6 +137,8 @@ void font_info_release(font_info* info)
 	glDeleteTextures(1, &info->tex);
 	glDeleteVertexArrays(1, &info->vao);
 	glDeleteBuffers(1, &info->vbo);
+	/* The texture and vertex array object may have been bound. */
+	kuhl_gl_state_invalidate();
 }
 
 void font_release() {
@@ -200,9 +201,8 @@ void font_draw(font_info* info, const char *text, float x, float y) {
 	if (info == NULL || text == NULL)
 		return;
 	
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, info->tex);
-	glBindVertexArray(info->vao);
+	kuhl_gl_bind_texture(0, info->tex);
+	kuhl_gl_bind_vertex_array(info->vao);
 	glBindBuffer(GL_ARRAY_BUFFER, info->vbo);
 	glEnableVertexAttribArray(info->attribute_coord);
 	
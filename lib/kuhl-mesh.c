@@ -0,0 +1,1183 @@
+/* Copyright (c) 2026 agent. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author agent
+ *
+ * Functions that process triangle meshes. None of these functions
+ * call OpenGL: they operate on arrays of positions and indices that
+ * the caller provides (see kuhl_geometry_attrib_get() for one way to
+ * get these arrays from a kuhl_geometry).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "kuhl-nodep.h"
+#include "kuhl-mesh.h"
+
+/** Quadric error metric of a vertex (Garland and Heckbert 1997). The
+ * upper triangle of the symmetric 4x4 matrix is stored along with
+ * the total area of the planes that were added to it so that the
+ * error can be converted back into a distance. */
+typedef struct
+{
+	double a[10]; /**< xx, xy, xz, xw, yy, yz, yw, zz, zw, ww */
+	double weight; /**< Sum of the weights of all planes in the quadric */
+} kuhl_mesh_quadric;
+
+/** An edge collapse that kuhl_mesh_simplify() might perform. */
+typedef struct
+{
+	unsigned int from; /**< Vertex that is removed */
+	unsigned int to; /**< Vertex that takes its place */
+	float error; /**< Root-mean-square distance between the new vertex position and the planes of the original triangles around both vertices */
+} kuhl_mesh_collapse;
+
+/** Adds the plane ax+by+cz+d=0 to a quadric. */
+static void kuhl_mesh_quadric_add_plane(kuhl_mesh_quadric *q, const double plane[4], double weight)
+{
+	int k = 0;
+	for(int i=0; i<4; i++)
+		for(int j=i; j<4; j++)
+			q->a[k++] += weight*plane[i]*plane[j];
+	q->weight += weight;
+}
+
+static void kuhl_mesh_quadric_add(kuhl_mesh_quadric *q, const kuhl_mesh_quadric *other)
+{
+	for(int i=0; i<10; i++)
+		q->a[i] += other->a[i];
+	q->weight += other->weight;
+}
+
+/** Calculates the average squared distance between a point and the
+ * planes in a quadric. */
+static double kuhl_mesh_quadric_error(const kuhl_mesh_quadric *q, const float p[3])
+{
+	if(q->weight <= 0)
+		return 0;
+	double x = p[0], y = p[1], z = p[2];
+	const double *a = q->a;
+	double e = a[0]*x*x + 2*a[1]*x*y + 2*a[2]*x*z + 2*a[3]*x
+		+ a[4]*y*y + 2*a[5]*y*z + 2*a[6]*y
+		+ a[7]*z*z + 2*a[8]*z
+		+ a[9];
+	return e > 0 ? e / q->weight : 0;
+}
+
+static void kuhl_mesh_normal(double n[3], const float a[3], const float b[3], const float c[3])
+{
+	double u[3] = { b[0]-a[0], b[1]-a[1], b[2]-a[2] };
+	double v[3] = { c[0]-a[0], c[1]-a[1], c[2]-a[2] };
+	n[0] = u[1]*v[2] - u[2]*v[1];
+	n[1] = u[2]*v[0] - u[0]*v[2];
+	n[2] = u[0]*v[1] - u[1]*v[0];
+}
+
+static int kuhl_mesh_collapse_compare(const void *a, const void *b)
+{
+	float ea = ((const kuhl_mesh_collapse*)a)->error;
+	float eb = ((const kuhl_mesh_collapse*)b)->error;
+	return (ea > eb) - (ea < eb);
+}
+
+static int kuhl_mesh_edge_compare(const void *a, const void *b)
+{
+	unsigned long long ea = *(const unsigned long long*)a;
+	unsigned long long eb = *(const unsigned long long*)b;
+	return (ea > eb) - (ea < eb);
+}
+
+/** Finds vertices that share a position.
+ *
+ * @param positions Vertex positions (see kuhl_mesh_simplify()).
+ * @param vertexCount Number of vertices.
+ * @param stride Number of floats between the start of each position.
+ *
+ * @return An array which maps each vertex to the first vertex that
+ * has the same position. The caller should free() it.
+ */
+static unsigned int* kuhl_mesh_position_remap(const float *positions, unsigned int vertexCount, unsigned int stride)
+{
+	unsigned int tableSize = 1;
+	while(tableSize < vertexCount*2)
+		tableSize *= 2;
+	unsigned int *table = (unsigned int*) kuhl_malloc(sizeof(unsigned int)*tableSize);
+	memset(table, 0xff, sizeof(unsigned int)*tableSize);
+	unsigned int *remap = (unsigned int*) kuhl_malloc(sizeof(unsigned int)*vertexCount);
+
+	for(unsigned int i=0; i<vertexCount; i++)
+	{
+		const float *p = positions + (size_t)i*stride;
+		unsigned int bits[3];
+		memcpy(bits, p, sizeof(bits));
+		unsigned int hash = (bits[0]*73856093u) ^ (bits[1]*19349663u) ^ (bits[2]*83492791u);
+		unsigned int slot = hash & (tableSize-1);
+		while(table[slot] != 0xffffffffu &&
+		      memcmp(positions + (size_t)table[slot]*stride, p, sizeof(float)*3) != 0)
+			slot = (slot+1) & (tableSize-1);
+		if(table[slot] == 0xffffffffu)
+			table[slot] = i;
+		remap[i] = table[slot];
+	}
+	free(table);
+	return remap;
+}
+
+/** Reduces the number of triangles in a mesh by repeatedly collapsing
+ * the edge that changes the shape of the mesh the least. Each
+ * collapse moves one vertex onto one of its neighbors, so the
+ * simplified mesh uses a subset of the original vertices and only the
+ * indices need to change.
+ *
+ * Vertices on the border of the mesh and vertices that share a
+ * position with another vertex (for example, at a texture seam) are
+ * never moved so that holes and texture seams don't open up.
+ * Collapses that would flip a triangle over are skipped.
+ *
+ * @param dest Array of at least indexCount values where the new
+ * indices are written. It may point to the same array as indices.
+ *
+ * @param indices Indices of the triangles in the mesh.
+ *
+ * @param indexCount Number of indices (a multiple of 3).
+ *
+ * @param positions Vertex positions. Each position is 3 floats.
+ *
+ * @param vertexCount Number of vertices in positions.
+ *
+ * @param stride Number of floats from the start of one position to
+ * the start of the next one (3 if positions are tightly packed).
+ *
+ * @param targetIndexCount Stop simplifying once the mesh has this
+ * many indices or fewer.
+ *
+ * @param targetError Stop simplifying before the error of a collapse
+ * would exceed this distance (in the same units as positions). The
+ * error of a collapse is the area-weighted root-mean-square distance
+ * between the vertex's new position and the planes of the original
+ * triangles around it. It is an average, so individual points on the
+ * surface may move further than this.
+ *
+ * @param resultError If not NULL, set to the largest error (as
+ * defined for targetError) of a collapse that was performed.
+ *
+ * @return The number of indices written to dest.
+ */
+unsigned int kuhl_mesh_simplify(unsigned int *dest, const unsigned int *indices, unsigned int indexCount,
+                                const float *positions, unsigned int vertexCount, unsigned int stride,
+                                unsigned int targetIndexCount, float targetError, float *resultError)
+{
+	if(resultError)
+		*resultError = 0;
+	if(dest != indices)
+		memcpy(dest, indices, sizeof(unsigned int)*indexCount);
+	if(indexCount <= targetIndexCount || indexCount < 3)
+		return indexCount;
+	if(indexCount % 3 != 0 || stride < 3)
+	{
+		msg(MSG_ERROR, "Can't simplify a mesh with %u indices and a stride of %u.", indexCount, stride);
+		return indexCount;
+	}
+	for(unsigned int i=0; i<indexCount; i++)
+	{
+		if(indices[i] >= vertexCount)
+		{
+			msg(MSG_ERROR, "Can't simplify a mesh: index %u refers to vertex %u but there are only %u vertices.",
+			    i, indices[i], vertexCount);
+			return indexCount;
+		}
+	}
+
+	unsigned int *remap = kuhl_mesh_position_remap(positions, vertexCount, stride);
+	unsigned char *locked = (unsigned char*) kuhl_malloc(vertexCount);
+	unsigned char *seam = (unsigned char*) kuhl_malloc(vertexCount);
+	memset(locked, 0, vertexCount);
+	memset(seam, 0, vertexCount);
+	for(unsigned int i=0; i<vertexCount; i++)
+		if(remap[i] != i)
+			seam[i] = seam[remap[i]] = 1;
+
+	/* Edges that are used by one triangle are on the border of the
+	 * mesh. Edges that are used by more than two triangles are
+	 * non-manifold. Vertices on either kind of edge aren't moved. */
+	unsigned long long *edges = (unsigned long long*) kuhl_malloc(sizeof(unsigned long long)*indexCount);
+	for(unsigned int i=0; i<indexCount; i++)
+	{
+		unsigned long long a = remap[indices[i]];
+		unsigned long long b = remap[indices[i%3 == 2 ? i-2 : i+1]];
+		edges[i] = a < b ? (a << 32) | b : (b << 32) | a;
+	}
+	qsort(edges, indexCount, sizeof(unsigned long long), kuhl_mesh_edge_compare);
+	for(unsigned int i=0; i<indexCount; )
+	{
+		unsigned int run = 1;
+		while(i+run < indexCount && edges[i+run] == edges[i])
+			run++;
+		if(run != 2)
+		{
+			locked[edges[i] >> 32] = 1;
+			locked[edges[i] & 0xffffffffu] = 1;
+		}
+		i += run;
+	}
+	free(edges);
+	for(unsigned int i=0; i<vertexCount; i++)
+		if(locked[remap[i]] || seam[i])
+			locked[i] = 1;
+
+	/* Each vertex starts with the planes of the triangles around it. */
+	kuhl_mesh_quadric *quadrics = (kuhl_mesh_quadric*) kuhl_malloc(sizeof(kuhl_mesh_quadric)*vertexCount);
+	memset(quadrics, 0, sizeof(kuhl_mesh_quadric)*vertexCount);
+	for(unsigned int i=0; i<indexCount; i+=3)
+	{
+		const float *p0 = positions + (size_t)indices[i]*stride;
+		double plane[4];
+		kuhl_mesh_normal(plane, p0,
+		                 positions + (size_t)indices[i+1]*stride,
+		                 positions + (size_t)indices[i+2]*stride);
+		double area2 = sqrt(plane[0]*plane[0] + plane[1]*plane[1] + plane[2]*plane[2]);
+		if(area2 == 0)
+			continue;
+		for(int j=0; j<3; j++)
+			plane[j] /= area2;
+		plane[3] = -(plane[0]*p0[0] + plane[1]*p0[1] + plane[2]*p0[2]);
+		for(int j=0; j<3; j++)
+			kuhl_mesh_quadric_add_plane(&quadrics[remap[indices[i+j]]], plane, area2/2);
+	}
+
+	unsigned int *collapseTo = (unsigned int*) kuhl_malloc(sizeof(unsigned int)*vertexCount);
+	unsigned char *touched = (unsigned char*) kuhl_malloc(vertexCount);
+	unsigned int *adjacencyStart = (unsigned int*) kuhl_malloc(sizeof(unsigned int)*(vertexCount+1));
+	unsigned int *adjacency = (unsigned int*) kuhl_malloc(sizeof(unsigned int)*indexCount);
+	kuhl_mesh_collapse *candidates = (kuhl_mesh_collapse*) kuhl_malloc(sizeof(kuhl_mesh_collapse)*indexCount);
+
+	float maxError = 0;
+	unsigned int count = indexCount;
+	while(count > targetIndexCount)
+	{
+		/* Find the triangles that use each vertex. */
+		memset(adjacencyStart, 0, sizeof(unsigned int)*(vertexCount+1));
+		for(unsigned int i=0; i<count; i++)
+			adjacencyStart[dest[i]+1]++;
+		for(unsigned int i=0; i<vertexCount; i++)
+			adjacencyStart[i+1] += adjacencyStart[i];
+		for(unsigned int i=0; i<count; i++)
+			adjacency[adjacencyStart[dest[i]]++] = i/3;
+		for(unsigned int i=vertexCount; i>0; i--)
+			adjacencyStart[i] = adjacencyStart[i-1];
+		adjacencyStart[0] = 0;
+
+		/* Calculate the error of collapsing each edge in the
+		 * direction that is allowed and has the smallest error. */
+		unsigned int candidateCount = 0;
+		for(unsigned int i=0; i<count; i++)
+		{
+			unsigned int a = dest[i];
+			unsigned int b = dest[i%3 == 2 ? i-2 : i+1];
+			float errorAB = -1, errorBA = -1;
+			if(!locked[a] && !seam[b])
+				errorAB = (float) sqrt(kuhl_mesh_quadric_error(&quadrics[a], positions + (size_t)b*stride) +
+				                       kuhl_mesh_quadric_error(&quadrics[b], positions + (size_t)b*stride));
+			if(!locked[b] && !seam[a])
+				errorBA = (float) sqrt(kuhl_mesh_quadric_error(&quadrics[b], positions + (size_t)a*stride) +
+				                       kuhl_mesh_quadric_error(&quadrics[a], positions + (size_t)a*stride));
+			if(errorAB < 0 && errorBA < 0)
+				continue;
+			kuhl_mesh_collapse *c = &candidates[candidateCount++];
+			if(errorBA < 0 || (errorAB >= 0 && errorAB <= errorBA))
+			{
+				c->from = a; c->to = b; c->error = errorAB;
+			}
+			else
+			{
+				c->from = b; c->to = a; c->error = errorBA;
+			}
+		}
+		qsort(candidates, candidateCount, sizeof(kuhl_mesh_collapse), kuhl_mesh_collapse_compare);
+
+		/* Perform the cheapest collapses that don't affect each
+		 * other. A vertex that is next to a collapsed vertex waits
+		 * until the next pass so that the flip test stays valid. */
+		for(unsigned int i=0; i<vertexCount; i++)
+			collapseTo[i] = i;
+		memset(touched, 0, vertexCount);
+		unsigned int removed = 0;
+		unsigned int collapses = 0;
+		for(unsigned int c=0; c<candidateCount && count - removed*3 > targetIndexCount; c++)
+		{
+			unsigned int from = candidates[c].from, to = candidates[c].to;
+			if(candidates[c].error > targetError)
+				break;
+			if(touched[from] || touched[to])
+				continue;
+
+			const float *pFrom = positions + (size_t)from*stride;
+			const float *pTo   = positions + (size_t)to*stride;
+			int flips = 0;
+			unsigned int degenerate = 0;
+			for(unsigned int t=adjacencyStart[from]; t<adjacencyStart[from+1] && !flips; t++)
+			{
+				const unsigned int *tri = dest + adjacency[t]*3;
+				if(tri[0] == to || tri[1] == to || tri[2] == to)
+				{
+					degenerate++;
+					continue;
+				}
+				/* The other two vertices, in winding order after from. */
+				int k = tri[0] == from ? 0 : (tri[1] == from ? 1 : 2);
+				const float *p1 = positions + (size_t)tri[(k+1)%3]*stride;
+				const float *p2 = positions + (size_t)tri[(k+2)%3]*stride;
+				double before[3], after[3];
+				kuhl_mesh_normal(before, pFrom, p1, p2);
+				kuhl_mesh_normal(after, pTo, p1, p2);
+				if(before[0]*after[0] + before[1]*after[1] + before[2]*after[2] <= 0)
+					flips = 1;
+			}
+			if(flips)
+				continue;
+
+			collapseTo[from] = to;
+			kuhl_mesh_quadric_add(&quadrics[to], &quadrics[from]);
+			for(unsigned int t=adjacencyStart[from]; t<adjacencyStart[from+1]; t++)
+			{
+				const unsigned int *tri = dest + adjacency[t]*3;
+				touched[tri[0]] = touched[tri[1]] = touched[tri[2]] = 1;
+			}
+			touched[to] = 1;
+			removed += degenerate;
+			collapses++;
+			if(candidates[c].error > maxError)
+				maxError = candidates[c].error;
+		}
+		if(collapses == 0)
+			break;
+
+		/* Move the collapsed vertices and remove the triangles that
+		 * no longer have any area. */
+		unsigned int newCount = 0;
+		for(unsigned int i=0; i<count; i+=3)
+		{
+			unsigned int a = collapseTo[dest[i]];
+			unsigned int b = collapseTo[dest[i+1]];
+			unsigned int c = collapseTo[dest[i+2]];
+			if(remap[a] == remap[b] || remap[b] == remap[c] || remap[a] == remap[c])
+				continue;
+			dest[newCount++] = a;
+			dest[newCount++] = b;
+			dest[newCount++] = c;
+		}
+		count = newCount;
+	}
+
+	free(candidates);
+	free(adjacency);
+	free(adjacencyStart);
+	free(touched);
+	free(collapseTo);
+	free(quadrics);
+	free(seam);
+	free(locked);
+	free(remap);
+
+	if(resultError)
+		*resultError = maxError;
+	return count;
+}
+
+/** Calculates the average cache miss ratio (ACMR) of a triangle
+ * mesh: the number of vertices that would be processed by the vertex
+ * program per triangle with a FIFO post-transform vertex cache. A
+ * value of 3 means that no vertices are reused. Well-ordered meshes
+ * approach 0.5.
+ *
+ * @param indices Indices of the triangles in the mesh.
+ *
+ * @param indexCount Number of indices (a multiple of 3).
+ *
+ * @param vertexCount Number of vertices.
+ *
+ * @param cacheSize Number of vertices in the simulated cache (for
+ * example, KUHL_MESH_CACHE_SIZE).
+ *
+ * @return The ACMR, or 0 if there are no triangles.
+ */
+float kuhl_mesh_acmr(const unsigned int *indices, unsigned int indexCount, unsigned int vertexCount, unsigned int cacheSize)
+{
+	if(indexCount < 3 || vertexCount == 0)
+		return 0;
+	/* A vertex is in the FIFO cache if fewer than cacheSize
+	 * misses have happened since it was added. */
+	unsigned int *added = (unsigned int*) kuhl_malloc(sizeof(unsigned int)*vertexCount);
+	memset(added, 0, sizeof(unsigned int)*vertexCount);
+	unsigned int misses = 0;
+	for(unsigned int i=0; i<indexCount; i++)
+	{
+		unsigned int v = indices[i];
+		if(added[v] == 0 || misses - added[v] >= cacheSize)
+			added[v] = ++misses;
+	}
+	free(added);
+	return misses / (float) (indexCount/3);
+}
+
+/** Counts the triangles that use each vertex and lists them.
+ *
+ * @param start Array of vertexCount+1 values. The triangles that
+ * use vertex v are triangles[start[v]] through triangles[start[v+1]-1].
+ *
+ * @param triangles Array of indexCount values.
+ */
+static void kuhl_mesh_adjacency(unsigned int *start, unsigned int *triangles, const unsigned int *indices,
+                                unsigned int indexCount, unsigned int vertexCount)
+{
+	memset(start, 0, sizeof(unsigned int)*(vertexCount+1));
+	for(unsigned int i=0; i<indexCount; i++)
+		start[indices[i]+1]++;
+	for(unsigned int i=0; i<vertexCount; i++)
+		start[i+1] += start[i];
+	for(unsigned int i=0; i<indexCount; i++)
+		triangles[start[indices[i]]++] = i/3;
+	for(unsigned int i=vertexCount; i>0; i--)
+		start[i] = start[i-1];
+	start[0] = 0;
+}
+
+/** Reorders the triangles of a mesh so that vertices are reused
+ * while they are still in the GPU's post-transform vertex cache
+ * ("Tipsify", Sander, Nehab and Barczak 2007). The algorithm fans
+ * around one vertex at a time and picks the next vertex among the
+ * ones that were just used, so it runs in linear time.
+ *
+ * @param dest Array of indexCount values where the reordered indices
+ * are written. It may not point to the same array as indices.
+ *
+ * @param indices Indices of the triangles in the mesh.
+ *
+ * @param indexCount Number of indices (a multiple of 3).
+ *
+ * @param vertexCount Number of vertices.
+ *
+ * @param cacheSize Size of the vertex cache to optimize for (for
+ * example, KUHL_MESH_CACHE_SIZE).
+ */
+void kuhl_mesh_optimize_vertex_cache(unsigned int *dest, const unsigned int *indices, unsigned int indexCount,
+                                     unsigned int vertexCount, unsigned int cacheSize)
+{
+	if(indexCount < 3 || indexCount % 3 != 0 || vertexCount == 0)
+	{
+		memcpy(dest, indices, sizeof(unsigned int)*indexCount);
+		return;
+	}
+
+	unsigned int *start = (unsigned int*) kuhl_malloc(sizeof(unsigned int)*(vertexCount+1));
+	unsigned int *triangles = (unsigned int*) kuhl_malloc(sizeof(unsigned int)*indexCount);
+	kuhl_mesh_adjacency(start, triangles, indices, indexCount, vertexCount);
+
+	unsigned int *live = (unsigned int*) kuhl_malloc(sizeof(unsigned int)*vertexCount);
+	unsigned int *cacheTime = (unsigned int*) kuhl_malloc(sizeof(unsigned int)*vertexCount);
+	unsigned char *emitted = (unsigned char*) kuhl_malloc(indexCount/3);
+	unsigned int *deadEnd = (unsigned int*) kuhl_malloc(sizeof(unsigned int)*indexCount);
+	unsigned int *candidates = (unsigned int*) kuhl_malloc(sizeof(unsigned int)*indexCount);
+	for(unsigned int v=0; v<vertexCount; v++)
+	{
+		live[v] = start[v+1] - start[v];
+		cacheTime[v] = 0;
+	}
+	memset(emitted, 0, indexCount/3);
+
+	unsigned int deadEndCount = 0;
+	unsigned int time = cacheSize+1;
+	unsigned int cursor = 0; // next vertex to check when we reach a dead end
+	unsigned int out = 0;
+	long fan = 0;
+	while(fan >= 0)
+	{
+		/* Emit every remaining triangle around the fanning vertex. */
+		unsigned int candidateCount = 0;
+		for(unsigned int t=start[fan]; t<start[fan+1]; t++)
+		{
+			unsigned int tri = triangles[t];
+			if(emitted[tri])
+				continue;
+			emitted[tri] = 1;
+			for(int j=0; j<3; j++)
+			{
+				unsigned int v = indices[tri*3+j];
+				dest[out++] = v;
+				deadEnd[deadEndCount++] = v;
+				candidates[candidateCount++] = v;
+				live[v]--;
+				if(time - cacheTime[v] > cacheSize)
+					cacheTime[v] = time++;
+			}
+		}
+
+		/* Pick the next vertex to fan around: one that was just used,
+		 * has triangles left and will still be in the cache after
+		 * they are emitted. Prefer the one that has been in the
+		 * cache the longest. */
+		fan = -1;
+		long best = -1;
+		for(unsigned int c=0; c<candidateCount; c++)
+		{
+			unsigned int v = candidates[c];
+			if(live[v] == 0)
+				continue;
+			long priority = 0;
+			if(time - cacheTime[v] + 2*live[v] <= cacheSize)
+				priority = time - cacheTime[v];
+			if(priority > best)
+			{
+				best = priority;
+				fan = v;
+			}
+		}
+
+		/* Dead end: go back to a recently used vertex that still has
+		 * triangles or, if there are none, the next unused vertex. */
+		while(fan < 0 && deadEndCount > 0)
+		{
+			unsigned int v = deadEnd[--deadEndCount];
+			if(live[v] > 0)
+				fan = v;
+		}
+		while(fan < 0 && cursor < vertexCount)
+		{
+			if(live[cursor] > 0)
+				fan = cursor;
+			cursor++;
+		}
+	}
+
+	free(candidates);
+	free(deadEnd);
+	free(emitted);
+	free(cacheTime);
+	free(live);
+	free(triangles);
+	free(start);
+}
+
+/** A group of triangles that kuhl_mesh_optimize_overdraw() keeps together. */
+typedef struct
+{
+	unsigned int first; /**< First index of the cluster */
+	unsigned int count; /**< Number of indices in the cluster */
+	float sortKey; /**< How much the cluster faces away from the center of the mesh */
+} kuhl_mesh_cluster;
+
+static int kuhl_mesh_cluster_compare(const void *a, const void *b)
+{
+	float ka = ((const kuhl_mesh_cluster*)a)->sortKey;
+	float kb = ((const kuhl_mesh_cluster*)b)->sortKey;
+	return (ka < kb) - (ka > kb); // largest first
+}
+
+/** Reorders groups of triangles so that the triangles on the outside
+ * of a mesh are drawn first and the ones that they are likely to
+ * cover are drawn later and rejected by the depth test (Sander, Nehab
+ * and Barczak 2007). The mesh is split into clusters at places where
+ * the vertex cache would be empty anyway, and clusters are split
+ * further as long as the ACMR of each cluster stays within threshold
+ * times the ACMR of the whole mesh. The clusters are then sorted by
+ * how much they face away from the center of the mesh. The order of
+ * triangles within each cluster does not change, so run
+ * kuhl_mesh_optimize_vertex_cache() first.
+ *
+ * @param dest Array of indexCount values where the reordered indices
+ * are written. It may not point to the same array as indices.
+ *
+ * @param indices Indices of the triangles in the mesh.
+ *
+ * @param indexCount Number of indices (a multiple of 3).
+ *
+ * @param positions Vertex positions, see kuhl_mesh_simplify().
+ *
+ * @param vertexCount Number of vertices.
+ *
+ * @param stride Number of floats from the start of one position to
+ * the start of the next one.
+ *
+ * @param cacheSize Size of the vertex cache (for example,
+ * KUHL_MESH_CACHE_SIZE).
+ *
+ * @param threshold How much worse the vertex cache may perform
+ * (1.05 allows the ACMR to increase by about 5%).
+ */
+void kuhl_mesh_optimize_overdraw(unsigned int *dest, const unsigned int *indices, unsigned int indexCount,
+                                 const float *positions, unsigned int vertexCount, unsigned int stride,
+                                 unsigned int cacheSize, float threshold)
+{
+	memcpy(dest, indices, sizeof(unsigned int)*indexCount);
+	unsigned int triangleCount = indexCount/3;
+	if(triangleCount < 2 || indexCount % 3 != 0 || vertexCount == 0)
+		return;
+
+	/* Simulate the cache to find out how many misses each triangle
+	 * causes. */
+	unsigned int *added = (unsigned int*) kuhl_malloc(sizeof(unsigned int)*vertexCount);
+	unsigned char *triangleMisses = (unsigned char*) kuhl_malloc(triangleCount);
+	memset(added, 0, sizeof(unsigned int)*vertexCount);
+	unsigned int misses = 0;
+	for(unsigned int t=0; t<triangleCount; t++)
+	{
+		triangleMisses[t] = 0;
+		for(int j=0; j<3; j++)
+		{
+			unsigned int v = indices[t*3+j];
+			if(added[v] == 0 || misses - added[v] >= cacheSize)
+			{
+				added[v] = ++misses;
+				triangleMisses[t]++;
+			}
+		}
+	}
+	float meshAcmr = misses / (float) triangleCount;
+
+	/* Split wherever all three vertices of a triangle missed the
+	 * cache. Within those clusters, split wherever the ACMR of the
+	 * cluster so far is low enough. Clusters can be drawn in any
+	 * order, so the cache is simulated as if it were empty at the
+	 * start of each cluster. */
+	kuhl_mesh_cluster *clusters = (kuhl_mesh_cluster*) kuhl_malloc(sizeof(kuhl_mesh_cluster)*triangleCount);
+	unsigned int clusterCount = 0;
+	unsigned int clusterStart = 0, clusterMisses = 0;
+	memset(added, 0, sizeof(unsigned int)*vertexCount);
+	misses = 0;
+	for(unsigned int t=0; t<triangleCount; t++)
+	{
+		if(t > clusterStart && triangleMisses[t] == 3)
+		{
+			clusters[clusterCount].first = clusterStart*3;
+			clusters[clusterCount++].count = (t-clusterStart)*3;
+			clusterStart = t;
+			clusterMisses = 0;
+			misses += cacheSize; // empty the cache
+		}
+		for(int j=0; j<3; j++)
+		{
+			unsigned int v = indices[t*3+j];
+			if(added[v] == 0 || misses - added[v] >= cacheSize)
+			{
+				added[v] = ++misses;
+				clusterMisses++;
+			}
+		}
+		unsigned int size = t+1 - clusterStart;
+		if(clusterMisses <= threshold * meshAcmr * size)
+		{
+			clusters[clusterCount].first = clusterStart*3;
+			clusters[clusterCount++].count = size*3;
+			clusterStart = t+1;
+			clusterMisses = 0;
+			misses += cacheSize;
+		}
+	}
+	if(clusterStart < triangleCount)
+	{
+		clusters[clusterCount].first = clusterStart*3;
+		clusters[clusterCount++].count = (triangleCount-clusterStart)*3;
+	}
+	free(added);
+	free(triangleMisses);
+
+	/* Find the area-weighted center and the average normal of each
+	 * cluster and the center of the whole mesh. */
+	float *clusterInfo = (float*) kuhl_malloc(sizeof(float)*6*clusterCount);
+	double meshCenter[3] = { 0, 0, 0 };
+	double meshArea = 0;
+	for(unsigned int c=0; c<clusterCount; c++)
+	{
+		double center[3] = { 0, 0, 0 }, normal[3] = { 0, 0, 0 };
+		double area = 0;
+		for(unsigned int i=clusters[c].first; i<clusters[c].first+clusters[c].count; i+=3)
+		{
+			const float *p0 = positions + (size_t)indices[i]*stride;
+			const float *p1 = positions + (size_t)indices[i+1]*stride;
+			const float *p2 = positions + (size_t)indices[i+2]*stride;
+			double n[3];
+			kuhl_mesh_normal(n, p0, p1, p2);
+			double a = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+			for(int j=0; j<3; j++)
+			{
+				center[j] += a * (p0[j]+p1[j]+p2[j]) / 3;
+				normal[j] += n[j];
+			}
+			area += a;
+		}
+		for(int j=0; j<3; j++)
+			meshCenter[j] += center[j];
+		meshArea += area;
+
+		double len = sqrt(normal[0]*normal[0] + normal[1]*normal[1] + normal[2]*normal[2]);
+		for(int j=0; j<3; j++)
+		{
+			clusterInfo[c*6+j]   = (float) (area > 0 ? center[j] / area : 0);
+			clusterInfo[c*6+3+j] = (float) (len > 0 ? normal[j] / len : 0);
+		}
+	}
+	if(meshArea > 0)
+		for(int j=0; j<3; j++)
+			meshCenter[j] /= meshArea;
+
+	/* Clusters that are far from the center and face outward are
+	 * likely to cover other parts of the mesh, so draw them first. */
+	for(unsigned int c=0; c<clusterCount; c++)
+	{
+		const float *info = clusterInfo + c*6;
+		clusters[c].sortKey = (float) ((info[0]-meshCenter[0])*info[3] +
+		                               (info[1]-meshCenter[1])*info[4] +
+		                               (info[2]-meshCenter[2])*info[5]);
+	}
+	free(clusterInfo);
+	qsort(clusters, clusterCount, sizeof(kuhl_mesh_cluster), kuhl_mesh_cluster_compare);
+
+	unsigned int out = 0;
+	for(unsigned int c=0; c<clusterCount; c++)
+	{
+		memcpy(dest+out, indices+clusters[c].first, sizeof(unsigned int)*clusters[c].count);
+		out += clusters[c].count;
+	}
+	free(clusters);
+}
+
+/** Calculates a new order for the vertices of a mesh so that the
+ * vertex buffer is read from start to end while the mesh is drawn:
+ * vertices are numbered in the order in which the indices first use
+ * them. Vertices that aren't used by any triangle are moved to the
+ * end. The indices are changed to use the new numbering; the caller
+ * must reorder each vertex attribute with the remap array.
+ *
+ * @param remap Array of vertexCount values. remap[v] is set to the new
+ * position of the vertex that was at position v.
+ *
+ * @param indices Indices of the mesh, which are changed to use the
+ * new order.
+ *
+ * @param indexCount Number of indices.
+ *
+ * @param vertexCount Number of vertices.
+ *
+ * @return The number of vertices used by the indices.
+ */
+unsigned int kuhl_mesh_optimize_vertex_fetch(unsigned int *remap, unsigned int *indices, unsigned int indexCount,
+                                             unsigned int vertexCount)
+{
+	memset(remap, 0xff, sizeof(unsigned int)*vertexCount);
+	unsigned int next = 0;
+	for(unsigned int i=0; i<indexCount; i++)
+	{
+		unsigned int v = indices[i];
+		if(remap[v] == 0xffffffffu)
+			remap[v] = next++;
+		indices[i] = remap[v];
+	}
+	unsigned int used = next;
+	for(unsigned int v=0; v<vertexCount; v++)
+		if(remap[v] == 0xffffffffu)
+			remap[v] = next++;
+	return used;
+}
+
+/** Finds the cell of the grid used by kuhl_mesh_weld() that a vertex
+ * is in.
+ *
+ * @param cell Set to the cell coordinates.
+ *
+ * @param half Set to 1 for each axis where the vertex is in the upper
+ * half of its cell, 0 otherwise.
+ *
+ * @param p The position of the vertex.
+ *
+ * @param components Number of floats in p to use (at most 3).
+ *
+ * @param epsilon Half of the width of a cell. If 0, each distinct
+ * position has its own cell.
+ */
+static void kuhl_mesh_weld_cell(int cell[3], int half[3], const float *p, unsigned int components, float epsilon)
+{
+	for(unsigned int c=0; c<3; c++)
+	{
+		cell[c] = 0;
+		half[c] = 0;
+		if(c >= components)
+			continue;
+		if(epsilon > 0)
+		{
+			double scaled = p[c] / (2.0*epsilon);
+			double f = floor(scaled);
+			if(!(f > -2e9 && f < 2e9)) // also catches NaN
+				f = 0;
+			cell[c] = (int) f;
+			half[c] = scaled - f >= 0.5;
+		}
+		else
+		{
+			float value = p[c] == 0 ? 0 : p[c]; // -0 and 0 are the same position
+			memcpy(&cell[c], &value, sizeof(float));
+		}
+	}
+}
+
+/** Merges vertices whose attributes are all within a small distance
+ * of each other. This turns a mesh where each triangle has its own
+ * copy of every vertex (such as a non-indexed triangle list) into a
+ * smaller set of vertices plus indices. Vertices are hashed by their
+ * position in a grid, so only vertices in neighboring cells are
+ * compared.
+ *
+ * @param remap Array of vertexCount values. remap[v] is set to the
+ * new index of vertex v. The first vertex of each group of merged
+ * vertices keeps its values; new indices are assigned in the order
+ * that the groups first appear.
+ *
+ * @param vertices The values of all of the attributes of each
+ * vertex. The first 3 floats of each vertex should be its position
+ * (fewer if stride is less than 3).
+ *
+ * @param vertexCount Number of vertices.
+ *
+ * @param stride Number of floats per vertex.
+ *
+ * @param epsilon Vertices are merged if every one of their values
+ * differs by this much or less. Use 0 to only merge identical
+ * vertices.
+ *
+ * @return The number of vertices after merging.
+ */
+unsigned int kuhl_mesh_weld(unsigned int *remap, const float *vertices, unsigned int vertexCount,
+                            unsigned int stride, float epsilon)
+{
+	unsigned int tableSize = 1;
+	while(tableSize < vertexCount*2)
+		tableSize *= 2;
+	unsigned int *table = (unsigned int*) kuhl_malloc(sizeof(unsigned int)*tableSize);
+	memset(table, 0xff, sizeof(unsigned int)*tableSize);
+	/* First vertex and grid cell of each new vertex. */
+	unsigned int *first = (unsigned int*) kuhl_malloc(sizeof(unsigned int)*vertexCount);
+	int *cells = (int*) kuhl_malloc(sizeof(int)*3*(size_t)vertexCount);
+	unsigned int hashComponents = stride < 3 ? stride : 3;
+	unsigned int count = 0;
+
+	for(unsigned int v=0; v<vertexCount; v++)
+	{
+		const float *p = vertices + (size_t)v*stride;
+		int cell[3], half[3];
+		kuhl_mesh_weld_cell(cell, half, p, hashComponents, epsilon);
+
+		/* A vertex within epsilon of p is in p's cell or in the
+		 * neighboring cell on the side of the half that p is in. */
+		unsigned int match = 0xffffffffu;
+		unsigned int neighbors = epsilon > 0 ? 1u << hashComponents : 1;
+		for(unsigned int n=0; n<neighbors && match == 0xffffffffu; n++)
+		{
+			int look[3];
+			for(int c=0; c<3; c++)
+				look[c] = cell[c] + ((n >> c) & 1) * (half[c] ? 1 : -1);
+			unsigned int hash = ((unsigned int)look[0]*73856093u) ^ ((unsigned int)look[1]*19349663u) ^ ((unsigned int)look[2]*83492791u);
+			for(unsigned int slot = hash & (tableSize-1); table[slot] != 0xffffffffu; slot = (slot+1) & (tableSize-1))
+			{
+				unsigned int u = table[slot];
+				if(memcmp(cells + (size_t)u*3, look, sizeof(look)) != 0)
+					continue;
+				const float *q = vertices + (size_t)first[u]*stride;
+				unsigned int c = 0;
+				while(c < stride && fabsf(p[c]-q[c]) <= epsilon)
+					c++;
+				if(c == stride)
+				{
+					match = u;
+					break;
+				}
+			}
+		}
+
+		if(match == 0xffffffffu)
+		{
+			match = count++;
+			first[match] = v;
+			memcpy(cells + (size_t)match*3, cell, sizeof(cell));
+			unsigned int hash = ((unsigned int)cell[0]*73856093u) ^ ((unsigned int)cell[1]*19349663u) ^ ((unsigned int)cell[2]*83492791u);
+			unsigned int slot = hash & (tableSize-1);
+			while(table[slot] != 0xffffffffu)
+				slot = (slot+1) & (tableSize-1);
+			table[slot] = match;
+		}
+		remap[v] = match;
+	}
+
+	free(cells);
+	free(first);
+	free(table);
+	return count;
+}
+
+/** Calculates the bounding sphere and normal cone of a meshlet.
+ *
+ * @param m The meshlet; first and count must be set.
+ *
+ * @param indices The indices that m->first refers to.
+ */
+static void kuhl_mesh_meshlet_bounds(kuhl_meshlet *m, const unsigned int *indices,
+                                     const float *positions, unsigned int stride)
+{
+	float min[3], max[3];
+	for(int j=0; j<3; j++)
+	{
+		min[j] = positions[(size_t)indices[m->first]*stride+j];
+		max[j] = min[j];
+	}
+	double axis[3] = { 0, 0, 0 };
+	for(unsigned int i=m->first; i<m->first+m->count; i+=3)
+	{
+		const float *p[3];
+		for(int k=0; k<3; k++)
+		{
+			p[k] = positions + (size_t)indices[i+k]*stride;
+			for(int j=0; j<3; j++)
+			{
+				min[j] = fminf(min[j], p[k][j]);
+				max[j] = fmaxf(max[j], p[k][j]);
+			}
+		}
+		double n[3];
+		kuhl_mesh_normal(n, p[0], p[1], p[2]);
+		for(int j=0; j<3; j++)
+			axis[j] += n[j];
+	}
+
+	m->radius = 0;
+	for(int j=0; j<3; j++)
+		m->center[j] = (min[j]+max[j])/2;
+	for(unsigned int i=m->first; i<m->first+m->count; i++)
+	{
+		const float *p = positions + (size_t)indices[i]*stride;
+		float d[3] = { p[0]-m->center[0], p[1]-m->center[1], p[2]-m->center[2] };
+		float dist = sqrtf(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+		if(dist > m->radius)
+			m->radius = dist;
+	}
+
+	/* The cone contains the normal of every triangle. If the normals
+	 * point in every direction, the meshlet can't be culled. */
+	m->coneCutoff = 1;
+	double len = sqrt(axis[0]*axis[0] + axis[1]*axis[1] + axis[2]*axis[2]);
+	for(int j=0; j<3; j++)
+		m->coneAxis[j] = len > 0 ? (float)(axis[j]/len) : 0;
+	if(len == 0)
+		return;
+	double minDot = 1;
+	for(unsigned int i=m->first; i<m->first+m->count; i+=3)
+	{
+		double n[3];
+		kuhl_mesh_normal(n, positions + (size_t)indices[i]*stride,
+		                 positions + (size_t)indices[i+1]*stride,
+		                 positions + (size_t)indices[i+2]*stride);
+		double nlen = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+		if(nlen == 0)
+			continue;
+		double dot = (n[0]*m->coneAxis[0] + n[1]*m->coneAxis[1] + n[2]*m->coneAxis[2]) / nlen;
+		if(dot < minDot)
+			minDot = dot;
+	}
+	/* Store the sine of the cone's half angle. */
+	if(minDot > 0)
+		m->coneCutoff = (float) sqrt(1 - minDot*minDot);
+}
+
+/** Groups the triangles of a mesh into meshlets: small clusters of
+ * neighboring triangles that share few vertices with other meshlets.
+ * Each meshlet gets a bounding sphere and a cone that contains the
+ * normals of its triangles so that meshlets that are outside of the
+ * view frustum or that face away from the viewer can be skipped
+ * without looking at their triangles (see kuhl_mesh_meshlet_backfacing()).
+ *
+ * Meshlets are grown one triangle at a time, picking the neighboring
+ * triangle that adds the fewest new vertices. The triangles are
+ * reordered so that each meshlet is a contiguous range of indices.
+ *
+ * @param dest Array of indexCount values where the reordered indices
+ * are written. It may not point to the same array as indices.
+ *
+ * @param indices Indices of the triangles in the mesh.
+ *
+ * @param indexCount Number of indices (a multiple of 3).
+ *
+ * @param positions Vertex positions, see kuhl_mesh_simplify().
+ *
+ * @param vertexCount Number of vertices.
+ *
+ * @param stride Number of floats from the start of one position to
+ * the start of the next one.
+ *
+ * @param maxVertices Largest number of vertices in one meshlet (at
+ * least 3, for example KUHL_MESHLET_MAX_VERTICES).
+ *
+ * @param maxTriangles Largest number of triangles in one meshlet (for
+ * example, KUHL_MESHLET_MAX_TRIANGLES).
+ *
+ * @param meshletCount Set to the number of meshlets.
+ *
+ * @return A newly allocated array of meshlets which the caller should
+ * free(), or NULL if there are no triangles.
+ */
+kuhl_meshlet* kuhl_mesh_build_meshlets(unsigned int *dest, const unsigned int *indices, unsigned int indexCount,
+                                       const float *positions, unsigned int vertexCount, unsigned int stride,
+                                       unsigned int maxVertices, unsigned int maxTriangles, unsigned int *meshletCount)
+{
+	*meshletCount = 0;
+	unsigned int triangleCount = indexCount/3;
+	if(triangleCount == 0 || vertexCount == 0 || maxVertices < 3 || maxTriangles == 0)
+		return NULL;
+
+	/* Triangles are neighbors if they share a position, even if
+	 * they use different vertices (because of texture seams, for
+	 * example). */
+	unsigned int *remap = kuhl_mesh_position_remap(positions, vertexCount, stride);
+	unsigned int *welded = (unsigned int*) kuhl_malloc(sizeof(unsigned int)*indexCount);
+	for(unsigned int i=0; i<indexCount; i++)
+		welded[i] = remap[indices[i]];
+	free(remap);
+	unsigned int *start = (unsigned int*) kuhl_malloc(sizeof(unsigned int)*(vertexCount+1));
+	unsigned int *adjacent = (unsigned int*) kuhl_malloc(sizeof(unsigned int)*indexCount);
+	kuhl_mesh_adjacency(start, adjacent, welded, indexCount, vertexCount);
+
+	/* stamp[v] is the number of the meshlet (plus one) that welded
+	 * vertex v was last added to. */
+	unsigned int *stamp = (unsigned int*) kuhl_malloc(sizeof(unsigned int)*vertexCount);
+	memset(stamp, 0, sizeof(unsigned int)*vertexCount);
+	unsigned char *used = (unsigned char*) kuhl_malloc(triangleCount);
+	memset(used, 0, triangleCount);
+	unsigned int *verts = (unsigned int*) kuhl_malloc(sizeof(unsigned int)*maxVertices);
+	unsigned int vertCount = 0;
+
+	/* Grown as needed since disconnected parts of the mesh need
+	 * meshlets of their own. */
+	unsigned int capacity = triangleCount/maxTriangles + 16;
+	kuhl_meshlet *meshlets = (kuhl_meshlet*) kuhl_malloc(sizeof(kuhl_meshlet)*capacity);
+	unsigned int count = 0;
+	unsigned int written = 0;
+	unsigned int scan = 0; // all triangles before this one are used
+	kuhl_meshlet *m = NULL;
+
+	while(written < indexCount)
+	{
+		/* Pick the unused triangle touching the meshlet that adds the
+		 * fewest vertices to it. Of those, pick the one closest to
+		 * the center of the meshlet so that it stays round. */
+		unsigned int best = triangleCount, bestNew = 4;
+		float bestDist = 0;
+		float center[3] = { 0, 0, 0 };
+		for(unsigned int k=0; k<vertCount; k++)
+			for(int j=0; j<3; j++)
+				center[j] += positions[(size_t)verts[k]*stride+j] / vertCount;
+		for(unsigned int k=0; k<vertCount; k++)
+		{
+			unsigned int v = verts[k];
+			for(unsigned int a=start[v]; a<start[v+1]; a++)
+			{
+				unsigned int t = adjacent[a];
+				if(used[t])
+					continue;
+				unsigned int added = 0;
+				float dist = 0;
+				for(int j=0; j<3; j++)
+				{
+					if(stamp[welded[t*3+j]] != count)
+						added++;
+					const float *p = positions + (size_t)welded[t*3+j]*stride;
+					float d[3] = { p[0]-center[0], p[1]-center[1], p[2]-center[2] };
+					dist += d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+				}
+				if(added < bestNew || (added == bestNew && dist < bestDist))
+				{
+					best = t;
+					bestNew = added;
+					bestDist = dist;
+				}
+			}
+		}
+
+		/* Start a new meshlet if the meshlet is full or if none of
+		 * the remaining triangles touch it. A full meshlet is
+		 * followed by one of its neighbors so that the next meshlet
+		 * is nearby. */
+		if(m == NULL || best == triangleCount || m->count/3 == maxTriangles ||
+		   vertCount + bestNew > maxVertices)
+		{
+			if(count == capacity)
+			{
+				capacity *= 2;
+				meshlets = (kuhl_meshlet*) realloc(meshlets, sizeof(kuhl_meshlet)*capacity);
+			}
+			m = &meshlets[count++];
+			m->first = written;
+			m->count = 0;
+			vertCount = 0;
+		}
+		if(best == triangleCount)
+		{
+			while(used[scan])
+				scan++;
+			best = scan;
+		}
+
+		used[best] = 1;
+		for(int j=0; j<3; j++)
+		{
+			unsigned int v = welded[best*3+j];
+			dest[written++] = indices[best*3+j];
+			if(stamp[v] != count)
+			{
+				stamp[v] = count;
+				verts[vertCount++] = v;
+			}
+		}
+		m->count += 3;
+	}
+
+	for(unsigned int i=0; i<count; i++)
+		kuhl_mesh_meshlet_bounds(&meshlets[i], dest, positions, stride);
+
+	free(welded);
+	free(start);
+	free(adjacent);
+	free(stamp);
+	free(used);
+	free(verts);
+	*meshletCount = count;
+	return meshlets;
+}
+
+/** Checks if every triangle in a meshlet faces away from a viewer.
+ * Such meshlets are not visible if back-facing triangles are culled
+ * (or if the mesh is closed).
+ *
+ * @param m The meshlet, see kuhl_mesh_build_meshlets().
+ *
+ * @param viewer The position of the viewer in the same coordinates as
+ * the mesh's vertex positions.
+ *
+ * @return 1 if all of the triangles face away from the viewer, 0 if
+ * some of them might face the viewer.
+ */
+int kuhl_mesh_meshlet_backfacing(const kuhl_meshlet *m, const float viewer[3])
+{
+	if(m->coneCutoff >= 1)
+		return 0;
+	/* A triangle with normal n faces away from the viewer if the
+	 * angle between n and the direction from the viewer to the
+	 * triangle is less than 90 degrees. Every normal is within the
+	 * cone's half angle of the axis, so the direction from the
+	 * viewer to every point in the bounding sphere must be within 90
+	 * degrees minus the half angle of the axis. */
+	float d[3] = { m->center[0]-viewer[0], m->center[1]-viewer[1], m->center[2]-viewer[2] };
+	float dist = sqrtf(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+	float along = d[0]*m->coneAxis[0] + d[1]*m->coneAxis[1] + d[2]*m->coneAxis[2];
+	return along - m->radius > m->coneCutoff * (dist + m->radius);
+}
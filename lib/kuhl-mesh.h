@@ -0,0 +1,64 @@
+/* Copyright (c) 2026 agent. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author agent
+ *
+ * Functions that process triangle meshes stored as arrays of vertex
+ * positions and indices. Like kuhl-nodep.h, these functions do not
+ * depend on OpenGL so they can also be used by tools that prepare
+ * models ahead of time.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Number of vertices in the post-transform vertex cache that
+ * kuhl_mesh_optimize_vertex_cache() optimizes for and that ACMR
+ * values reported by the library are measured with. */
+#define KUHL_MESH_CACHE_SIZE 16
+
+/** Largest number of vertices in a meshlet created by the library,
+ * see kuhl_mesh_build_meshlets(). */
+#define KUHL_MESHLET_MAX_VERTICES 64
+/** Largest number of triangles in a meshlet created by the library. */
+#define KUHL_MESHLET_MAX_TRIANGLES 124
+
+/** A group of neighboring triangles that can be culled as a unit,
+ * see kuhl_mesh_build_meshlets(). */
+typedef struct
+{
+	unsigned int first; /**< Position of the meshlet's first index in the index array */
+	unsigned int count; /**< Number of indices in the meshlet */
+	float center[3]; /**< Center of a sphere that contains the meshlet */
+	float radius; /**< Radius of the bounding sphere */
+	float coneAxis[3]; /**< Unit vector in the average direction that the triangles face */
+	float coneCutoff; /**< Sine of the angle between coneAxis and the normal furthest from it (1 if the meshlet can't be culled by its normals) */
+} kuhl_meshlet;
+
+unsigned int kuhl_mesh_simplify(unsigned int *dest, const unsigned int *indices, unsigned int indexCount,
+                                const float *positions, unsigned int vertexCount, unsigned int stride,
+                                unsigned int targetIndexCount, float targetError, float *resultError);
+float kuhl_mesh_acmr(const unsigned int *indices, unsigned int indexCount, unsigned int vertexCount, unsigned int cacheSize);
+void kuhl_mesh_optimize_vertex_cache(unsigned int *dest, const unsigned int *indices, unsigned int indexCount,
+                                     unsigned int vertexCount, unsigned int cacheSize);
+void kuhl_mesh_optimize_overdraw(unsigned int *dest, const unsigned int *indices, unsigned int indexCount,
+                                 const float *positions, unsigned int vertexCount, unsigned int stride,
+                                 unsigned int cacheSize, float threshold);
+unsigned int kuhl_mesh_optimize_vertex_fetch(unsigned int *remap, unsigned int *indices, unsigned int indexCount,
+                                             unsigned int vertexCount);
+unsigned int kuhl_mesh_weld(unsigned int *remap, const float *vertices, unsigned int vertexCount,
+                            unsigned int stride, float epsilon);
+kuhl_meshlet* kuhl_mesh_build_meshlets(unsigned int *dest, const unsigned int *indices, unsigned int indexCount,
+                                       const float *positions, unsigned int vertexCount, unsigned int stride,
+                                       unsigned int maxVertices, unsigned int maxTriangles, unsigned int *meshletCount);
+int kuhl_mesh_meshlet_backfacing(const kuhl_meshlet *m, const float viewer[3]);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
@@ -14,6 +14,7 @@
 
 #pragma once
 
+#include <stddef.h>
 #include "msg.h"
 
 // When compiling on windows, add suseconds_t and the rand48 functions.
@@ -41,6 +42,8 @@ typedef struct
  * prints a message when common errors occur (out of memory, trying to
  * allocate 0 bytes). */
 #define kuhl_malloc(size) kuhl_mallocFileLine(size, __FILE__, __LINE__)
+// kuhl_malloc() calls this C function:
+void* kuhl_mallocFileLine(size_t size, const char *file, int line);
 
 
 int kuhl_can_read_file(const char *filename);
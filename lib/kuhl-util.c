@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <math.h>
 #include <float.h> // for FLT_MAX
+#include <stdint.h> // uint32_t
 #ifndef _WIN32
 #include <libgen.h> // for dirname()
 #include <sys/time.h> // gettimeofday()
@@ -36,6 +37,7 @@
 #endif
 
 #include "kuhl-nodep.h"
+#include "kuhl-mesh.h"
 
 #include <assimp/cimport.h>
 #include <assimp/scene.h>
@@ -73,6 +75,246 @@ static const char *texTypeListStr[TEX_TYPE_LEN] = {"DIFFUSE", "SPECULAR", "AMBIE
 static GLFWwindow *the_window = NULL;
 
 
+/** Value stored in the GL state shadow when we do not know what is
+ * bound. */
+#define KUHL_GL_UNKNOWN ((GLuint)-1)
+
+/** A copy of the OpenGL state that kuhl_geometry_draw() changes. It
+ * lets us skip redundant binds without asking the driver (glGet*()
+ * calls can force the CPU to wait on the GPU). Only libkuhl's own
+ * functions (such as kuhl_gl_use_program()) update it; OpenGL calls
+ * that a program makes itself are not seen. See
+ * kuhl_gl_state_invalidate(). */
+static struct
+{
+	GLuint program;    /**< Program set by glUseProgram() */
+	GLuint vao;        /**< Vertex array object set by glBindVertexArray() */
+	GLuint activeUnit; /**< Texture unit set by glActiveTexture() (GL_TEXTURE0, ...) */
+	GLuint texture2D[MAX_TEXTURES]; /**< 2D texture bound to each texture unit */
+	int rasterKnown;   /**< Set if the four fields below are known */
+	GLboolean colorMask[4]; /**< Set by glColorMask() */
+	GLboolean depthMask;    /**< Set by glDepthMask() */
+	GLboolean cullFace;     /**< GL_CULL_FACE is enabled */
+	GLboolean depthClamp;   /**< GL_DEPTH_CLAMP is enabled */
+} kuhl_gl_shadow = { KUHL_GL_UNKNOWN, KUHL_GL_UNKNOWN, KUHL_GL_UNKNOWN,
+                     { KUHL_GL_UNKNOWN, KUHL_GL_UNKNOWN, KUHL_GL_UNKNOWN, KUHL_GL_UNKNOWN,
+                       KUHL_GL_UNKNOWN, KUHL_GL_UNKNOWN, KUHL_GL_UNKNOWN, KUHL_GL_UNKNOWN },
+                     0, { GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE }, GL_TRUE, GL_FALSE, GL_FALSE };
+
+/** If set, kuhl_geometry_draw() queries the OpenGL state and restores
+ * it after drawing like older versions of this library did. */
+static int kuhl_gl_restore = 0;
+
+/** Number of entries in the uniform value cache (see
+ * kuhl_uniform_int()). Must be a power of two. */
+#define KUHL_UNIFORM_VALUE_CACHE_SIZE 1024
+
+/** The value that libkuhl last sent to a uniform variable. */
+typedef struct
+{
+	GLuint program; /**< Program containing the variable (0 if the entry is empty) */
+	GLint location; /**< Location of the variable */
+	int valid; /**< 0 if the variable may have changed since libkuhl set it */
+	size_t size; /**< Bytes in data (0 if the value is a bone palette) */
+	GLfloat data[16]; /**< The value (GLints are stored as their bits) */
+	const kuhl_bonemat *bones; /**< Bone palette sent to the variable (NULL if data is used) */
+	unsigned int bones_generation; /**< bones->generation when the palette was sent */
+} kuhl_uniform_value;
+
+static kuhl_uniform_value kuhl_uniform_values[KUHL_UNIFORM_VALUE_CACHE_SIZE];
+static unsigned int kuhl_uniform_value_count = 0; /**< Number of entries in use */
+static long kuhl_uniform_issued = 0;  /**< glUniform*() calls made by libkuhl since kuhl_uniform_stats() */
+static long kuhl_uniform_skipped = 0; /**< glUniform*() calls skipped since kuhl_uniform_stats() */
+
+/** Removes all entries from the uniform value cache. */
+static void kuhl_uniform_value_clear(void)
+{
+	for(int i=0; i<KUHL_UNIFORM_VALUE_CACHE_SIZE; i++)
+		kuhl_uniform_values[i].program = 0;
+	kuhl_uniform_value_count = 0;
+}
+
+/** Finds the entry for a uniform variable in the uniform value
+ * cache. Entries are found with linear probing.
+ *
+ * @param program The program containing the variable.
+ *
+ * @param location The location of the variable.
+ *
+ * @return The entry for the variable, or the empty entry where it
+ * should be added.
+ */
+static kuhl_uniform_value* kuhl_uniform_value_find(GLuint program, GLint location)
+{
+	unsigned int i = (program * 2654435761u ^ (unsigned int) location) & (KUHL_UNIFORM_VALUE_CACHE_SIZE-1);
+	while(kuhl_uniform_values[i].program != 0)
+	{
+		kuhl_uniform_value *v = &(kuhl_uniform_values[i]);
+		if(v->program == program && v->location == location)
+			return v;
+		i = (i+1) & (KUHL_UNIFORM_VALUE_CACHE_SIZE-1);
+	}
+	return &(kuhl_uniform_values[i]);
+}
+
+/** Reads the gl.restorestate setting and resets the shadow of the
+ * OpenGL state. Must be called after glewInit(). */
+static void kuhl_gl_state_init(void)
+{
+	kuhl_gl_restore = kuhl_config_boolean("gl.restorestate", 0, 0);
+	if(kuhl_gl_restore)
+		msg(MSG_DEBUG, "kuhl_geometry_draw() will save and restore OpenGL state (gl.restorestate=1).");
+	kuhl_gl_state_invalidate();
+}
+
+/** Forgets everything libkuhl knows about the currently bound OpenGL
+ * state so that the next kuhl_geometry_draw() binds everything that
+ * it needs. This is called automatically by viewmat_begin_frame() and
+ * viewmat_begin_eye().
+ *
+ * libkuhl only knows about the state that it set itself. If you call
+ * glUseProgram(), glBindVertexArray(), glActiveTexture(),
+ * glBindTexture(), glDeleteTextures() or glDeleteVertexArrays()
+ * yourself, call this function before the next kuhl_geometry_draw()
+ * in the same eye (or use kuhl_gl_use_program() and the other
+ * kuhl_gl_*() functions instead). The same is true if you change
+ * glColorMask(), glDepthMask(), GL_CULL_FACE or GL_DEPTH_CLAMP
+ * between calls to kuhl_geometry_draw_occlusion(). Otherwise,
+ * libkuhl may skip a bind that is needed.
+ */
+void kuhl_gl_state_invalidate(void)
+{
+	kuhl_gl_shadow.program = KUHL_GL_UNKNOWN;
+	kuhl_gl_shadow.vao = KUHL_GL_UNKNOWN;
+	kuhl_gl_shadow.activeUnit = KUHL_GL_UNKNOWN;
+	for(int i=0; i<MAX_TEXTURES; i++)
+		kuhl_gl_shadow.texture2D[i] = KUHL_GL_UNKNOWN;
+	kuhl_gl_shadow.rasterKnown = 0;
+}
+
+/** Fills in the write masks, GL_CULL_FACE and GL_DEPTH_CLAMP in
+ * kuhl_gl_shadow. OpenGL is only asked once after each call to
+ * kuhl_gl_state_invalidate() (or every time if kuhl_gl_restore is
+ * set).
+ */
+static void kuhl_gl_raster_state(void)
+{
+	if(kuhl_gl_shadow.rasterKnown && !kuhl_gl_restore)
+		return;
+	glGetBooleanv(GL_COLOR_WRITEMASK, kuhl_gl_shadow.colorMask);
+	glGetBooleanv(GL_DEPTH_WRITEMASK, &(kuhl_gl_shadow.depthMask));
+	kuhl_gl_shadow.cullFace = glIsEnabled(GL_CULL_FACE);
+	kuhl_gl_shadow.depthClamp = glIsEnabled(GL_DEPTH_CLAMP);
+	kuhl_gl_shadow.rasterKnown = 1;
+}
+
+/** Controls whether kuhl_geometry_draw() saves the OpenGL state with
+ * glGetIntegerv() before drawing and restores it afterwards. This is
+ * off by default because querying OpenGL state is slow. The default
+ * can be changed with the gl.restorestate config file setting.
+ *
+ * @param enable 1 to save and restore state, 0 to use the shadowed
+ * state instead.
+ */
+void kuhl_gl_state_restore(int enable)
+{
+	kuhl_gl_restore = enable;
+	kuhl_gl_state_invalidate();
+}
+
+/** Calls glUseProgram() if the program isn't already in use.
+ *
+ * @param program The GLSL program to use.
+ */
+void kuhl_gl_use_program(GLuint program)
+{
+	if(kuhl_gl_shadow.program == program)
+		return;
+	glUseProgram(program);
+	kuhl_gl_shadow.program = program;
+}
+
+/** Calls glBindVertexArray() if the vertex array object isn't already
+ * bound.
+ *
+ * @param vao The vertex array object to bind.
+ */
+void kuhl_gl_bind_vertex_array(GLuint vao)
+{
+	if(kuhl_gl_shadow.vao == vao)
+		return;
+	glBindVertexArray(vao);
+	kuhl_gl_shadow.vao = vao;
+}
+
+/** Calls glActiveTexture() if the texture unit isn't already active.
+ *
+ * @param texture The texture unit to activate (GL_TEXTURE0, GL_TEXTURE1, etc).
+ */
+void kuhl_gl_active_texture(GLenum texture)
+{
+	if(kuhl_gl_shadow.activeUnit == texture)
+		return;
+	glActiveTexture(texture);
+	kuhl_gl_shadow.activeUnit = texture;
+}
+
+/** Binds a 2D texture to a texture unit if it isn't already bound
+ * there. The active texture unit may be changed.
+ *
+ * @param unit The texture unit number (0 for GL_TEXTURE0, etc).
+ *
+ * @param texture The texture to bind to the unit.
+ */
+void kuhl_gl_bind_texture(GLuint unit, GLuint texture)
+{
+	if(unit < MAX_TEXTURES && kuhl_gl_shadow.texture2D[unit] == texture)
+		return;
+	kuhl_gl_active_texture(GL_TEXTURE0+unit);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	if(unit < MAX_TEXTURES)
+		kuhl_gl_shadow.texture2D[unit] = texture;
+}
+
+/** Should be called before a vertex array object is deleted inside of
+ * libkuhl. Deleting the bound vertex array object binds 0, and the
+ * name may be reused by the next glGenVertexArrays().
+ *
+ * @param vao The vertex array object that is about to be deleted.
+ */
+static void kuhl_gl_vertex_array_deleted(GLuint vao)
+{
+	if(kuhl_gl_shadow.vao == vao)
+		kuhl_gl_shadow.vao = 0;
+}
+
+/** Should be called before a texture is deleted inside of
+ * libkuhl. Units that the texture is bound to revert to 0.
+ *
+ * @param texture The texture that is about to be deleted.
+ */
+static void kuhl_gl_texture_deleted(GLuint texture)
+{
+	for(int i=0; i<MAX_TEXTURES; i++)
+		if(kuhl_gl_shadow.texture2D[i] == texture)
+			kuhl_gl_shadow.texture2D[i] = 0;
+}
+
+/** Should be called after glBindTexture() is called directly inside
+ * of libkuhl (for example, while creating a texture). */
+static void kuhl_gl_texture_changed(void)
+{
+	GLuint unit = kuhl_gl_shadow.activeUnit - GL_TEXTURE0;
+	if(kuhl_gl_shadow.activeUnit == KUHL_GL_UNKNOWN)
+	{
+		for(int i=0; i<MAX_TEXTURES; i++)
+			kuhl_gl_shadow.texture2D[i] = KUHL_GL_UNKNOWN;
+	}
+	else if(unit < MAX_TEXTURES)
+		kuhl_gl_shadow.texture2D[unit] = KUHL_GL_UNKNOWN;
+}
+
+
 /** Create a 4x4 float matrix from an ASSIMP 4x4 matrix structure.
     @param dest The location to store new matrix.
     @param src The location of the original matrix.
@@ -97,6 +339,149 @@ int kuhl_errorcheckFileLine(const char *file, int line, const char *func)
 	return 0;
 }
 
+
+/** Maximum number of distinct debug messages that
+ * kuhl_gl_debug_callback() keeps counts for. */
+#define KUHL_GL_DEBUG_MAX 64
+
+/** Number of times that each distinct OpenGL debug message was
+ * reported. The source, type and id together identify the place in
+ * the driver (and usually the kind of call) that generated the
+ * message. */
+static struct {
+	GLenum source;
+	GLenum type;
+	GLuint id;
+	GLenum severity;
+	long count;
+} kuhl_gl_debug_counts[KUHL_GL_DEBUG_MAX];
+static int kuhl_gl_debug_count_len = 0;
+static long kuhl_gl_debug_dropped = 0; /**< Messages that didn't fit in kuhl_gl_debug_counts */
+
+/** Returns a short human-readable name for a GL_DEBUG_SOURCE_* or
+ * GL_DEBUG_TYPE_* value. */
+static const char* kuhl_gl_debug_name(GLenum e)
+{
+	switch(e)
+	{
+		case GL_DEBUG_SOURCE_API:               return "API";
+		case GL_DEBUG_SOURCE_WINDOW_SYSTEM:     return "window system";
+		case GL_DEBUG_SOURCE_SHADER_COMPILER:   return "shader compiler";
+		case GL_DEBUG_SOURCE_THIRD_PARTY:       return "third party";
+		case GL_DEBUG_SOURCE_APPLICATION:       return "application";
+		case GL_DEBUG_TYPE_ERROR:               return "error";
+		case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR: return "deprecated";
+		case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR:  return "undefined behavior";
+		case GL_DEBUG_TYPE_PORTABILITY:         return "portability";
+		case GL_DEBUG_TYPE_PERFORMANCE:         return "performance";
+		default:                                return "other";
+	}
+}
+
+/** Called by OpenGL when the driver reports an error or warning.
+ * GL_DEBUG_OUTPUT_SYNCHRONOUS is enabled, so this runs on the thread
+ * that made the OpenGL call and kuhl_gl_debug_counts needs no lock. The first occurrence of each message is
+ * printed in full. After that, we only print how many times the
+ * message has occurred when the count reaches 10, 100, 1000,
+ * etc. kuhl_gl_debug_summary() prints the final counts when the
+ * program exits. */
+static void GLAPIENTRY kuhl_gl_debug_callback(GLenum source, GLenum type, GLuint id, GLenum severity,
+                                              GLsizei length, const GLchar *message, const void *userParam)
+{
+	(void) length;
+	(void) userParam;
+
+	int i = 0;
+	while(i < kuhl_gl_debug_count_len &&
+	      (kuhl_gl_debug_counts[i].source != source ||
+	       kuhl_gl_debug_counts[i].type   != type ||
+	       kuhl_gl_debug_counts[i].id     != id))
+		i++;
+	if(i == KUHL_GL_DEBUG_MAX)
+	{
+		kuhl_gl_debug_dropped++;
+		return;
+	}
+	if(i == kuhl_gl_debug_count_len)
+	{
+		kuhl_gl_debug_counts[i].source = source;
+		kuhl_gl_debug_counts[i].type = type;
+		kuhl_gl_debug_counts[i].id = id;
+		kuhl_gl_debug_counts[i].severity = severity;
+		kuhl_gl_debug_counts[i].count = 0;
+		kuhl_gl_debug_count_len++;
+	}
+	long count = ++kuhl_gl_debug_counts[i].count;
+
+	msg_type level = MSG_INFO;
+	if(type == GL_DEBUG_TYPE_ERROR || severity == GL_DEBUG_SEVERITY_HIGH)
+		level = MSG_ERROR;
+	else if(severity == GL_DEBUG_SEVERITY_MEDIUM)
+		level = MSG_WARNING;
+
+	if(count == 1)
+		msg(level, "OpenGL %s %s (id %u): %s", kuhl_gl_debug_name(source), kuhl_gl_debug_name(type), id, message);
+	else
+	{
+		long c = count;
+		while(c % 10 == 0)
+			c = c / 10;
+		if(c == 1)
+			msg(level, "OpenGL %s %s (id %u) has occurred %ld times", kuhl_gl_debug_name(source), kuhl_gl_debug_name(type), id, count);
+	}
+}
+
+/** Prints how many times each OpenGL debug message was reported. This
+ * is registered with atexit() by kuhl_gl_debug_init(). */
+static void kuhl_gl_debug_summary(void)
+{
+	for(int i=0; i<kuhl_gl_debug_count_len; i++)
+		msg(MSG_INFO, "OpenGL %s %s (id %u) occurred %ld time(s)",
+		    kuhl_gl_debug_name(kuhl_gl_debug_counts[i].source),
+		    kuhl_gl_debug_name(kuhl_gl_debug_counts[i].type),
+		    kuhl_gl_debug_counts[i].id, kuhl_gl_debug_counts[i].count);
+	if(kuhl_gl_debug_dropped > 0)
+		msg(MSG_INFO, "%ld additional OpenGL debug message(s) were not counted.", kuhl_gl_debug_dropped);
+}
+
+/** Returns 1 if the "gl.debug" config setting asks for OpenGL debug
+ * messages. By default, debug messages are enabled only if
+ * kuhl_errorcheck() was compiled out (KUHL_NO_ERRORCHECK). */
+static int kuhl_gl_debug_enabled(void)
+{
+#ifdef KUHL_NO_ERRORCHECK
+	return kuhl_config_boolean("gl.debug", 1, 1);
+#else
+	return kuhl_config_boolean("gl.debug", 0, 0);
+#endif
+}
+
+/** Asks OpenGL to report errors through kuhl_gl_debug_callback()
+ * instead of requiring us to call glGetError(). Must be called after
+ * glewInit(). The messages are synchronous: An asynchronous callback
+ * could run on a driver thread while the counts are being updated or
+ * printed by kuhl_gl_debug_summary(). Synchronous messages also make
+ * it possible to find the call that caused an error with a debugger.
+ * Unlike glGetError(), they don't make the CPU wait for the GPU. */
+static void kuhl_gl_debug_init(void)
+{
+	if(!kuhl_gl_debug_enabled())
+		return;
+	if(!GLEW_VERSION_4_3 && !GLEW_KHR_debug)
+	{
+		msg(MSG_WARNING, "gl.debug is set but OpenGL 4.3 or KHR_debug is not available. OpenGL errors will not be reported.");
+		return;
+	}
+
+	glDebugMessageCallback(kuhl_gl_debug_callback, NULL);
+	/* Notifications (buffer placement hints, etc) are too noisy to be useful. */
+	glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION, 0, NULL, GL_FALSE);
+	glEnable(GL_DEBUG_OUTPUT);
+	glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+	atexit(kuhl_gl_debug_summary);
+	msg(MSG_DEBUG, "OpenGL errors will be reported by glDebugMessageCallback() (gl.debug=1).");
+}
+
 /** An error callback function to be used with GLFW. */
 void kuhl_glfw_error(int error, const char* description)
 {
@@ -417,6 +802,10 @@ void kuhl_ogl_init(int *argcp, char **argv, int width, int height, int oglProfil
 	if(msaaSamples > 1)
 		glfwWindowHint(GLFW_SAMPLES, msaaSamples);
 
+	/* Some drivers only report debug messages in a debug context. */
+	if(kuhl_gl_debug_enabled())
+		glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GL_TRUE);
+
 	/* Create a GLFW window */
 	GLFWwindow *window = kuhl_glfw_create_window(width, height, argv[0]);
 	if(!window)
@@ -443,6 +832,9 @@ void kuhl_ogl_init(int *argcp, char **argv, int width, int height, int oglProfil
 	 * http://www.opengl.org/wiki/OpenGL_Loading_Library */
 	glGetError();
 
+	kuhl_gl_state_init();
+	kuhl_gl_debug_init();
+
 	if(kuhl_config_int("color.linear", 1, 1) == 1)
 		glEnable(GL_FRAMEBUFFER_SRGB);
 	if(msaaSamples > 1)
@@ -591,6 +983,26 @@ void kuhl_print_program_info(GLuint program)
 	kuhl_errorcheck();
 }
 
+/** Incremented whenever a GLSL program is linked, relinked or
+ * deleted. Uniform locations cached inside of kuhl_geometry are
+ * discarded when this value changes. */
+static unsigned int kuhl_program_generation = 1;
+
+/** Tells libkuhl that a GLSL program was relinked (for example, by
+ * calling glLinkProgram() directly) so that any uniform locations
+ * that libkuhl has cached for it are looked up again and any uniform
+ * values that it remembers are sent again. Programs
+ * created with kuhl_create_program() and deleted with
+ * kuhl_delete_program() are handled automatically.
+ *
+ * @param program The GLSL program that was relinked.
+ */
+void kuhl_program_relinked(GLuint program)
+{
+	(void) program; // all cached locations are discarded
+	kuhl_program_generation++;
+}
+
 /** Detaches shaders from the given GLSL program, deletes the program,
  * and flags the shaders for deletion.
  *
@@ -613,6 +1025,7 @@ void kuhl_delete_program(GLuint program)
 		glDeleteShader(shaders[i]);
 	}
 	glDeleteProgram(program);
+	kuhl_program_relinked(program);
 }
 
 /** Creates an OpenGL program from pair of files containing a vertex
@@ -671,6 +1084,26 @@ GLuint kuhl_create_program(const char *vertexFilename, const char *fragFilename)
 		exit(EXIT_FAILURE);
 	}
 
+	/* The new program may reuse the ID of a deleted program. */
+	kuhl_program_relinked(program);
+
+	/* If the program uses the per-frame camera data that viewmat
+	 * provides, connect it to the buffer. Programs that draw both
+	 * eyes at once declare an array of two blocks (see
+	 * viewmat_begin_stereo()). */
+	GLuint frameBlock = glGetUniformBlockIndex(program, "KuhlFrame");
+	if(frameBlock != GL_INVALID_INDEX)
+		glUniformBlockBinding(program, frameBlock, KUHL_FRAME_BINDING);
+	for(GLuint i=0; i<2; i++)
+	{
+		char name[32];
+		snprintf(name, 32, "KuhlFrame[%u]", i);
+		frameBlock = glGetUniformBlockIndex(program, name);
+		if(frameBlock != GL_INVALID_INDEX)
+			glUniformBlockBinding(program, frameBlock, KUHL_FRAME_BINDING+i);
+	}
+	kuhl_errorcheck();
+
 	/* We used to call glValidateProgram() here. However, some drivers
 	 * assume that you only call glValidateProgram() when you are
 	 * ready to draw (i.e., have a vertex array object set up, etc). */
@@ -696,6 +1129,60 @@ void kuhl_print_program_log(GLuint program)
 
 
 
+/** Number of entries in the kuhl_get_uniform() cache. Must be a
+ * power of two. */
+#define KUHL_UNIFORM_CACHE_SIZE 512
+
+/** An entry in the kuhl_get_uniform() cache. */
+typedef struct
+{
+	GLuint program; /**< Program the location is in (0 if the entry is empty) */
+	unsigned int hash; /**< Hash of the name */
+	char *name; /**< Name of the uniform variable */
+	GLint location; /**< Location of the uniform variable (-1 if missing) */
+} kuhl_uniform_cache_entry;
+
+static kuhl_uniform_cache_entry kuhl_uniform_cache[KUHL_UNIFORM_CACHE_SIZE];
+static unsigned int kuhl_uniform_cache_count = 0; /**< Number of entries in use */
+static unsigned int kuhl_uniform_cache_generation = 0; /**< kuhl_program_generation when the cache was filled */
+
+/** Removes all entries from the kuhl_get_uniform() cache. */
+static void kuhl_uniform_cache_clear(void)
+{
+	for(int i=0; i<KUHL_UNIFORM_CACHE_SIZE; i++)
+	{
+		free(kuhl_uniform_cache[i].name);
+		kuhl_uniform_cache[i].name = NULL;
+		kuhl_uniform_cache[i].program = 0;
+	}
+	kuhl_uniform_cache_count = 0;
+}
+
+/** Finds the entry for a uniform variable in the kuhl_get_uniform()
+ * cache. Entries are found with linear probing.
+ *
+ * @param program The program containing the variable.
+ *
+ * @param name The name of the variable.
+ *
+ * @param hash A hash of program and name.
+ *
+ * @return The entry for the variable, or the empty entry where it
+ * should be added.
+ */
+static kuhl_uniform_cache_entry* kuhl_uniform_cache_find(GLuint program, const char *name, unsigned int hash)
+{
+	unsigned int i = hash & (KUHL_UNIFORM_CACHE_SIZE-1);
+	while(kuhl_uniform_cache[i].program != 0)
+	{
+		kuhl_uniform_cache_entry *e = &(kuhl_uniform_cache[i]);
+		if(e->hash == hash && e->program == program && strcmp(e->name, name) == 0)
+			return e;
+		i = (i+1) & (KUHL_UNIFORM_CACHE_SIZE-1);
+	}
+	return &(kuhl_uniform_cache[i]);
+}
+
 /** Provides functionality similar to glGetUniformLocation() with
  * error checking. However, unlike glGetUniformLocation(), this
  * function gets the location of the variable from the active OpenGL
@@ -704,36 +1191,71 @@ void kuhl_print_program_log(GLuint program)
  * function may exit or return -1 if the uniform location is not
  * found.
  *
+ * Locations are cached for each program, so calling this function
+ * repeatedly (for example, once per object per frame) only costs a
+ * hash table lookup. The cache is cleared when a program is created
+ * or deleted with libkuhl or when kuhl_program_relinked() is called.
+ *
  * @param uniformName The name of the uniform variable.
  *
  * @return The location of the uniform variable.
  */
 GLint kuhl_get_uniform(const char *uniformName)
 {
-	kuhl_errorcheck();
 	if(uniformName == NULL || strlen(uniformName) == 0)
 	{
 		msg(MSG_ERROR, "You asked for the location of an uniform name, but your name was an empty string or a NULL pointer.\n");
 		return -1;
 	}
 
-	GLint currentProgram = 0;
-	glGetIntegerv(GL_CURRENT_PROGRAM, &currentProgram);
+	/* libkuhl tracks the current program (see kuhl_gl_use_program())
+	 * so we usually don't need to ask OpenGL. */
+	GLint currentProgram = (GLint) kuhl_gl_shadow.program;
+	if(kuhl_gl_shadow.program == KUHL_GL_UNKNOWN)
+	{
+		glGetIntegerv(GL_CURRENT_PROGRAM, &currentProgram);
+		kuhl_gl_shadow.program = (GLuint) currentProgram;
+	}
 	if(currentProgram == 0)
 	{
 		msg(MSG_ERROR, "Can't get the uniform location of %s because no GLSL program is currently being used.\n", uniformName);
 		return -1;
 	}
-	
-	if(!glIsProgram(currentProgram))
+
+	if(kuhl_uniform_cache_generation != kuhl_program_generation ||
+	   kuhl_uniform_cache_count >= KUHL_UNIFORM_CACHE_SIZE*3/4)
 	{
-		msg(MSG_ERROR, "The current active program (%d) is not a valid GLSL program.\n", currentProgram);
-		return -1;
+		kuhl_uniform_cache_clear();
+		kuhl_uniform_cache_generation = kuhl_program_generation;
+	}
+
+	/* FNV-1a hash of the name and program. */
+	unsigned int hash = 2166136261u ^ (unsigned int) currentProgram;
+	for(const char *c = uniformName; *c; c++)
+		hash = (hash ^ (unsigned char) *c) * 16777619u;
+
+	kuhl_uniform_cache_entry *entry = kuhl_uniform_cache_find(currentProgram, uniformName, hash);
+	GLint loc = entry->location;
+	if(entry->program == 0)
+	{
+		kuhl_errorcheck();
+		if(!glIsProgram(currentProgram))
+		{
+			msg(MSG_ERROR, "The current active program (%d) is not a valid GLSL program.\n", currentProgram);
+			return -1;
+		}
+
+		loc = glGetUniformLocation(currentProgram, uniformName);
+		kuhl_errorcheck();
+
+		entry->program = currentProgram;
+		entry->hash = hash;
+		entry->name = strdup(uniformName);
+		entry->location = loc;
+		kuhl_uniform_cache_count++;
 	}
 
 	static int missingUniformCount = 0;
-	GLint loc = glGetUniformLocation(currentProgram, uniformName);
-	kuhl_errorcheck();
 	if(loc == -1 && missingUniformCount < 50)
 	{
 		msg(MSG_ERROR, "Uniform variable '%s' is missing or inactive in GLSL program %d.\n", uniformName, currentProgram);
@@ -747,6 +1269,176 @@ GLint kuhl_get_uniform(const char *uniformName)
 	return loc;
 }
 
+/** Looks up the cache entry for a uniform variable in the current
+ * program, adding an entry if there isn't one. The cache is cleared
+ * when a program is linked or deleted, since that resets the values
+ * of its uniform variables.
+ *
+ * @param location The location of the variable.
+ *
+ * @return The entry, or NULL if the value can't be cached (the
+ * current program is unknown).
+ */
+static kuhl_uniform_value* kuhl_uniform_value_lookup(GLint location)
+{
+	static unsigned int generation = 0;
+	if(kuhl_gl_shadow.program == KUHL_GL_UNKNOWN || kuhl_gl_shadow.program == 0)
+		return NULL;
+	if(generation != kuhl_program_generation ||
+	   kuhl_uniform_value_count >= KUHL_UNIFORM_VALUE_CACHE_SIZE*3/4)
+	{
+		kuhl_uniform_value_clear();
+		generation = kuhl_program_generation;
+	}
+
+	kuhl_uniform_value *v = kuhl_uniform_value_find(kuhl_gl_shadow.program, location);
+	if(v->program == 0)
+	{
+		v->program = kuhl_gl_shadow.program;
+		v->location = location;
+		v->valid = 0;
+		kuhl_uniform_value_count++;
+	}
+	return v;
+}
+
+/** Checks if a uniform variable already has a value. If it does, the
+ * glUniform*() call is counted as skipped.
+ *
+ * @param v The cache entry for the variable (may be NULL).
+ *
+ * @param data The value.
+ *
+ * @param size The size of the value in bytes.
+ *
+ * @return 1 if the variable already has the value, 0 if it must be set.
+ */
+static int kuhl_uniform_value_same(const kuhl_uniform_value *v, const void *data, size_t size)
+{
+	if(v == NULL || !v->valid || v->bones != NULL || v->size != size ||
+	   memcmp(v->data, data, size) != 0)
+		return 0;
+	kuhl_uniform_skipped++;
+	return 1;
+}
+
+/** Records the value that was just sent to a uniform variable.
+ *
+ * @param v The cache entry for the variable (may be NULL).
+ *
+ * @param data The value.
+ *
+ * @param size The size of the value in bytes. Values larger than 16
+ * floats are not cached.
+ */
+static void kuhl_uniform_value_store(kuhl_uniform_value *v, const void *data, size_t size)
+{
+	kuhl_uniform_issued++;
+	if(v == NULL)
+		return;
+	v->valid = size <= sizeof(v->data);
+	if(!v->valid)
+		return;
+	memcpy(v->data, data, size);
+	v->size = size;
+	v->bones = NULL;
+}
+
+/** Sets an int uniform variable in the current program unless it
+ * already has the value. libkuhl remembers the last value that it set
+ * each (program, location) to, so setting the same value for every
+ * object only calls glUniform1i() once. See kuhl_uniform_stats().
+ *
+ * libkuhl can't see glUniform*() calls that a program makes itself,
+ * so this is only used for the variables that kuhl_geometry_draw()
+ * owns: HasTex, NumBones, BoneMat and GeomTransform. Programs must
+ * not set these variables themselves. The cache is cleared when a
+ * program is linked by kuhl_create_program() or when
+ * kuhl_program_relinked() is called.
+ *
+ * @param location The location of the variable (-1 is ignored).
+ *
+ * @param value The value to set the variable to.
+ */
+static void kuhl_uniform_int(GLint location, GLint value)
+{
+	if(location == -1)
+		return;
+	kuhl_uniform_value *v = kuhl_uniform_value_lookup(location);
+	if(kuhl_uniform_value_same(v, &value, sizeof(GLint)))
+		return;
+	glUniform1i(location, value);
+	kuhl_uniform_value_store(v, &value, sizeof(GLint));
+}
+
+/** Sets a mat4 (or an array of mat4) uniform variable that
+ * kuhl_geometry_draw() owns in the current program unless it already
+ * has the value. Only single matrices are compared; arrays are always
+ * sent. See kuhl_uniform_int().
+ *
+ * @param location The location of the variable (-1 is ignored).
+ *
+ * @param count The number of matrices.
+ *
+ * @param value The matrices (column-major like the rest of libkuhl).
+ */
+static void kuhl_uniform_mat4f(GLint location, GLsizei count, const GLfloat *value)
+{
+	if(location == -1)
+		return;
+	kuhl_uniform_value *v = kuhl_uniform_value_lookup(location);
+	size_t size = sizeof(GLfloat)*16*count;
+	if(kuhl_uniform_value_same(v, value, size))
+		return;
+	glUniformMatrix4fv(location, count, 0, value);
+	kuhl_uniform_value_store(v, value, size);
+}
+
+/** Sends the bone matrices of a geometry to the BoneMat variable in
+ * the current program unless the same palette was sent there last
+ * and hasn't changed since (see kuhl_bonemat.generation). Only the
+ * matrices of bones that the geometry uses are sent.
+ *
+ * @param location The location of BoneMat.
+ *
+ * @param bones The bones.
+ */
+static void kuhl_uniform_bones(GLint location, const kuhl_bonemat *bones)
+{
+	kuhl_uniform_value *v = kuhl_uniform_value_lookup(location);
+	if(v != NULL && v->valid && v->bones == bones && v->bones_generation == bones->generation)
+	{
+		kuhl_uniform_skipped++;
+		return;
+	}
+	glUniformMatrix4fv(location, bones->count, 0, bones->matrices[0]);
+	kuhl_uniform_issued++;
+	if(v == NULL)
+		return;
+	v->valid = 1;
+	v->size = 0;
+	v->bones = bones;
+	v->bones_generation = bones->generation;
+}
+
+/** Returns how many glUniform*() calls kuhl_geometry_draw() made for
+ * the variables that it owns (HasTex, NumBones, BoneMat and
+ * GeomTransform) and how many it skipped because the variable already
+ * had the value since the last time this function was called.
+ *
+ * @param issued Set to the number of glUniform*() calls made (may be NULL).
+ * @param skipped Set to the number of calls skipped (may be NULL).
+ */
+void kuhl_uniform_stats(long *issued, long *skipped)
+{
+	if(issued)
+		*issued = kuhl_uniform_issued;
+	if(skipped)
+		*skipped = kuhl_uniform_skipped;
+	kuhl_uniform_issued = 0;
+	kuhl_uniform_skipped = 0;
+}
+
 /** glGetAttribLocation() with error checking. This function behaves
  * the same as glGetAttribLocation() except that when an error
  * occurs, it prints an error message if the attribute variable doesn't
@@ -894,6 +1586,12 @@ static void kuhl_geometry_sanity_check(kuhl_geometry *geom)
 /** Applies a transformation matrix to an axis-aligned bounding box to
     produce a new axis aligned bounding box.
 
+    Instead of transforming the 8 corners of the box, the center of
+    the box is transformed and the new half-widths are calculated
+    from the absolute values of the matrix (Arvo, "Transforming
+    Axis-Aligned Bounding Boxes", Graphics Gems, 1990). The result is
+    the same, but it is much faster. The matrix is assumed to be
+    affine (bottom row is 0,0,0,1).
 
     @param bbox The bounding box to rotate (xmin, xmax, ymin, ...)
     @param mat The 4x4 transformation matrix to apply to the bounding box
@@ -903,80 +1601,161 @@ void kuhl_bbox_transform(float bbox[6], float mat[16])
 	if(mat == NULL)
 		return;
 
-	int xmin=0, xmax=1, ymin=2, ymax=3, zmin=4, zmax=5;
+	float center[3], halfwidth[3];
+	for(int i=0; i<3; i++)
+	{
+		center[i]    = (bbox[i*2] + bbox[i*2+1]) / 2.0f;
+		halfwidth[i] = (bbox[i*2+1] - bbox[i*2]) / 2.0f;
+	}
 
-	// The 8 vertices of the bounding box
-	float coords[8][3] = { {bbox[xmin], bbox[ymin], bbox[zmin] },
-	                       {bbox[xmin], bbox[ymin], bbox[zmax] },
-	                       {bbox[xmin], bbox[ymax], bbox[zmin] },
-	                       {bbox[xmin], bbox[ymax], bbox[zmax] },
-	                       {bbox[xmax], bbox[ymin], bbox[zmax] },
-	                       {bbox[xmax], bbox[ymax], bbox[zmin] },
-	                       {bbox[xmax], bbox[ymax], bbox[zmax] } };
-	// Transform the 8 vertices of the bounding box
-	for(int i=0; i<8; i++)
-		mat4f_mult_vec4f_new(coords[i], mat, coords[i]);
-	
-	/* Calculate new axis aligned bounding box */
-	for(int i=0; i<6; i=i+2) // set min values to the largest float
-		bbox[i] = FLT_MAX;
-	for(int i=1; i<6; i=i+2) // set max values to the smallest float
-		bbox[i] = -FLT_MAX;
-	for(unsigned int i=0; i<8; i++)
-	{
-		// Check for new min values
-		if(coords[i][0] < bbox[0])
-			bbox[0] = coords[i][0];
-		if(coords[i][1] < bbox[2])
-			bbox[2] = coords[i][1];
-		if(coords[i][2] < bbox[4])
-			bbox[4] = coords[i][2];
-
-		// Check for new max values
-		if(coords[i][0] > bbox[1])
-			bbox[1] = coords[i][0];
-		if(coords[i][1] > bbox[3])
-			bbox[3] = coords[i][1];
-		if(coords[i][2] > bbox[5])
-			bbox[5] = coords[i][2];
+	/* mat is column-major: row r, column c is mat[c*4+r] */
+	for(int r=0; r<3; r++)
+	{
+		float c = mat[12+r];
+		float h = 0;
+		for(int k=0; k<3; k++)
+		{
+			c += mat[k*4+r] * center[k];
+			h += fabsf(mat[k*4+r]) * halfwidth[k];
+		}
+		bbox[r*2]   = c - h;
+		bbox[r*2+1] = c + h;
 	}
 }
-    
 
-#if 0
-/** Checks if the axis-aligned bounding box of two kuhl_geometry objects intersect.
+/** Calculates the 6 planes of a view frustum. A point p is inside of
+    the frustum if planes[i][0]*p.x + planes[i][1]*p.y +
+    planes[i][2]*p.z + planes[i][3] >= 0 for every plane i (Gribb and
+    Hartmann, "Fast Extraction of Viewing Frustum Planes from the
+    World-View-Projection Matrix", 2001). The planes are not
+    normalized.
 
-    @return 1 if the bounding boxes intersect; 0 otherwise
+    @param planes To be filled in with the left, right, bottom, top,
+    near and far planes.
 
-    @param geom1 One of the pieces of geometry.
-    @param mat1 A 4x4 transformation matrix to be applied to the bounding box of geom1 prior to checking for collision.
-    @param geom2 The other piece of geometry.
-    @param mat2 A 4x4 transformation matrix to be applied to the bounding box of geom2 prior to checking for collision.
+    @param mat A projection matrix multiplied by a modelview
+    matrix. The planes will be in the coordinate system that mat
+    is applied to.
 */
-int kuhl_geometry_collide(kuhl_geometry *geom1, float mat1[16],
-                          kuhl_geometry *geom2, float mat2[16])
+void kuhl_frustum_planes(float planes[6][4], const float mat[16])
 {
-	float box1[6], box2[6];
-	for(int i=0; i<6; i++)
+	for(int i=0; i<3; i++)
 	{
-		box1[i] = geom1->aabbox[i];
-		box2[i] = geom2->aabbox[i];
+		for(int k=0; k<4; k++)
+		{
+			/* Row 3 of the matrix plus or minus row i. */
+			planes[i*2][k]   = mat[k*4+3] + mat[k*4+i];
+			planes[i*2+1][k] = mat[k*4+3] - mat[k*4+i];
+		}
 	}
-	kuhl_bbox_transform(box1, mat1);
-	kuhl_bbox_transform(box2, mat1);
+}
 
-	int xmin=0, xmax=1, ymin=2, ymax=3, zmin=4, zmax=5;
-	// If the smallest x coordinate in geom1 is larger than the
-	// largest x coordinate in geom2, there is no intersection when we
-	// project the bounding boxes onto to the X plane. (geom1 is to
-	// the right of geom2). Repeat for Y and Z planes
-	if(box1[xmin] > box2[xmax]) return 0;
-	if(box1[ymin] > box2[ymax]) return 0;
-	if(box1[zmin] > box2[zmax]) return 0;
-	// If the largest x coordinate of geom1 is smaller than the
-	// largest smallest x coordinate in geom 2, there is no
-	// intersection when we project the bounding boxes onto the X
-	// plane. (geom1 is to the left of geom2). Repeat for Y and Z
+/** Number of bounding boxes that kuhl_bbox_frustum_cull() tests at a
+ * time. */
+#define KUHL_CULL_BATCH 8
+
+/** Checks which axis-aligned bounding boxes intersect a view
+    frustum. A box is considered visible unless it is entirely on the
+    outside of one of the planes, so some boxes that are outside of
+    the frustum near its corners are reported as visible.
+
+    The boxes are tested in batches. The loops over a batch have a
+    fixed length and no branches so that the compiler can test
+    several boxes at once with SIMD instructions.
+
+    @param visible An array of count values that will be set to 1 if
+    the box is visible or 0 if it is not.
+
+    @param bboxes An array of count bounding boxes (6 floats each:
+    xmin, xmax, ymin, ymax, zmin, zmax).
+
+    @param count The number of bounding boxes.
+
+    @param planes Frustum planes from kuhl_frustum_planes().
+
+    @return The number of visible boxes.
+*/
+int kuhl_bbox_frustum_cull(unsigned char *visible, const float *bboxes, int count, float planes[6][4])
+{
+	int numVisible = 0;
+	for(int start=0; start<count; start+=KUHL_CULL_BATCH)
+	{
+		int n = count-start < KUHL_CULL_BATCH ? count-start : KUHL_CULL_BATCH;
+
+		/* Convert the boxes into centers and half-widths. A partial
+		 * batch is padded with copies of its last box. */
+		float cx[KUHL_CULL_BATCH], cy[KUHL_CULL_BATCH], cz[KUHL_CULL_BATCH];
+		float hx[KUHL_CULL_BATCH], hy[KUHL_CULL_BATCH], hz[KUHL_CULL_BATCH];
+		for(int i=0; i<KUHL_CULL_BATCH; i++)
+		{
+			const float *b = bboxes + 6*(start + (i<n ? i : n-1));
+			cx[i] = (b[0]+b[1])*.5f;  hx[i] = (b[1]-b[0])*.5f;
+			cy[i] = (b[2]+b[3])*.5f;  hy[i] = (b[3]-b[2])*.5f;
+			cz[i] = (b[4]+b[5])*.5f;  hz[i] = (b[5]-b[4])*.5f;
+		}
+
+		int inside[KUHL_CULL_BATCH];
+		for(int i=0; i<KUHL_CULL_BATCH; i++)
+			inside[i] = 1;
+		for(int p=0; p<6; p++)
+		{
+			const float *pl = planes[p];
+			float ax = fabsf(pl[0]), ay = fabsf(pl[1]), az = fabsf(pl[2]);
+			for(int i=0; i<KUHL_CULL_BATCH; i++)
+			{
+				/* Distance from the center of the box to the plane and
+				 * the largest distance that a corner of the box can be
+				 * from the center in the direction of the plane normal
+				 * (both scaled by the length of the normal). */
+				float dist   = pl[0]*cx[i] + pl[1]*cy[i] + pl[2]*cz[i] + pl[3];
+				float radius = ax*hx[i] + ay*hy[i] + az*hz[i];
+				inside[i] &= (dist + radius >= 0);
+			}
+		}
+
+		for(int i=0; i<n; i++)
+		{
+			visible[start+i] = (unsigned char) inside[i];
+			numVisible += inside[i];
+		}
+	}
+	return numVisible;
+}
+
+#if 0
+/** Checks if the axis-aligned bounding box of two kuhl_geometry objects intersect.
+
+    @return 1 if the bounding boxes intersect; 0 otherwise
+
+    @param geom1 One of the pieces of geometry.
+    @param mat1 A 4x4 transformation matrix to be applied to the bounding box of geom1 prior to checking for collision.
+    @param geom2 The other piece of geometry.
+    @param mat2 A 4x4 transformation matrix to be applied to the bounding box of geom2 prior to checking for collision.
+*/
+int kuhl_geometry_collide(kuhl_geometry *geom1, float mat1[16],
+                          kuhl_geometry *geom2, float mat2[16])
+{
+	float box1[6], box2[6];
+	for(int i=0; i<6; i++)
+	{
+		box1[i] = geom1->aabbox[i];
+		box2[i] = geom2->aabbox[i];
+	}
+	kuhl_bbox_transform(box1, mat1);
+	kuhl_bbox_transform(box2, mat1);
+
+	int xmin=0, xmax=1, ymin=2, ymax=3, zmin=4, zmax=5;
+	// If the smallest x coordinate in geom1 is larger than the
+	// largest x coordinate in geom2, there is no intersection when we
+	// project the bounding boxes onto to the X plane. (geom1 is to
+	// the right of geom2). Repeat for Y and Z planes
+	if(box1[xmin] > box2[xmax]) return 0;
+	if(box1[ymin] > box2[ymax]) return 0;
+	if(box1[zmin] > box2[zmax]) return 0;
+	// If the largest x coordinate of geom1 is smaller than the
+	// largest smallest x coordinate in geom 2, there is no
+	// intersection when we project the bounding boxes onto the X
+	// plane. (geom1 is to the left of geom2). Repeat for Y and Z
 	// planes.
 	if(box1[xmax] < box2[xmin]) return 0;
 	if(box1[ymax] < box2[ymin]) return 0;
@@ -1068,6 +1847,65 @@ void kuhl_geometry_texture(kuhl_geometry *geom, GLuint texture, const char* name
 
 	geom->textures[destIndex].name = strdup(name);
 	geom->textures[destIndex].textureId = texture;
+	geom->textures[destIndex].location = samplerLocation;
+
+	/* HasTex depends on the list of textures. */
+	geom->locations.program = 0;
+	for(unsigned int i=0; i<geom->program_vao_count; i++)
+		geom->program_vaos[i].generation = 0;
+}
+
+/** Looks up the locations of the uniform variables that
+ * kuhl_geometry_draw() sets in a program.
+ *
+ * @param geom The geometry whose textures should be looked up.
+ *
+ * @param program The program to look up the locations in.
+ *
+ * @param l Location to store the uniform locations in.
+ *
+ * @param textureLocations Array of geom->texture_count values to
+ * store the location of each texture's sampler in.
+ */
+static void kuhl_program_locations(const kuhl_geometry *geom, GLuint program,
+                                   kuhl_uniform_locations *l, GLint *textureLocations)
+{
+	l->program = program;
+	l->generation = kuhl_program_generation;
+	l->hasTexValue = 0;
+	for(unsigned int i=0; i<geom->texture_count; i++)
+	{
+		const kuhl_texture *tex = &(geom->textures[i]);
+		textureLocations[i] = glGetUniformLocation(program, tex->name);
+		if(textureLocations[i] != -1 && strcmp(tex->name, "tex") == 0)
+			l->hasTexValue = 1;
+	}
+	l->hasTex        = glGetUniformLocation(program, "HasTex");
+	l->boneMat       = glGetUniformLocation(program, "BoneMat");
+	l->numBones      = glGetUniformLocation(program, "NumBones");
+	l->geomTransform = glGetUniformLocation(program, "GeomTransform");
+	l->modelView     = glGetUniformLocation(program, "ModelView");
+	kuhl_errorcheck();
+}
+
+/** Looks up the locations of the uniform variables that
+ * kuhl_geometry_draw() sets so that drawing does not require any
+ * glGetUniformLocation() calls. The locations are stored in
+ * geom->locations and are only looked up again if the program
+ * changes or is relinked.
+ *
+ * @param geom The geometry to resolve the uniform locations for.
+ */
+static void kuhl_geometry_locations(kuhl_geometry *geom)
+{
+	kuhl_uniform_locations *l = &(geom->locations);
+	if(l->program == geom->program && l->generation == kuhl_program_generation)
+		return;
+
+	GLint textureLocations[MAX_TEXTURES];
+	kuhl_program_locations(geom, geom->program, l, textureLocations);
+	for(unsigned int i=0; i<geom->texture_count; i++)
+		geom->textures[i].location = textureLocations[i];
 }
 
 
@@ -1095,660 +1933,4429 @@ int kuhl_geometry_attrib_index(kuhl_geometry *geom, const char *name)
 	return -1;
 }
 
-/** Retrieves vertex attribute information stored in an OpenGL array
- * buffer.
- *
- * @param geom The geometry object containing the attribute that you
- * want to retrieve.
+/** Unmaps any attribute buffers that kuhl_geometry_attrib_get()
+ * mapped. OpenGL can't draw with a buffer while it is mapped.
  *
- * @param name The GLSL variable name of the attribute that you are
- * interested in.
+ * @param geom The geometry to unmap the buffers for.
+ */
+static void kuhl_geometry_attrib_unmap(kuhl_geometry *geom)
+{
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		kuhl_attrib *attrib = &(geom->attribs[i]);
+		if(attrib->mapped == NULL)
+			continue;
+		glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		/* Interleaved attributes share the same mapping. */
+		for(unsigned int j=i; j<geom->attrib_count; j++)
+			if(geom->attribs[j].bufferobject == attrib->bufferobject)
+				geom->attribs[j].mapped = NULL;
+		kuhl_errorcheck();
+	}
+}
+
+/** Converts a 32-bit float into a 16-bit float (GL_HALF_FLOAT). Values
+ * that are too large become infinity.
  *
- * @param size A pointer to an integer that will be filled in with the
- * length of the data retrieved.
+ * @param f The value to convert.
  *
- * @return A pointer to a array of floats which contains all of
- * per-vertex data for this attribute. Any changes you make to the
- * array will automatically be propagated back to OpenGL before the
- * next time the geometry is drawn. The array should NOT be
- * free()'d. It also should NOT be accessed after the geometry is
- * drawn. If you want to continue to access the data, you should call
- * kuhl_geometry_attrib_get() every frame. If you aren't changing the
- * data but still want access to it, it is best to make a copy of the
- * array that kuhl_geometry_attrib_get() returns instead of calling it
- * every single frame to retrieve the same data repeatedly.
+ * @return The value as a 16-bit float.
  */
-GLfloat* kuhl_geometry_attrib_get(kuhl_geometry *geom, const char *name, GLint *size)
+static GLushort kuhl_float_to_half(float f)
 {
-	if(size != NULL)
-		*size = 0;
-
-	if(geom == NULL || name == NULL || size == NULL)
-		return NULL;
-
-	int index = kuhl_geometry_attrib_index(geom, name);
-	if(index < 0)
-		return NULL;
-
-	/* Bind the VAO and the buffer we are interested in */
-	kuhl_attrib *attrib = &(geom->attribs[index]);
-	if(!glIsBuffer(attrib->bufferobject) || !glIsVertexArray(geom->vao))
-		return NULL;
-	glBindVertexArray(geom->vao);
-	glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
-	kuhl_errorcheck();
-
-	/* Get the size of the buffer */
-	GLint bufferSize = 0;
-	glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_SIZE, &bufferSize);
-	GLint bufferNumFloats = bufferSize / sizeof(GLfloat);
-
-	/* Get a pointer to the memory-mapped array (but first check if
-	 * the buffer is already mapped. */
-	GLfloat *ret;
-	glGetBufferPointerv(GL_ARRAY_BUFFER, GL_BUFFER_MAP_POINTER, (void**) &ret);
-	if(ret == NULL) /* If buffer is not already mapped */
-		ret = (GLfloat*) glMapBuffer(GL_ARRAY_BUFFER, GL_READ_WRITE);
-
-	/* NOTE: We will unmap any buffer that needs unmapping in
-	 * kuhl_geometry_draw() before we draw. */
-	kuhl_errorcheck();
-	if(ret == NULL)
-		return NULL;
-	*size = bufferNumFloats;
+	union { float f; uint32_t u; } v;
+	v.f = f;
+	uint32_t sign = (v.u >> 16) & 0x8000;
+	int exponent = (int)((v.u >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = v.u & 0x7fffff;
+
+	if(((v.u >> 23) & 0xff) == 0xff) // infinity or NaN
+		return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+	if(exponent >= 31) // too large
+		return sign | 0x7c00;
+	if(exponent <= 0) // denormalized or zero
+	{
+		if(exponent < -10)
+			return sign;
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		uint32_t half = mantissa >> shift;
+		if((mantissa >> (shift-1)) & 1) // round
+			half++;
+		return sign | half;
+	}
+	uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+	if(mantissa & 0x1000) // round (a carry correctly increases the exponent)
+		half++;
+	return half;
+}
 
-	// unbind
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindVertexArray(0);
-	kuhl_errorcheck();
+/** Converts a 16-bit float (GL_HALF_FLOAT) into a 32-bit float.
+ *
+ * @param h The 16-bit float.
+ *
+ * @return The value as a 32-bit float.
+ */
+static float kuhl_half_to_float(GLushort h)
+{
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+	uint32_t exponent = (h >> 10) & 0x1f;
+	uint32_t mantissa = h & 0x3ff;
+	union { float f; uint32_t u; } v;
+	if(exponent == 0) // denormalized or zero
+	{
+		v.f = mantissa / 16777216.0f; // mantissa * 2^-24
+		v.u |= sign;
+	}
+	else if(exponent == 31) // infinity or NaN
+		v.u = sign | 0x7f800000 | (mantissa << 13);
+	else
+		v.u = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+	return v.f;
+}
 
-	return ret;
+/** Converts a value between -1 and 1 into a signed normalized integer
+ * with the given number of bits.
+ *
+ * @param f The value to convert. It is clamped to [-1,1].
+ *
+ * @param max The largest integer (511 for 10 bits, 32767 for 16 bits, etc).
+ */
+static GLint kuhl_float_to_snorm(float f, GLint max)
+{
+	if(f > 1)
+		f = 1;
+	if(f < -1)
+		f = -1;
+	return (GLint) lroundf(f * max);
 }
 
-/** Changes the GLSL program that is used by a kuhl_geometry object.
+/** Copies per-vertex floats into the format that an attribute is
+ * stored in.
  *
- * @param geom A geometry that you want to change the GLSL program for.
+ * @param attrib The attribute (type, components and vertex_size must be set).
  *
- * @param program The new GLSL program you wish to use with the geometry.
+ * @param data vertexCount*attrib->components floats.
  *
- * @param kg_options Set this to KG_FULL_LIST to apply the new program
- * to all geometries in the kuhl_geometry linked list. Otherwise, set
- * to 0.
+ * @param vertexCount The number of vertices.
+ *
+ * @return A newly allocated array of vertexCount*attrib->vertex_size
+ * bytes which the caller should free().
  */
-void kuhl_geometry_program(kuhl_geometry *geom, GLuint program, int kg_options)
+static void* kuhl_attrib_encode(const kuhl_attrib *attrib, const GLfloat *data, GLuint vertexCount)
 {
-	if(geom == NULL)
-		return;
-
-	if(kg_options & KG_FULL_LIST)
-		kuhl_geometry_program(geom->next, program, kg_options);
-
-	// If the caller deleted their old program and created a new one,
-	// the new program ID might match the old program ID. Therefore,
-	// we can't rely on the program IDs to verify that the user
-	// changed the program.
+	GLuint c = attrib->components;
+	GLubyte *out = (GLubyte*) kuhl_malloc((size_t)vertexCount*attrib->vertex_size);
+	memset(out, 0, (size_t)vertexCount*attrib->vertex_size);
+	for(GLuint v=0; v<vertexCount; v++)
+	{
+		const GLfloat *in = data + (size_t)v*c;
+		void *vertex = out + (size_t)v*attrib->vertex_size;
+		if(attrib->type == GL_HALF_FLOAT)
+		{
+			for(GLuint i=0; i<c; i++)
+				((GLushort*)vertex)[i] = kuhl_float_to_half(in[i]);
+		}
+		else if(attrib->type == GL_SHORT)
+		{
+			for(GLuint i=0; i<c; i++)
+				((GLshort*)vertex)[i] = (GLshort) kuhl_float_to_snorm(in[i], 32767);
+		}
+		else if(attrib->type == GL_INT_2_10_10_10_REV)
+		{
+			GLuint packed = 0;
+			for(GLuint i=0; i<3; i++)
+				packed |= (GLuint)(kuhl_float_to_snorm(in[i], 511) & 0x3ff) << (i*10);
+			if(c == 4)
+				packed |= (GLuint)(kuhl_float_to_snorm(in[3], 1) & 0x3) << 30;
+			*(GLuint*)vertex = packed;
+		}
+		else
+			memcpy(vertex, in, sizeof(GLfloat)*c);
+	}
+	return out;
+}
 
-	if(!glIsProgram(program))
+/** Converts data stored in the format of an attribute back into
+ * floats. This is the inverse of kuhl_attrib_encode() (except for the
+ * precision lost while encoding).
+ *
+ * @param attrib The attribute that the data belongs to.
+ *
+ * @param raw vertexCount*attrib->vertex_size bytes.
+ *
+ * @param vertexCount The number of vertices.
+ *
+ * @param out Filled in with vertexCount*attrib->components floats.
+ */
+static void kuhl_attrib_decode(const kuhl_attrib *attrib, const void *raw, GLuint vertexCount, GLfloat *out)
+{
+	GLuint c = attrib->components;
+	for(GLuint v=0; v<vertexCount; v++)
 	{
-		msg(MSG_WARNING, "GLSL program %d is not a valid program.\n",program);
+		const GLubyte *vertex = (const GLubyte*) raw + (size_t)v*attrib->vertex_size;
+		GLfloat *o = out + (size_t)v*c;
+		if(attrib->type == GL_HALF_FLOAT)
+		{
+			for(GLuint i=0; i<c; i++)
+				o[i] = kuhl_half_to_float(((const GLushort*)vertex)[i]);
+		}
+		else if(attrib->type == GL_SHORT)
+		{
+			for(GLuint i=0; i<c; i++)
+				o[i] = fmaxf(((const GLshort*)vertex)[i] / 32767.0f, -1);
+		}
+		else if(attrib->type == GL_INT_2_10_10_10_REV)
+		{
+			GLuint packed = *(const GLuint*)vertex;
+			for(GLuint i=0; i<3; i++)
+			{
+				GLint x = (GLint)(((packed >> (i*10)) & 0x3ff) ^ 0x200) - 0x200;
+				o[i] = fmaxf(x / 511.0f, -1);
+			}
+			if(c == 4)
+			{
+				GLint w = (GLint)(((packed >> 30) & 0x3) ^ 0x2) - 0x2;
+				o[3] = fmaxf((float) w, -1);
+			}
+		}
+		else
+			memcpy(o, vertex, sizeof(GLfloat)*c);
 	}
-	
-	geom->program = program;
+}
 
-	/* Iterate through the vertex attributes in this kuhl_geometry
-	 * object and determine where these attributes should go in the
-	 * newly specified program. */
-	glBindVertexArray(geom->vao);
-	for(unsigned int i=0; i<geom->attrib_count; i++)
+/** Returns the KG_* option that stores an attribute in the same
+ * format as an existing attribute.
+ *
+ * @param attrib The existing attribute.
+ */
+static int kuhl_attrib_format_options(const kuhl_attrib *attrib)
+{
+	switch(attrib->type)
 	{
-		kuhl_attrib *attrib = &(geom->attribs[i]);
-		glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
-		kuhl_errorcheck();
-
-		// Find attribute location in the new program; enable that location
-		GLint attribLocation = kuhl_get_attribute(geom->program, attrib->name);
-		glEnableVertexAttribArray(attribLocation);
-
-		/* Get the size of the buffer */
-		GLint bufferSize = 0;
-		glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_SIZE, &bufferSize);
-		GLint bufferNumFloats = bufferSize/sizeof(GLfloat);
-		GLint components = bufferNumFloats / geom->vertex_count;
-
-		/* Connect this vertex attribute with the (possibly different)
-		 * attribute location. */
-		glVertexAttribPointer(
-			attribLocation, // attribute location in glsl program
-			components, // number of elements (x,y,z)
-			GL_FLOAT, // type of each element
-			GL_FALSE, // should OpenGL normalize values?
-			0,        // no extra data between each position
-			0 );      // offset of first element
-		kuhl_errorcheck();
+		case GL_HALF_FLOAT:          return KG_HALF;
+		case GL_SHORT:               return KG_NORM16;
+		case GL_INT_2_10_10_10_REV:  return KG_PACKED;
+		default:                     return KG_NONE;
 	}
-
-	/* NOTE: We do not have to update the uniform locations because
-	 * they are determined in kuhl_geometry_draw() */
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindVertexArray(0);
 }
 
-
-/** Adds a vertex attribute (such as vertex position, normal, color,
- * texture coordinate, etc) to the geometry object.
+/** Tells OpenGL where the data for an attribute is in its buffer. The
+ * vertex array object and the attribute's buffer must be bound.
  *
- * @param geom The geometry to add the attribute to.
+ * @param attrib The attribute to set the pointer for.
  *
- * @param data An array of floats that contains the attribute
- * data. This array should contain geom->vertex_count * components
- * floats.
+ * @param location The location of the attribute in the program that
+ * the vertex array object is used with.
+ */
+static void kuhl_attrib_pointer(const kuhl_attrib *attrib, GLint location)
+{
+	GLsizeiptr offset = attrib->offset;
+	if(attrib->ring != NULL && attrib->ring->mapped != NULL)
+		offset += attrib->ring->slice_size * attrib->ring->slice;
+	GLboolean normalize = GL_FALSE;
+	if(attrib->type == GL_SHORT || attrib->type == GL_INT_2_10_10_10_REV)
+		normalize = GL_TRUE;
+	glVertexAttribPointer(
+		location, // attribute location in glsl program
+		attrib->type == GL_INT_2_10_10_10_REV ? 4 : attrib->components, // number of elements (x,y,z)
+		attrib->type, // type of each element
+		normalize, // should OpenGL normalize values?
+		attrib->stride ? attrib->stride : attrib->vertex_size, // bytes between each vertex
+		(const GLvoid*) offset); // offset of first element
+	kuhl_errorcheck();
+}
+
+/** Allocates storage for a KG_DYNAMIC attribute in the buffer that is
+ * bound to GL_ARRAY_BUFFER. If glBufferStorage() is available, the
+ * buffer holds KUHL_RING_SLICES copies of the attribute and stays
+ * mapped for the lifetime of the attribute. Otherwise, the buffer
+ * holds one copy that is orphaned every time it is updated.
  *
- * @param components The number of floats per vertex in this attribute.
+ * @param data The initial value of the attribute.
  *
- * @param name The GLSL variable name that this attribute should be
- * connected to.
+ * @param size The size of data in bytes.
  *
- * @param warnIfAttribMissing If nonzero, print a warning if the
- * attribute isn't present in the GLSL program for this geometry
- * object.
+ * @return A newly allocated kuhl_attrib_ring.
  */
-void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint components, const char* name, int warnIfAttribMissing)
+static kuhl_attrib_ring* kuhl_attrib_ring_new(const GLfloat *data, GLsizeiptr size)
 {
-	if(name == NULL || strlen(name) == 0)
-	{
-		msg(MSG_WARNING, "Unable to add an attribute that is NULL or an empty string.\n");
-		return;
+	kuhl_attrib_ring *ring = (kuhl_attrib_ring*) kuhl_malloc(sizeof(kuhl_attrib_ring));
+	ring->data = (GLfloat*) kuhl_malloc(size);
+	memcpy(ring->data, data, size);
+	ring->dirty = 0;
+	ring->slice_size = size;
+	ring->slice = 0;
+	for(int i=0; i<KUHL_RING_SLICES; i++)
+		ring->fences[i] = 0;
+	ring->mapped = NULL;
+
+	if(GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage)
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, size*KUHL_RING_SLICES, NULL, flags);
+		ring->mapped = (GLubyte*) glMapBufferRange(GL_ARRAY_BUFFER, 0, size*KUHL_RING_SLICES, flags);
+		kuhl_errorcheck();
 	}
-	if(geom == NULL)
-	{
-		msg(MSG_WARNING, "Unable to add attribute '%s' to the geometry object because you passed in a geometry object that was set to NULL.\n",name);
+	if(ring->mapped != NULL)
+		memcpy(ring->mapped, data, size);
+	else
+		glBufferData(GL_ARRAY_BUFFER, size, data, GL_STREAM_DRAW);
+	kuhl_errorcheck();
+	return ring;
+}
+
+/** Frees a kuhl_attrib_ring. The buffer that the ring was stored in
+ * should be deleted separately (deleting the buffer also unmaps it).
+ *
+ * @param ring The ring to free.
+ */
+static void kuhl_attrib_ring_free(kuhl_attrib_ring *ring)
+{
+	if(ring == NULL)
 		return;
+	for(int i=0; i<KUHL_RING_SLICES; i++)
+		if(ring->fences[i])
+			glDeleteSync(ring->fences[i]);
+	free(ring->data);
+	free(ring);
+}
+
+/** Copies the RAM copy of a KG_DYNAMIC attribute into its buffer,
+ * which must be bound to GL_ARRAY_BUFFER. With glBufferStorage(), the
+ * data is written into the next copy in the buffer after waiting for
+ * the GPU to finish drawing with it---since that copy was last used
+ * KUHL_RING_SLICES-1 updates ago, we normally don't have to wait at
+ * all.
+ *
+ * @param ring The attribute's ring.
+ *
+ * @return 1 if the data was written to a different part of the
+ * buffer and the attribute pointer must be updated, 0 otherwise.
+ */
+static int kuhl_attrib_ring_upload(kuhl_attrib_ring *ring)
+{
+	ring->dirty = 0;
+	if(ring->mapped == NULL)
+	{
+		/* Orphan the old storage so we don't wait for the GPU to
+		 * finish drawing with it. */
+		glBufferData(GL_ARRAY_BUFFER, ring->slice_size, NULL, GL_STREAM_DRAW);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, ring->slice_size, ring->data);
+		return 0;
 	}
-	if(data == NULL)
+
+	ring->slice = (ring->slice+1) % KUHL_RING_SLICES;
+	GLsync fence = ring->fences[ring->slice];
+	if(fence)
 	{
-		msg(MSG_WARNING, "Unable to add attribute '%s' to the geometry object because you passed in an array set to NULL.\n", name);
+		GLenum result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+		while(result == GL_TIMEOUT_EXPIRED)
+			result = glClientWaitSync(fence, 0, 1000000000);
+		glDeleteSync(fence);
+		ring->fences[ring->slice] = 0;
+	}
+	memcpy(ring->mapped + ring->slice_size*ring->slice, ring->data, ring->slice_size);
+	return 1;
+}
+
+/** Records that the GPU is reading the current copy of a KG_DYNAMIC
+ * attribute.
+ *
+ * @param ring The attribute's ring (may be NULL).
+ */
+static void kuhl_attrib_ring_fence(kuhl_attrib_ring *ring)
+{
+	if(ring == NULL || ring->mapped == NULL)
+		return;
+	if(ring->fences[ring->slice])
+		glDeleteSync(ring->fences[ring->slice]);
+	ring->fences[ring->slice] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+/** Creates the RAM copy of a KG_SHADOW attribute.
+ *
+ * @param data The initial value of the attribute.
+ *
+ * @param count The number of floats in data.
+ *
+ * @return A newly allocated kuhl_attrib_shadow.
+ */
+static kuhl_attrib_shadow* kuhl_attrib_shadow_new(const GLfloat *data, size_t count)
+{
+	kuhl_attrib_shadow *shadow = (kuhl_attrib_shadow*) kuhl_malloc(sizeof(kuhl_attrib_shadow));
+	shadow->data = (GLfloat*) kuhl_malloc(sizeof(GLfloat)*count);
+	memcpy(shadow->data, data, sizeof(GLfloat)*count);
+	shadow->dirty_ranges = 0;
+	return shadow;
+}
+
+/** Frees a kuhl_attrib_shadow.
+ *
+ * @param shadow The shadow to free (may be NULL).
+ */
+static void kuhl_attrib_shadow_free(kuhl_attrib_shadow *shadow)
+{
+	if(shadow == NULL)
+		return;
+	free(shadow->data);
+	free(shadow);
+}
+
+/** Removes one of the changed ranges of a KG_SHADOW attribute.
+ *
+ * @param shadow The attribute's shadow.
+ *
+ * @param r The index of the range to remove.
+ */
+static void kuhl_attrib_shadow_remove(kuhl_attrib_shadow *shadow, unsigned int r)
+{
+	shadow->dirty_ranges--;
+	shadow->dirty_first[r] = shadow->dirty_first[shadow->dirty_ranges];
+	shadow->dirty_count[r] = shadow->dirty_count[shadow->dirty_ranges];
+}
+
+/** Records that some vertices of a KG_SHADOW attribute changed. The
+ * range is merged with ranges that it overlaps or touches. If there
+ * are already KUHL_SHADOW_RANGES ranges, the closest one is merged
+ * with it too.
+ *
+ * @param shadow The attribute's shadow.
+ *
+ * @param first The first vertex that changed.
+ *
+ * @param count The number of vertices that changed.
+ */
+static void kuhl_attrib_shadow_dirty(kuhl_attrib_shadow *shadow, GLuint first, GLuint count)
+{
+	if(count == 0)
 		return;
+	GLuint last = first + count;
+	for(;;)
+	{
+		unsigned int r = 0;
+		while(r < shadow->dirty_ranges)
+		{
+			GLuint rFirst = shadow->dirty_first[r];
+			GLuint rLast = rFirst + shadow->dirty_count[r];
+			if(rFirst <= last && first <= rLast)
+			{
+				first = rFirst < first ? rFirst : first;
+				last = rLast > last ? rLast : last;
+				kuhl_attrib_shadow_remove(shadow, r);
+			}
+			else
+				r++;
+		}
+		if(shadow->dirty_ranges < KUHL_SHADOW_RANGES)
+			break;
+
+		/* Merging the closest range uploads the fewest vertices
+		 * that didn't change. */
+		unsigned int closest = 0;
+		GLuint closestGap = 0xffffffff;
+		for(r=0; r<shadow->dirty_ranges; r++)
+		{
+			GLuint rFirst = shadow->dirty_first[r];
+			GLuint rLast = rFirst + shadow->dirty_count[r];
+			GLuint gap = rLast < first ? first - rLast : rFirst - last;
+			if(gap < closestGap)
+			{
+				closest = r;
+				closestGap = gap;
+			}
+		}
+		GLuint cFirst = shadow->dirty_first[closest];
+		GLuint cLast = cFirst + shadow->dirty_count[closest];
+		first = cFirst < first ? cFirst : first;
+		last = cLast > last ? cLast : last;
+		kuhl_attrib_shadow_remove(shadow, closest);
+	}
+	shadow->dirty_first[shadow->dirty_ranges] = first;
+	shadow->dirty_count[shadow->dirty_ranges] = last - first;
+	shadow->dirty_ranges++;
+}
+
+/** Copies the changed vertices of a KG_SHADOW attribute into its
+ * buffer, which must be bound to GL_ARRAY_BUFFER.
+ *
+ * @param attrib The attribute to update.
+ */
+static void kuhl_attrib_shadow_upload(const kuhl_attrib *attrib)
+{
+	kuhl_attrib_shadow *shadow = attrib->shadow;
+	for(unsigned int r=0; r<shadow->dirty_ranges; r++)
+	{
+		GLuint first = shadow->dirty_first[r];
+		GLuint count = shadow->dirty_count[r];
+		const GLfloat *data = shadow->data + (size_t)first*attrib->components;
+		GLintptr offset = attrib->offset + (GLintptr)first*attrib->vertex_size;
+		GLsizeiptr size = (GLsizeiptr)count*attrib->vertex_size;
+		if(attrib->type == GL_FLOAT)
+			glBufferSubData(GL_ARRAY_BUFFER, offset, size, data);
+		else
+		{
+			void *encoded = kuhl_attrib_encode(attrib, data, count);
+			glBufferSubData(GL_ARRAY_BUFFER, offset, size, encoded);
+			free(encoded);
+		}
 	}
-	if(components == 0 || components > 4)
+	shadow->dirty_ranges = 0;
+	kuhl_errorcheck();
+}
+
+/** Tells OpenGL where the data for a per-instance attribute is in its
+ * buffer. The vertex array object and the attribute's buffer must be
+ * bound. A mat4 is sent as four vec4 columns in consecutive
+ * locations.
+ *
+ * @param attrib The attribute to set the pointer for.
+ *
+ * @param location The location of the attribute in the program that
+ * the vertex array object is used with.
+ */
+static void kuhl_instance_attrib_pointer(const kuhl_instance_attrib *attrib, GLint location)
+{
+	GLsizeiptr offset = 0;
+	if(attrib->ring != NULL && attrib->ring->mapped != NULL)
+		offset = attrib->ring->slice_size * attrib->ring->slice;
+	GLuint columns = attrib->components == 16 ? 4 : 1;
+	GLuint size = attrib->components == 16 ? 4 : attrib->components;
+	for(GLuint c=0; c<columns; c++)
+	{
+		glEnableVertexAttribArray(location + c);
+		glVertexAttribPointer(location + c, size, GL_FLOAT, GL_FALSE,
+		                      sizeof(GLfloat)*attrib->components,
+		                      (const GLvoid*) (offset + sizeof(GLfloat)*4*c));
+		/* Advance to the next value once per instance. */
+		glVertexAttribDivisor(location + c, 1);
+	}
+	kuhl_errorcheck();
+}
+
+/** Copies any KG_DYNAMIC attributes (per-vertex or per-instance)
+ * and any changed vertices of KG_SHADOW attributes into their
+ * buffers.
+ *
+ * @param geom The geometry to update the attributes of.
+ *
+ * @return 1 if a KG_DYNAMIC attribute moved to a different part of
+ * its buffer, so the geometry's vertex array objects must be pointed
+ * at it again (see kuhl_geometry_vaos_repoint()). 0 otherwise.
+ */
+static int kuhl_geometry_attrib_sync(kuhl_geometry *geom)
+{
+	int moved = 0;
+	for(unsigned int i=0; i<geom->attrib_count; i++)
 	{
-		msg(MSG_WARNING, "Unable to add attribute '%s' to the geometry object. You requested %d components but it must be 1, 2, 3, or 4.\n", name, components);
-		return;
+		kuhl_attrib *attrib = &(geom->attribs[i]);
+		if(attrib->shadow != NULL && attrib->shadow->dirty_ranges > 0)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+			kuhl_attrib_shadow_upload(attrib);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+		if(attrib->ring == NULL || attrib->ring->dirty == 0)
+			continue;
+		glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+		if(kuhl_attrib_ring_upload(attrib->ring))
+			moved = 1;
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		kuhl_errorcheck();
 	}
-	if(!glIsVertexArray(geom->vao))
+	for(unsigned int i=0; i<geom->instance_attrib_count; i++)
 	{
-		msg(MSG_WARNING, "Unable to add attribute '%s' to the geometry object because the geometry has an invalid vertex array object %d\n", name, geom->vao);
-		return;
+		kuhl_instance_attrib *attrib = &(geom->instance_attribs[i]);
+		if(attrib->ring == NULL || attrib->ring->dirty == 0)
+			continue;
+		glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+		if(kuhl_attrib_ring_upload(attrib->ring))
+			moved = 1;
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		kuhl_errorcheck();
 	}
+	return moved;
+}
 
-	/* If this attribute isn't available in the GLSL program, move
-	 * on to the next one. */
-	// GLint attribLocation = kuhl_get_attribute(geom->program, name);
+/** Records that the GPU is reading the current copy of each
+ * KG_DYNAMIC attribute. Should be called after the geometry is drawn.
+ *
+ * @param geom The geometry that was drawn.
+ */
+static void kuhl_geometry_attrib_fence(kuhl_geometry *geom)
+{
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+		kuhl_attrib_ring_fence(geom->attribs[i].ring);
+	for(unsigned int i=0; i<geom->instance_attrib_count; i++)
+		kuhl_attrib_ring_fence(geom->instance_attribs[i].ring);
+}
 
-	// Get attribute location directly so kuhl_get_attribute() and
-	// this function don't print the same error repeatedly.
-	GLint attribLocation = glGetAttribLocation(geom->program, name);
-	if(attribLocation == -1)
+/** Returns the number of components per vertex in an attribute
+ * buffer.
+ *
+ * @param geom The geometry containing the attribute.
+ *
+ * @param index Index of the attribute in geom->attribs.
+ */
+static GLuint kuhl_geometry_attrib_components(const kuhl_geometry *geom, unsigned int index)
+{
+	if(geom->vertex_count == 0)
+		return 0;
+	return geom->attribs[index].components;
+}
+
+/** Copies the data in an attribute buffer into a newly allocated
+ * array without converting it into floats. If the attribute is
+ * interleaved, only the bytes for this attribute are copied.
+ *
+ * @param geom The geometry containing the attribute.
+ *
+ * @param index Index of the attribute in geom->attribs.
+ *
+ * @return An array of vertex_count*vertex_size bytes which the caller
+ * should free().
+ */
+static void* kuhl_geometry_attrib_read_raw(kuhl_geometry *geom, unsigned int index)
+{
+	kuhl_geometry_attrib_unmap(geom);
+	const kuhl_attrib *attrib = &(geom->attribs[index]);
+	/* The copy in RAM may be newer than the buffer. */
+	if(attrib->shadow != NULL)
+		return kuhl_attrib_encode(attrib, attrib->shadow->data, geom->vertex_count);
+	size_t size = (size_t)attrib->vertex_size * geom->vertex_count;
+	GLubyte *data = (GLubyte*) kuhl_malloc(size);
+	if(attrib->ring != NULL)
+	{
+		memcpy(data, attrib->ring->data, size);
+		return data;
+	}
+	glBindBuffer(GL_COPY_READ_BUFFER, attrib->bufferobject);
+	if(attrib->stride == 0)
+		glGetBufferSubData(GL_COPY_READ_BUFFER, attrib->offset, size, data);
+	else if(geom->vertex_count > 0)
+	{
+		/* Read all of the interleaved vertices and pick out the
+		 * values for this attribute. */
+		size_t span = (size_t)attrib->stride*(geom->vertex_count-1) + attrib->vertex_size;
+		GLubyte *interleaved = (GLubyte*) kuhl_malloc(span);
+		glGetBufferSubData(GL_COPY_READ_BUFFER, attrib->offset, span, interleaved);
+		for(GLuint v=0; v<geom->vertex_count; v++)
+			memcpy(data + (size_t)v*attrib->vertex_size, interleaved + (size_t)v*attrib->stride, attrib->vertex_size);
+		free(interleaved);
+	}
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	kuhl_errorcheck();
+	return data;
+}
+
+/** Copies the data in an attribute buffer into a newly allocated
+ * array of floats. Unlike kuhl_geometry_attrib_get(), the buffer is
+ * not mapped. This is intended for processing geometry while it is
+ * loaded, not for use every frame.
+ *
+ * @param geom The geometry containing the attribute.
+ *
+ * @param index Index of the attribute in geom->attribs.
+ *
+ * @param components Set to the number of components per vertex.
+ *
+ * @return An array of vertex_count*components floats which the
+ * caller should free().
+ */
+static GLfloat* kuhl_geometry_attrib_read(kuhl_geometry *geom, unsigned int index, GLuint *components)
+{
+	*components = kuhl_geometry_attrib_components(geom, index);
+	const kuhl_attrib *attrib = &(geom->attribs[index]);
+	if(attrib->shadow != NULL)
+	{
+		size_t size = sizeof(GLfloat) * geom->vertex_count * (*components);
+		GLfloat *data = (GLfloat*) kuhl_malloc(size);
+		memcpy(data, attrib->shadow->data, size);
+		return data;
+	}
+	void *raw = kuhl_geometry_attrib_read_raw(geom, index);
+	if(attrib->type == GL_FLOAT)
+		return (GLfloat*) raw;
+
+	GLfloat *data = (GLfloat*) kuhl_malloc(sizeof(GLfloat) * geom->vertex_count * (*components));
+	kuhl_attrib_decode(attrib, raw, geom->vertex_count, data);
+	free(raw);
+	return data;
+}
+
+/** The slots of the geometry in a kuhl_geometry list, in order, see
+ * kuhl_registry_list_get(). */
+typedef struct
+{
+	unsigned int *slots;
+	unsigned int count;
+	unsigned int capacity;
+	unsigned long version; /**< kuhl_registry.list_version when the slots were filled in */
+} kuhl_registry_list;
+
+/** Every kuhl_geometry that exists, see kuhl_geometry_registry_get().
+ * The arrays grow as needed; slots of deleted geometry are reused
+ * with a new handle. */
+static struct
+{
+	unsigned int slots;    /**< Number of slots that have been handed out */
+	unsigned int capacity; /**< Allocated length of the arrays */
+	unsigned int count;    /**< Number of slots that contain geometry */
+	kuhl_geometry **geom;
+	kuhl_geometry_handle *handle;
+	GLuint *vao;
+	GLuint *program;
+	GLuint *vertex_count;
+	GLuint *indices_len;
+	float (*matrix)[16];
+	float (*aabbox)[6];
+	int *aabbox_valid;
+	kuhl_registry_list *lists; /**< The list that starts at each slot (filled in when it is needed) */
+	unsigned long list_version; /**< Changes whenever geometry is created, deleted or linked into a list */
+	unsigned int *free_slots; /**< Empty slots that can be reused */
+	unsigned int free_count;
+} kuhl_registry;
+
+/** Resizes one of the arrays in the geometry registry. Exits if the
+ * memory can't be allocated. */
+static void* kuhl_registry_grow(void *array, size_t elementSize, unsigned int capacity)
+{
+	void *ret = realloc(array, elementSize*capacity);
+	if(ret == NULL)
 	{
-		if(warnIfAttribMissing)
-			msg(MSG_WARNING, "Unable to add attribute '%s' to the geometry object because it was missing or inactive in program %d\n",
-			    name, geom->program);
-		return;
+		msg(MSG_FATAL, "Unable to grow the geometry registry to %u entries.", capacity);
+		exit(EXIT_FAILURE);
 	}
+	return ret;
+}
 
-	/* If another attribute in kuhl_geometry has the same name,
-	 * overwrite it. */
-	int destIndex = kuhl_geometry_attrib_index(geom, name);
+/** Checks if a geometry is in the geometry registry. A copy of a
+ * kuhl_geometry struct has the handle of the original but is not in
+ * the registry. */
+static int kuhl_registry_contains(const kuhl_geometry *geom)
+{
+	unsigned int slot = (unsigned int) (geom->handle & KUHL_GEOMETRY_HANDLE_SLOT_MASK);
+	return geom->handle != 0 && slot < kuhl_registry.slots &&
+		kuhl_registry.geom[slot] == geom &&
+		kuhl_registry.handle[slot] == geom->handle;
+}
 
-	if(destIndex < 0)
+/** Copies the draw-related values of a geometry into the geometry
+ * registry. Does nothing if the geometry isn't in the registry. */
+static void kuhl_registry_store(const kuhl_geometry *geom)
+{
+	if(!kuhl_registry_contains(geom))
+		return;
+	unsigned int slot = (unsigned int) (geom->handle & KUHL_GEOMETRY_HANDLE_SLOT_MASK);
+	kuhl_registry.vao[slot] = geom->vao;
+	kuhl_registry.program[slot] = geom->program;
+	kuhl_registry.vertex_count[slot] = geom->vertex_count;
+	kuhl_registry.indices_len[slot] = geom->indices_len;
+	mat4f_copy(kuhl_registry.matrix[slot], geom->matrix);
+	memcpy(kuhl_registry.aabbox[slot], geom->aabbox, sizeof(float)*6);
+	kuhl_registry.aabbox_valid[slot] = geom->aabbox_valid;
+}
+
+/** Removes a geometry from the geometry registry and sets its handle
+ * to 0. Handles to it stop working, even after its slot is
+ * reused. */
+static void kuhl_registry_remove(kuhl_geometry *geom)
+{
+	if(kuhl_registry_contains(geom))
 	{
-		/* If this is a new attribute for this geometry object */
-		destIndex = geom->attrib_count;
-		geom->attrib_count++;
+		unsigned int slot = (unsigned int) (geom->handle & KUHL_GEOMETRY_HANDLE_SLOT_MASK);
+		kuhl_registry.geom[slot] = NULL;
+		kuhl_registry.count--;
+		kuhl_registry.list_version++;
+		/* A slot whose count of uses ran out is never used again. */
+		if((kuhl_registry.handle[slot] >> KUHL_GEOMETRY_HANDLE_SLOT_BITS) < KUHL_GEOMETRY_HANDLE_SLOT_MASK)
+			kuhl_registry.free_slots[kuhl_registry.free_count++] = slot;
 	}
+	geom->handle = 0;
+}
+
+/** Adds a geometry to the geometry registry and sets geom->handle.
+ * geom->handle may be uninitialized when this is called. */
+static void kuhl_registry_add(kuhl_geometry *geom)
+{
+	/* kuhl_geometry_new() was called again without
+	 * kuhl_geometry_delete(). */
+	if(kuhl_registry_contains(geom))
+		kuhl_registry_remove(geom);
+
+	unsigned int slot;
+	if(kuhl_registry.free_count > 0)
+		slot = kuhl_registry.free_slots[--kuhl_registry.free_count];
 	else
 	{
-		/* If overwriting, free resources from old attribute. */
-		free(geom->attribs[destIndex].name);
-		if(glIsBuffer(geom->attribs[destIndex].bufferobject))
-			glDeleteBuffers(1, &(geom->attribs[destIndex].bufferobject));
-	}
-	msg(MSG_DEBUG, "Storing attribute %s at index %d in kuhl_geometry; connected to location %d in program %d", name, destIndex, attribLocation, geom->program);
-	
-	/* If we are writing past the end of the array. */
-	if(destIndex == MAX_ATTRIBUTES)
+		if(kuhl_registry.slots == kuhl_registry.capacity)
+		{
+			if(kuhl_registry.capacity > KUHL_GEOMETRY_HANDLE_SLOT_MASK/2)
+			{
+				msg(MSG_FATAL, "Too many kuhl_geometry objects (the limit is %u).", KUHL_GEOMETRY_HANDLE_SLOT_MASK/2);
+				exit(EXIT_FAILURE);
+			}
+			unsigned int capacity = kuhl_registry.capacity ? kuhl_registry.capacity*2 : 64;
+			kuhl_registry.geom         = kuhl_registry_grow(kuhl_registry.geom,         sizeof(kuhl_geometry*), capacity);
+			kuhl_registry.handle       = kuhl_registry_grow(kuhl_registry.handle,       sizeof(kuhl_geometry_handle), capacity);
+			kuhl_registry.vao          = kuhl_registry_grow(kuhl_registry.vao,          sizeof(GLuint), capacity);
+			kuhl_registry.program      = kuhl_registry_grow(kuhl_registry.program,      sizeof(GLuint), capacity);
+			kuhl_registry.vertex_count = kuhl_registry_grow(kuhl_registry.vertex_count, sizeof(GLuint), capacity);
+			kuhl_registry.indices_len  = kuhl_registry_grow(kuhl_registry.indices_len,  sizeof(GLuint), capacity);
+			kuhl_registry.matrix       = kuhl_registry_grow(kuhl_registry.matrix,       sizeof(float)*16, capacity);
+			kuhl_registry.aabbox       = kuhl_registry_grow(kuhl_registry.aabbox,       sizeof(float)*6, capacity);
+			kuhl_registry.aabbox_valid = kuhl_registry_grow(kuhl_registry.aabbox_valid, sizeof(int), capacity);
+			kuhl_registry.lists        = kuhl_registry_grow(kuhl_registry.lists,        sizeof(kuhl_registry_list), capacity);
+			kuhl_registry.free_slots   = kuhl_registry_grow(kuhl_registry.free_slots,   sizeof(unsigned int), capacity);
+			memset(kuhl_registry.lists+kuhl_registry.capacity, 0,
+			       sizeof(kuhl_registry_list)*(capacity-kuhl_registry.capacity));
+			kuhl_registry.capacity = capacity;
+		}
+		slot = kuhl_registry.slots++;
+		kuhl_registry.handle[slot] = 0;
+	}
+
+	/* The upper bits count how often the slot was used so that old
+	 * handles to it don't match. 0 is never a valid handle. */
+	kuhl_geometry_handle generation = (kuhl_registry.handle[slot] >> KUHL_GEOMETRY_HANDLE_SLOT_BITS) + 1;
+	kuhl_registry.handle[slot] = (generation << KUHL_GEOMETRY_HANDLE_SLOT_BITS) | slot;
+	kuhl_registry.geom[slot] = geom;
+	kuhl_registry.count++;
+	kuhl_registry.list_version++;
+	geom->handle = kuhl_registry.handle[slot];
+	kuhl_registry_store(geom);
+}
+
+/** Gets the registry slots of a geometry and of the geometry that
+ * follows it in its linked list. The slots are remembered until
+ * geometry is created, deleted or linked into a list, so drawing or
+ * counting the same list again reads one array instead of following
+ * the next pointers.
+ *
+ * @param geom The first geometry in the list.
+ *
+ * @return The slots of the geometry in list order, or NULL if geom or
+ * any geometry after it is not in the registry (such as a copy of a
+ * kuhl_geometry struct). The result is valid until the registry
+ * changes.
+ */
+static const kuhl_registry_list* kuhl_registry_list_get(const kuhl_geometry *geom)
+{
+	if(geom == NULL || !kuhl_registry_contains(geom))
+		return NULL;
+	kuhl_registry_list *list = &(kuhl_registry.lists[geom->handle & KUHL_GEOMETRY_HANDLE_SLOT_MASK]);
+	if(list->version == kuhl_registry.list_version)
+		return list;
+
+	list->count = 0;
+	for(const kuhl_geometry *g = geom; g != NULL; g = g->next)
 	{
-		msg(MSG_FATAL, "You tried to add more than %d attributes to a kuhl_geometry object\n", MAX_ATTRIBUTES);
-		exit(EXIT_FAILURE);
+		if(!kuhl_registry_contains(g))
+			return NULL;
+		if(list->count == list->capacity)
+		{
+			list->capacity = list->capacity ? list->capacity*2 : 8;
+			list->slots = kuhl_registry_grow(list->slots, sizeof(unsigned int), list->capacity);
+		}
+		list->slots[list->count++] = (unsigned int) (g->handle & KUHL_GEOMETRY_HANDLE_SLOT_MASK);
 	}
+	list->version = kuhl_registry.list_version;
+	return list;
+}
 
-	/* Set up this attribute. */
-	kuhl_attrib *attrib = &(geom->attribs[destIndex]);
-	attrib->name = strdup(name);
+/** Steps to the next geometry in a list. This reads the slots from
+ * kuhl_registry_list_get() if there are any and follows g->next
+ * otherwise:
 
-	/* Switch to our vertex array object. */
-	glBindVertexArray(geom->vao);
+\verbatim
+const kuhl_registry_list *list = kuhl_registry_list_get(geom);
+unsigned int i = 0;
+for(kuhl_geometry *g = geom; g != NULL; g = kuhl_registry_list_next(list, &i, g))
+\endverbatim
+ *
+ * @param list The list from kuhl_registry_list_get() (may be NULL).
+ *
+ * @param i The position of g in the list, updated by this function.
+ *
+ * @param g The current geometry.
+ *
+ * @return The next geometry or NULL at the end of the list.
+ */
+static kuhl_geometry* kuhl_registry_list_next(const kuhl_registry_list *list, unsigned int *i, kuhl_geometry *g)
+{
+	if(list == NULL)
+		return g->next;
+	(*i)++;
+	if(*i >= list->count)
+		return NULL;
+	return kuhl_registry.geom[list->slots[*i]];
+}
 
-	/* Enable this attribute location for this vertex array object. */
-	glEnableVertexAttribArray(attribLocation);
-	
-	/* Ask OpenGL for one new buffer "name" (or ID number). */
-	glGenBuffers(1, &(attrib->bufferobject));
-	/* Tell OpenGL that we are going to use this buffer until we
-	 * say otherwise. GL_ARRAY_BUFFER basically means that the
-	 * data stored in this buffer will be an array containing
-	 * vertex information. */
-	glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
-	kuhl_errorcheck();
+/** Frees a kuhl_meshlets struct.
+ *
+ * @param meshlets The meshlets to free (may be NULL).
+ */
+static void kuhl_meshlets_free(kuhl_meshlets *meshlets)
+{
+	if(meshlets == NULL)
+		return;
+	free(meshlets->meshlets);
+	free(meshlets->draw_counts);
+	free(meshlets->draw_offsets);
+	free(meshlets);
+}
 
-	/* Copy our data into the buffer object that is currently bound. */
-	glBufferData(GL_ARRAY_BUFFER,
-	             sizeof(GLfloat)*geom->vertex_count*components,
-	             data, GL_STATIC_DRAW);
-	kuhl_errorcheck();
+/** Frees a kuhl_batch struct.
+ *
+ * @param batch The batch to free (may be NULL).
+ */
+static void kuhl_batch_free(kuhl_batch *batch)
+{
+	if(batch == NULL)
+		return;
+	free(batch->pieces);
+	free(batch->draw_counts);
+	free(batch->draw_offsets);
+	free(batch);
+}
 
-	/* Tell OpenGL some information about the data that is in the
-	 * buffer. Among other things, we need to tell OpenGL which
-	 * attribute number (i.e., variable) the data should correspond to
-	 * in the vertex program. */
-	glVertexAttribPointer(
-		attribLocation, // attribute location in glsl program
-		components, // number of elements (x,y,z)
-		GL_FLOAT, // type of each element
-		GL_FALSE, // should OpenGL normalize values?
-		0,        // no extra data between each position
-		0 );      // offset of first element
-	kuhl_errorcheck();
+/** Creates a kuhl_meshlets struct that is not culled yet.
+ *
+ * @param meshlets Array of meshlets, which the new struct takes
+ * ownership of.
+ *
+ * @param count Number of meshlets.
+ *
+ * @return The new struct.
+ */
+static kuhl_meshlets* kuhl_meshlets_new(kuhl_meshlet *meshlets, unsigned int count)
+{
+	kuhl_meshlets *m = (kuhl_meshlets*) kuhl_malloc(sizeof(kuhl_meshlets));
+	m->meshlets = meshlets;
+	m->count = count;
+	/* Every other meshlet may be culled, so there may be half as
+	 * many ranges as meshlets. */
+	m->draw_counts = (GLsizei*) kuhl_malloc(sizeof(GLsizei)*(count/2+1));
+	m->draw_offsets = (const GLvoid**) kuhl_malloc(sizeof(GLvoid*)*(count/2+1));
+	m->draw_ranges = 0;
+	m->culled = 0;
+	return m;
+}
 
-	// unbind
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindVertexArray(0);
+/** Copies a kuhl_meshlets struct (without the culling results).
+ *
+ * @param meshlets The meshlets to copy (may be NULL).
+ *
+ * @return A new struct, or NULL if meshlets is NULL.
+ */
+static kuhl_meshlets* kuhl_meshlets_copy(const kuhl_meshlets *meshlets)
+{
+	if(meshlets == NULL)
+		return NULL;
+	kuhl_meshlet *copy = (kuhl_meshlet*) kuhl_malloc(sizeof(kuhl_meshlet)*meshlets->count);
+	memcpy(copy, meshlets->meshlets, sizeof(kuhl_meshlet)*meshlets->count);
+	return kuhl_meshlets_new(copy, meshlets->count);
 }
 
-/** Calculates the number of objects in the kuhl_geometry linked list.
+/** Shared buffers that the model loader can reuse for meshes that it
+ * loads later (a list of kuhl_shared_buffers pointers), see
+ * kuhl_private_shared_finish(). */
+static list *kuhl_shared_cache = NULL;
 
-    @param geom The geometry object which you want to know the length of.
+/** Checks if a buffer is one of the shared buffers. */
+static int kuhl_shared_buffers_owns(const kuhl_shared_buffers *shared, GLuint buffer)
+{
+	for(unsigned int i=0; i<shared->buffer_count; i++)
+		if(shared->buffers[i] == buffer)
+			return 1;
+	return 0;
+}
+
+/** Creates a kuhl_shared_buffers record for the vertex and index
+ * buffers of a geometry (unless it already has one).
+ *
+ * @param geom The geometry whose buffers will be shared.
+ *
+ * @return The record that geom->shared points to.
+ */
+static kuhl_shared_buffers* kuhl_shared_buffers_record(kuhl_geometry *geom)
+{
+	if(geom->shared != NULL)
+		return geom->shared;
+
+	kuhl_shared_buffers *shared = (kuhl_shared_buffers*) kuhl_malloc(sizeof(kuhl_shared_buffers));
+	shared->refcount = 1;
+	shared->buffer_count = 0;
+	shared->key = NULL;
+	shared->source = NULL;
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		GLuint buffer = geom->attribs[i].bufferobject;
+		if(buffer != 0 && !kuhl_shared_buffers_owns(shared, buffer))
+			shared->buffers[shared->buffer_count++] = buffer;
+	}
+	if(geom->indices_bufferobject != 0)
+		shared->buffers[shared->buffer_count++] = geom->indices_bufferobject;
+	geom->shared = shared;
+	return shared;
+}
+
+/** Frees a kuhl_shared_buffers record without deleting its buffers. */
+static void kuhl_shared_buffers_free(kuhl_shared_buffers *shared)
+{
+	if(kuhl_shared_cache != NULL)
+		list_remove_all(kuhl_shared_cache, &shared);
+	if(shared->source != NULL)
+	{
+		for(unsigned int i=0; i<shared->source->attrib_count; i++)
+			free(shared->source->attribs[i].name);
+		free(shared->source->lod);
+		kuhl_meshlets_free(shared->source->meshlets);
+		free(shared->source);
+	}
+	free(shared->key);
+	free(shared);
+}
+
+/** Stops a geometry from using its shared buffers. Buffers that
+ * other geometry still uses are set to 0 in geom so that
+ * kuhl_geometry_delete() doesn't delete them; the shared buffers are
+ * deleted when the last geometry stops using them.
+ *
+ * @param geom The geometry that is being deleted.
+ */
+static void kuhl_shared_buffers_release(kuhl_geometry *geom)
+{
+	kuhl_shared_buffers *shared = geom->shared;
+	if(shared == NULL)
+		return;
+	geom->shared = NULL;
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+		if(kuhl_shared_buffers_owns(shared, geom->attribs[i].bufferobject))
+			geom->attribs[i].bufferobject = 0;
+	if(kuhl_shared_buffers_owns(shared, geom->interleaved_bufferobject))
+		geom->interleaved_bufferobject = 0;
+	if(kuhl_shared_buffers_owns(shared, geom->indices_bufferobject))
+		geom->indices_bufferobject = 0;
+
+	shared->refcount--;
+	if(shared->refcount == 0)
+	{
+		glDeleteBuffers(shared->buffer_count, shared->buffers);
+		kuhl_shared_buffers_free(shared);
+	}
+}
+
+/** Makes sure that no other geometry uses the buffers of a geometry
+ * before they are changed. If the geometry is the only one using its
+ * shared buffers, it becomes their owner (and the model loader
+ * forgets about them).
+ *
+ * @param geom The geometry that will be changed.
+ *
+ * @return 1 if the buffers of the geometry can be changed, 0 if other
+ * geometry uses them.
+ */
+static int kuhl_geometry_unshare(kuhl_geometry *geom)
+{
+	kuhl_shared_buffers *shared = geom->shared;
+	if(shared == NULL)
+		return 1;
+	if(shared->refcount > 1)
+		return 0;
+	kuhl_shared_buffers_free(shared);
+	geom->shared = NULL;
+	return 1;
+}
+
+/** Checks if an attribute of a geometry can be changed without
+ * changing other geometry that shares its buffer.
+ *
+ * @param geom The geometry containing the attribute.
+ *
+ * @param attrib The attribute that will be changed.
+ *
+ * @return 1 if the attribute can be changed, 0 if it must be copied
+ * into a new buffer first.
+ */
+static int kuhl_geometry_unshare_attrib(kuhl_geometry *geom, const kuhl_attrib *attrib)
+{
+	if(geom->shared == NULL || !kuhl_shared_buffers_owns(geom->shared, attrib->bufferobject))
+		return 1;
+	return kuhl_geometry_unshare(geom);
+}
+
+/** Retrieves vertex attribute information stored in an OpenGL array
+ * buffer.
+ *
+ * @param geom The geometry object containing the attribute that you
+ * want to retrieve.
+ *
+ * @param name The GLSL variable name of the attribute that you are
+ * interested in.
+ *
+ * @param size A pointer to an integer that will be filled in with the
+ * length of the data retrieved.
+ *
+ * @return A pointer to a array of floats which contains all of
+ * per-vertex data for this attribute. Any changes you make to the
+ * array will automatically be propagated back to OpenGL before the
+ * next time the geometry is drawn. The array should NOT be
+ * free()'d. It also should NOT be accessed after the geometry is
+ * drawn. If you want to continue to access the data, you should call
+ * kuhl_geometry_attrib_get() every frame. If you aren't changing the
+ * data but still want access to it, it is best to make a copy of the
+ * array that kuhl_geometry_attrib_get() returns instead of calling it
+ * every single frame to retrieve the same data repeatedly.
+ *
+ * If the attribute was created with KG_DYNAMIC (see
+ * kuhl_geometry_attrib() and kuhl_geometry_attrib_dynamic()), the
+ * returned array is a copy of the attribute in RAM and calling this
+ * function does not require OpenGL to wait for the GPU. The changes
+ * are copied into an unused part of the attribute's buffer the next
+ * time the geometry is drawn. You must call this function again every
+ * frame that you change the data.
+ *
+ * If the attribute was created with KG_SHADOW (see
+ * kuhl_geometry_attrib_shadow()), this function is the same as
+ * calling kuhl_geometry_attrib_get_range() for every vertex.
+ */
+GLfloat* kuhl_geometry_attrib_get(kuhl_geometry *geom, const char *name, GLint *size)
+{
+	if(size != NULL)
+		*size = 0;
+
+	if(geom == NULL || name == NULL || size == NULL)
+		return NULL;
+
+	int index = kuhl_geometry_attrib_index(geom, name);
+	if(index < 0)
+		return NULL;
+
+	kuhl_attrib *attrib = &(geom->attribs[index]);
+	if(attrib->ring != NULL)
+	{
+		attrib->ring->dirty = 1;
+		*size = geom->vertex_count * attrib->components;
+		return attrib->ring->data;
+	}
+	if(attrib->shadow != NULL)
+		return kuhl_geometry_attrib_get_range(geom, name, 0, geom->vertex_count, size);
+	/* The caller expects the attribute to be tightly packed
+	 * floats. Move an interleaved or compact attribute into its own
+	 * buffer. Use kuhl_geometry_attrib_get_strided() to avoid this for
+	 * interleaved attributes. The caller may also change the data, so
+	 * copy an attribute that other geometry shares. */
+	if(attrib->stride != 0 || attrib->type != GL_FLOAT ||
+	   !kuhl_geometry_unshare_attrib(geom, attrib))
+	{
+		msg(MSG_DEBUG, "Moving attribute '%s' into its own buffer of floats for kuhl_geometry_attrib_get()", attrib->name);
+		GLuint components = 0;
+		GLfloat *data = kuhl_geometry_attrib_read(geom, index, &components);
+		char *attribName = strdup(attrib->name);
+		kuhl_geometry_attrib(geom, data, components, attribName, KG_NONE);
+		free(attribName);
+		free(data);
+	}
+
+	/* The caller may move the vertices. */
+	if(strcmp(attrib->name, "in_Position") == 0)
+	{
+		geom->aabbox_valid = 0;
+		kuhl_registry_store(geom);
+	}
+
+	/* Bind the buffer we are interested in */
+	if(!glIsBuffer(attrib->bufferobject))
+		return NULL;
+	glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+	kuhl_errorcheck();
+
+	/* Get the size of the buffer */
+	GLint bufferSize = 0;
+	glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_SIZE, &bufferSize);
+	GLint bufferNumFloats = bufferSize / sizeof(GLfloat);
+
+	/* Get a pointer to the memory-mapped array (unless we already
+	 * mapped the buffer). */
+	if(attrib->mapped == NULL)
+		attrib->mapped = (GLfloat*) glMapBuffer(GL_ARRAY_BUFFER, GL_READ_WRITE);
+
+	/* NOTE: We will unmap any buffer that needs unmapping in
+	 * kuhl_geometry_draw() before we draw. */
+	kuhl_errorcheck();
+
+	// unbind
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	kuhl_errorcheck();
+
+	if(attrib->mapped == NULL)
+		return NULL;
+	*size = bufferNumFloats;
+	return attrib->mapped;
+}
+
+/** Retrieves a pointer to the data in a vertex attribute without
+ * requiring the attribute to be tightly packed. This works the same
+ * way as kuhl_geometry_attrib_get() except that it also works on
+ * attributes that were interleaved with kuhl_geometry_interleave()
+ * without moving them into their own buffer (unless the attribute is
+ * stored with KG_HALF, KG_PACKED or KG_NORM16). Component k of vertex v
+ * is stored at ptr[v*stride+k].
+ *
+ * @param geom The geometry that you want to retrieve the attribute from.
+ *
+ * @param name The GLSL variable name of the attribute.
+ *
+ * @param size Filled in with the number of values in the attribute
+ * (geom->vertex_count * components).
+ *
+ * @param stride Filled in with the number of floats from the start of
+ * one vertex to the start of the next.
+ *
+ * @return A pointer to the first vertex of the attribute. As with
+ * kuhl_geometry_attrib_get(), the pointer should not be used after
+ * the geometry is drawn.
+ */
+GLfloat* kuhl_geometry_attrib_get_strided(kuhl_geometry *geom, const char *name, GLint *size, GLint *stride)
+{
+	if(size != NULL)
+		*size = 0;
+	if(stride != NULL)
+		*stride = 0;
+	if(geom == NULL || name == NULL || size == NULL || stride == NULL)
+		return NULL;
+
+	int index = kuhl_geometry_attrib_index(geom, name);
+	if(index < 0)
+		return NULL;
+	kuhl_attrib *attrib = &(geom->attribs[index]);
+	if(attrib->stride == 0 || attrib->type != GL_FLOAT ||
+	   !kuhl_geometry_unshare_attrib(geom, attrib))
+	{
+		*stride = attrib->components;
+		return kuhl_geometry_attrib_get(geom, name, size);
+	}
+
+	/* Another attribute that shares the buffer may have mapped it
+	 * already. */
+	for(unsigned int i=0; i<geom->attrib_count && attrib->mapped == NULL; i++)
+		if(geom->attribs[i].bufferobject == attrib->bufferobject)
+			attrib->mapped = geom->attribs[i].mapped;
+	if(attrib->mapped == NULL)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+		attrib->mapped = (GLfloat*) glMapBuffer(GL_ARRAY_BUFFER, GL_READ_WRITE);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		kuhl_errorcheck();
+	}
+	if(attrib->mapped == NULL)
+		return NULL;
+	if(strcmp(attrib->name, "in_Position") == 0)
+	{
+		geom->aabbox_valid = 0;
+		kuhl_registry_store(geom);
+	}
+
+	*size = geom->vertex_count * attrib->components;
+	*stride = attrib->stride / sizeof(GLfloat);
+	return attrib->mapped + attrib->offset / sizeof(GLfloat);
+}
+
+/** Retrieves the copy in RAM of an attribute that was created with
+ * KG_SHADOW (see kuhl_geometry_attrib_shadow()) and records which
+ * vertices the caller will change. Reading the data never waits for
+ * the GPU. The changed vertices are copied into the attribute's
+ * buffer with glBufferSubData() the next time the geometry is drawn,
+ * so changing a few vertices every frame is much cheaper than with
+ * kuhl_geometry_attrib_get().
+ *
+ * If the attribute doesn't have a copy in RAM, this function is the
+ * same as kuhl_geometry_attrib_get().
+ *
+ * @param geom The geometry containing the attribute.
+ *
+ * @param name The GLSL variable name of the attribute.
+ *
+ * @param firstVertex The first vertex that the caller will change.
+ *
+ * @param vertexCount The number of vertices that the caller will
+ * change. Use 0 if the caller will only read the data.
+ *
+ * @param size Filled in with the number of floats in the returned
+ * array (geom->vertex_count * components).
+ *
+ * @return A pointer to all of the data in the attribute (starting at
+ * vertex 0, not at firstVertex). The array should NOT be free()'d. It
+ * remains valid until the attribute is replaced or the geometry is
+ * deleted. Call this function again before making more changes.
+ */
+GLfloat* kuhl_geometry_attrib_get_range(kuhl_geometry *geom, const char *name, GLuint firstVertex, GLuint vertexCount, GLint *size)
+{
+	if(size != NULL)
+		*size = 0;
+	if(geom == NULL || name == NULL || size == NULL)
+		return NULL;
+
+	int index = kuhl_geometry_attrib_index(geom, name);
+	if(index < 0)
+		return NULL;
+	kuhl_attrib *attrib = &(geom->attribs[index]);
+	if(attrib->shadow == NULL)
+		return kuhl_geometry_attrib_get(geom, name, size);
+
+	if(firstVertex > geom->vertex_count || vertexCount > geom->vertex_count - firstVertex)
+	{
+		msg(MSG_ERROR, "Vertices %u to %u of attribute '%s' were requested, but the geometry has only %u vertices.",
+		    firstVertex, firstVertex+vertexCount, name, geom->vertex_count);
+		vertexCount = firstVertex < geom->vertex_count ? geom->vertex_count - firstVertex : 0;
+	}
+	kuhl_attrib_shadow_dirty(attrib->shadow, firstVertex, vertexCount);
+
+	/* The caller may move the vertices. */
+	if(vertexCount > 0 && strcmp(attrib->name, "in_Position") == 0)
+	{
+		geom->aabbox_valid = 0;
+		kuhl_registry_store(geom);
+	}
+
+	*size = geom->vertex_count * attrib->components;
+	return attrib->shadow->data;
+}
+
+/** Copies part of the index buffer of a geometry into a newly
+ * allocated array.
+ *
+ * @param geom The geometry to read the indices of.
+ *
+ * @param first The position of the first index to read.
+ *
+ * @param count The number of indices to read.
+ *
+ * @return An array of count indices which the caller should free(),
+ * or NULL if the geometry has no indices.
+ */
+static GLuint* kuhl_geometry_indices_read_range(const kuhl_geometry *geom, GLuint first, GLuint count)
+{
+	if(count == 0 || geom->indices_bufferobject == 0)
+		return NULL;
+	GLuint *indices = (GLuint*) kuhl_malloc(sizeof(GLuint)*count);
+	glBindBuffer(GL_COPY_READ_BUFFER, geom->indices_bufferobject);
+	if(geom->indices_type == GL_UNSIGNED_SHORT)
+	{
+		GLushort *shortIndices = (GLushort*) kuhl_malloc(sizeof(GLushort)*count);
+		glGetBufferSubData(GL_COPY_READ_BUFFER, sizeof(GLushort)*first, sizeof(GLushort)*count, shortIndices);
+		for(GLuint i=0; i<count; i++)
+			indices[i] = shortIndices[i];
+		free(shortIndices);
+	}
+	else
+		glGetBufferSubData(GL_COPY_READ_BUFFER, sizeof(GLuint)*first, sizeof(GLuint)*count, indices);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	kuhl_errorcheck();
+	return indices;
+}
+
+/** Copies the indices of a geometry into a newly allocated array.
+ *
+ * @param geom The geometry to read the indices of.
+ *
+ * @return An array of geom->indices_len indices which the caller
+ * should free(), or NULL if the geometry has no indices.
+ */
+static GLuint* kuhl_geometry_indices_read(const kuhl_geometry *geom)
+{
+	return kuhl_geometry_indices_read_range(geom, 0, geom->indices_len);
+}
+
+/** Per-mesh data stored in kuhl_multidraw's shader storage buffer
+ * (matches the std430 layout of the KuhlDraw struct in GLSL). */
+typedef struct
+{
+	GLfloat geomTransform[16];
+	GLint material[4];
+} kuhl_multidraw_data;
+
+/** Connects the in_DrawID attribute of a multidraw geometry to a
+ * program. The vertex array object must be bound.
+ *
+ * @param geom A geometry with geom->multidraw set.
+ *
+ * @param program The program that the vertex array object is used
+ * with.
+ */
+static void kuhl_multidraw_bind_drawid(kuhl_geometry *geom, GLuint program)
+{
+	GLint loc = glGetAttribLocation(program, "in_DrawID");
+	if(loc == -1)
+	{
+		msg(MSG_WARNING, "GLSL program %d is missing the in_DrawID attribute needed to draw packed meshes.\n", program);
+		return;
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, geom->multidraw->drawid_bufferobject);
+	glEnableVertexAttribArray(loc);
+	glVertexAttribIPointer(loc, 1, GL_UNSIGNED_INT, 0, 0);
+	/* Advance once per instance. Each draw command uses its index as
+	 * its base instance, so in_DrawID is the index of the command. */
+	glVertexAttribDivisor(loc, 1);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	kuhl_errorcheck();
+}
+
+/** Draws all of the meshes packed into a geometry with one
+ * glMultiDrawElementsIndirect() call. The program and vertex array
+ * object must already be bound.
+ *
+ * @param geom A geometry with geom->multidraw set.
+ */
+static void kuhl_multidraw_draw(kuhl_geometry *geom)
+{
+	kuhl_multidraw *md = geom->multidraw;
+	kuhl_multidraw_data *data = (kuhl_multidraw_data*) md->drawdata;
+
+	/* The matrices of the meshes may have been changed by
+	 * kuhl_update_model(). Only upload them if they changed. */
+	int changed = 0;
+	unsigned int i = 0;
+	for(kuhl_geometry *p = md->parts; p != NULL && i < md->count; p = p->next, i++)
+	{
+		if(memcmp(data[i].geomTransform, p->matrix, sizeof(float)*16) != 0)
+		{
+			mat4f_copy(data[i].geomTransform, p->matrix);
+			changed = 1;
+		}
+	}
+	if(changed || geom->has_been_drawn == 0)
+	{
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, md->draw_bufferobject);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(kuhl_multidraw_data)*md->count, data);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, KUHL_MULTIDRAW_BINDING, md->draw_bufferobject);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, md->indirect_bufferobject);
+	glMultiDrawElementsIndirect(geom->primitive_type, geom->indices_type, NULL, md->count, 0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	kuhl_errorcheck();
+}
+
+/** Changes the GLSL program that is used by a kuhl_geometry object.
+ *
+ * @param geom A geometry that you want to change the GLSL program for.
+ *
+ * @param program The new GLSL program you wish to use with the geometry.
+ *
+ * @param kg_options Set this to KG_FULL_LIST to apply the new program
+ * to all geometries in the kuhl_geometry linked list. Otherwise, set
+ * to 0.
+ */
+void kuhl_geometry_program(kuhl_geometry *geom, GLuint program, int kg_options)
+{
+	if(geom == NULL)
+		return;
+
+	if(kg_options & KG_FULL_LIST)
+		kuhl_geometry_program(geom->next, program, kg_options);
+
+	// If the caller deleted their old program and created a new one,
+	// the new program ID might match the old program ID. Therefore,
+	// we can't rely on the program IDs to verify that the user
+	// changed the program.
+
+	if(!glIsProgram(program))
+	{
+		msg(MSG_WARNING, "GLSL program %d is not a valid program.\n",program);
+	}
+	
+	geom->program = program;
+
+	/* Iterate through the vertex attributes in this kuhl_geometry
+	 * object and determine where these attributes should go in the
+	 * newly specified program. */
+	kuhl_gl_bind_vertex_array(geom->vao);
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		kuhl_attrib *attrib = &(geom->attribs[i]);
+		glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+		kuhl_errorcheck();
+
+		// Find attribute location in the new program; enable that location
+		attrib->location = kuhl_get_attribute(geom->program, attrib->name);
+		glEnableVertexAttribArray(attrib->location);
+
+		/* Connect this vertex attribute with the (possibly different)
+		 * attribute location. */
+		kuhl_attrib_pointer(attrib, attrib->location);
+	}
+
+	for(unsigned int i=0; i<geom->instance_attrib_count; i++)
+	{
+		kuhl_instance_attrib *attrib = &(geom->instance_attribs[i]);
+		attrib->location = glGetAttribLocation(geom->program, attrib->name);
+		if(attrib->location == -1)
+			continue;
+		glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+		kuhl_instance_attrib_pointer(attrib, attrib->location);
+	}
+
+	if(geom->multidraw)
+		kuhl_multidraw_bind_drawid(geom, geom->program);
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	kuhl_gl_bind_vertex_array(0);
+
+	/* Look up the uniform locations in the new program. */
+	kuhl_geometry_locations(geom);
+	kuhl_registry_store(geom);
+}
+
+/** Incremented every time kuhl_program_vao_find() returns a vertex
+ * array object so that the least recently used one can be
+ * replaced. */
+static unsigned long kuhl_program_vao_clock = 0;
+
+/** Connects the index buffer and the attributes of a geometry to
+ * another program in one of the geometry's extra vertex array
+ * objects. Attributes that the program doesn't use are skipped
+ * without a warning: a depth-only or picking program usually only
+ * reads the positions.
+ *
+ * @param geom The geometry.
+ *
+ * @param pv The vertex array object to fill in. pv->program and
+ * pv->vao must be set.
+ */
+static void kuhl_program_vao_bind(kuhl_geometry *geom, kuhl_program_vao *pv)
+{
+	kuhl_program_locations(geom, pv->program, &(pv->locations), pv->texture_locations);
+
+	kuhl_gl_bind_vertex_array(pv->vao);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geom->indices_bufferobject);
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		const kuhl_attrib *attrib = &(geom->attribs[i]);
+		pv->attrib_locations[i] = glGetAttribLocation(pv->program, attrib->name);
+		if(pv->attrib_locations[i] == -1)
+			continue;
+		glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+		glEnableVertexAttribArray(pv->attrib_locations[i]);
+		kuhl_attrib_pointer(attrib, pv->attrib_locations[i]);
+	}
+	for(unsigned int i=0; i<geom->instance_attrib_count; i++)
+	{
+		const kuhl_instance_attrib *attrib = &(geom->instance_attribs[i]);
+		pv->instance_locations[i] = glGetAttribLocation(pv->program, attrib->name);
+		if(pv->instance_locations[i] == -1)
+			continue;
+		glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+		kuhl_instance_attrib_pointer(attrib, pv->instance_locations[i]);
+	}
+	if(geom->multidraw)
+		kuhl_multidraw_bind_drawid(geom, pv->program);
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	kuhl_gl_bind_vertex_array(0);
+	kuhl_errorcheck();
+}
+
+/** Finds (or creates) the vertex array object that connects a
+ * geometry to a program other than geom->program. Each geometry
+ * keeps up to KUHL_MAX_PROGRAM_VAOS of them; when there is no room
+ * for another one, the least recently used one is replaced. The
+ * attribute and uniform locations are only looked up when the vertex
+ * array object is created or when the program is relinked (see
+ * kuhl_program_relinked()).
+ *
+ * @param geom The geometry.
+ *
+ * @param program The program to draw the geometry with.
+ *
+ * @return The vertex array object for the program.
+ */
+static kuhl_program_vao* kuhl_program_vao_find(kuhl_geometry *geom, GLuint program)
+{
+	kuhl_program_vao_clock++;
+
+	kuhl_program_vao *pv = NULL;
+	for(unsigned int i=0; i<geom->program_vao_count; i++)
+	{
+		if(geom->program_vaos[i].program == program)
+		{
+			pv = &(geom->program_vaos[i]);
+			break;
+		}
+	}
+
+	if(pv == NULL)
+	{
+		if(geom->program_vaos == NULL)
+			geom->program_vaos = (kuhl_program_vao*) kuhl_malloc(sizeof(kuhl_program_vao)*KUHL_MAX_PROGRAM_VAOS);
+		if(geom->program_vao_count < KUHL_MAX_PROGRAM_VAOS)
+			pv = &(geom->program_vaos[geom->program_vao_count++]);
+		else
+		{
+			pv = &(geom->program_vaos[0]);
+			for(unsigned int i=1; i<geom->program_vao_count; i++)
+				if(geom->program_vaos[i].last_used < pv->last_used)
+					pv = &(geom->program_vaos[i]);
+			kuhl_gl_vertex_array_deleted(pv->vao);
+			glDeleteVertexArrays(1, &(pv->vao));
+		}
+		pv->program = program;
+		pv->vao = 0;
+		pv->generation = 0;
+	}
+
+	/* Start over with an empty vertex array object if the
+	 * attribute locations may have changed. */
+	if(pv->generation != kuhl_program_generation)
+	{
+		if(pv->vao != 0)
+		{
+			kuhl_gl_vertex_array_deleted(pv->vao);
+			glDeleteVertexArrays(1, &(pv->vao));
+		}
+		glGenVertexArrays(1, &(pv->vao));
+		kuhl_program_vao_bind(geom, pv);
+	}
+	pv->last_used = kuhl_program_vao_clock;
+	return pv;
+}
+
+/** Deletes the vertex array objects that a geometry keeps for
+ * programs other than geom->program. They are created again the next
+ * time kuhl_geometry_draw_with_program() needs them. This is called
+ * whenever the attributes or the indices of the geometry change.
+ *
+ * @param geom The geometry.
+ */
+static void kuhl_geometry_vaos_free(kuhl_geometry *geom)
+{
+	for(unsigned int i=0; i<geom->program_vao_count; i++)
+	{
+		kuhl_gl_vertex_array_deleted(geom->program_vaos[i].vao);
+		glDeleteVertexArrays(1, &(geom->program_vaos[i].vao));
+	}
+	free(geom->program_vaos);
+	geom->program_vaos = NULL;
+	geom->program_vao_count = 0;
+}
+
+/** Points every vertex array object of a geometry at the part of
+ * the buffer that each KG_DYNAMIC attribute was last copied into. See
+ * kuhl_geometry_attrib_sync().
+ *
+ * @param geom The geometry.
+ */
+static void kuhl_geometry_vaos_repoint(kuhl_geometry *geom)
+{
+	for(int v=-1; v<(int)geom->program_vao_count; v++)
+	{
+		const kuhl_program_vao *pv = v < 0 ? NULL : &(geom->program_vaos[v]);
+		kuhl_gl_bind_vertex_array(pv ? pv->vao : geom->vao);
+		for(unsigned int i=0; i<geom->attrib_count; i++)
+		{
+			const kuhl_attrib *attrib = &(geom->attribs[i]);
+			GLint loc = pv ? pv->attrib_locations[i] : attrib->location;
+			if(attrib->ring == NULL || loc == -1)
+				continue;
+			glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+			kuhl_attrib_pointer(attrib, loc);
+		}
+		for(unsigned int i=0; i<geom->instance_attrib_count; i++)
+		{
+			const kuhl_instance_attrib *attrib = &(geom->instance_attribs[i]);
+			GLint loc = pv ? pv->instance_locations[i] : attrib->location;
+			if(attrib->ring == NULL || loc == -1)
+				continue;
+			glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+			kuhl_instance_attrib_pointer(attrib, loc);
+		}
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	kuhl_errorcheck();
+}
+
+
+/** Calculates the bounding box of the vertex positions of a
+ * geometry.
+ *
+ * @param geom The geometry to set geom->aabbox in.
+ *
+ * @param data The in_Position data (geom->vertex_count vertices).
+ *
+ * @param components The number of components per vertex. Missing
+ * components are treated as 0.
+ */
+static void kuhl_geometry_calc_aabbox(kuhl_geometry *geom, const GLfloat *data, GLuint components)
+{
+	geom->aabbox_valid = 0;
+	if(geom->vertex_count == 0)
+		return;
+	for(int i=0; i<3; i++)
+	{
+		geom->aabbox[i*2]   = FLT_MAX;
+		geom->aabbox[i*2+1] = -FLT_MAX;
+	}
+	for(GLuint v=0; v<geom->vertex_count; v++)
+	{
+		for(GLuint i=0; i<3; i++)
+		{
+			float value = i < components ? data[v*components+i] : 0;
+			if(value < geom->aabbox[i*2])
+				geom->aabbox[i*2] = value;
+			if(value > geom->aabbox[i*2+1])
+				geom->aabbox[i*2+1] = value;
+		}
+	}
+	geom->aabbox_valid = 1;
+}
+
+/** Adds a vertex attribute (such as vertex position, normal, color,
+ * texture coordinate, etc) to the geometry object.
+ *
+ * @param geom The geometry to add the attribute to.
+ *
+ * @param data An array of floats that contains the attribute
+ * data. This array should contain geom->vertex_count * components
+ * floats.
+ *
+ * @param components The number of floats per vertex in this attribute.
+ *
+ * @param name The GLSL variable name that this attribute should be
+ * connected to.
+ *
+ * @param kg_options If KG_WARN is set, print a warning if the
+ * attribute isn't present in the GLSL program for this geometry
+ * object. Set KG_DYNAMIC if you will change the attribute every frame
+ * with kuhl_geometry_attrib_get(). Dynamic attributes are kept in RAM
+ * and in a buffer that holds several copies of the attribute so that
+ * the data can be updated without waiting for the GPU to finish
+ * drawing the previous frame. Set KG_SHADOW to keep a copy of the
+ * attribute in RAM that kuhl_geometry_attrib_get_range() reads and
+ * changes instead of the buffer; only the vertices that changed are
+ * copied into the buffer (with glBufferSubData()) the next time the
+ * geometry is drawn. KG_SHADOW is ignored for KG_DYNAMIC attributes,
+ * which are always kept in RAM.
+ *
+ * To use less memory, set KG_HALF to store the values as 16-bit
+ * floats, KG_NORM16 to store values between -1 and 1 as 16-bit
+ * integers, or KG_PACKED to store 3 or 4 values between -1 and 1
+ * (such as normals) in 32 bits. The vertex program still receives
+ * floats. These options are ignored for KG_DYNAMIC attributes.
+ */
+void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint components, const char* name, int kg_options)
+{
+	if(name == NULL || strlen(name) == 0)
+	{
+		msg(MSG_WARNING, "Unable to add an attribute that is NULL or an empty string.\n");
+		return;
+	}
+	if(geom == NULL)
+	{
+		msg(MSG_WARNING, "Unable to add attribute '%s' to the geometry object because you passed in a geometry object that was set to NULL.\n",name);
+		return;
+	}
+	if(data == NULL)
+	{
+		msg(MSG_WARNING, "Unable to add attribute '%s' to the geometry object because you passed in an array set to NULL.\n", name);
+		return;
+	}
+	if(components == 0 || components > 4)
+	{
+		msg(MSG_WARNING, "Unable to add attribute '%s' to the geometry object. You requested %d components but it must be 1, 2, 3, or 4.\n", name, components);
+		return;
+	}
+	if(!glIsVertexArray(geom->vao))
+	{
+		msg(MSG_WARNING, "Unable to add attribute '%s' to the geometry object because the geometry has an invalid vertex array object %d\n", name, geom->vao);
+		return;
+	}
+
+	/* If this attribute isn't available in the GLSL program, move
+	 * on to the next one. */
+	// GLint attribLocation = kuhl_get_attribute(geom->program, name);
+
+	// Get attribute location directly so kuhl_get_attribute() and
+	// this function don't print the same error repeatedly.
+	GLint attribLocation = glGetAttribLocation(geom->program, name);
+	if(attribLocation == -1)
+	{
+		if(kg_options & KG_WARN)
+			msg(MSG_WARNING, "Unable to add attribute '%s' to the geometry object because it was missing or inactive in program %d\n",
+			    name, geom->program);
+		return;
+	}
+
+	/* If another attribute in kuhl_geometry has the same name,
+	 * overwrite it. */
+	int destIndex = kuhl_geometry_attrib_index(geom, name);
+
+	if(destIndex < 0)
+	{
+		/* If this is a new attribute for this geometry object */
+		destIndex = geom->attrib_count;
+		geom->attrib_count++;
+	}
+	else
+	{
+		/* If overwriting, free resources from old attribute
+		 * (deleting a mapped buffer also unmaps it). */
+		free(geom->attribs[destIndex].name);
+		kuhl_attrib_ring_free(geom->attribs[destIndex].ring);
+		kuhl_attrib_shadow_free(geom->attribs[destIndex].shadow);
+		/* Interleaved buffers are shared with other attributes,
+		 * and shared buffers with other geometry. */
+		if(geom->attribs[destIndex].stride == 0 &&
+		   (geom->shared == NULL || !kuhl_shared_buffers_owns(geom->shared, geom->attribs[destIndex].bufferobject)) &&
+		   glIsBuffer(geom->attribs[destIndex].bufferobject))
+			glDeleteBuffers(1, &(geom->attribs[destIndex].bufferobject));
+	}
+	msg(MSG_DEBUG, "Storing attribute %s at index %d in kuhl_geometry; connected to location %d in program %d", name, destIndex, attribLocation, geom->program);
+	
+	/* If we are writing past the end of the array. */
+	if(destIndex == MAX_ATTRIBUTES)
+	{
+		msg(MSG_FATAL, "You tried to add more than %d attributes to a kuhl_geometry object\n", MAX_ATTRIBUTES);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Set up this attribute. */
+	kuhl_attrib *attrib = &(geom->attribs[destIndex]);
+	attrib->name = strdup(name);
+	attrib->mapped = NULL;
+	attrib->location = attribLocation;
+	attrib->components = components;
+	attrib->type = GL_FLOAT;
+	if(kg_options & KG_DYNAMIC)
+		; // dynamic attributes are always stored as floats
+	else if(kg_options & KG_PACKED)
+	{
+		if(components >= 3 && (GLEW_VERSION_3_3 || GLEW_ARB_vertex_type_2_10_10_10_rev))
+			attrib->type = GL_INT_2_10_10_10_REV;
+		else
+			msg(MSG_DEBUG, "Storing attribute '%s' as floats instead of GL_INT_2_10_10_10_REV", name);
+	}
+	else if(kg_options & KG_HALF)
+		attrib->type = GL_HALF_FLOAT;
+	else if(kg_options & KG_NORM16)
+		attrib->type = GL_SHORT;
+	if(attrib->type == GL_FLOAT)
+		attrib->vertex_size = sizeof(GLfloat)*components;
+	else if(attrib->type == GL_INT_2_10_10_10_REV)
+		attrib->vertex_size = sizeof(GLuint);
+	else // 16-bit values, padded so each vertex starts on a 4 byte boundary
+		attrib->vertex_size = (sizeof(GLushort)*components + 3) & ~3;
+	attrib->stride = 0;
+	attrib->offset = 0;
+	attrib->ring = NULL;
+	attrib->shadow = NULL;
+	if((kg_options & KG_SHADOW) && !(kg_options & KG_DYNAMIC))
+		attrib->shadow = kuhl_attrib_shadow_new(data, (size_t)geom->vertex_count*components);
+
+	/* Remember the bounds of the vertex positions for
+	 * kuhl_geometry_draw_culled(). Positions that change every frame
+	 * have unknown bounds. */
+	if(strcmp(name, "in_Position") == 0)
+	{
+		if(kg_options & KG_DYNAMIC)
+			geom->aabbox_valid = 0;
+		else
+			kuhl_geometry_calc_aabbox(geom, data, components);
+		kuhl_registry_store(geom);
+	}
+
+	/* Vertex array objects for other programs refer to the old
+	 * buffer. */
+	kuhl_geometry_vaos_free(geom);
+
+	/* Switch to our vertex array object. */
+	kuhl_gl_bind_vertex_array(geom->vao);
+
+	/* Enable this attribute location for this vertex array object. */
+	glEnableVertexAttribArray(attribLocation);
+	
+	/* Ask OpenGL for one new buffer "name" (or ID number). */
+	glGenBuffers(1, &(attrib->bufferobject));
+	/* Tell OpenGL that we are going to use this buffer until we
+	 * say otherwise. GL_ARRAY_BUFFER basically means that the
+	 * data stored in this buffer will be an array containing
+	 * vertex information. */
+	glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+	kuhl_errorcheck();
+
+	/* Copy our data into the buffer object that is currently bound. */
+	if(kg_options & KG_DYNAMIC)
+		attrib->ring = kuhl_attrib_ring_new(data, sizeof(GLfloat)*geom->vertex_count*components);
+	else if(attrib->type == GL_FLOAT)
+		glBufferData(GL_ARRAY_BUFFER,
+		             sizeof(GLfloat)*geom->vertex_count*components,
+		             data, GL_STATIC_DRAW);
+	else
+	{
+		void *encoded = kuhl_attrib_encode(attrib, data, geom->vertex_count);
+		glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)attrib->vertex_size*geom->vertex_count,
+		             encoded, GL_STATIC_DRAW);
+		free(encoded);
+	}
+	kuhl_errorcheck();
+
+	/* Tell OpenGL some information about the data that is in the
+	 * buffer. Among other things, we need to tell OpenGL which
+	 * attribute number (i.e., variable) the data should correspond to
+	 * in the vertex program. */
+	kuhl_attrib_pointer(attrib, attrib->location);
+
+	// unbind
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	kuhl_gl_bind_vertex_array(0);
+}
+
+/** Changes an existing vertex attribute so that it can be efficiently
+ * changed every frame with kuhl_geometry_attrib_get(). This is useful
+ * for geometry that was loaded with kuhl_load_model(). See the
+ * KG_DYNAMIC option in kuhl_geometry_attrib() for more information.
+ *
+ * @param geom The geometry containing the attribute.
+ *
+ * @param name The GLSL variable name of the attribute.
+ *
+ * @param kg_options Set this to KG_FULL_LIST to change the attribute
+ * in all geometries in the kuhl_geometry linked list. Otherwise, set
+ * to 0.
+ */
+void kuhl_geometry_attrib_dynamic(kuhl_geometry *geom, const char *name, int kg_options)
+{
+	if(geom == NULL)
+		return;
+	if(kg_options & KG_FULL_LIST)
+		kuhl_geometry_attrib_dynamic(geom->next, name, kg_options);
+
+	int index = kuhl_geometry_attrib_index(geom, name);
+	if(index < 0 || geom->attribs[index].ring != NULL)
+		return;
+
+	GLuint components = 0;
+	GLfloat *data = kuhl_geometry_attrib_read(geom, index, &components);
+	kuhl_geometry_attrib(geom, data, components, name, KG_DYNAMIC);
+	free(data);
+}
+
+/** Keeps a copy of an existing vertex attribute in RAM so that it can
+ * be read and occasionally changed with
+ * kuhl_geometry_attrib_get_range() without mapping the buffer (which
+ * waits for the GPU). This is useful for geometry that was loaded with
+ * kuhl_load_model(). See the KG_SHADOW option in
+ * kuhl_geometry_attrib() for more information. An interleaved
+ * attribute is moved into its own buffer; the format of the attribute
+ * (KG_HALF, etc) does not change.
+ *
+ * @param geom The geometry containing the attribute.
+ *
+ * @param name The GLSL variable name of the attribute.
+ *
+ * @param kg_options Set this to KG_FULL_LIST to change the attribute
+ * in all geometries in the kuhl_geometry linked list. Otherwise, set
+ * to 0.
+ */
+void kuhl_geometry_attrib_shadow(kuhl_geometry *geom, const char *name, int kg_options)
+{
+	if(geom == NULL)
+		return;
+	if(kg_options & KG_FULL_LIST)
+		kuhl_geometry_attrib_shadow(geom->next, name, kg_options);
+
+	int index = kuhl_geometry_attrib_index(geom, name);
+	if(index < 0 || geom->attribs[index].ring != NULL || geom->attribs[index].shadow != NULL)
+		return;
+
+	GLuint components = 0;
+	GLfloat *data = kuhl_geometry_attrib_read(geom, index, &components);
+	int options = kuhl_attrib_format_options(&(geom->attribs[index])) | KG_SHADOW;
+	kuhl_geometry_attrib(geom, data, components, name, options);
+	free(data);
+}
+
+/** Moves all of the vertex attributes in a geometry into a single
+ * buffer where the attributes for each vertex are stored next to each
+ * other. This reduces the number of buffers that OpenGL must read
+ * from while drawing the geometry. Attributes created with KG_DYNAMIC
+ * keep their own buffers. kuhl_geometry_attrib_get() moves an
+ * interleaved attribute back into its own buffer;
+ * kuhl_geometry_attrib_get_strided() does not.
+ *
+ * @param geom The geometry to interleave.
+ *
+ * @param kg_options Set this to KG_FULL_LIST to interleave all
+ * geometries in the kuhl_geometry linked list. Otherwise, set to 0.
+ */
+void kuhl_geometry_interleave(kuhl_geometry *geom, int kg_options)
+{
+	if(geom == NULL)
+		return;
+	if(kg_options & KG_FULL_LIST)
+		kuhl_geometry_interleave(geom->next, kg_options);
+	if(!kuhl_geometry_unshare(geom))
+	{
+		msg(MSG_WARNING, "Can't interleave geometry that shares its buffers with other geometry.");
+		return;
+	}
+
+	/* Find the attributes that we can interleave and calculate the
+	 * size of each vertex. */
+	unsigned int list[MAX_ATTRIBUTES];
+	unsigned int count = 0;
+	GLsizei stride = 0;
+	int alreadyInterleaved = 1;
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		if(geom->attribs[i].ring != NULL || geom->attribs[i].shadow != NULL)
+			continue;
+		list[count++] = i;
+		stride += geom->attribs[i].vertex_size;
+		if(geom->attribs[i].stride == 0)
+			alreadyInterleaved = 0;
+	}
+	if(count < 2 || alreadyInterleaved || geom->vertex_count == 0)
+		return;
+
+	GLubyte *interleaved = (GLubyte*) kuhl_malloc((size_t)stride * geom->vertex_count);
+	GLsizeiptr offsets[MAX_ATTRIBUTES];
+	GLsizeiptr offset = 0;
+	for(unsigned int a=0; a<count; a++)
+	{
+		GLsizei vertexSize = geom->attribs[list[a]].vertex_size;
+		GLubyte *data = (GLubyte*) kuhl_geometry_attrib_read_raw(geom, list[a]);
+		for(GLuint v=0; v<geom->vertex_count; v++)
+			memcpy(interleaved + (size_t)v*stride + offset, data + (size_t)v*vertexSize, vertexSize);
+		free(data);
+		offsets[a] = offset;
+		offset += vertexSize;
+	}
+
+	GLuint buffer = 0;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)stride * geom->vertex_count, interleaved, GL_STATIC_DRAW);
+	free(interleaved);
+	kuhl_errorcheck();
+
+	/* Point the attributes at the new buffer and delete the old ones. */
+	kuhl_geometry_vaos_free(geom);
+	kuhl_gl_bind_vertex_array(geom->vao);
+	for(unsigned int a=0; a<count; a++)
+	{
+		kuhl_attrib *attrib = &(geom->attribs[list[a]]);
+		if(attrib->stride == 0)
+			glDeleteBuffers(1, &(attrib->bufferobject));
+		attrib->bufferobject = buffer;
+		attrib->stride = stride;
+		attrib->offset = offsets[a];
+		kuhl_attrib_pointer(attrib, attrib->location);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	kuhl_gl_bind_vertex_array(0);
+
+	if(glIsBuffer(geom->interleaved_bufferobject))
+		glDeleteBuffers(1, &(geom->interleaved_bufferobject));
+	geom->interleaved_bufferobject = buffer;
+	kuhl_errorcheck();
+}
+
+/** Adds a vertex attribute that has one value per instance when the
+ * geometry is drawn with kuhl_geometry_draw_instanced(). This can be
+ * used to give each instance its own transformation matrix, color,
+ * animation time, etc. The value for the current instance appears in
+ * the vertex program as a normal input variable (for example, "in
+ * mat4 in_InstanceMatrix;").
+ *
+ * @param geom The geometry to add the attribute to.
+ *
+ * @param data An array of instanceCount*components floats.
+ *
+ * @param instanceCount The number of instances that data contains
+ * values for. The geometry can't be drawn with more instances than
+ * this.
+ *
+ * @param components The number of floats per instance: 1, 2, 3, 4 or
+ * 16 (a 4x4 matrix in column-major order).
+ *
+ * @param name The GLSL variable name the attribute should be
+ * connected to.
+ *
+ * @param kg_options KG_WARN to print a warning if the attribute is
+ * missing in the GLSL program. KG_DYNAMIC if the data will be changed
+ * every frame with kuhl_geometry_instance_attrib_update(). KG_FULL_LIST
+ * to add the attribute to every geometry in the linked list.
+ */
+void kuhl_geometry_instance_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint instanceCount, GLuint components, const char *name, int kg_options)
+{
+	if(geom == NULL || data == NULL || name == NULL)
+	{
+		msg(MSG_WARNING, "A parameter passed to kuhl_geometry_instance_attrib() was NULL.");
+		return;
+	}
+	if((kg_options & KG_FULL_LIST) && geom->next != NULL)
+		kuhl_geometry_instance_attrib(geom->next, data, instanceCount, components, name, kg_options);
+
+	if((components == 0 || components > 4) && components != 16)
+	{
+		msg(MSG_WARNING, "Unable to add per-instance attribute '%s'. You requested %u components but it must be 1, 2, 3, 4 or 16.", name, components);
+		return;
+	}
+	if(instanceCount == 0)
+	{
+		msg(MSG_WARNING, "Unable to add per-instance attribute '%s' with no instances.", name);
+		return;
+	}
+	GLint location = glGetAttribLocation(geom->program, name);
+	if(location == -1)
+	{
+		if(kg_options & KG_WARN)
+			msg(MSG_WARNING, "Unable to add per-instance attribute '%s' because it was missing or inactive in program %d", name, geom->program);
+		return;
+	}
+
+	/* Replace an existing attribute with the same name. */
+	unsigned int index = 0;
+	while(index < geom->instance_attrib_count &&
+	      strcmp(geom->instance_attribs[index].name, name) != 0)
+		index++;
+	kuhl_instance_attrib *attrib = &(geom->instance_attribs[index]);
+	if(index < geom->instance_attrib_count)
+	{
+		free(attrib->name);
+		kuhl_attrib_ring_free(attrib->ring);
+		glDeleteBuffers(1, &(attrib->bufferobject));
+	}
+	else if(index == MAX_INSTANCE_ATTRIBUTES)
+	{
+		msg(MSG_FATAL, "You tried to add more than %d per-instance attributes to a kuhl_geometry object", MAX_INSTANCE_ATTRIBUTES);
+		exit(EXIT_FAILURE);
+	}
+	else
+		geom->instance_attrib_count++;
+
+	attrib->name = strdup(name);
+	attrib->location = location;
+	attrib->components = components;
+	attrib->count = instanceCount;
+	attrib->ring = NULL;
+
+	kuhl_geometry_vaos_free(geom);
+	kuhl_gl_bind_vertex_array(geom->vao);
+	glGenBuffers(1, &(attrib->bufferobject));
+	glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+	GLsizeiptr size = sizeof(GLfloat)*components*instanceCount;
+	if(kg_options & KG_DYNAMIC)
+		attrib->ring = kuhl_attrib_ring_new(data, size);
+	else
+		glBufferData(GL_ARRAY_BUFFER, size, data, GL_STATIC_DRAW);
+	kuhl_instance_attrib_pointer(attrib, attrib->location);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	kuhl_gl_bind_vertex_array(0);
+	kuhl_errorcheck();
+}
+
+/** Replaces the values in a per-instance attribute. If the attribute
+ * was created with KG_DYNAMIC, the data is copied into RAM and sent to
+ * OpenGL when the geometry is drawn without waiting for the GPU to
+ * finish drawing the previous frame. This allows thousands of
+ * instances with transforms computed on the CPU to be drawn with one
+ * call every frame.
+ *
+ * @param geom The geometry containing the attribute.
+ *
+ * @param data An array of instanceCount*components floats.
+ *
+ * @param instanceCount The number of instances in data. If this is
+ * larger than the number of instances the attribute was created with,
+ * the attribute is recreated.
+ *
+ * @param name The GLSL variable name of the attribute.
+ *
+ * @param kg_options KG_FULL_LIST to update the attribute in every
+ * geometry in the linked list. Otherwise, set to 0.
+ */
+void kuhl_geometry_instance_attrib_update(kuhl_geometry *geom, const GLfloat *data, GLuint instanceCount, const char *name, int kg_options)
+{
+	if(geom == NULL || data == NULL || name == NULL)
+		return;
+	if(kg_options & KG_FULL_LIST)
+		kuhl_geometry_instance_attrib_update(geom->next, data, instanceCount, name, kg_options);
+
+	kuhl_instance_attrib *attrib = NULL;
+	for(unsigned int i=0; i<geom->instance_attrib_count; i++)
+		if(strcmp(geom->instance_attribs[i].name, name) == 0)
+			attrib = &(geom->instance_attribs[i]);
+	if(attrib == NULL)
+		return;
+
+	if(instanceCount > attrib->count)
+	{
+		kuhl_geometry_instance_attrib(geom, data, instanceCount, attrib->components, name,
+		                              attrib->ring ? KG_DYNAMIC : KG_NONE);
+		return;
+	}
+
+	size_t size = sizeof(GLfloat)*attrib->components*instanceCount;
+	if(attrib->ring != NULL)
+	{
+		memcpy(attrib->ring->data, data, size);
+		attrib->ring->dirty = 1;
+	}
+	else
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, size, data);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		kuhl_errorcheck();
+	}
+}
+
+/** Calculates the number of objects in the kuhl_geometry linked list.
+    The geometry registry remembers the length of each list, so this
+    only walks the list the first time it is called after geometry
+    was created, deleted or linked into a list. The number of all
+    geometry objects is available from kuhl_geometry_registry_get().
+
+    @param geom The geometry object which you want to know the length of.
+
+    @return The number of geometry objects in the list.
+*/
+unsigned int kuhl_geometry_count(const kuhl_geometry *geom)
+{
+	if(geom == NULL)
+		return 0;
+	const kuhl_registry_list *list = kuhl_registry_list_get(geom);
+	if(list != NULL)
+		return list->count;
+
+	/* Copies of kuhl_geometry structs aren't in the registry. */
+	const kuhl_geometry *g = geom;
+	unsigned int count = 1;
+	while(g->next != NULL)
+	{
+		count++;
+		g = g->next;
+	}
+	return count;
+}
+
+/** Provides the draw-related values of every kuhl_geometry that has
+ * been created with kuhl_geometry_new() and not deleted yet. The
+ * values are stored in parallel arrays so that looking at many
+ * objects (for example, to cull them) reads contiguous memory instead
+ * of following the next pointers of each model.
+ *
+ * The library updates the arrays when its functions change a
+ * geometry. Programs that change fields such as geom->matrix or
+ * geom->next directly should call kuhl_geometry_registry_sync()
+ * before drawing the geometry with kuhl_geometry_draw_culled() or
+ * relying on the arrays.
+ *
+ * @return The registry. The pointers in it may change when geometry
+ * is created, so call this function again instead of keeping them.
+ */
+const kuhl_geometry_registry* kuhl_geometry_registry_get(void)
+{
+	static kuhl_geometry_registry view;
+	view.slots = kuhl_registry.slots;
+	view.count = kuhl_registry.count;
+	view.geom = kuhl_registry.geom;
+	view.handle = kuhl_registry.handle;
+	view.vao = kuhl_registry.vao;
+	view.program = kuhl_registry.program;
+	view.vertex_count = kuhl_registry.vertex_count;
+	view.indices_len = kuhl_registry.indices_len;
+	view.matrix = (const float (*)[16]) kuhl_registry.matrix;
+	view.aabbox = (const float (*)[6]) kuhl_registry.aabbox;
+	view.aabbox_valid = kuhl_registry.aabbox_valid;
+	return &view;
+}
+
+/** Finds the geometry that a handle refers to.
+ *
+ * @param handle A handle from the handle field of a kuhl_geometry.
+ *
+ * @return The geometry or NULL if it has been deleted (or if handle
+ * is 0).
+ */
+kuhl_geometry* kuhl_geometry_handle_lookup(kuhl_geometry_handle handle)
+{
+	unsigned int slot = (unsigned int) (handle & KUHL_GEOMETRY_HANDLE_SLOT_MASK);
+	if(handle == 0 || slot >= kuhl_registry.slots ||
+	   kuhl_registry.handle[slot] != handle)
+		return NULL;
+	return kuhl_registry.geom[slot];
+}
+
+/** Updates the geometry registry after a program changed the fields
+ * of a kuhl_geometry (such as geom->matrix) or linked geometry into a
+ * list (geom->next) directly. See kuhl_geometry_registry_get().
+ *
+ * @param geom The geometry that was changed.
+ *
+ * @param kg_options Set to KG_FULL_LIST to update every geometry in
+ * the list, KG_NONE otherwise.
+ */
+void kuhl_geometry_registry_sync(kuhl_geometry *geom, int kg_options)
+{
+	for(kuhl_geometry *g=geom; g; g=(kg_options & KG_FULL_LIST)? g->next : NULL)
+		kuhl_registry_store(g);
+	kuhl_registry.list_version++;
+}
+
+
+/** Initializes the vertex array object (VAO) associated with this
+    kuhl_geometry and initializes other variables inside of the struct.
+
+    @param geom A kuhl_geometry struct populated with the information
+    necessary to draw some geometry.
+
+    @param program A GLSL program to be used when rendering this
+    geometry.
+
+    @param vertexCount The number of vertices in this piece of geometry.
+
+    @param primitive_type OpenGL primitive type of the geometry.
+*/
+void kuhl_geometry_new(kuhl_geometry *geom, GLuint program, unsigned int vertexCount, GLint primitive_type)
+{
+	if(geom == NULL)
+	{
+		msg(MSG_FATAL, "You called kuhl_geometry_new() with geom parameter set to NULL.");
+		exit(EXIT_FAILURE);
+	}
+	
+	kuhl_errorcheck();
+
+	/* Ask OpenGL for one vertex array object "name" (really an
+	 * integer that you can think of as an ID number) that we can use
+	 * for a new VAO (vertex array object) */
+	glGenVertexArrays(1, &(geom->vao));
+	/* Bind to the VAO to finish creating it */
+	kuhl_gl_bind_vertex_array(geom->vao);
+	kuhl_gl_bind_vertex_array(0); // unbind
+
+	/* Check if the program is valid (we don't need to enable it here). */
+	if(!glIsProgram(program))
+	{
+		msg(MSG_FATAL, "The program you specified in your kuhl_geometry struct (%d) is not a valid GLSL program.\n", program);
+		exit(EXIT_FAILURE);
+	}
+
+	if(vertexCount == 0)
+	{
+		msg(MSG_WARNING, "You are creating a geometry object with a vertexCount of 0.\n");
+	}
+
+	geom->program = program;
+	geom->vertex_count = vertexCount;
+	geom->primitive_type = primitive_type;
+
+	geom->attrib_count = 0;
+	geom->interleaved_bufferobject = 0;
+	geom->instance_attrib_count = 0;
+	geom->texture_count = 0;
+
+	geom->locations.program = 0;
+	kuhl_geometry_locations(geom);
+	geom->program_vaos = NULL;
+	geom->program_vao_count = 0;
+
+	geom->indices_len = 0;
+	geom->indices_bufferobject = 0;
+	geom->indices_type = GL_UNSIGNED_INT;
+
+	mat4f_identity(geom->matrix);
+	mat4f_identity(geom->fitMatrix);
+	mat4f_identity(geom->decodeMatrix);
+	geom->aabbox_valid = 0;
+	geom->occlusion_query = 0;
+	geom->occlusion_proxy = NULL;
+	geom->lod = NULL;
+	geom->meshlets = NULL;
+	geom->batch = NULL;
+	geom->shared = NULL;
+	geom->has_been_drawn = 0;
+	
+	geom->assimp_node  = NULL;
+	geom->assimp_scene = NULL;
+	geom->bones        = NULL;
+	geom->material_index = -1;
+	geom->multidraw    = NULL;
+
+	geom->next = NULL;
+	kuhl_registry_add(geom);
+}
+
+/** Applies a set of indices to the geometry so that vertices can be
+ * re-used by multiple triangles or lines.
+ *
+ * @param geom The geometry that the indices should be used with.
+ *
+ * @param indices A list of indices. Each index refers to a specific vertex.
+ *
+ * @param indexCount The number of indices. For example, if the
+ * geometry object consists of triangles, indexCount should be
+ * numTriangles*3.
+*/
+void kuhl_geometry_indices(kuhl_geometry *geom, GLuint *indices, GLuint indexCount)
+{
+	if(indexCount == 0 || indices == NULL)
+	{
+		msg(MSG_WARNING, "indexCount was zero or indices array was NULL\n");
+		return;
+	}
+
+	if(geom->primitive_type == GL_TRIANGLES && indexCount % 3 != 0)
+	{
+		msg(MSG_FATAL, "indexCount=%u was not a multiple of 3 even though this geometry has triangles in it.", indexCount);
+		exit(EXIT_FAILURE);
+	}
+	else if(geom->primitive_type == GL_LINES && indexCount % 2 != 0)
+	{
+		msg(MSG_FATAL, "indexCount=%u was not a multiple of 2 even though this geometry has lines in it.", indexCount);
+		exit(EXIT_FAILURE);
+	}
+
+	/* TODO: Check if indices are already set? If so, print an error
+	 * message and/or free the old indices buffer before making a new
+	 * one to replace it. */
+
+	/* Levels of detail, meshlets, batch pieces and vertex array
+	 * objects for other programs refer to the old indices. */
+	kuhl_geometry_vaos_free(geom);
+	free(geom->lod);
+	geom->lod = NULL;
+	kuhl_meshlets_free(geom->meshlets);
+	geom->meshlets = NULL;
+	kuhl_batch_free(geom->batch);
+	geom->batch = NULL;
+	
+	geom->indices_len = indexCount;
+
+	/* Verify that the indices the user passed in are
+	 * appropriate. If there are only 10 vertices, then a user
+	 * can't draw a vertex at index 10, 11, 13, etc. */
+	GLuint maxIndex = 0;
+	for(GLuint i=0; i<geom->indices_len; i++)
+	{
+		if(indices[i] >= geom->vertex_count)
+			msg(MSG_ERROR, "kuhl_geometry has %d vertices but indices[%d] is asking for vertex at index %d to be drawn.\n",
+			    geom->vertex_count, i, indices[i]);
+		if(indices[i] > maxIndex)
+			maxIndex = indices[i];
+	}
+
+	/* Use 16-bit indices if we can. 0xffff is avoided since it is
+	 * the primitive restart index for 16-bit indices. */
+	const void *indexData = indices;
+	GLushort *shortIndices = NULL;
+	GLsizeiptr indexSize = sizeof(GLuint);
+	geom->indices_type = GL_UNSIGNED_INT;
+	if(maxIndex < 0xffff)
+	{
+		shortIndices = (GLushort*) kuhl_malloc(sizeof(GLushort)*geom->indices_len);
+		for(GLuint i=0; i<geom->indices_len; i++)
+			shortIndices[i] = (GLushort) indices[i];
+		indexData = shortIndices;
+		indexSize = sizeof(GLushort);
+		geom->indices_type = GL_UNSIGNED_SHORT;
+	}
+
+	/* Enable VAO */
+	kuhl_gl_bind_vertex_array(geom->vao);
+		
+	/* Set up a buffer object (BO) which is a place to store the
+	 * *indices* on the graphics card. */
+	glGenBuffers(1, &(geom->indices_bufferobject));
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geom->indices_bufferobject);
+	kuhl_errorcheck();
+
+	/* Copy the indices data into the currently bound buffer. */
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexSize*geom->indices_len,
+	             indexData, GL_STATIC_DRAW);
+	free(shortIndices);
+	kuhl_errorcheck();
+	// Don't unbind GL_ELEMENT_ARRAY_BUFFER since the VAO keeps track of this for us.
+
+	// unbind vao
+	kuhl_gl_bind_vertex_array(0);
+	kuhl_registry_store(geom);
+}
+
+/** Makes a new geometry draw the vertex and index buffers of another
+ * geometry. See kuhl_geometry_share().
+ *
+ * @param geom A geometry created with kuhl_geometry_new() that has no
+ * attributes or indices.
+ *
+ * @param source The geometry (or a template of one that the model
+ * loader kept) that owns the buffers.
+ */
+static void kuhl_private_share_buffers(kuhl_geometry *geom, kuhl_geometry *source)
+{
+	kuhl_shared_buffers *shared = kuhl_shared_buffers_record(source);
+	shared->refcount++;
+	geom->shared = shared;
+
+	geom->vertex_count = source->vertex_count;
+	geom->primitive_type = source->primitive_type;
+	geom->attrib_count = source->attrib_count;
+	for(unsigned int i=0; i<source->attrib_count; i++)
+	{
+		geom->attribs[i] = source->attribs[i];
+		geom->attribs[i].name = strdup(source->attribs[i].name);
+		geom->attribs[i].mapped = NULL;
+		geom->attribs[i].ring = NULL;
+		geom->attribs[i].shadow = NULL;
+	}
+	geom->interleaved_bufferobject = source->interleaved_bufferobject;
+	geom->indices_len = source->indices_len;
+	geom->indices_bufferobject = source->indices_bufferobject;
+	geom->indices_type = source->indices_type;
+	memcpy(geom->aabbox, source->aabbox, sizeof(float)*6);
+	geom->aabbox_valid = source->aabbox_valid;
+	mat4f_copy(geom->decodeMatrix, source->decodeMatrix);
+	if(source->lod != NULL)
+	{
+		geom->lod = (kuhl_lod*) kuhl_malloc(sizeof(kuhl_lod));
+		*(geom->lod) = *(source->lod);
+	}
+	geom->meshlets = kuhl_meshlets_copy(source->meshlets);
+
+	/* The VAO remembers the index buffer; kuhl_geometry_program()
+	 * connects the attributes to the VAO. */
+	kuhl_gl_bind_vertex_array(geom->vao);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geom->indices_bufferobject);
+	kuhl_gl_bind_vertex_array(0);
+	kuhl_geometry_program(geom, geom->program, KG_NONE);
+}
+
+/** Creates a new geometry that draws the same vertices and indices as
+ * an existing geometry without copying them: Both geometries use the
+ * same OpenGL buffers, so drawing a mesh N times with different
+ * matrices, programs or textures only stores the mesh on the GPU
+ * once. The buffers are deleted when the last geometry that uses them
+ * is deleted with kuhl_geometry_delete().
+ *
+ * The new geometry has its own matrix, program, textures and bones
+ * (none of which are copied from source). Functions that change
+ * the buffers of one geometry (kuhl_geometry_attrib_get(),
+ * kuhl_geometry_attrib() and kuhl_geometry_indices()) give that
+ * geometry its own copy first; kuhl_geometry_interleave(),
+ * kuhl_geometry_optimize() and the LOD functions skip geometry that
+ * shares its buffers. kuhl_load_model_options() uses this function
+ * automatically when the same model is loaded more than once.
+ *
+ * @param geom The kuhl_geometry object to create (it should not have
+ * been initialized with kuhl_geometry_new()).
+ *
+ * @param source The geometry to share buffers with. source->next is
+ * ignored. Geometry with KG_DYNAMIC attributes or several meshes
+ * packed with KL_MULTIDRAW can't be shared.
+ *
+ * @param program The GLSL program to draw geom with.
+ */
+void kuhl_geometry_share(kuhl_geometry *geom, kuhl_geometry *source, GLuint program)
+{
+	if(source->multidraw != NULL)
+	{
+		msg(MSG_FATAL, "Geometry containing several packed meshes can't be shared.");
+		exit(EXIT_FAILURE);
+	}
+	for(unsigned int i=0; i<source->attrib_count; i++)
+	{
+		if(source->attribs[i].ring != NULL || source->attribs[i].shadow != NULL)
+		{
+			msg(MSG_FATAL, "Geometry with a dynamic or shadowed attribute (%s) can't be shared.", source->attribs[i].name);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	kuhl_geometry_new(geom, program, source->vertex_count, source->primitive_type);
+	kuhl_private_share_buffers(geom, source);
+	kuhl_errorcheck();
+}
+
+/** OpenGL state recorded by kuhl_gl_state_save() */
+typedef struct
+{
+	GLint program;
+	GLint texture2D;
+	GLint activeUnit;
+	GLint vao;
+} kuhl_gl_saved_state;
+
+/** Records the OpenGL state that drawing geometry changes. Unless
+ * kuhl_gl_state_restore() is enabled, the state is copied from the
+ * shadow state instead of being queried from OpenGL.
+ *
+ * @param saved Location to store the state in.
+ */
+static void kuhl_gl_state_save(kuhl_gl_saved_state *saved)
+{
+	if(kuhl_gl_restore)
+	{
+		glGetIntegerv(GL_CURRENT_PROGRAM, &(saved->program));
+		glGetIntegerv(GL_TEXTURE_BINDING_2D, &(saved->texture2D));
+		glGetIntegerv(GL_ACTIVE_TEXTURE, &(saved->activeUnit));
+		glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &(saved->vao));
+		/* Our shadow state is now accurate for these values. */
+		kuhl_gl_shadow.program = saved->program;
+		kuhl_gl_shadow.vao = saved->vao;
+		kuhl_gl_shadow.activeUnit = saved->activeUnit;
+	}
+	else
+	{
+		saved->program = kuhl_gl_shadow.program;
+		saved->activeUnit = kuhl_gl_shadow.activeUnit;
+		saved->texture2D = KUHL_GL_UNKNOWN;
+		saved->vao = KUHL_GL_UNKNOWN;
+	}
+}
+
+/** Restores OpenGL state recorded with kuhl_gl_state_save(). Unless
+ * kuhl_gl_state_restore() is enabled, only the program and active
+ * texture unit are restored (and only if they changed). The vertex
+ * array object of the geometry stays bound so that the next draw of
+ * the same geometry doesn't need to bind it again.
+ *
+ * @param saved State recorded by kuhl_gl_state_save().
+ */
+static void kuhl_gl_state_load(const kuhl_gl_saved_state *saved)
+{
+	if(kuhl_gl_restore)
+	{
+		/* Restore previously active texture */
+		glActiveTexture(saved->activeUnit);
+		/* Restore previously bound texture */
+		glBindTexture(GL_TEXTURE_2D, saved->texture2D);
+		kuhl_gl_texture_changed();
+		/* Restore the GLSL program that was used before drawing. */
+		glUseProgram(saved->program);
+		/* Restore the VAO */
+		glBindVertexArray(saved->vao);
+		kuhl_gl_shadow.activeUnit = saved->activeUnit;
+		kuhl_gl_shadow.program = saved->program;
+		kuhl_gl_shadow.vao = saved->vao;
+		return;
+	}
+
+	/* If we don't know what was bound before, leave our state in
+	 * place. */
+	if((GLuint)saved->activeUnit != KUHL_GL_UNKNOWN)
+		kuhl_gl_active_texture(saved->activeUnit);
+	if((GLuint)saved->program != KUHL_GL_UNKNOWN)
+		kuhl_gl_use_program(saved->program);
+}
+
+/** Finds the ranges of the index buffer of a batch that contain
+ * pieces which are not hidden. Neighboring pieces are drawn as one
+ * range.
+ *
+ * @param geom A geometry created by kuhl_geometry_batch_static().
+ */
+static void kuhl_batch_ranges(kuhl_geometry *geom)
+{
+	kuhl_batch *b = geom->batch;
+	GLsizeiptr indexSize = geom->indices_type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+	b->draw_ranges = 0;
+	GLuint rangeEnd = 0;
+	for(unsigned int i=0; i<b->count; i++)
+	{
+		const kuhl_batch_piece *p = &(b->pieces[i]);
+		if(p->hidden)
+			continue;
+		if(b->draw_ranges > 0 && rangeEnd == p->first)
+			b->draw_counts[b->draw_ranges-1] += p->count;
+		else
+		{
+			b->draw_counts[b->draw_ranges] = p->count;
+			b->draw_offsets[b->draw_ranges] = (const GLvoid*) (p->first * indexSize);
+			b->draw_ranges++;
+		}
+		rangeEnd = p->first + p->count;
+	}
+	b->ranges_valid = 1;
+}
+
+/** Draws a single kuhl_geometry object (ignoring geom->next). The
+ * caller is responsible for saving and restoring OpenGL state.
+ *
+ * @param geom The geometry to draw.
+ *
+ * @param instances Number of instances to draw.
+ *
+ * @param geomTransform The matrix to send to GeomTransform.
+ *
+ * @param modelview If not NULL, the matrix is sent to the ModelView
+ * uniform variable (if it exists in the program).
+ *
+ * @param pv The vertex array object to draw the geometry with a
+ * program other than geom->program (see kuhl_program_vao_find()), or
+ * NULL to use geom->program.
+ */
+static void kuhl_geometry_draw_node(kuhl_geometry *geom, GLsizei instances,
+                                    const float geomTransform[16], const float modelview[16],
+                                    const kuhl_program_vao *pv)
+{
+	if(geom->vertex_count == 0)
+	{
+		msg(MSG_WARNING, "You tried to draw geometry which contained 0 vertices.");
+		return;
+	}
+	if(geom->attrib_count == 0)
+	{
+		msg(MSG_WARNING, "You tried to draw geometry which had no attributes. It needs at least one attribute (i.e., vertex position)");
+		return;
+	}
+
+	GLuint program = pv ? pv->program : geom->program;
+	GLuint vao = pv ? pv->vao : geom->vao;
+
+	/* Check that there is a valid program and VAO object for us to
+	 * use. Asking OpenGL is slow, so we only do it when the user
+	 * asked us to save/restore state. */
+	if(program == 0 || (kuhl_gl_restore && glIsProgram(program) == 0))
+	{
+		msg(MSG_ERROR, "Program (%d) is invalid. Have you initialized this kuhl_geometry object?\n", program);
+		kuhl_errorcheck();
+		return;
+	}
+	else if (vao == 0 || (kuhl_gl_restore && glIsVertexArray(vao) == 0))
+	{
+		msg(MSG_ERROR, "Vertex array object (%d) is invalid.\n", vao);
+		kuhl_errorcheck();
+		return;
+	}
+	kuhl_gl_use_program(program);
+	kuhl_errorcheck();
+
+	/* Make sure the cached uniform locations match the program. The
+	 * locations in pv were checked by kuhl_program_vao_find(). */
+	kuhl_geometry_locations(geom);
+	const kuhl_uniform_locations *locs = pv ? &(pv->locations) : &(geom->locations);
+
+	/* Bind all of the textures used in this geometry to texture
+	 * units. */
+	for(unsigned int i=0; i<geom->texture_count; i++)
+	{
+		kuhl_texture *tex = &(geom->textures[i]);
+		if(tex->textureId == 0 || (kuhl_gl_restore && !glIsTexture(tex->textureId)))
+			continue;
+
+		/* Check if the sampler variable is available in the GLSL
+		 * program. If not, don't send the texture. */
+		GLint location = pv ? pv->texture_locations[i] : tex->location;
+		if(location == -1)
+			continue;
+
+		/* Tell OpenGL that the texture that we refer to in our
+		 * GLSL program is going to be in texture unit number 'i'.
+		 */
+		glUniform1i(location, i);
+		kuhl_errorcheck();
+		/* Bind the texture that we want to use to texture unit
+		 * 'i' (unless it is already bound there). */
+		kuhl_gl_bind_texture(i, tex->textureId);
+		kuhl_errorcheck();
+	}
+
+	/* Set the HasTex variable if it exists in the GLSL program. */
+	kuhl_uniform_int(locs->hasTex, locs->hasTexValue);
+
+	/* Try to set uniform variables if they are active in the current
+	 * GLSL program. If they are not active, don't print any warning
+	 * messages. */
+	int numBones = 0;
+	if(geom->bones)
+	{
+		if(locs->boneMat != -1)
+		{
+			kuhl_uniform_bones(locs->boneMat, geom->bones);
+			numBones = geom->bones->count;
+		}
+	}
+	kuhl_uniform_int(locs->numBones, numBones);
+
+	if(modelview != NULL)
+		glUniformMatrix4fv(locs->modelView, 1, 0, modelview);
+
+	if(locs->geomTransform != -1)
+		kuhl_uniform_mat4f(locs->geomTransform, 1, geomTransform);
+	else if(geom->has_been_drawn == 0)
+	{ /* If the geom->matrix was not the identity and if it is not in
+	   * the GLSL shader program, print a helpful warning message. */
+		float identity[16];
+		mat4f_identity(identity);
+		float sum = 0;
+		for(int i=0; i<16; i++)
+			sum += fabsf(identity[i] - geomTransform[i]);
+		if(sum > 0.00001)
+		{
+			printf("\n\n");
+			printf("ERROR: You must include a 'uniform mat4 GeomTransform' variable in your GLSL shader (program %d) when you load/display a model with kuhl-util. This matrix should be applied to the vertices in your model before you multiply by your modelview matrix in the vertex program. For example:\n\ngl_Position = Projection * ModelView * GeomTransform * in_Position\n\n", program);
+			printf("This matrix is required to correctly translate/rotate/scale your geometry and is also used by some models to implement animation. This matrix is stored inside of a variable called 'matrix' in kuhl_geometry and is set to the identity matrix by default. This message only gets printed if you are using something that actually sets the matrix to something other than the identity. Earlier versions of this software simply transformed the vertices as the file was being loaded instead of doing it in the vertex program.\n");
+			printf("\n");
+			printf("We would set the GeomTransform to:\n");
+			mat4f_print(geomTransform);
+			printf("This program will resume running in 2 seconds...\n");
+			sleep(2);
+			printf("...continuing despite the missing variable.\n");
+		}
+	}
+
+	/* kuhl_geometry_attrib_get() allows vertex attribute buffers to
+	 * be mapped. If any of them are, unmap them before we draw the
+	 * geometry. */
+	kuhl_geometry_attrib_unmap(geom);
+	/* Copy any KG_DYNAMIC attributes that changed into their
+	 * buffers. All of the geometry's vertex array objects must
+	 * point at the new copies. */
+	if(kuhl_geometry_attrib_sync(geom))
+		kuhl_geometry_vaos_repoint(geom);
+
+	/* Use the vertex array object for this geometry and program */
+	kuhl_gl_bind_vertex_array(vao);
+	kuhl_errorcheck();
+
+	/* Don't read past the end of a per-instance attribute. */
+	for(unsigned int i=0; i<geom->instance_attrib_count; i++)
+	{
+		if((GLuint) instances > geom->instance_attribs[i].count)
+		{
+			if(geom->has_been_drawn == 0)
+				msg(MSG_WARNING, "Drawing %d instances but per-instance attribute '%s' only has values for %u instances.",
+				    instances, geom->instance_attribs[i].name, geom->instance_attribs[i].count);
+			instances = geom->instance_attribs[i].count;
+		}
+	}
+
+	/* If several meshes are packed into this geometry, draw all of
+	 * them at once. */
+	if(geom->multidraw != NULL)
+	{
+		if(instances != 1 && geom->has_been_drawn == 0)
+			msg(MSG_WARNING, "Geometry containing packed meshes can't be drawn with instancing. Drawing one instance.");
+		kuhl_multidraw_draw(geom);
+	}
+	/* If the user provided us with indices, use glDrawElements() to
+	 * draw the geometry. */
+	else if(geom->indices_len > 0 && geom->indices_bufferobject != 0)
+	{
+		/* Draw the level of detail picked by
+		 * kuhl_geometry_lod_select(). */
+		GLuint count = geom->indices_len;
+		size_t offset = 0;
+		if(geom->lod != NULL)
+		{
+			const kuhl_lod_level *level = &(geom->lod->levels[geom->lod->current]);
+			count = level->count;
+			offset = level->first * (geom->indices_type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint));
+		}
+		/* Draw the meshlets that kuhl_geometry_meshlets_cull()
+		 * didn't cull (meshlets are only in the most detailed
+		 * level). Pieces of a batch that were hidden with
+		 * kuhl_geometry_batch_hide() are skipped the same way. */
+		kuhl_meshlets *meshlets = geom->meshlets;
+		kuhl_batch *batch = geom->batch;
+		if(batch != NULL && batch->hidden_count > 0 &&
+		   (geom->lod == NULL || geom->lod->current == 0))
+		{
+			if(!batch->ranges_valid)
+				kuhl_batch_ranges(geom);
+			/* There is no instanced version of
+			 * glMultiDrawElements(), so instanced batches draw
+			 * each visible range separately. */
+			if(instances == 1 && batch->draw_ranges > 0)
+				glMultiDrawElements(geom->primitive_type, batch->draw_counts, geom->indices_type,
+				                    batch->draw_offsets, batch->draw_ranges);
+			else
+			{
+				for(GLsizei r=0; r<batch->draw_ranges; r++)
+					glDrawElementsInstanced(geom->primitive_type, batch->draw_counts[r], geom->indices_type,
+					                        batch->draw_offsets[r], instances);
+			}
+		}
+		else if(meshlets != NULL && meshlets->culled && instances == 1 &&
+		        (geom->lod == NULL || geom->lod->current == 0))
+		{
+			if(meshlets->draw_ranges > 0)
+				glMultiDrawElements(geom->primitive_type, meshlets->draw_counts, geom->indices_type,
+				                    meshlets->draw_offsets, meshlets->draw_ranges);
+			/* The ranges are only valid for the view they were
+			 * culled for. */
+			meshlets->culled = 0;
+		}
+		else if(instances == 1)
+			glDrawElements(geom->primitive_type,
+			               count,
+			               geom->indices_type,
+			               (const GLvoid*) offset);
+		else
+			glDrawElementsInstanced(
+				           geom->primitive_type,
+			               count,
+			               geom->indices_type,
+			               (const GLvoid*) offset, instances);
+
+		kuhl_errorcheck();
+	}
+	else
+	{
+		/* If the user didn't provide us with indices, just draw the
+		 * vertices in order. */
+		if(instances == 1)
+			glDrawArrays(geom->primitive_type, 0, geom->vertex_count);
+		else
+			glDrawArraysInstanced(geom->primitive_type, 0, geom->vertex_count, instances);
+		kuhl_errorcheck();
+	}
+	kuhl_geometry_attrib_fence(geom);
+
+	/* In compatibility mode, unbind the textures from each texture
+	 * unit that we bound a texture to since we have finished drawing
+	 * the geometry. Otherwise, leave them bound: the next piece of
+	 * geometry likely uses the same textures. */
+	if(kuhl_gl_restore)
+	{
+		for(unsigned int i=0; i<geom->texture_count; i++)
+		{
+			kuhl_gl_bind_texture(i, 0);
+			kuhl_errorcheck();
+		}
+	}
+
+	/* Indicate in the struct that we have successfully drawn this
+	 * geom once. */
+	geom->has_been_drawn = 1;
+}
+
+/** Draws a kuhl_geometry object. Typically, instances == 1. If
+ * instances > 1, the object will be drawn multiple times with
+ * different 'gl_InstanceID' variables in the GLSL program.
+ *
+ * By default, this function does not ask OpenGL what state is
+ * currently bound. Instead, it uses a shadow copy of the state kept
+ * by libkuhl (see kuhl_gl_state_invalidate()) to skip redundant
+ * binds. The GLSL program and active texture unit that were in use
+ * are restored after drawing. The vertex array object and the
+ * textures are left bound, so drawing the same geometry again doesn't
+ * bind them again. Because the vertex array object stays bound, bind
+ * your own vertex array object (or call kuhl_gl_bind_vertex_array(0))
+ * before binding a buffer to GL_ELEMENT_ARRAY_BUFFER yourself.
+ * Otherwise, the buffer replaces the indices of the geometry that was
+ * drawn last. If you bind anything yourself between draws, call
+ * kuhl_gl_state_invalidate(). Call kuhl_gl_state_restore(1) or set
+ * gl.restorestate=1 in the config file to query and restore all of
+ * the state like older versions of this function did.
+ *
+ * @param geom The geometry to draw to the screen. If the kuhl_geometry
+ * object is a part of a linked list, this function will draw each of
+ * the objects in order.
+ *
+ * @param instances Number of instanced objects to draw. To draw an
+ * object once normally (i.e., non-instanced), set it to 1.
+ */
+void kuhl_geometry_draw_instanced(kuhl_geometry *geom, GLsizei instances)
+{
+	if(geom == NULL)
+		return;
+	if(instances < 1)
+	{
+		msg(MSG_WARNING, "You tried to draw less than 1 instance of an object.");
+		return;
+	}
+
+	kuhl_errorcheck();
+
+	/* Record the OpenGL state so that we can restore it when we have
+	 * finished drawing. */
+	kuhl_gl_saved_state saved;
+	kuhl_gl_state_save(&saved);
+
+	/* Draw each of the nodes in the list. */
+	const kuhl_registry_list *list = kuhl_registry_list_get(geom);
+	unsigned int i = 0;
+	for(kuhl_geometry *g = geom; g != NULL; g = kuhl_registry_list_next(list, &i, g))
+		kuhl_geometry_draw_node(g, instances, g->matrix, NULL, NULL);
+
+	kuhl_gl_state_load(&saved);
+	kuhl_errorcheck();
+}
+
+/** Draws a kuhl_geometry object with a different GLSL program than
+ * the one it was created with, without changing geom->program. This
+ * is useful for drawing the same geometry in several passes (such as
+ * a depth-only pass, a shadow map or an object picking pass) with a
+ * different program in each pass.
+ *
+ * Each geometry keeps a vertex array object for each of the last
+ * KUHL_MAX_PROGRAM_VAOS programs that it was drawn with. The
+ * attribute and uniform locations are looked up once for each
+ * geometry and program; after that, drawing with a program costs the
+ * same as kuhl_geometry_draw(). Attributes that the program doesn't
+ * use are ignored.
+ *
+ * @param geom The geometry to draw. If the kuhl_geometry object is a
+ * part of a linked list, this function will draw each of the objects
+ * in order.
+ *
+ * @param program The GLSL program to draw the geometry with. If it
+ * is the geometry's own program, this is the same as
+ * kuhl_geometry_draw().
+ */
+void kuhl_geometry_draw_with_program(kuhl_geometry *geom, GLuint program)
+{
+	if(geom == NULL)
+		return;
+	if(program == 0 || (kuhl_gl_restore && glIsProgram(program) == 0))
+	{
+		msg(MSG_ERROR, "Program (%d) is invalid.", program);
+		return;
+	}
+
+	kuhl_errorcheck();
+	kuhl_gl_saved_state saved;
+	kuhl_gl_state_save(&saved);
+
+	const kuhl_registry_list *list = kuhl_registry_list_get(geom);
+	unsigned int i = 0;
+	for(kuhl_geometry *g = geom; g != NULL; g = kuhl_registry_list_next(list, &i, g))
+	{
+		if(g->vao == 0)
+			continue;
+		const kuhl_program_vao *pv = NULL;
+		if(program != g->program)
+			pv = kuhl_program_vao_find(g, program);
+		kuhl_geometry_draw_node(g, 1, g->matrix, NULL, pv);
+	}
+
+	kuhl_gl_state_load(&saved);
+	kuhl_errorcheck();
+}
+
+/** Checks if we know where all of the vertices in a geometry will be
+ * drawn so that kuhl_geometry_draw_culled() can skip it.
+ *
+ * @param geom The geometry to check.
+ *
+ * @return 1 if the geometry can be culled with geom->aabbox, 0 if it
+ * must always be drawn.
+ */
+static int kuhl_geometry_cullable(const kuhl_geometry *geom)
+{
+	/* Bones move vertices outside of the box, per-instance attributes
+	 * usually move instances around, and the meshes in packed
+	 * geometry have their own matrices. */
+	return geom->aabbox_valid &&
+		geom->bones == NULL &&
+		geom->instance_attrib_count == 0 &&
+		geom->multidraw == NULL;
+}
+
+/** Draws the objects in a kuhl_geometry list that may be visible and
+ * skips the ones that are entirely outside of the view frustum. The
+ * bounding box of each object (calculated when its in_Position
+ * attribute is set) is transformed by geom->matrix and tested against
+ * the frustum. Objects with unknown bounds (KG_DYNAMIC positions,
+ * positions changed with kuhl_geometry_attrib_get(), bones, etc) are
+ * always drawn. The boxes and matrices are read from the geometry
+ * registry; call kuhl_geometry_registry_sync() after changing
+ * geom->matrix directly.
+ *
+ * @param geom The geometry to draw.
+ *
+ * @param modelview The modelview matrix that the ModelView uniform
+ * in the geometry's program is set to. The caller must set the
+ * uniform.
+ *
+ * @param projection The projection matrix that the Projection uniform
+ * in the geometry's program is set to.
+ *
+ * @param culled If not NULL, set to the number of objects that were
+ * not drawn.
+ *
+ * @return The number of objects that were drawn.
+ */
+int kuhl_geometry_draw_culled(kuhl_geometry *geom, const float modelview[16], const float projection[16], int *culled)
+{
+	if(culled != NULL)
+		*culled = 0;
+	if(geom == NULL)
+		return 0;
+
+	float clip[16], planes[6][4];
+	mat4f_mult_mat4f_new(clip, projection, modelview);
+	kuhl_frustum_planes(planes, clip);
+
+	kuhl_errorcheck();
+	kuhl_gl_saved_state saved;
+	kuhl_gl_state_save(&saved);
+
+	/* Test and draw the list one batch at a time so that the boxes
+	 * fit on the stack. The boxes and matrices of geometry in the
+	 * geometry registry are read from its arrays. */
+	kuhl_geometry *nodes[KUHL_CULL_BATCH];
+	float bboxes[KUHL_CULL_BATCH*6];
+	unsigned char visible[KUHL_CULL_BATCH];
+	int count = 0, drawn = 0;
+	const kuhl_registry_list *list = kuhl_registry_list_get(geom);
+	unsigned int next = 0;
+	kuhl_geometry *g = geom;
+	for(;;)
+	{
+		int n = 0;
+		while(n < KUHL_CULL_BATCH)
+		{
+			const float *box;
+			float *matrix;
+			if(list != NULL)
+			{
+				if(next == list->count)
+					break;
+				unsigned int slot = list->slots[next++];
+				nodes[n] = kuhl_registry.geom[slot];
+				box = kuhl_registry.aabbox[slot];
+				matrix = kuhl_registry.matrix[slot];
+			}
+			else
+			{
+				if(g == NULL)
+					break;
+				nodes[n] = g;
+				box = g->aabbox;
+				matrix = g->matrix;
+				g = g->next;
+			}
+
+			float *bbox = bboxes + 6*n;
+			if(kuhl_geometry_cullable(nodes[n]))
+			{
+				memcpy(bbox, box, sizeof(float)*6);
+				kuhl_bbox_transform(bbox, matrix);
+			}
+			else
+				memset(bbox, 0, sizeof(float)*6);
+			n++;
+		}
+		if(n == 0)
+			break;
+		kuhl_bbox_frustum_cull(visible, bboxes, n, planes);
+
+		for(int i=0; i<n; i++)
+		{
+			if(visible[i] || !kuhl_geometry_cullable(nodes[i]))
+			{
+				kuhl_geometry_draw_node(nodes[i], 1, nodes[i]->matrix, NULL, NULL);
+				drawn++;
+			}
+		}
+		count += n;
+	}
+
+	kuhl_gl_state_load(&saved);
+	kuhl_errorcheck();
+
+	if(culled != NULL)
+		*culled = count - drawn;
+	return drawn;
+}
+
+/** Counts of occlusion query results since kuhl_occlusion_stats()
+ * was last called. */
+static long kuhl_occlusion_visible = 0, kuhl_occlusion_occluded = 0, kuhl_occlusion_pending = 0;
+
+/** Creates or updates the box that kuhl_geometry_draw_occlusion()
+ * draws in place of a geometry to check if it is hidden.
+ *
+ * @param geom The geometry to create a box for. geom->aabbox must be
+ * valid.
+ *
+ * @return The box geometry, which uses the same program as geom.
+ */
+static kuhl_geometry* kuhl_geometry_occlusion_proxy(kuhl_geometry *geom)
+{
+	kuhl_geometry *proxy = geom->occlusion_proxy;
+	if(proxy == NULL)
+	{
+		proxy = (kuhl_geometry*) kuhl_malloc(sizeof(kuhl_geometry));
+		kuhl_geometry_new(proxy, geom->program, 8, GL_TRIANGLES);
+		/* Front and back faces of the box are both drawn, so the
+		 * winding doesn't matter. */
+		GLuint indexData[] = { 0,1,3, 0,3,2,   4,6,7, 4,7,5,   // -x, +x
+		                       0,4,5, 0,5,1,   2,3,7, 2,7,6,   // -y, +y
+		                       0,2,6, 0,6,4,   1,5,7, 1,7,3 }; // -z, +z
+		kuhl_geometry_indices(proxy, indexData, 36);
+		geom->occlusion_proxy = proxy;
+	}
+	else if(proxy->program != geom->program)
+		kuhl_geometry_program(proxy, geom->program, KG_NONE);
+
+	/* Update the corners if the bounds of the geometry changed. */
+	if(!proxy->aabbox_valid || memcmp(proxy->aabbox, geom->aabbox, sizeof(float)*6) != 0)
+	{
+		const float *b = geom->aabbox;
+		GLfloat corners[24];
+		for(int i=0; i<8; i++)
+		{
+			corners[i*3+0] = b[(i>>2)&1];
+			corners[i*3+1] = b[2+((i>>1)&1)];
+			corners[i*3+2] = b[4+(i&1)];
+		}
+		kuhl_geometry_attrib(proxy, corners, 3, "in_Position", KG_WARN);
+	}
+	return proxy;
+}
+
+/** Draws the box from kuhl_geometry_occlusion_proxy(). The box only
+ * has positions and never changes after it is created, so this skips
+ * the textures, bones and buffer updates in kuhl_geometry_draw_node().
+ *
+ * @param proxy The box to draw.
+ *
+ * @param geomTransform The GeomTransform matrix of the geometry that the box is in place of.
+ */
+static void kuhl_geometry_draw_proxy(kuhl_geometry *proxy, const float geomTransform[16])
+{
+	kuhl_gl_use_program(proxy->program);
+	kuhl_geometry_locations(proxy);
+	/* The program may be shared with skinned geometry, so make sure
+	 * the box isn't moved by bones left over from it. */
+	kuhl_uniform_int(proxy->locations.numBones, 0);
+	kuhl_uniform_mat4f(proxy->locations.geomTransform, 1, geomTransform);
+	kuhl_gl_bind_vertex_array(proxy->vao);
+	glDrawElements(GL_TRIANGLES, proxy->indices_len, proxy->indices_type, 0);
+}
+
+/** Draws a kuhl_geometry list using hardware occlusion queries to
+ * skip objects that are hidden behind objects that were drawn
+ * earlier. For each object, the bounding box of the object is drawn
+ * (without changing the color or depth buffers) inside of an
+ * occlusion query. Then, the object itself is drawn with conditional
+ * rendering: If no part of the box was visible, the GPU skips the
+ * object. The CPU never waits for query results---if the GPU hasn't
+ * finished the query, it draws the object anyway.
+ *
+ * This helps the most when objects are drawn from front to back and
+ * when the objects are expensive to draw compared to their bounding
+ * box. Objects with unknown bounds (see kuhl_geometry_draw_culled())
+ * are always drawn. The result of the query from the previous frame is
+ * read (if it is ready) and counted in the statistics returned by
+ * kuhl_occlusion_stats().
+ *
+ * The box is drawn with the geometry's program, so the ModelView and
+ * Projection uniforms should be set before calling this function
+ * just like for kuhl_geometry_draw(). The color and depth write masks,
+ * GL_CULL_FACE and GL_DEPTH_CLAMP are put back the way they were
+ * after each box is drawn. They are read from OpenGL once per eye (see
+ * kuhl_gl_state_invalidate()) instead of once per call.
+ *
+ * @param geom The geometry to draw. If the kuhl_geometry object is a
+ * part of a linked list, each of the objects are tested and drawn in
+ * order.
+ */
+void kuhl_geometry_draw_occlusion(kuhl_geometry *geom)
+{
+	if(geom == NULL)
+		return;
+
+	/* Conservative queries are cheaper when the hardware supports
+	 * them, and any-samples queries can stop counting early. */
+	GLenum target = GL_SAMPLES_PASSED;
+	if(GLEW_VERSION_4_3)
+		target = GL_ANY_SAMPLES_PASSED_CONSERVATIVE;
+	else if(GLEW_VERSION_3_3)
+		target = GL_ANY_SAMPLES_PASSED;
+
+	kuhl_errorcheck();
+	kuhl_gl_saved_state saved;
+	kuhl_gl_state_save(&saved);
+
+	kuhl_gl_raster_state();
+	const GLboolean *colorMask = kuhl_gl_shadow.colorMask;
+
+	for(kuhl_geometry *g = geom; g != NULL; g = g->next)
+	{
+		if(!kuhl_geometry_cullable(g))
+		{
+			kuhl_geometry_draw_node(g, 1, g->matrix, NULL, NULL);
+			continue;
+		}
+
+		/* Count the result of last frame's query if it is ready. */
+		if(g->occlusion_query == 0)
+			glGenQueries(1, &(g->occlusion_query));
+		else
+		{
+			GLuint available = 0;
+			glGetQueryObjectuiv(g->occlusion_query, GL_QUERY_RESULT_AVAILABLE, &available);
+			if(available)
+			{
+				GLuint samples = 0;
+				glGetQueryObjectuiv(g->occlusion_query, GL_QUERY_RESULT, &samples);
+				if(samples)
+					kuhl_occlusion_visible++;
+				else
+					kuhl_occlusion_occluded++;
+			}
+			else
+				kuhl_occlusion_pending++;
+		}
+
+		/* Draw the box. Both sides of the box are drawn and the box
+		 * isn't clipped by the near plane so the box is still visible
+		 * if the camera is near or inside of it. */
+		kuhl_geometry *proxy = kuhl_geometry_occlusion_proxy(g);
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		glDepthMask(GL_FALSE);
+		glDisable(GL_CULL_FACE);
+		glEnable(GL_DEPTH_CLAMP);
+		glBeginQuery(target, g->occlusion_query);
+		kuhl_geometry_draw_proxy(proxy, g->matrix);
+		glEndQuery(target);
+		glColorMask(colorMask[0], colorMask[1], colorMask[2], colorMask[3]);
+		glDepthMask(kuhl_gl_shadow.depthMask);
+		if(kuhl_gl_shadow.cullFace)
+			glEnable(GL_CULL_FACE);
+		if(!kuhl_gl_shadow.depthClamp)
+			glDisable(GL_DEPTH_CLAMP);
+
+		glBeginConditionalRender(g->occlusion_query, GL_QUERY_NO_WAIT);
+		kuhl_geometry_draw_node(g, 1, g->matrix, NULL, NULL);
+		glEndConditionalRender();
+		kuhl_errorcheck();
+	}
+
+	kuhl_gl_state_load(&saved);
+	kuhl_errorcheck();
+}
+
+/** Returns how many occlusion queries made by
+ * kuhl_geometry_draw_occlusion() found that an object was visible or
+ * hidden since the last time this function was called. Queries are
+ * read one frame after they were made; queries that the GPU hadn't
+ * finished by then are counted as pending. Many pending queries means
+ * that the GPU is more than a frame behind the CPU.
+ *
+ * @param visible Set to the number of queries where the object was visible (may be NULL).
+ * @param occluded Set to the number of queries where the object was hidden (may be NULL).
+ * @param pending Set to the number of queries that weren't ready (may be NULL).
+ */
+void kuhl_occlusion_stats(long *visible, long *occluded, long *pending)
+{
+	if(visible)
+		*visible = kuhl_occlusion_visible;
+	if(occluded)
+		*occluded = kuhl_occlusion_occluded;
+	if(pending)
+		*pending = kuhl_occlusion_pending;
+	kuhl_occlusion_visible = 0;
+	kuhl_occlusion_occluded = 0;
+	kuhl_occlusion_pending = 0;
+}
+
+/** Draws a kuhl_geometry struct to the screen. The struct passed into
+ * this function should have been set up with kuhl_geometry_new() and
+ * at least one position attribute with kuhl_geometry_attrib() before
+ * calling this function.
+ *
+ * @param geom The geometry to draw to the screen. If the kuhl_geometry
+ * object is a part of a linked list, this function will draw each of
+ * the objects in order. */
+void kuhl_geometry_draw(kuhl_geometry *geom)
+{
+	kuhl_geometry_draw_instanced(geom, 1);
+}
+
+/** Meshes with fewer indices than this aren't simplified any further
+ * by kuhl_geometry_lod_generate(). */
+#define KUHL_LOD_MIN_INDICES 96
+
+/** Replaces the index buffer of a geometry. Unlike
+ * kuhl_geometry_indices(), the old buffer is deleted and the levels
+ * of detail (if any) are kept.
+ *
+ * @param geom The geometry to change.
+ *
+ * @param indices The new indices. If the geometry has levels of
+ * detail, this contains all of the levels.
+ *
+ * @param indexCount The number of indices.
+ */
+static void kuhl_geometry_indices_replace(kuhl_geometry *geom, GLuint *indices, GLuint indexCount)
+{
+	kuhl_lod *lod = geom->lod;
+	geom->lod = NULL;
+	if(glIsBuffer(geom->indices_bufferobject))
+		glDeleteBuffers(1, &(geom->indices_bufferobject));
+	geom->indices_bufferobject = 0;
+	kuhl_geometry_indices(geom, indices, indexCount);
+	if(lod != NULL)
+	{
+		geom->lod = lod;
+		geom->indices_len = lod->levels[0].count;
+		kuhl_registry_store(geom);
+	}
+}
+
+/** Replaces the index buffer of a geometry with one that contains
+ * every level of detail.
+ *
+ * @param geom The geometry to change.
+ *
+ * @param indices The indices of all of the levels, one level after
+ * another.
+ *
+ * @param indexCount The total number of indices.
+ *
+ * @param lod Describes where each level is in indices.
+ */
+static void kuhl_geometry_lod_set(kuhl_geometry *geom, GLuint *indices, GLuint indexCount, const kuhl_lod *lod)
+{
+	free(geom->lod);
+	geom->lod = (kuhl_lod*) kuhl_malloc(sizeof(kuhl_lod));
+	*geom->lod = *lod;
+	geom->lod->current = 0;
+	/* Other code that reads the indices (kuhl_geometry_indices_read(),
+	 * etc) only sees the original mesh. */
+	kuhl_geometry_indices_replace(geom, indices, indexCount);
+}
+
+/** Finds the in_Position attribute of a geometry and the sphere
+ * that contains all of its vertices.
+ *
+ * @param geom The geometry to read the positions of.
+ *
+ * @param components Set to the number of components in each position.
+ *
+ * @param lod The center and radius fields are set.
+ *
+ * @return The positions which the caller should free(), or NULL if
+ * the geometry has no positions.
+ */
+static GLfloat* kuhl_geometry_lod_positions(kuhl_geometry *geom, GLuint *components, kuhl_lod *lod)
+{
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		if(strcmp(geom->attribs[i].name, "in_Position") != 0)
+			continue;
+		GLfloat *positions = kuhl_geometry_attrib_read(geom, i, components);
+		if(*components < 3)
+		{
+			free(positions);
+			return NULL;
+		}
+
+		float min[3] = {  FLT_MAX,  FLT_MAX,  FLT_MAX };
+		float max[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		for(GLuint v=0; v<geom->vertex_count; v++)
+			for(int j=0; j<3; j++)
+			{
+				float p = positions[v*(*components)+j];
+				if(p < min[j]) min[j] = p;
+				if(p > max[j]) max[j] = p;
+			}
+		vec3f_add_new(lod->center, min, max);
+		vec3f_scalarDiv(lod->center, 2);
+		float radiusSq = 0;
+		for(GLuint v=0; v<geom->vertex_count; v++)
+		{
+			float diff[3];
+			vec3f_sub_new(diff, positions+v*(*components), lod->center);
+			if(vec3f_normSq(diff) > radiusSq)
+				radiusSq = vec3f_normSq(diff);
+		}
+		lod->radius = sqrtf(radiusSq);
+		return positions;
+	}
+	return NULL;
+}
+
+/** Creates simplified versions of a triangle mesh that can be drawn
+ * instead of the original mesh when the geometry is far away from
+ * the camera. Each level has about half as many triangles as the
+ * previous one (see kuhl_mesh_simplify()). All of the levels are
+ * stored in the geometry's index buffer, so no extra vertices are
+ * created. After the levels are generated, kuhl_geometry_lod_select()
+ * picks which level kuhl_geometry_draw() draws. Level 0 (the
+ * original mesh) is drawn until then.
+ *
+ * Geometry that isn't made of indexed triangles, or that contains
+ * several packed meshes (see KL_MULTIDRAW), is not changed.
+ *
+ * @param geom The geometry to simplify.
+ *
+ * @param maxError The largest error (see kuhl_lod_level) that a level
+ * may have as a fraction of the radius of the geometry's bounding
+ * sphere (for example, 0.05).
+ *
+ * @param kg_options KG_FULL_LIST to simplify every geometry in the list.
+ */
+void kuhl_geometry_lod_generate(kuhl_geometry *geom, float maxError, int kg_options)
+{
+	if(geom == NULL)
+		return;
+	if(kg_options & KG_FULL_LIST)
+		kuhl_geometry_lod_generate(geom->next, maxError, kg_options);
+	if(geom->primitive_type != GL_TRIANGLES || geom->multidraw != NULL ||
+	   geom->indices_len < KUHL_LOD_MIN_INDICES*2 || !kuhl_geometry_unshare(geom))
+		return;
+
+	kuhl_lod lod;
+	GLuint components = 0;
+	GLfloat *positions = kuhl_geometry_lod_positions(geom, &components, &lod);
+	if(positions == NULL)
+		return;
+	GLuint indexCount = geom->indices_len;
+	GLuint *indices = kuhl_geometry_indices_read(geom);
+
+	/* Every level is at most 3/4 the size of the previous one, so
+	 * all of the levels fit in 4 times the original size. */
+	GLuint *all = (GLuint*) kuhl_malloc(sizeof(GLuint)*indexCount*4);
+	GLuint *scratch = (GLuint*) kuhl_malloc(sizeof(GLuint)*indexCount);
+	memcpy(all, indices, sizeof(GLuint)*indexCount);
+	lod.levels[0].count = indexCount;
+	lod.levels[0].first = 0;
+	lod.levels[0].error = 0;
+	lod.count = 1;
+	GLuint used = indexCount;
+
+	/* Simplify the original mesh each time so that the error of
+	 * each level is measured against the original. */
+	GLuint target = indexCount;
+	while(lod.count < KUHL_MAX_LODS)
+	{
+		target = target / 6 * 3;
+		if(target < KUHL_LOD_MIN_INDICES)
+			break;
+		float error = 0;
+		GLuint count = kuhl_mesh_simplify(scratch, indices, indexCount,
+		                                  positions, geom->vertex_count, components,
+		                                  target, maxError*lod.radius, &error);
+		/* Stop if the error limit (or vertices that can't be moved)
+		 * kept the mesh from getting much smaller. */
+		if(count > lod.levels[lod.count-1].count / 4 * 3)
+			break;
+		kuhl_mesh_optimize_vertex_cache(all+used, scratch, count, geom->vertex_count, KUHL_MESH_CACHE_SIZE);
+		lod.levels[lod.count].count = count;
+		lod.levels[lod.count].first = used;
+		lod.levels[lod.count].error = error;
+		lod.count++;
+		used += count;
+		target = count;
+	}
+
+	if(lod.count > 1)
+	{
+		kuhl_geometry_lod_set(geom, all, used, &lod);
+		msg(MSG_DEBUG, "Generated %u levels of detail for a mesh with %u triangles; the smallest has %u triangles.",
+		    lod.count, indexCount/3, lod.levels[lod.count-1].count/3);
+	}
+	free(scratch);
+	free(all);
+	free(indices);
+	free(positions);
+}
+
+/** Picks which level of detail kuhl_geometry_draw() draws for
+ * geometry that has levels created by kuhl_geometry_lod_generate().
+ * The least detailed level is picked whose error (see kuhl_lod_level)
+ * covers no more than lod.pixelerror pixels (a config file setting,
+ * 1 by default) in the viewport. Since the error is a
+ * root-mean-square distance, some pixels may be off by more than
+ * that. Call this function each time the camera or the geometry
+ * moves.
+ *
+ * @param geom The geometry to pick a level for.
+ *
+ * @param modelview The modelview matrix that the geometry will be
+ * drawn with (geom->matrix is applied to it).
+ *
+ * @param projection The projection matrix that the geometry will be
+ * drawn with.
+ *
+ * @param viewportHeight Height of the viewport in pixels (see
+ * viewmat_get_viewport()).
+ *
+ * @param kg_options KG_FULL_LIST to pick a level for every geometry
+ * in the list.
+ */
+void kuhl_geometry_lod_select(kuhl_geometry *geom, const float modelview[16], const float projection[16],
+                              int viewportHeight, int kg_options)
+{
+	static float pixelError = -1;
+	if(pixelError < 0)
+		pixelError = kuhl_config_float("lod.pixelerror", 1, 1);
+
+	/* Number of pixels covered by one unit in eye coordinates at a
+	 * distance of 1 (or at any distance for orthographic
+	 * projections). */
+	float pixelsPerUnit = projection[5] * viewportHeight / 2.0f;
+	int perspective = projection[15] == 0;
+
+	for(kuhl_geometry *g = geom; g != NULL; g = (kg_options & KG_FULL_LIST) ? g->next : NULL)
+	{
+		kuhl_lod *lod = g->lod;
+		if(lod == NULL)
+			continue;
+
+		float mat[16], center[4];
+		mat4f_mult_mat4f_new(mat, modelview, g->matrix);
+		float center4[4] = { lod->center[0], lod->center[1], lod->center[2], 1 };
+		mat4f_mult_vec4f_new(center, mat, center4);
+
+		/* The largest amount that the matrix scales an object by. */
+		float scale = 0;
+		for(int col=0; col<3; col++)
+		{
+			float axis[3] = { mat[col*4], mat[col*4+1], mat[col*4+2] };
+			if(vec3f_norm(axis) > scale)
+				scale = vec3f_norm(axis);
+		}
+
+		float pixels = pixelsPerUnit * scale;
+		if(perspective)
+		{
+			/* Use the most detailed level if the camera is inside
+			 * of the bounding sphere. */
+			float distance = vec3f_norm(center) - lod->radius*scale;
+			if(distance <= 0)
+			{
+				lod->current = 0;
+				continue;
+			}
+			pixels /= distance;
+		}
+
+		lod->current = 0;
+		for(unsigned int i=lod->count-1; i>0; i--)
+		{
+			if(lod->levels[i].error * pixels <= pixelError)
+			{
+				lod->current = i;
+				break;
+			}
+		}
+	}
+}
+
+/** Version number written into files created by kuhl_geometry_lod_save(). */
+#define KUHL_LOD_FILE_VERSION 2
+
+/** Calculates a FNV-1a hash of the original indices of a geometry so
+ * that kuhl_geometry_lod_load() can tell if they changed (for
+ * example, if they were reordered by kuhl_geometry_optimize()). */
+static uint32_t kuhl_geometry_lod_hash(const kuhl_geometry *geom)
+{
+	GLuint *indices = kuhl_geometry_indices_read(geom);
+	uint32_t hash = 2166136261u;
+	for(GLuint i=0; i<geom->indices_len; i++)
+		hash = (hash ^ indices[i]) * 16777619u;
+	free(indices);
+	return hash;
+}
 
-    @return The number of geometry objects in the list.
-*/
-unsigned int kuhl_geometry_count(const kuhl_geometry *geom)
+/** Writes the levels of detail of a list of kuhl_geometry objects to
+ * a file so that kuhl_geometry_lod_load() can reuse them instead of
+ * generating them again. The file stores the indices of every level
+ * except level 0 in the byte order of the current machine.
+ *
+ * @param geom The first geometry in the list.
+ *
+ * @param filename The file to write.
+ *
+ * @param maxError The maxError that was passed to
+ * kuhl_geometry_lod_generate().
+ *
+ * @return 1 if the file was written, 0 otherwise.
+ */
+int kuhl_geometry_lod_save(const kuhl_geometry *geom, const char *filename, float maxError)
 {
 	if(geom == NULL)
 		return 0;
-	const kuhl_geometry *g = geom;
-	unsigned int count = 1;
-	while(g->next != NULL)
+	FILE *f = fopen(filename, "wb");
+	if(f == NULL)
 	{
-		count++;
-		g = g->next;
+		msg(MSG_DEBUG, "Unable to write levels of detail to %s", filename);
+		return 0;
 	}
-	return count;
-}
 
+	uint32_t header[3] = { 0x444f4c4b, KUHL_LOD_FILE_VERSION, kuhl_geometry_count(geom) }; // "KLOD"
+	int ok = fwrite(header, sizeof(header), 1, f) == 1 &&
+		fwrite(&maxError, sizeof(float), 1, f) == 1;
+	for(const kuhl_geometry *g = geom; g != NULL && ok; g = g->next)
+	{
+		const kuhl_lod *lod = g->lod;
+		uint32_t node[4] = { g->vertex_count, g->indices_len,
+		                     lod ? kuhl_geometry_lod_hash(g) : 0, lod ? lod->count : 0 };
+		ok = fwrite(node, sizeof(node), 1, f) == 1;
+		if(lod == NULL || !ok)
+			continue;
+		ok = fwrite(lod->center, sizeof(float), 3, f) == 3 &&
+			fwrite(&(lod->radius), sizeof(float), 1, f) == 1;
+		for(unsigned int i=1; i<lod->count && ok; i++)
+		{
+			GLuint *indices = kuhl_geometry_indices_read_range(g, lod->levels[i].first, lod->levels[i].count);
+			uint32_t count = lod->levels[i].count;
+			ok = fwrite(&(lod->levels[i].error), sizeof(float), 1, f) == 1 &&
+				fwrite(&count, sizeof(uint32_t), 1, f) == 1 &&
+				fwrite(indices, sizeof(GLuint), count, f) == count;
+			free(indices);
+		}
+	}
+	if(fclose(f) != 0)
+		ok = 0;
+	if(!ok)
+	{
+		msg(MSG_WARNING, "Failed to write levels of detail to %s", filename);
+		remove(filename);
+		return 0;
+	}
+	msg(MSG_DEBUG, "Wrote levels of detail to %s", filename);
+	return 1;
+}
 
-/** Initializes the vertex array object (VAO) associated with this
-    kuhl_geometry and initializes other variables inside of the struct.
+/** Reads the levels of detail for a list of kuhl_geometry objects from
+ * a file written by kuhl_geometry_lod_save(). The file is only used if
+ * the list has the same number of objects with the same vertex
+ * counts and indices as the list that the file was written from.
+ *
+ * @param geom The first geometry in the list.
+ *
+ * @param filename The file to read.
+ *
+ * @param maxError The file is only used if the levels in it were
+ * generated with the same maxError.
+ *
+ * @return 1 if the levels of detail were loaded, 0 if the file
+ * couldn't be read or doesn't match the geometry.
+ */
+int kuhl_geometry_lod_load(kuhl_geometry *geom, const char *filename, float maxError)
+{
+	if(geom == NULL)
+		return 0;
+	FILE *f = fopen(filename, "rb");
+	if(f == NULL)
+		return 0;
 
-    @param geom A kuhl_geometry struct populated with the information
-    necessary to draw some geometry.
+	/* Read the whole file before changing any of the geometry. */
+	unsigned int geomCount = kuhl_geometry_count(geom);
+	kuhl_lod *lods = (kuhl_lod*) kuhl_malloc(sizeof(kuhl_lod)*geomCount);
+	GLuint **levelIndices = (GLuint**) kuhl_malloc(sizeof(GLuint*)*geomCount);
+	memset(levelIndices, 0, sizeof(GLuint*)*geomCount);
+
+	uint32_t header[3];
+	float fileError = 0;
+	int ok = fread(header, sizeof(header), 1, f) == 1 &&
+		fread(&fileError, sizeof(float), 1, f) == 1 &&
+		header[0] == 0x444f4c4b && header[1] == KUHL_LOD_FILE_VERSION &&
+		header[2] == geomCount && fileError == maxError;
+	unsigned int n = 0;
+	for(kuhl_geometry *g = geom; g != NULL && ok; g = g->next, n++)
+	{
+		kuhl_lod *lod = &lods[n];
+		uint32_t node[4];
+		ok = fread(node, sizeof(node), 1, f) == 1 &&
+			node[0] == g->vertex_count && node[1] == g->indices_len &&
+			node[3] <= KUHL_MAX_LODS;
+		lod->count = ok ? node[3] : 0;
+		if(lod->count == 0)
+			continue;
+		if(node[2] != kuhl_geometry_lod_hash(g))
+		{
+			ok = 0;
+			continue;
+		}
+		ok = fread(lod->center, sizeof(float), 3, f) == 3 &&
+			fread(&(lod->radius), sizeof(float), 1, f) == 1;
+
+		/* Level 0 is the index buffer that the geometry already has. */
+		GLuint used = g->indices_len;
+		levelIndices[n] = (GLuint*) kuhl_malloc(sizeof(GLuint)*used*4);
+		lod->levels[0].count = used;
+		lod->levels[0].first = 0;
+		lod->levels[0].error = 0;
+		for(unsigned int i=1; i<lod->count && ok; i++)
+		{
+			uint32_t count = 0;
+			ok = fread(&(lod->levels[i].error), sizeof(float), 1, f) == 1 &&
+				fread(&count, sizeof(uint32_t), 1, f) == 1 &&
+				count % 3 == 0 && used + count <= g->indices_len*4 &&
+				fread(levelIndices[n]+used, sizeof(GLuint), count, f) == count;
+			for(uint32_t j=0; j<count && ok; j++)
+				if(levelIndices[n][used+j] >= g->vertex_count)
+					ok = 0;
+			lod->levels[i].count = count;
+			lod->levels[i].first = used;
+			used += count;
+		}
+	}
+	fclose(f);
 
-    @param program A GLSL program to be used when rendering this
-    geometry.
+	n = 0;
+	for(kuhl_geometry *g = geom; g != NULL; g = g->next, n++)
+	{
+		if(ok && lods[n].count > 0 && kuhl_geometry_unshare(g))
+		{
+			GLuint *original = kuhl_geometry_indices_read(g);
+			memcpy(levelIndices[n], original, sizeof(GLuint)*g->indices_len);
+			free(original);
+			const kuhl_lod_level *last = &(lods[n].levels[lods[n].count-1]);
+			kuhl_geometry_lod_set(g, levelIndices[n], last->first + last->count, &lods[n]);
+		}
+		free(levelIndices[n]);
+	}
+	free(levelIndices);
+	free(lods);
 
-    @param vertexCount The number of vertices in this piece of geometry.
+	if(!ok)
+		msg(MSG_DEBUG, "Levels of detail in %s don't match the model, ignoring it.", filename);
+	return ok;
+}
 
-    @param primitive_type OpenGL primitive type of the geometry.
-*/
-void kuhl_geometry_new(kuhl_geometry *geom, GLuint program, unsigned int vertexCount, GLint primitive_type)
+/** Checks if the vertices of a geometry can be reordered by
+ * kuhl_geometry_attrib_reorder(). */
+static int kuhl_geometry_attrib_reorderable(const kuhl_geometry *geom)
 {
-	if(geom == NULL)
+	for(unsigned int i=0; i<geom->attrib_count; i++)
 	{
-		msg(MSG_FATAL, "You called kuhl_geometry_new() with geom parameter set to NULL.");
-		exit(EXIT_FAILURE);
+		const kuhl_attrib *attrib = &(geom->attribs[i]);
+		/* KG_DYNAMIC and KG_SHADOW attributes are rewritten by the
+		 * caller in the original order. */
+		if(attrib->ring != NULL || attrib->shadow != NULL)
+			return 0;
+		if(attrib->stride != 0 && attrib->bufferobject != geom->interleaved_bufferobject)
+			return 0;
 	}
-	
-	kuhl_errorcheck();
-
-	/* Ask OpenGL for one vertex array object "name" (really an
-	 * integer that you can think of as an ID number) that we can use
-	 * for a new VAO (vertex array object) */
-	glGenVertexArrays(1, &(geom->vao));
-	/* Bind to the VAO to finish creating it */
-	glBindVertexArray(geom->vao);
-	glBindVertexArray(0); // unbind
+	return geom->attrib_count > 0;
+}
 
-	/* Check if the program is valid (we don't need to enable it here). */
-	if(!glIsProgram(program))
+/** Moves the vertices of a geometry to new positions in its attribute
+ * buffers. Attributes that were interleaved with
+ * kuhl_geometry_interleave() are moved together.
+ *
+ * @param geom The geometry to change.
+ *
+ * @param remap remap[v] is the new position of the vertex at position v.
+ */
+static void kuhl_geometry_attrib_reorder(kuhl_geometry *geom, const GLuint *remap)
+{
+	kuhl_geometry_attrib_unmap(geom);
+	int interleavedDone = 0;
+	for(unsigned int i=0; i<geom->attrib_count; i++)
 	{
-		msg(MSG_FATAL, "The program you specified in your kuhl_geometry struct (%d) is not a valid GLSL program.\n", program);
-		exit(EXIT_FAILURE);
+		const kuhl_attrib *attrib = &(geom->attribs[i]);
+		size_t vertexSize = attrib->vertex_size;
+		GLintptr offset = attrib->offset;
+		if(attrib->stride != 0)
+		{
+			/* Move every attribute in the interleaved buffer at once. */
+			if(interleavedDone)
+				continue;
+			interleavedDone = 1;
+			vertexSize = attrib->stride;
+			offset = 0;
+		}
+
+		size_t size = vertexSize * geom->vertex_count;
+		GLubyte *data = (GLubyte*) kuhl_malloc(size);
+		GLubyte *reordered = (GLubyte*) kuhl_malloc(size);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, attrib->bufferobject);
+		glGetBufferSubData(GL_COPY_WRITE_BUFFER, offset, size, data);
+		for(GLuint v=0; v<geom->vertex_count; v++)
+			memcpy(reordered + remap[v]*vertexSize, data + v*vertexSize, vertexSize);
+		glBufferSubData(GL_COPY_WRITE_BUFFER, offset, size, reordered);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		free(reordered);
+		free(data);
+		kuhl_errorcheck();
 	}
+}
 
-	if(vertexCount == 0)
+/** Keeps some of the vertices of a geometry and removes the rest from
+ * its attribute buffers. Attributes that were interleaved with
+ * kuhl_geometry_interleave() are copied together. The indices must
+ * be replaced by the caller.
+ *
+ * @param geom The geometry to change.
+ *
+ * @param keep keep[n] is the old position of the vertex that becomes
+ * vertex n.
+ *
+ * @param count Number of vertices to keep.
+ */
+static void kuhl_geometry_attrib_compact(kuhl_geometry *geom, const GLuint *keep, GLuint count)
+{
+	kuhl_geometry_attrib_unmap(geom);
+	int interleavedDone = 0;
+	for(unsigned int i=0; i<geom->attrib_count; i++)
 	{
-		msg(MSG_WARNING, "You are creating a geometry object with a vertexCount of 0.\n");
+		const kuhl_attrib *attrib = &(geom->attribs[i]);
+		size_t vertexSize = attrib->vertex_size;
+		GLintptr offset = attrib->offset;
+		if(attrib->stride != 0)
+		{
+			if(interleavedDone)
+				continue;
+			interleavedDone = 1;
+			vertexSize = attrib->stride;
+			offset = 0;
+		}
+
+		GLubyte *data = (GLubyte*) kuhl_malloc(vertexSize * geom->vertex_count);
+		GLubyte *compacted = (GLubyte*) kuhl_malloc(vertexSize * count);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, attrib->bufferobject);
+		glGetBufferSubData(GL_COPY_WRITE_BUFFER, offset, vertexSize * geom->vertex_count, data);
+		for(GLuint v=0; v<count; v++)
+			memcpy(compacted + v*vertexSize, data + keep[v]*vertexSize, vertexSize);
+		glBufferData(GL_COPY_WRITE_BUFFER, vertexSize * count, compacted, GL_STATIC_DRAW);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		free(compacted);
+		free(data);
+		kuhl_errorcheck();
 	}
+	geom->vertex_count = count;
+}
 
-	geom->program = program;
-	geom->vertex_count = vertexCount;
-	geom->primitive_type = primitive_type;
+/** Reorders the triangles and vertices of a geometry so that it can
+ * be drawn faster. The indices that aiProcess_JoinIdenticalVertices
+ * and other sources produce are often in an order that makes poor
+ * use of the GPU's post-transform vertex cache. This function:
+ *
+ * - Reorders the triangles for the vertex cache (see
+ *   kuhl_mesh_optimize_vertex_cache()).
+ *
+ * - Reorders groups of triangles so that triangles that are likely
+ *   to be hidden are drawn last (see kuhl_mesh_optimize_overdraw()).
+ *   The optimize.overdraw config file setting (1.05 by default) sets
+ *   how much the vertex cache may suffer; 0 disables this step.
+ *
+ * - Reorders the vertices so that the vertex buffers are read from
+ *   start to end (see kuhl_mesh_optimize_vertex_fetch()). This step
+ *   is skipped for geometry with KG_DYNAMIC attributes.
+ *
+ * Levels of detail (see kuhl_geometry_lod_generate()) are optimized
+ * too. Geometry that isn't made of indexed triangles is not changed.
+ * The average cache miss ratio (ACMR, see kuhl_mesh_acmr()) before
+ * and after optimization is printed.
+ *
+ * @param geom The geometry to optimize.
+ *
+ * @param kg_options KG_FULL_LIST to optimize every geometry in the list.
+ */
+void kuhl_geometry_optimize(kuhl_geometry *geom, int kg_options)
+{
+	float threshold = kuhl_config_float("optimize.overdraw", 1.05f, 1.05f);
+	double missesBefore = 0, missesAfter = 0;
+	unsigned long triangles = 0;
 
-	geom->attrib_count = 0;
-	geom->texture_count = 0;
+	for(kuhl_geometry *g = geom; g != NULL; g = (kg_options & KG_FULL_LIST) ? g->next : NULL)
+	{
+		if(g->primitive_type != GL_TRIANGLES || g->indices_len < 3 || g->multidraw != NULL ||
+		   !kuhl_geometry_unshare(g))
+			continue;
 
-	geom->indices_len = 0;
-	geom->indices_bufferobject = 0;
+		/* Ranges of the index buffer to optimize separately. */
+		kuhl_lod_level whole = { g->indices_len, 0, 0 };
+		const kuhl_lod_level *levels = g->lod ? g->lod->levels : &whole;
+		unsigned int levelCount = g->lod ? g->lod->count : 1;
+		GLuint total = levels[levelCount-1].first + levels[levelCount-1].count;
 
-	mat4f_identity(geom->matrix);
-	mat4f_identity(geom->fitMatrix);
-	geom->has_been_drawn = 0;
-	
-	geom->assimp_node  = NULL;
-	geom->assimp_scene = NULL;
-	geom->bones        = NULL;
+		GLuint *indices = kuhl_geometry_indices_read_range(g, 0, total);
+		GLuint *scratch = (GLuint*) kuhl_malloc(sizeof(GLuint)*total);
+		kuhl_lod sphere;
+		GLuint components = 0;
+		GLfloat *positions = threshold > 0 ? kuhl_geometry_lod_positions(g, &components, &sphere) : NULL;
 
-	geom->next = NULL;
+		float before = kuhl_mesh_acmr(indices, g->indices_len, g->vertex_count, KUHL_MESH_CACHE_SIZE);
+		for(unsigned int l=0; l<levelCount; l++)
+		{
+			GLuint *level = indices + levels[l].first;
+			kuhl_mesh_optimize_vertex_cache(scratch, level, levels[l].count, g->vertex_count, KUHL_MESH_CACHE_SIZE);
+			if(positions != NULL)
+				kuhl_mesh_optimize_overdraw(level, scratch, levels[l].count, positions, g->vertex_count,
+				                            components, KUHL_MESH_CACHE_SIZE, threshold);
+			else
+				memcpy(level, scratch, sizeof(GLuint)*levels[l].count);
+		}
+		float after = kuhl_mesh_acmr(indices, g->indices_len, g->vertex_count, KUHL_MESH_CACHE_SIZE);
+
+		/* Number the vertices in the order the original mesh uses
+		 * them and apply the same numbering to the other levels. */
+		if(kuhl_geometry_attrib_reorderable(g))
+		{
+			GLuint *remap = (GLuint*) kuhl_malloc(sizeof(GLuint)*g->vertex_count);
+			kuhl_mesh_optimize_vertex_fetch(remap, indices, g->indices_len, g->vertex_count);
+			for(GLuint i=g->indices_len; i<total; i++)
+				indices[i] = remap[indices[i]];
+			kuhl_geometry_attrib_reorder(g, remap);
+			free(remap);
+		}
+		kuhl_geometry_indices_replace(g, indices, total);
+
+		missesBefore += before * (g->indices_len/3);
+		missesAfter += after * (g->indices_len/3);
+		triangles += g->indices_len/3;
+		free(positions);
+		free(scratch);
+		free(indices);
+	}
+
+	if(triangles > 0)
+		msg(MSG_INFO, "Optimized %lu triangles: ACMR %.3f before, %.3f after (%d vertex cache)",
+		    triangles, missesBefore/triangles, missesAfter/triangles, KUHL_MESH_CACHE_SIZE);
 }
 
-/** Applies a set of indices to the geometry so that vertices can be
- * re-used by multiple triangles or lines.
+/** Merges the duplicate vertices of a geometry and draws it with
+ * indices instead. Procedurally generated meshes are often made of
+ * separate triangles (without indices) where each vertex is repeated
+ * for every triangle that uses it, so the vertex program runs for
+ * the same vertex several times. After welding, each distinct vertex
+ * is stored once and the post-transform vertex cache can reuse it.
+ * Call kuhl_geometry_optimize() afterwards to also order the
+ * triangles for the cache.
  *
- * @param geom The geometry that the indices should be used with.
+ * Vertices are merged when all of their attributes are within
+ * epsilon of each other (see kuhl_mesh_weld()). The attribute buffers
+ * are replaced with the remaining vertices (keeping the types that
+ * they were stored with) and the geometry is given 16-bit indices if
+ * there are few enough vertices, 32-bit indices otherwise. If the
+ * geometry already has indices (including levels of detail), they
+ * are changed to refer to the merged vertices. Geometry with
+ * KG_DYNAMIC or KG_SHADOW attributes and geometry containing several
+ * meshes packed with KL_MULTIDRAW are not changed.
  *
- * @param indices A list of indices. Each index refers to a specific vertex.
+ * @param geom The geometry to weld.
  *
- * @param indexCount The number of indices. For example, if the
- * geometry object consists of triangles, indexCount should be
- * numTriangles*3.
-*/
-void kuhl_geometry_indices(kuhl_geometry *geom, GLuint *indices, GLuint indexCount)
+ * @param epsilon Largest difference between the values of two
+ * vertices that are merged. Use 0 to only merge identical vertices.
+ *
+ * @param kg_options KG_FULL_LIST to weld every geometry in the list.
+ */
+void kuhl_geometry_weld(kuhl_geometry *geom, float epsilon, int kg_options)
 {
-	if(indexCount == 0 || indices == NULL)
-	{
-		msg(MSG_WARNING, "indexCount was zero or indices array was NULL\n");
-		return;
-	}
-
-	if(geom->primitive_type == GL_TRIANGLES && indexCount % 3 != 0)
-	{
-		msg(MSG_FATAL, "indexCount=%u was not a multiple of 3 even though this geometry has triangles in it.", indexCount);
-		exit(EXIT_FAILURE);
-	}
-	else if(geom->primitive_type == GL_LINES && indexCount % 2 != 0)
+	unsigned long verticesBefore = 0, verticesAfter = 0;
+	for(kuhl_geometry *g = geom; g != NULL; g = (kg_options & KG_FULL_LIST) ? g->next : NULL)
 	{
-		msg(MSG_FATAL, "indexCount=%u was not a multiple of 2 even though this geometry has lines in it.", indexCount);
-		exit(EXIT_FAILURE);
-	}
+		if(g->vertex_count == 0 || g->multidraw != NULL || !kuhl_geometry_attrib_reorderable(g) ||
+		   !kuhl_geometry_unshare(g))
+			continue;
 
-	/* TODO: Check if indices are already set? If so, print an error
-	 * message and/or free the old indices buffer before making a new
-	 * one to replace it. */
-	
-	geom->indices_len = indexCount;
+		/* Gather every attribute of each vertex together, starting
+		 * with the position since vertices are hashed by the first
+		 * values. */
+		int position = kuhl_geometry_attrib_index(g, "in_Position");
+		GLfloat *attribData[MAX_ATTRIBUTES];
+		GLuint components[MAX_ATTRIBUTES];
+		GLuint stride = 0;
+		for(unsigned int i=0; i<g->attrib_count; i++)
+		{
+			attribData[i] = kuhl_geometry_attrib_read(g, i, &components[i]);
+			stride += components[i];
+		}
+		GLfloat *vertices = (GLfloat*) kuhl_malloc(sizeof(GLfloat)*stride*g->vertex_count);
+		for(GLuint v=0; v<g->vertex_count; v++)
+		{
+			GLfloat *dest = vertices + (size_t)v*stride;
+			if(position >= 0)
+			{
+				memcpy(dest, attribData[position] + (size_t)v*components[position], sizeof(GLfloat)*components[position]);
+				dest += components[position];
+			}
+			for(unsigned int i=0; i<g->attrib_count; i++)
+			{
+				if((int) i == position)
+					continue;
+				memcpy(dest, attribData[i] + (size_t)v*components[i], sizeof(GLfloat)*components[i]);
+				dest += components[i];
+			}
+		}
+		for(unsigned int i=0; i<g->attrib_count; i++)
+			free(attribData[i]);
+
+		GLuint *remap = (GLuint*) kuhl_malloc(sizeof(GLuint)*g->vertex_count);
+		GLuint count = kuhl_mesh_weld(remap, vertices, g->vertex_count, stride, epsilon);
+		free(vertices);
+
+		/* Apply the new numbering to the existing indices (every
+		 * level of detail) or create indices. */
+		GLuint total = g->vertex_count;
+		GLuint *indices = NULL;
+		if(g->indices_len > 0 && g->indices_bufferobject != 0)
+		{
+			total = g->indices_len;
+			if(g->lod != NULL)
+				total = g->lod->levels[g->lod->count-1].first + g->lod->levels[g->lod->count-1].count;
+			if(count == g->vertex_count)
+			{
+				free(remap);
+				continue;
+			}
+			indices = kuhl_geometry_indices_read_range(g, 0, total);
+			for(GLuint i=0; i<total; i++)
+				indices[i] = remap[indices[i]];
+		}
+		else
+		{
+			indices = (GLuint*) kuhl_malloc(sizeof(GLuint)*total);
+			for(GLuint i=0; i<total; i++)
+				indices[i] = remap[i];
+		}
 
-	/* Verify that the indices the user passed in are
-	 * appropriate. If there are only 10 vertices, then a user
-	 * can't draw a vertex at index 10, 11, 13, etc. */
-	for(GLuint i=0; i<geom->indices_len; i++)
-	{
-		if(indices[i] >= geom->vertex_count)
-			msg(MSG_ERROR, "kuhl_geometry has %d vertices but indices[%d] is asking for vertex at index %d to be drawn.\n",
-			    geom->vertex_count, i, indices[i]);
-	}
+		/* Keep the first vertex of each group. */
+		GLuint *keep = (GLuint*) kuhl_malloc(sizeof(GLuint)*count);
+		GLuint kept = 0;
+		for(GLuint v=0; v<g->vertex_count; v++)
+		{
+			if(remap[v] == kept)
+				keep[kept++] = v;
+		}
 
-	/* Enable VAO */
-	glBindVertexArray(geom->vao);
-		
-	/* Set up a buffer object (BO) which is a place to store the
-	 * *indices* on the graphics card. */
-	glGenBuffers(1, &(geom->indices_bufferobject));
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geom->indices_bufferobject);
-	kuhl_errorcheck();
+		verticesBefore += g->vertex_count;
+		verticesAfter += count;
+		kuhl_geometry_attrib_compact(g, keep, count);
+		kuhl_geometry_indices_replace(g, indices, total);
 
-	/* Copy the indices data into the currently bound buffer. */
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)*geom->indices_len,
-	             indices, GL_STATIC_DRAW);
-	kuhl_errorcheck();
-	// Don't unbind GL_ELEMENT_ARRAY_BUFFER since the VAO keeps track of this for us.
+		free(keep);
+		free(indices);
+		free(remap);
+	}
 
-	// unbind vao
-	glBindVertexArray(0);
+	if(verticesBefore > 0)
+		msg(MSG_INFO, "Welded %lu vertices into %lu vertices", verticesBefore, verticesAfter);
 }
 
-/** Draws a kuhl_geometry object. Typically, instances == 1. If
- * instances > 1, the object will be drawn multiple times with
- * different 'gl_InstanceID' variables in the GLSL program.
+/** Smallest number of triangles that a mesh must have before
+ * kuhl_geometry_meshlets() splits it into meshlets. Culling smaller
+ * meshes saves less than it costs. */
+#define KUHL_MESHLET_MIN_TRIANGLES 2048
+
+/** Splits large triangle meshes into meshlets: groups of about
+ * KUHL_MESHLET_MAX_TRIANGLES neighboring triangles that each have a
+ * bounding sphere and a cone containing their normals (see
+ * kuhl_mesh_build_meshlets()). The triangles of the most detailed
+ * level of detail are reordered so that each meshlet is a contiguous
+ * range of the index buffer. After kuhl_geometry_meshlets_cull() is
+ * called, the next draw of the geometry only draws the ranges
+ * containing meshlets that may be visible.
  *
- * @param geom The geometry to draw to the screen. If the kuhl_geometry
- * object is a part of a linked list, this function will draw each of
- * the objects in order.
+ * This is most useful for meshes with a very large number of
+ * triangles in a single mesh (such as scanned objects), where culling
+ * whole meshes doesn't help. Meshes with fewer than
+ * KUHL_MESHLET_MIN_TRIANGLES triangles, meshes with bones or with
+ * positions of unknown bounds (such as KG_DYNAMIC positions) are not
+ * changed. Changing the indices of the geometry afterwards (including
+ * kuhl_geometry_optimize() and kuhl_geometry_lod_generate()) removes
+ * the meshlets, so call this function last.
+ *
+ * @param geom The geometry to split.
  *
- * @param Number of instanced objects to draw. To draw an object once
- * normally (i.e., non-instanced), set it to 1.
+ * @param kg_options KG_FULL_LIST to split every geometry in the list.
  */
-void kuhl_geometry_draw_instanced(kuhl_geometry *geom, GLsizei instances)
+void kuhl_geometry_meshlets(kuhl_geometry *geom, int kg_options)
 {
-	if(geom == NULL)
-		return;
-	if(geom->vertex_count == 0)
-	{
-		msg(MSG_WARNING, "You tried to draw geometry which contained 0 vertices.");
-		return;
-	}
-	if(geom->attrib_count == 0)
-	{
-		msg(MSG_WARNING, "You tried to draw geometry which had no attributes. It needs at least one attribute (i.e., vertex position)");
-		return;
-	}
-	if(instances < 1)
+	unsigned long meshletCount = 0, meshCount = 0;
+	for(kuhl_geometry *g = geom; g != NULL; g = (kg_options & KG_FULL_LIST) ? g->next : NULL)
 	{
-		msg(MSG_WARNING, "You tried to draw less than 1 instance of an object.");
-		return;
-	}
+		if(g->primitive_type != GL_TRIANGLES || g->multidraw != NULL || g->bones != NULL ||
+		   !g->aabbox_valid || g->indices_len/3 < KUHL_MESHLET_MIN_TRIANGLES ||
+		   !kuhl_geometry_unshare(g))
+			continue;
 
-	kuhl_errorcheck();
-	
-	/* Record the OpenGL state so that we can restore it when we have
-	 * finished drawing. */
-	GLint previouslyUsedProgram = 0;
-	glGetIntegerv(GL_CURRENT_PROGRAM, &previouslyUsedProgram);
-	GLint previouslyBoundTexture = 0;
-	glGetIntegerv(GL_TEXTURE_BINDING_2D, &previouslyBoundTexture);
-	GLint previouslyActiveTexture = 0;
-	glGetIntegerv(GL_ACTIVE_TEXTURE, &previouslyActiveTexture);
-	GLint previousVAO=0;
-	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVAO);
-
-	/* Check that there is a valid program and VAO object for us to use. */
-	if(glIsProgram(geom->program) == 0)
-	{
-		msg(MSG_ERROR, "Program (%d) is invalid. Have you initialized this kuhl_geometry object?\n", geom->program);
-		kuhl_errorcheck();
-		return;
-	}
-	else if (glIsVertexArray(geom->vao) == 0)
-	{
-		msg(MSG_ERROR, "Vertex array object (%d) is invalid.\n", geom->vao);
-		kuhl_errorcheck();
-		return;
-	}
-	glUseProgram(geom->program);
-	kuhl_errorcheck();
+		/* Levels of detail after the first one are kept as they
+		 * are. */
+		GLuint total = g->indices_len;
+		if(g->lod != NULL)
+			total = g->lod->levels[g->lod->count-1].first + g->lod->levels[g->lod->count-1].count;
+		kuhl_lod sphere;
+		GLuint components = 0;
+		GLfloat *positions = kuhl_geometry_lod_positions(g, &components, &sphere);
+		if(positions == NULL)
+			continue;
+		GLuint *indices = kuhl_geometry_indices_read_range(g, 0, total);
+		GLuint *reordered = (GLuint*) kuhl_malloc(sizeof(GLuint)*total);
+		memcpy(reordered, indices, sizeof(GLuint)*total);
+
+		unsigned int count = 0;
+		kuhl_meshlet *meshlets = kuhl_mesh_build_meshlets(reordered, indices, g->indices_len,
+		                                                  positions, g->vertex_count, components,
+		                                                  KUHL_MESHLET_MAX_VERTICES, KUHL_MESHLET_MAX_TRIANGLES,
+		                                                  &count);
+		kuhl_geometry_indices_replace(g, reordered, total);
+		g->meshlets = kuhl_meshlets_new(meshlets, count);
+		meshletCount += count;
+		meshCount++;
+
+		free(positions);
+		free(indices);
+		free(reordered);
+	}
+
+	if(meshCount > 0)
+		msg(MSG_DEBUG, "Split %lu meshes into %lu meshlets", meshCount, meshletCount);
+}
 
-	/* Bind all of the textures used in this geometry to texture
-	 * units. */
-	int hasTex = 0;
-	for(unsigned int i=0; i<geom->texture_count; i++)
+/** Decides which meshlets of a geometry may be visible (see
+ * kuhl_geometry_meshlets()). Meshlets whose bounding sphere is outside
+ * of the view frustum are culled. If cullBackFaces is set, meshlets
+ * whose triangles all face away from the camera are culled too. Only
+ * the next kuhl_geometry_draw() of the geometry draws just the
+ * visible meshlets; later draws draw every meshlet until this
+ * function is called again. Like kuhl_geometry_lod_select(), call
+ * this function before drawing the geometry in each viewport.
+ *
+ * @param geom The geometry to cull.
+ *
+ * @param modelview The modelview matrix that the geometry will be
+ * drawn with (not including geom->matrix).
+ *
+ * @param projection The projection matrix that the geometry will be
+ * drawn with.
+ *
+ * @param cullBackFaces Set to 1 if the geometry is drawn with
+ * GL_CULL_FACE enabled, glCullFace(GL_BACK) and glFrontFace(GL_CCW),
+ * 0 otherwise. (Asking OpenGL for this state could make the CPU wait
+ * for the GPU.)
+ *
+ * @param kg_options KG_FULL_LIST to cull every geometry in the list.
+ *
+ * @return The number of meshlets that will be drawn.
+ */
+int kuhl_geometry_meshlets_cull(kuhl_geometry *geom, const float modelview[16], const float projection[16],
+                                int cullBackFaces, int kg_options)
+{
+	int perspective = projection[15] == 0;
+
+	int drawn = 0;
+	for(kuhl_geometry *g = geom; g != NULL; g = (kg_options & KG_FULL_LIST) ? g->next : NULL)
 	{
-		kuhl_texture *tex = &(geom->textures[i]);
-		if(!glIsTexture(tex->textureId))
+		kuhl_meshlets *m = g->meshlets;
+		if(m == NULL)
 			continue;
 
-		/* Check if the sampler variable is available in the GLSL
-		 * program. If not, don't send the texture. */
-		GLint loc = glGetUniformLocation(geom->program, tex->name);
-		if(loc == -1)
-			continue;
+		/* Find the frustum and the camera in the coordinates of the
+		 * vertex positions. */
+		float mat[16], clip[16], planes[6][4], inverse[16];
+		mat4f_mult_mat4f_new(mat, modelview, g->matrix);
+		mat4f_mult_mat4f_new(clip, projection, mat);
+		kuhl_frustum_planes(planes, clip);
+		float planeLength[6];
+		for(int p=0; p<6; p++)
+			planeLength[p] = vec3f_norm(planes[p]);
+
+		/* A matrix that mirrors the geometry changes which faces are
+		 * back faces. */
+		float cols[3][3], cross[3];
+		for(int c=0; c<3; c++)
+			vec3f_set(cols[c], mat[c*4], mat[c*4+1], mat[c*4+2]);
+		vec3f_cross_new(cross, cols[0], cols[1]);
+		int coneCull = cullBackFaces &&
+			perspective && vec3f_dot(cross, cols[2]) > 0 && mat4f_invert_new(inverse, mat);
+		float camera[3] = { inverse[12], inverse[13], inverse[14] };
+
+		GLsizeiptr indexSize = g->indices_type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+		m->draw_ranges = 0;
+		GLuint rangeEnd = 0;
+		for(unsigned int i=0; i<m->count; i++)
+		{
+			const kuhl_meshlet *ml = &(m->meshlets[i]);
+			int visible = 1;
+			for(int p=0; p<6 && visible; p++)
+			{
+				if(vec3f_dot(planes[p], ml->center) + planes[p][3] < -ml->radius * planeLength[p])
+					visible = 0;
+			}
+			if(visible && coneCull && kuhl_mesh_meshlet_backfacing(ml, camera))
+				visible = 0;
+			if(!visible)
+				continue;
+			drawn++;
 
-		if(strcmp(tex->name, "tex") == 0)
-			hasTex = 1;
-		
-		/* Tell OpenGL that the texture that we refer to in our
-		 * GLSL program is going to be in texture unit number 'i'.
-		 */
-		glUniform1i(loc, i);
-		kuhl_errorcheck();
-		/* Turn on appropriate texture unit */
-		glActiveTexture(GL_TEXTURE0+i);
-		kuhl_errorcheck();
-		/* Bind the texture that we want to use while the correct
-		 * texture unit is enabled. */
-		glBindTexture(GL_TEXTURE_2D, tex->textureId);
-		kuhl_errorcheck();
+			/* Extend the previous range if this meshlet follows
+			 * it. */
+			if(m->draw_ranges > 0 && rangeEnd == ml->first)
+				m->draw_counts[m->draw_ranges-1] += ml->count;
+			else
+			{
+				m->draw_counts[m->draw_ranges] = ml->count;
+				m->draw_offsets[m->draw_ranges] = (const GLvoid*) (ml->first * indexSize);
+				m->draw_ranges++;
+			}
+			rangeEnd = ml->first + ml->count;
+		}
+		m->culled = 1;
 	}
+	return drawn;
+}
 
-	/* Set the HasTex variable if it exists in the GLSL program. */
-	GLint loc;
-	loc = glGetUniformLocation(geom->program, "HasTex");
-	if(loc != -1)
-	    glUniform1i(loc, hasTex);
+/** Used by kuhl_drawlist_draw() to sort the items in a
+ * kuhl_drawlist. Items are sorted by program, then by the textures
+ * that they use, then by vertex array object. Items that are
+ * otherwise equal remain in the order they were added. */
+static int kuhl_drawlist_compare(const void *a, const void *b)
+{
+	const kuhl_drawlist_item *ia = (const kuhl_drawlist_item*) a;
+	const kuhl_drawlist_item *ib = (const kuhl_drawlist_item*) b;
+	const kuhl_geometry *ga = ia->geom;
+	const kuhl_geometry *gb = ib->geom;
 
-	/* Try to set uniform variables if they are active in the current
-	 * GLSL program. If they are not active, don't print any warning
-	 * messages. */
-	int numBones = 0;
-	if(geom->bones)
+	if(ga->program != gb->program)
+		return ga->program < gb->program ? -1 : 1;
+
+	if(ga->texture_count != gb->texture_count)
+		return ga->texture_count < gb->texture_count ? -1 : 1;
+	for(unsigned int i=0; i<ga->texture_count; i++)
 	{
-		loc = glGetUniformLocation(geom->program, "BoneMat");
-		if(loc != -1)
-		{
-			glUniformMatrix4fv(loc, MAX_BONES, 0, geom->bones->matrices[0]);
-			numBones = geom->bones->count;
-		}
+		GLuint ta = ga->textures[i].textureId;
+		GLuint tb = gb->textures[i].textureId;
+		if(ta != tb)
+			return ta < tb ? -1 : 1;
 	}
-	loc = glGetUniformLocation(geom->program, "NumBones");
-	if(loc != -1)
-	    glUniform1i(loc, numBones);
 
-	loc = glGetUniformLocation(geom->program, "GeomTransform");
-	if(loc != -1)
-		glUniformMatrix4fv(loc, 1, 0, geom->matrix);
-	else if(geom->has_been_drawn == 0)
-	{ /* If the geom->matrix was not the identity and if it is not in
-	   * the GLSL shader program, print a helpful warning message. */
-		float identity[16];
-		mat4f_identity(identity);
-		float sum = 0;
-		for(int i=0; i<16; i++)
-			sum += fabsf(identity[i] - (geom->matrix)[i]);
-		if(sum > 0.00001)
-		{
-			printf("\n\n");
-			printf("ERROR: You must include a 'uniform mat4 GeomTransform' variable in your GLSL shader (program %d) when you load/display a model with kuhl-util. This matrix should be applied to the vertices in your model before you multiply by your modelview matrix in the vertex program. For example:\n\ngl_Position = Projection * ModelView * GeomTransform * in_Position\n\n", geom->program);
-			printf("This matrix is required to correctly translate/rotate/scale your geometry and is also used by some models to implement animation. This matrix is stored inside of a variable called 'matrix' in kuhl_geometry and is set to the identity matrix by default. This message only gets printed if you are using something that actually sets the matrix to something other than the identity. Earlier versions of this software simply transformed the vertices as the file was being loaded instead of doing it in the vertex program.\n");
-			printf("\n");
-			printf("We would set the GeomTransform to:\n");
-			mat4f_print(geom->matrix);
-			printf("This program will resume running in 2 seconds...\n");
-			sleep(2);
-			printf("...continuing despite the missing variable.\n");
-		}
-	}
+	if(ga->vao != gb->vao)
+		return ga->vao < gb->vao ? -1 : 1;
 
-	/* Use the vertex array object for this geometry */
-	glBindVertexArray(geom->vao);
-	kuhl_errorcheck();
+	if(ia->order != ib->order)
+		return ia->order < ib->order ? -1 : 1;
+	return 0;
+}
 
-	/* kuhl_geometry_attrib_get() allows vertex attribute buffers to
-	 * be mapped. Here, we check if the buffers are mapped. If they
-	 * are, we unmap them before we draw the geometry. */
-	for(unsigned int i=0; i<geom->attrib_count; i++)
-	{
-		glBindBuffer(GL_ARRAY_BUFFER, geom->attribs[i].bufferobject);
-		GLint bufferIsMapped = 0;
-		glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_MAPPED, &bufferIsMapped);
-		kuhl_errorcheck();
-		if(bufferIsMapped)
-			glUnmapBuffer(GL_ARRAY_BUFFER);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		kuhl_errorcheck();
-	}
+/** Creates a new, empty kuhl_drawlist.
+ *
+ * @return A new kuhl_drawlist which should eventually be freed with
+ * kuhl_drawlist_delete().
+ */
+kuhl_drawlist* kuhl_drawlist_new(void)
+{
+	kuhl_drawlist *dl = (kuhl_drawlist*) kuhl_malloc(sizeof(kuhl_drawlist));
+	dl->items = list_new(64, sizeof(kuhl_drawlist_item), kuhl_drawlist_compare);
+	dl->sorted = 1;
+	return dl;
+}
 
-	/* If the user provided us with indices, use glDrawElements() to
-	 * draw the geometry. */
-	if(geom->indices_len > 0 && glIsBuffer(geom->indices_bufferobject))
+/** Adds geometry to a kuhl_drawlist. The geometry is not drawn until
+ * kuhl_drawlist_draw() is called.
+ *
+ * @param dl The list to add the geometry to.
+ *
+ * @param geom The geometry to add. The current value of geom->matrix
+ * is recorded and used as GeomTransform when the geometry is drawn.
+ *
+ * @param modelview If not NULL, a matrix to send to the ModelView
+ * uniform variable before drawing this geometry. If NULL, whatever
+ * the program's ModelView is set to when the list is drawn is used.
+ *
+ * @param kg_options Set to KG_FULL_LIST to add every kuhl_geometry in
+ * the geom->next list. Otherwise, set to KG_NONE.
+ */
+void kuhl_drawlist_add(kuhl_drawlist *dl, kuhl_geometry *geom, const float modelview[16], int kg_options)
+{
+	if(dl == NULL)
+		return;
+
+	const kuhl_registry_list *list = (kg_options & KG_FULL_LIST) ? kuhl_registry_list_get(geom) : NULL;
+	unsigned int i = 0;
+	for(kuhl_geometry *g = geom; g != NULL; g = kuhl_registry_list_next(list, &i, g))
 	{
-		if(instances == 1)
-			glDrawElements(geom->primitive_type,
-			               geom->indices_len,
-			               GL_UNSIGNED_INT,
-			               NULL);
-		else
-			glDrawElementsInstanced(
-				           geom->primitive_type,
-			               geom->indices_len,
-			               GL_UNSIGNED_INT,
-			               NULL, instances);
+		kuhl_drawlist_item item;
+		item.geom = g;
+		mat4f_copy(item.geomTransform, g->matrix);
+		if(modelview != NULL)
+			mat4f_copy(item.modelview, modelview);
+		item.hasModelview = (modelview != NULL);
+		item.order = (unsigned int) list_length(dl->items);
+		list_append(dl->items, &item);
 
-		kuhl_errorcheck();
+		if(!(kg_options & KG_FULL_LIST))
+			break;
 	}
-	else
+	dl->sorted = 0;
+}
+
+/** Draws all of the geometry in a kuhl_drawlist. The geometry is
+ * sorted first so that geometry using the same program, textures and
+ * vertex array object are drawn one after another without any
+ * redundant OpenGL state changes. The list is not cleared and can be
+ * drawn again (for example, for another eye).
+ *
+ * @param dl The list of geometry to draw.
+ *
+ * @param instances Number of instances of each piece of geometry to
+ * draw. For example, 2 when both eyes are drawn at once (see
+ * viewmat_begin_stereo()).
+ */
+void kuhl_drawlist_draw_instanced(kuhl_drawlist *dl, GLsizei instances)
+{
+	if(dl == NULL || list_length(dl->items) == 0)
+		return;
+	if(instances < 1)
 	{
-		/* If the user didn't provide us with indices, just draw the
-		 * vertices in order. */
-		if(instances == 1)
-			glDrawArrays(geom->primitive_type, 0, geom->vertex_count);
-		else
-			glDrawArraysInstanced(geom->primitive_type, 0, geom->vertex_count, instances);
-		kuhl_errorcheck();
+		msg(MSG_WARNING, "You tried to draw less than 1 instance of an object.");
+		return;
 	}
 
-
-	/* For each texture unit that we bound a texture to, unbind the
-	 * texture since we have finished drawing the geometry */
-	for(unsigned int i=0; i<geom->texture_count; i++)
+	if(!dl->sorted)
 	{
-		kuhl_errorcheck();
-		/* Turn on appropriate texture unit */
-		glActiveTexture(GL_TEXTURE0+i);
-		kuhl_errorcheck();
-		/* Unbind the texture */
-		glBindTexture(GL_TEXTURE_2D, 0);
-		kuhl_errorcheck();
+		list_sort(dl->items);
+		dl->sorted = 1;
 	}
 
-	/* Indicate in the struct that we have successfully drawn this
-	 * geom once. */
-	geom->has_been_drawn = 1;
+	kuhl_errorcheck();
+	kuhl_gl_saved_state saved;
+	kuhl_gl_state_save(&saved);
 
-	/* Restore previously active texture */
-	glActiveTexture(previouslyActiveTexture);
-	
-	/* Restore previously bound texture */
-	glBindTexture(GL_TEXTURE_2D, previouslyBoundTexture);
+	int len = list_length(dl->items);
+	for(int i=0; i<len; i++)
+	{
+		kuhl_drawlist_item *item = (kuhl_drawlist_item*) list_getptr(dl->items, i);
+		kuhl_geometry_draw_node(item->geom, instances, item->geomTransform,
+		                        item->hasModelview ? item->modelview : NULL, NULL);
+	}
 
-	/* Restore the GLSL program that was used before this function was
-	 * called. */
-	glUseProgram(previouslyUsedProgram);
-	
-	/* Unbind the VAO */
-	glBindVertexArray(previousVAO);
+	kuhl_gl_state_load(&saved);
 	kuhl_errorcheck();
+}
 
-	/* Draw the next nodes in the list. */
-	kuhl_geometry_draw(geom->next);
+/** Draws all of the geometry in a kuhl_drawlist once. See
+ * kuhl_drawlist_draw_instanced().
+ *
+ * @param dl The list of geometry to draw.
+ */
+void kuhl_drawlist_draw(kuhl_drawlist *dl)
+{
+	kuhl_drawlist_draw_instanced(dl, 1);
 }
 
-/** Draws a kuhl_geometry struct to the screen. The struct passed into
- * this function should have been set up with kuhl_geometry_new() and
- * at least one position attribute with kuhl_geometry_attrib() before
- * calling this function.
+/** Removes all of the geometry from a kuhl_drawlist. The geometry
+ * itself is not deleted.
  *
- * @param geom The geometry to draw to the screen. If the kuhl_geometry
- * object is a part of a linked list, this function will draw each of
- * the objects in order. */
-void kuhl_geometry_draw(kuhl_geometry *geom)
+ * @param dl The list to clear.
+ */
+void kuhl_drawlist_clear(kuhl_drawlist *dl)
 {
-	kuhl_geometry_draw_instanced(geom, 1);
+	if(dl == NULL)
+		return;
+	list_set_length(dl->items, 0);
+	dl->sorted = 1;
+}
+
+/** Frees a kuhl_drawlist created with kuhl_drawlist_new(). The
+ * geometry in the list is not deleted.
+ *
+ * @param dl The list to free.
+ */
+void kuhl_drawlist_delete(kuhl_drawlist *dl)
+{
+	if(dl == NULL)
+		return;
+	list_free(dl->items);
+	free(dl);
 }
 
 /** Deletes kuhl_geometry struct by freeing the OpenGL buffers that
@@ -1765,10 +6372,15 @@ void kuhl_geometry_draw(kuhl_geometry *geom)
 */
 void kuhl_geometry_delete(kuhl_geometry *geom)
 {
+	/* Forget about buffers that other geometry still uses. */
+	kuhl_shared_buffers_release(geom);
+	kuhl_registry_remove(geom);
+
 	// Delete this geometry object
 	geom->vertex_count = 0;
 	geom->program = 0;
 	geom->texture_count = 0;
+	geom->locations.program = 0;
 	mat4f_identity(geom->matrix);
 	mat4f_identity(geom->fitMatrix);
 	
@@ -1778,22 +6390,81 @@ void kuhl_geometry_delete(kuhl_geometry *geom)
 		if(attrib->name)
 			free(attrib->name);
 		attrib->name = NULL;
-		if(glIsBuffer(attrib->bufferobject))
+		kuhl_attrib_ring_free(attrib->ring);
+		attrib->ring = NULL;
+		kuhl_attrib_shadow_free(attrib->shadow);
+		attrib->shadow = NULL;
+		if(attrib->stride == 0 && glIsBuffer(attrib->bufferobject))
 			glDeleteBuffers(1, &(attrib->bufferobject));
 		attrib->bufferobject = 0;
+		attrib->mapped = NULL;
 	}
 	geom->attrib_count = 0;
+	if(glIsBuffer(geom->interleaved_bufferobject))
+		glDeleteBuffers(1, &(geom->interleaved_bufferobject));
+	geom->interleaved_bufferobject = 0;
+
+	for(unsigned int i=0; i<geom->instance_attrib_count; i++)
+	{
+		kuhl_instance_attrib *attrib = &(geom->instance_attribs[i]);
+		free(attrib->name);
+		kuhl_attrib_ring_free(attrib->ring);
+		glDeleteBuffers(1, &(attrib->bufferobject));
+	}
+	geom->instance_attrib_count = 0;
 
 	if(glIsBuffer(geom->indices_bufferobject))
 		glDeleteBuffers(1, &(geom->indices_bufferobject));
 	geom->indices_bufferobject = 0;
 	geom->indices_len = 0;
+	geom->indices_type = GL_UNSIGNED_INT;
+	mat4f_identity(geom->decodeMatrix);
 	
 	if(glIsVertexArray(geom->vao))
+	{
+		kuhl_gl_vertex_array_deleted(geom->vao);
 		glDeleteVertexArrays(1, &(geom->vao));
+	}
 	geom->vao = 0;
+	kuhl_geometry_vaos_free(geom);
 	geom->has_been_drawn = 0;
 
+	if(geom->occlusion_query)
+		glDeleteQueries(1, &(geom->occlusion_query));
+	geom->occlusion_query = 0;
+	if(geom->occlusion_proxy)
+	{
+		kuhl_geometry_delete(geom->occlusion_proxy);
+		free(geom->occlusion_proxy);
+	}
+	geom->occlusion_proxy = NULL;
+	free(geom->lod);
+	geom->lod = NULL;
+	kuhl_meshlets_free(geom->meshlets);
+	geom->meshlets = NULL;
+	kuhl_batch_free(geom->batch);
+	geom->batch = NULL;
+
+	if(geom->multidraw)
+	{
+		kuhl_multidraw *md = geom->multidraw;
+		glDeleteBuffers(1, &(md->indirect_bufferobject));
+		glDeleteBuffers(1, &(md->draw_bufferobject));
+		glDeleteBuffers(1, &(md->drawid_bufferobject));
+		free(md->drawdata);
+		/* The parts have no OpenGL objects. */
+		kuhl_geometry *p = md->parts;
+		while(p != NULL)
+		{
+			kuhl_geometry *next = p->next;
+			kuhl_registry_remove(p);
+			free(p);
+			p = next;
+		}
+		free(md);
+		geom->multidraw = NULL;
+	}
+
 	// Delete any other geometry objects in the list too---but
 	// maintain the linked-list structure.
 	if(geom->next != NULL)
@@ -1896,6 +6567,7 @@ GLuint kuhl_read_texture_array(const unsigned char* array, int width, int height
 		// campus supports 16k.
 
 		glBindTexture(GL_TEXTURE_2D, 0);
+		kuhl_gl_texture_changed();
 		return 0;
 	}
 
@@ -1935,6 +6607,7 @@ GLuint kuhl_read_texture_array(const unsigned char* array, int width, int height
 	// Unbind the texture, make the caller bind it when they want to use it. More details:
 	// http://stackoverflow.com/questions/15273674
 	glBindTexture(GL_TEXTURE_2D, 0);
+	kuhl_gl_texture_changed();
 	return texName;
 }
 
@@ -2155,7 +6828,10 @@ kuhl_geometry* kuhl_label_geom(kuhl_geometry *geom, GLuint program, float *width
 	for(unsigned int i=0; i<geom->texture_count; i++)
 	{
 		if(strcmp(geom->textures[i].name, "tex"))
+		{
+			kuhl_gl_texture_deleted(geom->textures[i].textureId);
 			glDeleteTextures(1, &(geom->textures[i].textureId));
+		}
 	}
 
 	/* Create a new texture to use. */
@@ -2168,6 +6844,7 @@ kuhl_geometry* kuhl_label_geom(kuhl_geometry *geom, GLuint program, float *width
 	{
 		kuhl_geometry_texture(geom, labelTexture, "tex", 1);
 		mat4f_scale_new(geom->matrix, fpsLabelAspectRatio, 1, 1);
+		kuhl_registry_store(geom);
 		if(width != NULL)
 			*width = fpsLabelAspectRatio;
 		return geom;
@@ -3282,24 +7959,253 @@ kuhl_geometry* kuhl_geometry_append(kuhl_geometry *a, kuhl_geometry *b)
 	while(a->next != NULL)
 		a = a->next;
 	a->next = b;
+	kuhl_registry.list_version++;
 	return origA;
 }
 
 
 
+/** A mesh found while loading a model that is drawn with the same
+ * buffers as another mesh, see kuhl_private_shared_finish(). */
+typedef struct
+{
+	char *key; /**< Model filename, mesh number and options */
+	kuhl_geometry *geom; /**< Geometry created for the mesh */
+	kuhl_geometry *first; /**< Geometry that geom will share buffers with (NULL if geom is the first one) */
+} kuhl_shared_pending;
+
+/** Meshes in the model that is being loaded, see kuhl_shared_pending. */
+static list *kuhl_shared_pending_list = NULL;
+
+/** Finds a mesh that was loaded in an earlier call to
+ * kuhl_load_model_options() and whose buffers are still in use.
+ *
+ * @param key The model filename, mesh number and options.
+ *
+ * @return A template of the geometry to pass to
+ * kuhl_private_share_buffers() or NULL if there is none.
+ */
+static kuhl_geometry* kuhl_private_shared_find(const char *key)
+{
+	if(kuhl_shared_cache == NULL)
+		return NULL;
+	for(int i=0; i<list_length(kuhl_shared_cache); i++)
+	{
+		kuhl_shared_buffers *shared = *(kuhl_shared_buffers**) list_getptr(kuhl_shared_cache, i);
+		if(strcmp(shared->key, key) == 0)
+			return shared->source;
+	}
+	return NULL;
+}
+
+/** Remembers a mesh in the model that is being loaded.
+ *
+ * @param key The model filename, mesh number and options.
+ *
+ * @param geom The geometry created for the mesh.
+ *
+ * @return The first geometry with this key if one was already
+ * remembered (in which case geom should not be filled in), otherwise
+ * NULL.
+ */
+static kuhl_geometry* kuhl_private_shared_pending(const char *key, kuhl_geometry *geom)
+{
+	if(kuhl_shared_pending_list == NULL)
+		kuhl_shared_pending_list = list_new(16, sizeof(kuhl_shared_pending), NULL);
+
+	kuhl_shared_pending item = { strdup(key), geom, NULL };
+	for(int i=0; i<list_length(kuhl_shared_pending_list); i++)
+	{
+		kuhl_shared_pending *p = (kuhl_shared_pending*) list_getptr(kuhl_shared_pending_list, i);
+		if(p->first == NULL && strcmp(p->key, key) == 0)
+		{
+			item.first = p->geom;
+			break;
+		}
+	}
+	list_append(kuhl_shared_pending_list, &item);
+	return item.first;
+}
+
+/** Connects the meshes remembered by kuhl_private_shared_pending() to
+ * the buffers of the first copy of each mesh and keeps templates of
+ * the first copies so that later calls to kuhl_load_model_options()
+ * can reuse their buffers. Called after the model is optimized and
+ * its levels of detail are created.
+ */
+static void kuhl_private_shared_finish(void)
+{
+	if(kuhl_shared_pending_list == NULL)
+		return;
+	if(kuhl_shared_cache == NULL)
+		kuhl_shared_cache = list_new(16, sizeof(kuhl_shared_buffers*), NULL);
+
+	for(int i=0; i<list_length(kuhl_shared_pending_list); i++)
+	{
+		kuhl_shared_pending *p = (kuhl_shared_pending*) list_getptr(kuhl_shared_pending_list, i);
+		if(p->first != NULL)
+		{
+			kuhl_private_share_buffers(p->geom, p->first);
+			mat4f_mult_mat4f_new(p->geom->matrix, p->geom->matrix, p->geom->decodeMatrix);
+		}
+		else if(p->geom->vertex_count > 0 &&
+		        (p->geom->shared == NULL || p->geom->shared->key == NULL))
+		{
+			kuhl_shared_buffers *shared = kuhl_shared_buffers_record(p->geom);
+			kuhl_geometry *source = (kuhl_geometry*) kuhl_malloc(sizeof(kuhl_geometry));
+			*source = *(p->geom);
+			for(unsigned int a=0; a<source->attrib_count; a++)
+				source->attribs[a].name = strdup(p->geom->attribs[a].name);
+			if(p->geom->lod != NULL)
+			{
+				source->lod = (kuhl_lod*) kuhl_malloc(sizeof(kuhl_lod));
+				*(source->lod) = *(p->geom->lod);
+			}
+			source->meshlets = kuhl_meshlets_copy(p->geom->meshlets);
+			/* The template only describes the buffers. */
+			source->vao = 0;
+			source->program_vaos = NULL;
+			source->program_vao_count = 0;
+			source->texture_count = 0;
+			source->instance_attrib_count = 0;
+			source->bones = NULL;
+			source->occlusion_query = 0;
+			source->occlusion_proxy = NULL;
+			source->batch = NULL;
+			source->handle = 0;
+			source->next = NULL;
+			shared->key = strdup(p->key);
+			shared->source = source;
+			list_append(kuhl_shared_cache, &shared);
+		}
+		free(p->key);
+	}
+	list_free(kuhl_shared_pending_list);
+	kuhl_shared_pending_list = NULL;
+}
+
+/** Tells a geometry about the textures that a mesh uses. The textures
+ * must already be loaded by kuhl_private_assimp_load(). */
+static void kuhl_private_load_textures(kuhl_geometry *geom, const struct aiScene *sc,
+                                       const struct aiMesh *mesh, unsigned int meshIndex,
+                                       const char *modelFilename, const char *textureDirname)
+{
+	/* Go through all texture types that ASSIMP supports. */
+	for(int tt=0; tt<TEX_TYPE_LEN; tt++)
+	{
+		/* Find our texture and tell our kuhl_geometry object about
+		 * it. */
+		struct aiString texPath;	//contains filename of texture
+		int texIndex = 0;
+		if(AI_SUCCESS == aiGetMaterialTexture(sc->mMaterials[mesh->mMaterialIndex],
+		                                      texTypeList[tt], texIndex, &texPath,
+		                                      NULL, NULL, NULL, NULL, NULL, NULL))
+		{
+			GLuint texture = 0;
+			for(int i=0; i<textureIdMapSize; i++)
+			{
+				char *fullpath = kuhl_private_assimp_fullpath(texPath.data, modelFilename, textureDirname);
+				if(strcmp(textureIdMap[i].textureFileName, fullpath) == 0)
+					texture = textureIdMap[i].textureID;
+				free(fullpath);
+			}
+			if(texture == 0)
+			{
+				msg(MSG_WARNING, "Mesh %u uses %s texture '%s'."
+				    "This texture should have been loaded earlier, but we can't find it now.",
+				    meshIndex, texTypeListStr[tt], texPath.data);
+			}
+			else
+			{
+				/* If model uses texture and we found the texture file,
+				   Make sure we repeat instead of clamp textures */
+				glBindTexture(GL_TEXTURE_2D, texture);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+				kuhl_gl_texture_changed();
+				kuhl_errorcheck();
+
+				if(texTypeList[tt] == aiTextureType_DIFFUSE)
+					// use "tex" variable name for diffuse textures.
+					kuhl_geometry_texture(geom, texture, "tex", 0);
+				else
+				{
+					// use variable names like tex_SPECULAR, tex_NORMALS, etc.
+					char glsl_var_name[100]="";
+					snprintf(glsl_var_name, 100, "tex_%s", texTypeListStr[tt]);
+					kuhl_geometry_texture(geom, texture, glsl_var_name, 0);
+				}
+			}
+		} // end if assimp provides this texture 
+	} // end loop through all of assimp supported texture types.
+}
+
+/** Source of kuhl_bonemat.generation values. Every change to any
+ * bone palette gets a new value so that a palette that was freed and
+ * replaced by a new one at the same address isn't mistaken for
+ * it. */
+static unsigned int kuhl_bonemat_generation = 0;
+
+/** Initializes the list of bone matrices of a geometry if its mesh
+ * has bones.
+ *
+ * @param geom The geometry created for the mesh.
+ *
+ * @param mesh The mesh.
+ *
+ * @param n The index of the mesh in its aiNode.
+ */
+static void kuhl_private_load_bones(kuhl_geometry *geom, const struct aiMesh *mesh, unsigned int n)
+{
+	if(mesh->mNumBones == 0)
+		return;
+	kuhl_bonemat *bones = (kuhl_bonemat*) kuhl_malloc(sizeof(kuhl_bonemat));
+	bones->count = mesh->mNumBones;
+	bones->mesh = n;
+	for(unsigned int b=0; b < mesh->mNumBones; b++)
+		bones->boneList[b] = mesh->mBones[b];
+	// set any unused bone matrices to the identity.
+	for(unsigned int b=mesh->mNumBones; b < MAX_BONES; b++)
+		mat4f_identity(bones->matrices[b]);
+	bones->generation = ++kuhl_bonemat_generation;
+	geom->bones = bones;
+}
+
+/** Checks if every geometry in a model uses buffers that were created
+ * by an earlier call to kuhl_load_model_options().
+ *
+ * @param geom The geometry returned by kuhl_private_load_model().
+ *
+ * @return 1 if the whole model is shared (and there is nothing to
+ * optimize or simplify), 0 otherwise.
+ */
+static int kuhl_private_shared_model(const kuhl_geometry *geom)
+{
+	for(const kuhl_geometry *g = geom; g != NULL; g = g->next)
+		if(g->shared == NULL)
+			return 0;
+	return geom != NULL;
+}
+
 /** Recursively calls itself to create one or more kuhl_geometry
  * structs for all of the nodes in the scene.
  *
  * @param sc The scene that we want to render.
  *
  * @param nd The current node that we are rendering.
+ *
+ * @param kl_options If KL_INTERLEAVE is set, the vertex attributes of
+ * each mesh are interleaved into one buffer. If KL_COMPACT is set,
+ * smaller types are used for positions, normals and texture
+ * coordinates.
  */
 static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
                                               const struct aiNode* nd,
                                               GLuint program,
                                               float currentTransform[16],
                                               const char* modelFilename,
-                                              const char* textureDirname)
+                                              const char* textureDirname,
+                                              int kl_options)
 {
 	/* Each node in the scene has a transform matrix that should
 	 * affect all of the nodes under it. The currentTransform matrix
@@ -3392,8 +8298,34 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 
 		geom->assimp_node = (struct aiNode*) nd;
 		geom->assimp_scene = (struct aiScene*) sc;
+		geom->material_index = mesh->mMaterialIndex;
 		mat4f_copy(geom->matrix, currentTransform);
 
+		/* Meshes that were already loaded (earlier in this model or
+		 * by an earlier call to kuhl_load_model_options()) are drawn
+		 * with the buffers of the earlier copy instead of storing
+		 * them on the GPU again. Packed meshes are not shared. */
+		char key[1100] = "";
+		if(!(kl_options & KL_MULTIDRAW))
+			snprintf(key, sizeof(key), "%s|%u|%d", modelFilename, nd->mMeshes[n],
+			         kl_options & (KL_COMPACT|KL_INTERLEAVE|KL_OPTIMIZE|KL_LOD|KL_MESHLETS));
+		kuhl_geometry *source = key[0] ? kuhl_private_shared_find(key) : NULL;
+		if(source != NULL || (key[0] && kuhl_private_shared_pending(key, geom) != NULL))
+		{
+			/* Meshes repeated within this model are connected to
+			 * their buffers in kuhl_private_shared_finish(). */
+			if(source != NULL)
+			{
+				kuhl_private_share_buffers(geom, source);
+				mat4f_mult_mat4f_new(geom->matrix, geom->matrix, geom->decodeMatrix);
+			}
+			kuhl_private_load_textures(geom, sc, mesh, nd->mMeshes[n], modelFilename, textureDirname);
+			kuhl_private_load_bones(geom, mesh, n);
+			msg(MSG_DEBUG, "Mesh #%03u in node \"%s\" (node has %d meshes): shares buffers with an earlier copy of the mesh",
+			    nd->mMeshes[n], nd->mName.data, nd->mNumMeshes);
+			continue;
+		}
+
 		/* Store the vertex position attribute into the kuhl_geometry struct */
 		float *vertexPositions = kuhl_malloc(sizeof(float)*mesh->mNumVertices*3);
 		for(unsigned int i=0; i<mesh->mNumVertices; i++)
@@ -3402,9 +8334,52 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 			vertexPositions[i*3+1] = (mesh->mVertices)[i].y;
 			vertexPositions[i*3+2] = (mesh->mVertices)[i].z;
 		}
-		kuhl_geometry_attrib(geom, vertexPositions, 3, "in_Position", 0);
+		/* With KL_COMPACT, store positions as 16-bit integers between
+		 * -1 and 1 and put the scale and offset into GeomTransform
+		 * instead. Meshes with bones are skinned before GeomTransform
+		 * is applied, and packed meshes share one set of buffers, so
+		 * those keep floats. */
+		int positionOptions = KG_NONE;
+		if((kl_options & KL_COMPACT) && mesh->mNumBones == 0 &&
+		   !(kl_options & KL_MULTIDRAW) && mesh->mNumVertices > 0)
+		{
+			float min[3], max[3];
+			vec3f_copy(min, vertexPositions);
+			vec3f_copy(max, vertexPositions);
+			for(unsigned int i=1; i<mesh->mNumVertices; i++)
+			{
+				for(int j=0; j<3; j++)
+				{
+					min[j] = fminf(min[j], vertexPositions[i*3+j]);
+					max[j] = fmaxf(max[j], vertexPositions[i*3+j]);
+				}
+			}
+			/* Use the same scale on every axis so that normals
+			 * are not affected. */
+			float ctr[3], halfSize = 0;
+			for(int j=0; j<3; j++)
+			{
+				ctr[j] = (min[j]+max[j])/2;
+				halfSize = fmaxf(halfSize, (max[j]-min[j])/2);
+			}
+			if(halfSize == 0)
+				halfSize = 1;
+			for(unsigned int i=0; i<mesh->mNumVertices*3; i++)
+				vertexPositions[i] = (vertexPositions[i] - ctr[i%3]) / halfSize;
+
+			float scaleMat[16];
+			mat4f_translate_new(geom->decodeMatrix, ctr[0], ctr[1], ctr[2]);
+			mat4f_scale_new(scaleMat, halfSize, halfSize, halfSize);
+			mat4f_mult_mat4f_new(geom->decodeMatrix, geom->decodeMatrix, scaleMat);
+			mat4f_mult_mat4f_new(geom->matrix, geom->matrix, geom->decodeMatrix);
+			positionOptions = KG_NORM16;
+		}
+		kuhl_geometry_attrib(geom, vertexPositions, 3, "in_Position", positionOptions);
 		free(vertexPositions);
 
+		/* Normals, tangents and bitangents are unit vectors. */
+		int directionOptions = (kl_options & KL_COMPACT) ? KG_PACKED : KG_NONE;
+
 		/* Store the normal vectors in the kuhl_geometry struct */
 		if(mesh->mNormals != NULL)
 		{
@@ -3415,7 +8390,7 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 				normals[i*3+1] = (mesh->mNormals)[i].y;
 				normals[i*3+2] = (mesh->mNormals)[i].z;
 			}
-			kuhl_geometry_attrib(geom, normals, 3, "in_Normal", 0);
+			kuhl_geometry_attrib(geom, normals, 3, "in_Normal", directionOptions);
 			free(normals);
 		}
 		if(mesh->mTangents)
@@ -3427,7 +8402,7 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 				tangents[i*3+1] = (mesh->mTangents)[i].y;
 				tangents[i*3+2] = (mesh->mTangents)[i].z;
 			}
-			kuhl_geometry_attrib(geom, tangents, 3, "in_Tangent", 0);
+			kuhl_geometry_attrib(geom, tangents, 3, "in_Tangent", directionOptions);
 			free(tangents);
 		}
 		if(mesh->mBitangents)
@@ -3439,7 +8414,7 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 				bitangents[i*3+1] = (mesh->mBitangents)[i].y;
 				bitangents[i*3+2] = (mesh->mBitangents)[i].z;
 			}
-			kuhl_geometry_attrib(geom, bitangents, 3, "in_Bitangent", 0);
+			kuhl_geometry_attrib(geom, bitangents, 3, "in_Bitangent", directionOptions);
 			free(bitangents);
 		}
 
@@ -3495,12 +8470,18 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 		if(mesh->mTextureCoords[0] != NULL)
 		{
 			float *texCoord = kuhl_malloc(sizeof(float)*mesh->mNumVertices*2);
+			/* 16-bit floats are only precise enough for texture
+			 * coordinates that don't repeat the texture many
+			 * times. */
+			int texCoordOptions = (kl_options & KL_COMPACT) ? KG_HALF : KG_NONE;
 			for(unsigned int i=0; i<mesh->mNumVertices; i++)
 			{
 				texCoord[i*2+0] = mesh->mTextureCoords[0][i].x;
 				texCoord[i*2+1] = mesh->mTextureCoords[0][i].y;
+				if(fabsf(texCoord[i*2+0]) > 2 || fabsf(texCoord[i*2+1]) > 2)
+					texCoordOptions = KG_NONE;
 			}
-			kuhl_geometry_attrib(geom, texCoord, 2, "in_TexCoord", 0);
+			kuhl_geometry_attrib(geom, texCoord, 2, "in_TexCoord", texCoordOptions);
 			free(texCoord);
 		}
 
@@ -3555,64 +8536,18 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 			{
 				if(weights[i*4+0] == 0)
 				{
-					msg(MSG_FATAL, "Every vertex should have at least one weight but vertex %ud has no weights!", i);
-					exit(EXIT_FAILURE);
-				}
-			}
-			kuhl_geometry_attrib(geom, indices, 4, "in_BoneIndex", 0);
-			kuhl_geometry_attrib(geom, weights, 4, "in_BoneWeight", 0);
-			free(indices);
-			free(weights);
-		} // end if there are bones 
-
-
-		/* Go through all texture types that ASSIMP supports. */
-		for(int tt=0; tt<TEX_TYPE_LEN; tt++)
-		{
-			/* Find our texture and tell our kuhl_geometry object about
-			 * it. */
-			struct aiString texPath;	//contains filename of texture
-			int texIndex = 0;
-			if(AI_SUCCESS == aiGetMaterialTexture(sc->mMaterials[mesh->mMaterialIndex],
-			                                      texTypeList[tt], texIndex, &texPath,
-			                                      NULL, NULL, NULL, NULL, NULL, NULL))
-			{
-				GLuint texture = 0;
-				for(int i=0; i<textureIdMapSize; i++)
-				{
-					char *fullpath = kuhl_private_assimp_fullpath(texPath.data, modelFilename, textureDirname);
-					if(strcmp(textureIdMap[i].textureFileName, fullpath) == 0)
-						texture = textureIdMap[i].textureID;
-					free(fullpath);
-				}
-				if(texture == 0)
-				{
-					msg(MSG_WARNING, "Mesh %u uses %s texture '%s'."
-					    "This texture should have been loaded earlier, but we can't find it now.",
-					    nd->mMeshes[n], texTypeListStr[tt], texPath.data);
-				}
-				else
-				{
-					/* If model uses texture and we found the texture file,
-					   Make sure we repeat instead of clamp textures */
-					glBindTexture(GL_TEXTURE_2D, texture);
-					glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-					glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-					kuhl_errorcheck();
-
-					if(texTypeList[tt] == aiTextureType_DIFFUSE)
-						// use "tex" variable name for diffuse textures.
-						kuhl_geometry_texture(geom, texture, "tex", 0);
-					else
-					{
-						// use variable names like tex_SPECULAR, tex_NORMALS, etc.
-						char glsl_var_name[100]="";
-						snprintf(glsl_var_name, 100, "tex_%s", texTypeListStr[tt]);
-						kuhl_geometry_texture(geom, texture, glsl_var_name, 0);
-					}
+					msg(MSG_FATAL, "Every vertex should have at least one weight but vertex %ud has no weights!", i);
+					exit(EXIT_FAILURE);
 				}
-			} // end if assimp provides this texture 
-		} // end loop through all of assimp supported texture types.
+			}
+			kuhl_geometry_attrib(geom, indices, 4, "in_BoneIndex", 0);
+			kuhl_geometry_attrib(geom, weights, 4, "in_BoneWeight", 0);
+			free(indices);
+			free(weights);
+		} // end if there are bones 
+
+
+		kuhl_private_load_textures(geom, sc, mesh, nd->mMeshes[n], modelFilename, textureDirname);
 
 		if(mesh->mNumFaces > 0)
 		{
@@ -3630,19 +8565,10 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 		}
 
 
-		/* Initialize list of bone matrices if this mesh has bones. */
-		if(mesh->mNumBones > 0)
-		{
-			kuhl_bonemat *bones = (kuhl_bonemat*) kuhl_malloc(sizeof(kuhl_bonemat));
-			bones->count = mesh->mNumBones;
-			bones->mesh = n;
-			for(unsigned int b=0; b < mesh->mNumBones; b++)
-				bones->boneList[b] = mesh->mBones[b];
-			// set any unused bone matrices to the identity.
-			for(unsigned int b=mesh->mNumBones; b < MAX_BONES; b++)
-				mat4f_identity(bones->matrices[b]);
-			geom->bones = bones;
-		}
+		kuhl_private_load_bones(geom, mesh, n);
+
+		if(kl_options & KL_INTERLEAVE)
+			kuhl_geometry_interleave(geom, KG_NONE);
 
 		msg(MSG_DEBUG, "Mesh #%03u in node \"%s\" (node has %d meshes): verts=%d indices=%d primType=%d normals=%s colors=%s texCoords=%s bones=%d texture_count=%d",
 		    nd->mMeshes[n], nd->mName.data, nd->mNumMeshes,
@@ -3660,7 +8586,7 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 	/* Process all of the meshes in the aiNode's children too */
 	for (unsigned int i = 0; i < nd->mNumChildren; i++)
 	{
-		kuhl_geometry *child_geom = kuhl_private_load_model(sc, nd->mChildren[i], program, currentTransform, modelFilename, textureDirname);
+		kuhl_geometry *child_geom = kuhl_private_load_model(sc, nd->mChildren[i], program, currentTransform, modelFilename, textureDirname, kl_options);
 		first_geom = kuhl_geometry_append(first_geom, child_geom);
 	}
 
@@ -3672,6 +8598,670 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 }
 
 
+/** Checks if a piece of geometry can be packed together with other
+ * geometry by kuhl_private_multidraw_pack().
+ *
+ * @param geom The geometry to check.
+ *
+ * @return 1 if the geometry can be packed, 0 otherwise.
+ */
+static int kuhl_private_multidraw_packable(const kuhl_geometry *geom)
+{
+	/* Dynamic and shadowed attributes can't be shared with other
+	 * meshes. */
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+		if(geom->attribs[i].ring != NULL || geom->attribs[i].shadow != NULL)
+			return 0;
+	/* Bones are sent as uniforms per mesh, so meshes with bones
+	 * must be drawn separately. */
+	return geom->bones == NULL && geom->multidraw == NULL &&
+		geom->lod == NULL && geom->meshlets == NULL && geom->indices_len > 0 && geom->attrib_count > 0 &&
+		geom->primitive_type == GL_TRIANGLES;
+}
+
+/** Checks if two pieces of geometry can be drawn with a single
+ * glMultiDrawElementsIndirect() call: They must use the same program
+ * and textures and have the same vertex attributes.
+ *
+ * @param a Geometry to compare.
+ *
+ * @param b Geometry to compare.
+ *
+ * @return 1 if the geometry is compatible, 0 otherwise.
+ */
+static int kuhl_private_multidraw_compatible(const kuhl_geometry *a, const kuhl_geometry *b)
+{
+	if(a->program != b->program ||
+	   a->primitive_type != b->primitive_type ||
+	   a->texture_count != b->texture_count ||
+	   a->attrib_count != b->attrib_count)
+		return 0;
+
+	for(unsigned int i=0; i<a->texture_count; i++)
+	{
+		if(a->textures[i].textureId != b->textures[i].textureId ||
+		   strcmp(a->textures[i].name, b->textures[i].name) != 0)
+			return 0;
+	}
+	for(unsigned int i=0; i<a->attrib_count; i++)
+	{
+		if(strcmp(a->attribs[i].name, b->attribs[i].name) != 0 ||
+		   a->attribs[i].type != b->attribs[i].type ||
+		   kuhl_geometry_attrib_components(a, i) != kuhl_geometry_attrib_components(b, i))
+			return 0;
+	}
+	return 1;
+}
+
+/** Packs a group of compatible geometry objects into one new
+ * kuhl_geometry object which draws all of them with one
+ * glMultiDrawElementsIndirect() call. The OpenGL objects in the
+ * original geometry objects are deleted; the objects themselves are
+ * stored in geom->multidraw->parts so that their matrices can still
+ * be updated by kuhl_update_model().
+ *
+ * @param parts Array of geometry objects to pack.
+ *
+ * @param count Number of items in the parts array.
+ *
+ * @return A new geometry object.
+ */
+static kuhl_geometry* kuhl_private_multidraw_group(kuhl_geometry **parts, unsigned int count)
+{
+	kuhl_geometry *first = parts[0];
+	GLuint totalVertices = 0, totalIndices = 0;
+	for(unsigned int i=0; i<count; i++)
+	{
+		totalVertices += parts[i]->vertex_count;
+		totalIndices += parts[i]->indices_len;
+	}
+
+	kuhl_geometry *geom = (kuhl_geometry*) kuhl_malloc(sizeof(kuhl_geometry));
+	kuhl_geometry_new(geom, first->program, totalVertices, first->primitive_type);
+
+	/* Concatenate each of the vertex attributes */
+	for(unsigned int a=0; a<first->attrib_count; a++)
+	{
+		GLuint components = kuhl_geometry_attrib_components(first, a);
+		GLfloat *data = (GLfloat*) kuhl_malloc(sizeof(GLfloat)*totalVertices*components);
+		GLuint offset = 0;
+		for(unsigned int i=0; i<count; i++)
+		{
+			GLuint c;
+			GLfloat *partData = kuhl_geometry_attrib_read(parts[i], a, &c);
+			memcpy(data+offset, partData, sizeof(GLfloat)*parts[i]->vertex_count*c);
+			offset += parts[i]->vertex_count*c;
+			free(partData);
+		}
+		kuhl_geometry_attrib(geom, data, components, first->attribs[a].name,
+		                     kuhl_attrib_format_options(&(first->attribs[a])));
+		free(data);
+	}
+
+	/* Concatenate the indices. The indices are not modified; each
+	 * draw command has a base vertex instead. */
+	typedef struct
+	{
+		GLuint count;
+		GLuint instanceCount;
+		GLuint firstIndex;
+		GLint  baseVertex;
+		GLuint baseInstance;
+	} drawCommand;
+	drawCommand *commands = (drawCommand*) kuhl_malloc(sizeof(drawCommand)*count);
+	GLuint *drawIds = (GLuint*) kuhl_malloc(sizeof(GLuint)*count);
+	kuhl_multidraw_data *drawData = (kuhl_multidraw_data*) kuhl_malloc(sizeof(kuhl_multidraw_data)*count);
+	GLuint *indices = (GLuint*) kuhl_malloc(sizeof(GLuint)*totalIndices);
+	GLuint firstIndex = 0, baseVertex = 0;
+	for(unsigned int i=0; i<count; i++)
+	{
+		GLuint *partIndices = kuhl_geometry_indices_read(parts[i]);
+		memcpy(indices+firstIndex, partIndices, sizeof(GLuint)*parts[i]->indices_len);
+		free(partIndices);
+
+		commands[i].count = parts[i]->indices_len;
+		commands[i].instanceCount = 1;
+		commands[i].firstIndex = firstIndex;
+		commands[i].baseVertex = baseVertex;
+		commands[i].baseInstance = i;
+		drawIds[i] = i;
+		mat4f_copy(drawData[i].geomTransform, parts[i]->matrix);
+		drawData[i].material[0] = parts[i]->material_index;
+		drawData[i].material[1] = drawData[i].material[2] = drawData[i].material[3] = 0;
+
+		firstIndex += parts[i]->indices_len;
+		baseVertex += parts[i]->vertex_count;
+	}
+	kuhl_geometry_indices(geom, indices, totalIndices);
+	free(indices);
+
+	for(unsigned int t=0; t<first->texture_count; t++)
+		kuhl_geometry_texture(geom, first->textures[t].textureId, first->textures[t].name, 0);
+
+	kuhl_multidraw *md = (kuhl_multidraw*) kuhl_malloc(sizeof(kuhl_multidraw));
+	md->count = count;
+	md->drawdata = drawData;
+
+	glGenBuffers(1, &(md->indirect_bufferobject));
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, md->indirect_bufferobject);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(drawCommand)*count, commands, GL_STATIC_DRAW);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+	glGenBuffers(1, &(md->draw_bufferobject));
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, md->draw_bufferobject);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(kuhl_multidraw_data)*count, drawData, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	glGenBuffers(1, &(md->drawid_bufferobject));
+	glBindBuffer(GL_ARRAY_BUFFER, md->drawid_bufferobject);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(GLuint)*count, drawIds, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	kuhl_errorcheck();
+	free(commands);
+	free(drawIds);
+
+	geom->multidraw = md;
+	kuhl_gl_bind_vertex_array(geom->vao);
+	kuhl_multidraw_bind_drawid(geom, geom->program);
+	kuhl_gl_bind_vertex_array(0);
+
+	/* Delete the OpenGL objects in the parts and link them together. */
+	for(unsigned int i=0; i<count; i++)
+	{
+		kuhl_geometry *p = parts[i];
+		for(unsigned int a=0; a<p->attrib_count; a++)
+		{
+			glDeleteBuffers(1, &(p->attribs[a].bufferobject));
+			free(p->attribs[a].name);
+		}
+		p->attrib_count = 0;
+		for(unsigned int t=0; t<p->texture_count; t++)
+			free(p->textures[t].name);
+		p->texture_count = 0;
+		glDeleteBuffers(1, &(p->indices_bufferobject));
+		p->indices_bufferobject = 0;
+		kuhl_gl_vertex_array_deleted(p->vao);
+		glDeleteVertexArrays(1, &(p->vao));
+		p->vao = 0;
+		p->next = (i+1 < count) ? parts[i+1] : NULL;
+		kuhl_registry_store(p);
+		kuhl_registry.list_version++;
+	}
+	md->parts = parts[0];
+	kuhl_errorcheck();
+
+	msg(MSG_DEBUG, "Packed %u meshes (%u vertices, %u indices) into one multidraw geometry.",
+	    count, totalVertices, totalIndices);
+	return geom;
+}
+
+/** Packs the meshes in a list of geometry objects that share a
+ * program and textures into as few geometry objects as possible.
+ * Each packed geometry object is drawn with
+ * glMultiDrawElementsIndirect() and requires a vertex program which
+ * reads GeomTransform out of a shader storage buffer (see
+ * kuhl_multidraw). Meshes that can't be packed (such as meshes with
+ * bones) are left alone.
+ *
+ * @param list The list of geometry to pack.
+ *
+ * @return The new list of geometry.
+ */
+static kuhl_geometry* kuhl_private_multidraw_pack(kuhl_geometry *list)
+{
+	if(list == NULL)
+		return NULL;
+
+	if(!GLEW_VERSION_4_3)
+	{
+		msg(MSG_WARNING, "Packing meshes for multidraw requires OpenGL 4.3; drawing each mesh separately instead.");
+		return list;
+	}
+	if(glGetAttribLocation(list->program, "in_DrawID") == -1)
+	{
+		msg(MSG_WARNING, "GLSL program %d has no in_DrawID attribute. It can't draw packed meshes; drawing each mesh separately instead.", list->program);
+		return list;
+	}
+
+	unsigned int count = kuhl_geometry_count(list);
+	kuhl_geometry **nodes = (kuhl_geometry**) kuhl_malloc(sizeof(kuhl_geometry*)*count);
+	kuhl_geometry **group = (kuhl_geometry**) kuhl_malloc(sizeof(kuhl_geometry*)*count);
+	unsigned int i = 0;
+	for(kuhl_geometry *g = list; g != NULL; g = g->next)
+		nodes[i++] = g;
+
+	kuhl_geometry *result = NULL;
+	for(i=0; i<count; i++)
+	{
+		if(nodes[i] == NULL)
+			continue;
+		if(!kuhl_private_multidraw_packable(nodes[i]))
+		{
+			nodes[i]->next = NULL;
+			result = kuhl_geometry_append(result, nodes[i]);
+			continue;
+		}
+
+		/* Find all of the nodes that can be drawn with this one. */
+		unsigned int groupCount = 0;
+		group[groupCount++] = nodes[i];
+		for(unsigned int j=i+1; j<count; j++)
+		{
+			if(nodes[j] != NULL && kuhl_private_multidraw_packable(nodes[j]) &&
+			   kuhl_private_multidraw_compatible(nodes[i], nodes[j]))
+			{
+				group[groupCount++] = nodes[j];
+				nodes[j] = NULL;
+			}
+		}
+		nodes[i] = NULL;
+
+		kuhl_geometry *packed = kuhl_private_multidraw_group(group, groupCount);
+		result = kuhl_geometry_append(result, packed);
+	}
+	free(nodes);
+	free(group);
+	return result;
+}
+
+/** Checks if a geometry can be merged into a batch by
+ * kuhl_geometry_batch_static(). The indices of strips and fans can't
+ * be concatenated, and bones and per-instance attributes move the
+ * vertices in the vertex program.
+ *
+ * @param geom The geometry to check.
+ *
+ * @return 1 if the geometry can be batched, 0 otherwise.
+ */
+static int kuhl_private_batch_batchable(const kuhl_geometry *geom)
+{
+	if(geom->bones != NULL || geom->multidraw != NULL ||
+	   geom->instance_attrib_count > 0 || geom->vertex_count == 0)
+		return 0;
+	if(geom->primitive_type != GL_TRIANGLES && geom->primitive_type != GL_LINES &&
+	   geom->primitive_type != GL_POINTS)
+		return 0;
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+		if(strcmp(geom->attribs[i].name, "in_Position") == 0)
+			return 1;
+	return 0;
+}
+
+/** Transforms the positions, normals or tangents of one piece of a
+ * batch. Normals are multiplied by the inverse transpose of the
+ * matrix, tangents and bitangents by the upper 3x3 of the matrix. Both
+ * are normalized and keep their fourth component (such as the
+ * handedness stored in the w component of some tangents).
+ *
+ * @param data The vertices to transform.
+ *
+ * @param vertexCount Number of vertices in data.
+ *
+ * @param components Number of components per vertex.
+ *
+ * @param matrix The matrix to transform the vertices by.
+ *
+ * @param kind 0 if data contains positions, 1 if it contains normals,
+ * 2 if it contains tangents or bitangents.
+ */
+static void kuhl_private_batch_transform(GLfloat *data, GLuint vertexCount, GLuint components,
+                                         const float matrix[16], int kind)
+{
+	float m[16];
+	if(kind == 1)
+	{
+		if(!mat4f_invert_new(m, matrix))
+			return;
+		mat4f_transpose(m);
+	}
+	else
+		mat4f_copy(m, matrix);
+
+	/* Directions have a w of 0 so that the translation is ignored. */
+	GLuint c = components < 4 ? components : 4;
+	if(kind != 0 && c > 3)
+		c = 3;
+	for(GLuint v=0; v<vertexCount; v++)
+	{
+		GLfloat *vertex = data + (size_t)v*components;
+		float in[4] = { 0, 0, 0, kind == 0 ? 1.0f : 0.0f };
+		float out[4];
+		for(GLuint i=0; i<c; i++)
+			in[i] = vertex[i];
+		mat4f_mult_vec4f_new(out, m, in);
+		if(kind != 0 && vec3f_norm(out) > 0)
+			vec3f_normalize(out);
+		for(GLuint i=0; i<c; i++)
+			vertex[i] = out[i];
+	}
+}
+
+/** Merges a group of compatible geometry objects into one new
+ * kuhl_geometry object for kuhl_geometry_batch_static(). The original
+ * geometry objects are not changed.
+ *
+ * @param geoms The geometry passed to kuhl_geometry_batch_static().
+ *
+ * @param matrices The matrices passed to kuhl_geometry_batch_static().
+ *
+ * @param members Positions in geoms of the geometry to merge.
+ *
+ * @param count Number of items in the members array.
+ *
+ * @return A new geometry object.
+ */
+static kuhl_geometry* kuhl_private_batch_group(kuhl_geometry **geoms, const float *matrices,
+                                               const unsigned int *members, unsigned int count)
+{
+	kuhl_geometry *first = geoms[members[0]];
+	GLuint totalVertices = 0, totalIndices = 0;
+	float (*transforms)[16] = (float (*)[16]) kuhl_malloc(sizeof(float)*16*count);
+	for(unsigned int i=0; i<count; i++)
+	{
+		kuhl_geometry *g = geoms[members[i]];
+		totalVertices += g->vertex_count;
+		totalIndices += g->indices_len > 0 ? g->indices_len : g->vertex_count;
+		if(matrices)
+			mat4f_mult_mat4f_new(transforms[i], matrices+members[i]*16, g->matrix);
+		else
+			mat4f_copy(transforms[i], g->matrix);
+	}
+
+	kuhl_geometry *geom = (kuhl_geometry*) kuhl_malloc(sizeof(kuhl_geometry));
+	kuhl_geometry_new(geom, first->program, totalVertices, first->primitive_type);
+
+	kuhl_batch *batch = (kuhl_batch*) kuhl_malloc(sizeof(kuhl_batch));
+	batch->pieces = (kuhl_batch_piece*) kuhl_malloc(sizeof(kuhl_batch_piece)*count);
+	batch->count = count;
+	batch->hidden_count = 0;
+	batch->draw_counts = (GLsizei*) kuhl_malloc(sizeof(GLsizei)*count);
+	batch->draw_offsets = (const GLvoid**) kuhl_malloc(sizeof(GLvoid*)*count);
+	batch->draw_ranges = 0;
+	batch->ranges_valid = 0;
+
+	/* Concatenate each of the vertex attributes and move the
+	 * positions, normals and tangents into world coordinates. */
+	for(unsigned int a=0; a<first->attrib_count; a++)
+	{
+		const char *name = first->attribs[a].name;
+		int isPosition = strcmp(name, "in_Position") == 0;
+		int isNormal = strcmp(name, "in_Normal") == 0;
+		int isTangent = strcmp(name, "in_Tangent") == 0 || strcmp(name, "in_Bitangent") == 0;
+		GLuint components = kuhl_geometry_attrib_components(first, a);
+		GLfloat *data = (GLfloat*) kuhl_malloc(sizeof(GLfloat)*totalVertices*components);
+		GLuint offset = 0;
+		for(unsigned int i=0; i<count; i++)
+		{
+			kuhl_geometry *g = geoms[members[i]];
+			GLuint c;
+			GLfloat *partData = kuhl_geometry_attrib_read(g, a, &c);
+			GLfloat *out = data+offset;
+			memcpy(out, partData, sizeof(GLfloat)*g->vertex_count*c);
+			free(partData);
+			offset += g->vertex_count*c;
+			if(isNormal)
+				kuhl_private_batch_transform(out, g->vertex_count, c, transforms[i], 1);
+			else if(isTangent)
+				kuhl_private_batch_transform(out, g->vertex_count, c, transforms[i], 2);
+			if(!isPosition)
+				continue;
+
+			kuhl_private_batch_transform(out, g->vertex_count, c, transforms[i], 0);
+			float *box = batch->pieces[i].aabbox;
+			for(int k=0; k<3; k++)
+			{
+				box[k*2]   = FLT_MAX;
+				box[k*2+1] = -FLT_MAX;
+			}
+			for(GLuint v=0; v<g->vertex_count; v++)
+			{
+				for(GLuint k=0; k<3; k++)
+				{
+					float value = k < c ? out[v*c+k] : 0;
+					if(value < box[k*2])
+						box[k*2] = value;
+					if(value > box[k*2+1])
+						box[k*2+1] = value;
+				}
+			}
+		}
+		/* Positions are stored as floats: The range that KG_NORM16
+		 * was picked for doesn't fit the transformed positions. */
+		kuhl_geometry_attrib(geom, data, components, name,
+		                     isPosition ? KG_NONE : kuhl_attrib_format_options(&(first->attribs[a])));
+		free(data);
+	}
+	free(transforms);
+
+	/* Concatenate the indices. Geometry without indices gets one
+	 * index per vertex. */
+	GLuint *indices = (GLuint*) kuhl_malloc(sizeof(GLuint)*totalIndices);
+	GLuint firstIndex = 0, baseVertex = 0;
+	for(unsigned int i=0; i<count; i++)
+	{
+		kuhl_geometry *g = geoms[members[i]];
+		kuhl_batch_piece *p = &(batch->pieces[i]);
+		p->index = members[i];
+		p->source = g->handle;
+		p->first = firstIndex;
+		p->hidden = 0;
+		if(g->indices_len > 0)
+		{
+			GLuint *partIndices = kuhl_geometry_indices_read(g);
+			for(GLuint k=0; k<g->indices_len; k++)
+				indices[firstIndex+k] = partIndices[k] + baseVertex;
+			free(partIndices);
+			p->count = g->indices_len;
+		}
+		else
+		{
+			for(GLuint k=0; k<g->vertex_count; k++)
+				indices[firstIndex+k] = baseVertex + k;
+			p->count = g->vertex_count;
+		}
+		firstIndex += p->count;
+		baseVertex += g->vertex_count;
+	}
+	kuhl_geometry_indices(geom, indices, totalIndices);
+	free(indices);
+	geom->batch = batch;
+
+	for(unsigned int t=0; t<first->texture_count; t++)
+		kuhl_geometry_texture(geom, first->textures[t].textureId, first->textures[t].name, 0);
+	kuhl_errorcheck();
+
+	msg(MSG_DEBUG, "Batched %u geometry objects (%u vertices, %u indices) into one geometry.",
+	    count, totalVertices, totalIndices);
+	return geom;
+}
+
+/** Merges many small geometry objects that never move into a few
+ * large ones so that they can be drawn with a few draw calls instead
+ * of one per object. The vertices of each object are transformed into
+ * world coordinates and copied into a shared buffer. Objects which
+ * use the same program, textures and vertex attributes are merged
+ * into the same batch.
+ *
+ * The original geometry is not changed and may be deleted. Each
+ * batch remembers which range of its indices came from which
+ * original object (see kuhl_batch) so that the objects can still be
+ * hidden with kuhl_geometry_batch_hide() or picked with
+ * kuhl_geometry_batch_pick(). Functions that replace the indices of a
+ * batch (such as kuhl_geometry_optimize()) discard this information.
+ *
+ * Geometry that can't be batched (geometry with bones, per-instance
+ * attributes, packed meshes, no in_Position attribute or a primitive
+ * type other than GL_TRIANGLES, GL_LINES or GL_POINTS) is left out.
+ *
+ * @param geoms Array of geometry to merge. geoms[i]->next is ignored.
+ *
+ * @param matrices count 4x4 matrices (16 floats each) that place each
+ * geometry in the world. geoms[i]->matrix is applied before
+ * matrices[i]. If NULL, only geoms[i]->matrix is used.
+ *
+ * @param count Number of items in the geoms array.
+ *
+ * @return A list of new geometry objects (one for each combination of
+ * program, textures and attributes) or NULL if none of the geometry
+ * could be batched. The list can be drawn with kuhl_geometry_draw()
+ * and freed with kuhl_geometry_delete() and free().
+ */
+kuhl_geometry* kuhl_geometry_batch_static(kuhl_geometry **geoms, const float *matrices, unsigned int count)
+{
+	unsigned char *used = (unsigned char*) calloc(count, 1);
+	unsigned int *group = (unsigned int*) kuhl_malloc(sizeof(unsigned int)*(count > 0 ? count : 1));
+	kuhl_geometry *result = NULL;
+	unsigned int batches = 0, skipped = 0;
+	for(unsigned int i=0; i<count; i++)
+	{
+		if(used[i])
+			continue;
+		if(!kuhl_private_batch_batchable(geoms[i]))
+		{
+			skipped++;
+			continue;
+		}
+
+		/* Find all of the geometry that can be merged with this one. */
+		unsigned int groupCount = 0;
+		group[groupCount++] = i;
+		for(unsigned int j=i+1; j<count; j++)
+		{
+			if(!used[j] && kuhl_private_batch_batchable(geoms[j]) &&
+			   kuhl_private_multidraw_compatible(geoms[i], geoms[j]))
+			{
+				group[groupCount++] = j;
+				used[j] = 1;
+			}
+		}
+		used[i] = 1;
+
+		result = kuhl_geometry_append(result, kuhl_private_batch_group(geoms, matrices, group, groupCount));
+		batches++;
+	}
+	free(used);
+	free(group);
+
+	if(skipped > 0)
+		msg(MSG_WARNING, "%u of %u geometry objects can't be batched and were left out.", skipped, count);
+	msg(MSG_DEBUG, "Merged %u geometry objects into %u batches.", count-skipped, batches);
+	return result;
+}
+
+/** Hides or shows one of the objects that kuhl_geometry_batch_static()
+ * merged into a batch.
+ *
+ * @param batches The list returned by kuhl_geometry_batch_static().
+ *
+ * @param index The position of the object in the array that was passed
+ * to kuhl_geometry_batch_static().
+ *
+ * @param hidden 1 to stop drawing the object, 0 to draw it again.
+ *
+ * @return 1 if the object was found, 0 otherwise.
+ */
+int kuhl_geometry_batch_hide(kuhl_geometry *batches, unsigned int index, int hidden)
+{
+	hidden = hidden != 0;
+	for(kuhl_geometry *g = batches; g != NULL; g = g->next)
+	{
+		kuhl_batch *b = g->batch;
+		if(b == NULL)
+			continue;
+		for(unsigned int i=0; i<b->count; i++)
+		{
+			kuhl_batch_piece *p = &(b->pieces[i]);
+			if(p->index != index)
+				continue;
+			if(p->hidden != hidden)
+			{
+				p->hidden = hidden;
+				if(hidden)
+					b->hidden_count++;
+				else
+					b->hidden_count--;
+				b->ranges_valid = 0;
+			}
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/** Finds the object in a set of batches that a ray hits first. Only
+ * the bounding box of each object is tested, and hidden objects are
+ * ignored. The ray is in the coordinates of the batched vertices (the
+ * coordinates that the matrices passed to kuhl_geometry_batch_static()
+ * transform into), so the matrix of the batch is not applied.
+ *
+ * @param batches The list returned by kuhl_geometry_batch_static().
+ *
+ * @param origin The start of the ray.
+ *
+ * @param direction The direction of the ray.
+ *
+ * @param distance If not NULL and an object is hit, set to the
+ * distance along the ray to the bounding box (in units of the length
+ * of direction).
+ *
+ * @return The position of the object in the array that was passed to
+ * kuhl_geometry_batch_static() or -1 if the ray doesn't hit any
+ * object.
+ */
+int kuhl_geometry_batch_pick(const kuhl_geometry *batches, const float origin[3], const float direction[3], float *distance)
+{
+	int best = -1;
+	float bestDistance = FLT_MAX;
+	for(const kuhl_geometry *g = batches; g != NULL; g = g->next)
+	{
+		const kuhl_batch *b = g->batch;
+		if(b == NULL)
+			continue;
+		for(unsigned int i=0; i<b->count; i++)
+		{
+			const kuhl_batch_piece *p = &(b->pieces[i]);
+			if(p->hidden)
+				continue;
+
+			/* Intersect the ray with the three pairs of planes
+			 * of the box. */
+			float tmin = 0, tmax = bestDistance;
+			int hit = 1;
+			for(int k=0; k<3 && hit; k++)
+			{
+				if(direction[k] == 0)
+				{
+					if(origin[k] < p->aabbox[k*2] || origin[k] > p->aabbox[k*2+1])
+						hit = 0;
+					continue;
+				}
+				float t1 = (p->aabbox[k*2]   - origin[k]) / direction[k];
+				float t2 = (p->aabbox[k*2+1] - origin[k]) / direction[k];
+				if(t1 > t2)
+				{
+					float tmp = t1;
+					t1 = t2;
+					t2 = tmp;
+				}
+				if(t1 > tmin)
+					tmin = t1;
+				if(t2 < tmax)
+					tmax = t2;
+				if(tmin > tmax)
+					hit = 0;
+			}
+			if(hit && tmin < bestDistance)
+			{
+				bestDistance = tmin;
+				best = (int) p->index;
+			}
+		}
+	}
+	if(best >= 0 && distance != NULL)
+		*distance = bestDistance;
+	return best;
+}
+
 /** Setup a model to draw at a specific time.
 
     @param modelFilename Name of model file to update.
@@ -3686,6 +9276,11 @@ void kuhl_update_model(kuhl_geometry *first_geom, unsigned int animationNum, flo
 {
 	for(kuhl_geometry *g = first_geom; g != NULL; g=g->next)
 	{
+		/* Packed meshes are animated through their original
+		 * geometry objects. */
+		if(g->multidraw)
+			kuhl_update_model(g->multidraw->parts, animationNum, time);
+
 		/* The aiScene object that this kuhl_geometry refers to. */
 		struct aiScene *scene = g->assimp_scene;
 		/* The aiNode object that this kuhl_geometry refers to. */
@@ -3722,13 +9317,18 @@ void kuhl_update_model(kuhl_geometry *first_geom, unsigned int animationNum, flo
 			// intended to place the model on/near the origin in a
 			// standard sized box. Re-apply the "fit" matrix here.
 			mat4f_mult_mat4f_new(g->matrix, g->fitMatrix, g->matrix);
+			mat4f_mult_mat4f_new(g->matrix, g->matrix, g->decodeMatrix);
+			kuhl_registry_store(g);
 		}
 
 		/* Don't process bones if there aren't any. */
 		if(g->bones == NULL)
 			continue;
 
-		/* Update the list of bone matrices. */
+		/* Update the list of bone matrices. Only mark the palette as
+		 * changed if a matrix changed (for example, not while the
+		 * animation is paused). */
+		int changed = 0;
 		for(int b=0; b < g->bones->count; b++) // For each bone
 		{
 			// Find the bone node and the bone itself.
@@ -3748,28 +9348,69 @@ void kuhl_update_model(kuhl_geometry *first_geom, unsigned int animationNum, flo
 			 * recalculate the transformation matrices for the nodes
 			 * near the root---potentially reducing performance.
 			 */
-			mat4f_identity(g->bones->matrices[b]);
+			float boneMatrix[16];
+			mat4f_identity(boneMatrix);
 			do
 			{
 				float transform[16];
 				kuhl_private_node_matrix(transform, scene, node, animationNum, time);
-				mat4f_mult_mat4f_new(g->bones->matrices[b], transform, g->bones->matrices[b]);
+				mat4f_mult_mat4f_new(boneMatrix, transform, boneMatrix);
 				node = node->mParent; // move to next node up
 			} while(node != NULL);
 
 			/* Also apply the bone offset */
 			float offset[16];
 			mat4f_from_aiMatrix4x4(offset, bone->mOffsetMatrix);
-			mat4f_mult_mat4f_new(g->bones->matrices[b], g->bones->matrices[b], offset);
+			mat4f_mult_mat4f_new(boneMatrix, boneMatrix, offset);
 
 			// If a "fit" matrix was used to make the model fit in box
 			// on or centered at the origin, use that matrix too.
-			mat4f_mult_mat4f_new(g->bones->matrices[b], g->fitMatrix, g->bones->matrices[b]);
+			mat4f_mult_mat4f_new(boneMatrix, g->fitMatrix, boneMatrix);
+
+			if(memcmp(boneMatrix, g->bones->matrices[b], sizeof(float)*16) != 0)
+			{
+				mat4f_copy(g->bones->matrices[b], boneMatrix);
+				changed = 1;
+			}
 
 		} // end for each bone
+		if(changed)
+			g->bones->generation = ++kuhl_bonemat_generation;
 	} // end for each geometry
 }
 
+/** Adds levels of detail to a model that was loaded with KL_LOD. The
+ * levels are read from "modelFilename.lod" if it exists and matches
+ * the model. Otherwise, they are generated with
+ * kuhl_geometry_lod_generate() and written to that file. The config
+ * file settings lod.maxerror (0.05 by default) and lod.cache (1 by
+ * default) control the largest error of each level and whether the
+ * file is used.
+ *
+ * @param geom The model.
+ *
+ * @param modelFilename The filename of the model.
+ */
+static void kuhl_private_load_lod(kuhl_geometry *geom, const char *modelFilename)
+{
+	float maxError = kuhl_config_float("lod.maxerror", 0.05f, 0.05f);
+	int useCache = kuhl_config_boolean("lod.cache", 1, 1);
+
+	char cacheFilename[1024];
+	snprintf(cacheFilename, 1024, "%s.lod", modelFilename);
+	if(useCache && kuhl_geometry_lod_load(geom, cacheFilename, maxError))
+	{
+		msg(MSG_DEBUG, "Read levels of detail from %s", cacheFilename);
+		return;
+	}
+
+	long start = kuhl_milliseconds();
+	kuhl_geometry_lod_generate(geom, maxError, KG_FULL_LIST);
+	msg(MSG_INFO, "%s: Generated levels of detail in %ld ms", modelFilename, kuhl_milliseconds()-start);
+	if(useCache)
+		kuhl_geometry_lod_save(geom, cacheFilename, maxError);
+}
+
 /** Loads a model without drawing it.
  *
  * @param modelFilename The filename of the model.
@@ -3791,6 +9432,58 @@ void kuhl_update_model(kuhl_geometry *first_geom, unsigned int animationNum, flo
  */
 kuhl_geometry* kuhl_load_model(const char *modelFilename, const char *textureDirname,
                                GLuint program, float bbox[6])
+{
+	return kuhl_load_model_options(modelFilename, textureDirname, program, bbox, KL_NONE);
+}
+
+/** Loads a model without drawing it. This function is the same as
+ * kuhl_load_model() except that it accepts options that change how
+ * the model is stored.
+ *
+ * @param modelFilename The filename of the model.
+ *
+ * @param textureDirname The directory that the model's textures are
+ * saved in. If set to NULL, the textures are assumed to be in the
+ * same directory as the model is in.
+ *
+ * @param program The GLSL program to draw the model with.
+ *
+ * @param bbox To be filled in with the bounding box of the model.
+ *
+ * @param kl_options KL_MULTIDRAW packs all meshes that share the
+ * program and textures into one set of buffers so that they are drawn
+ * with one glMultiDrawElementsIndirect() call. This requires OpenGL
+ * 4.3 and a vertex program that reads GeomTransform from a shader
+ * storage buffer (see kuhl_multidraw and
+ * samples/viewer-multidraw.vert). Meshes with bones are not
+ * packed. KL_INTERLEAVE stores all of the vertex attributes of each
+ * mesh in one buffer. KL_COMPACT stores positions as 16-bit integers
+ * (with the scale and offset included in GeomTransform), normals and
+ * tangents in 32 bits each, and texture coordinates as 16-bit
+ * floats. Positions of meshes with bones or meshes packed with
+ * KL_MULTIDRAW remain floats. KL_LOD generates levels of detail for
+ * each mesh (see kuhl_geometry_lod_generate()) and stores them in a
+ * file next to the model (see kuhl_private_load_lod()); it can't be
+ * combined with KL_MULTIDRAW. KL_OPTIMIZE reorders the triangles and
+ * vertices of each mesh before any levels of detail are generated
+ * (see kuhl_geometry_optimize()). KL_MESHLETS splits large meshes
+ * into meshlets after any levels of detail are generated so that
+ * kuhl_geometry_meshlets_cull() can skip the parts that can't be
+ * seen (see kuhl_geometry_meshlets()); it can't be combined with
+ * KL_MULTIDRAW. Use KL_NONE for no options.
+ *
+ * Unless KL_MULTIDRAW is set, a mesh that is used by several nodes
+ * in the model, or that was loaded by an earlier call with the same
+ * file and options, shares its vertex and index buffers with the
+ * first copy (see kuhl_geometry_share()). Loading the same model N
+ * times stores its meshes on the GPU only once; the buffers are
+ * deleted when the last geometry that uses them is deleted.
+ *
+ * @return Returns a kuhl_geometry object that can be later
+ * drawn. Calls exit() on error.
+ */
+kuhl_geometry* kuhl_load_model_options(const char *modelFilename, const char *textureDirname,
+                                       GLuint program, float bbox[6], int kl_options)
 {
 	char *newModelFilename = kuhl_find_file(modelFilename);
 	// Loads the model from the file and reads in all of the textures:
@@ -3805,14 +9498,58 @@ kuhl_geometry* kuhl_load_model(const char *modelFilename, const char *textureDir
 	// Convert the information in aiScene into a kuhl_geometry object.
 	float transform[16];
 	mat4f_identity(transform);
-	kuhl_geometry *ret = kuhl_private_load_model(scene, scene->mRootNode,
-	                                             program, transform,
-	                                             newModelFilename, textureDirname);
+	kuhl_geometry *ret = NULL;
+	if(kl_options & KL_MULTIDRAW)
+	{
+		/* Interleave after the meshes are packed together. */
+		ret = kuhl_private_load_model(scene, scene->mRootNode,
+		                              program, transform,
+		                              newModelFilename, textureDirname,
+		                              kl_options & ~KL_INTERLEAVE);
+		if(kl_options & KL_OPTIMIZE)
+			kuhl_geometry_optimize(ret, KG_FULL_LIST);
+		ret = kuhl_private_multidraw_pack(ret);
+		if(kl_options & KL_INTERLEAVE)
+			kuhl_geometry_interleave(ret, KG_FULL_LIST);
+	}
+	else
+	{
+		ret = kuhl_private_load_model(scene, scene->mRootNode,
+		                              program, transform,
+		                              newModelFilename, textureDirname,
+		                              kl_options);
+		if((kl_options & KL_OPTIMIZE) && !kuhl_private_shared_model(ret))
+			kuhl_geometry_optimize(ret, KG_FULL_LIST);
+	}
+
+	if(kl_options & KL_LOD)
+	{
+		if(kl_options & KL_MULTIDRAW)
+			msg(MSG_WARNING, "%s: KL_LOD can't be used with KL_MULTIDRAW. Levels of detail will not be generated.", modelFilename);
+		else if(!kuhl_private_shared_model(ret))
+			kuhl_private_load_lod(ret, newModelFilename);
+	}
+
+	if(kl_options & KL_MESHLETS)
+	{
+		if(kl_options & KL_MULTIDRAW)
+			msg(MSG_WARNING, "%s: KL_MESHLETS can't be used with KL_MULTIDRAW. Meshlets will not be created.", modelFilename);
+		else if(!kuhl_private_shared_model(ret))
+			kuhl_geometry_meshlets(ret, KG_FULL_LIST);
+	}
+
+	/* Meshes that appear more than once share buffers with the first
+	 * copy, which now has its final indices, levels of detail and
+	 * meshlets. */
+	kuhl_private_shared_finish();
 
 	/* Ensure model shows up in bind pose if the caller doesn't
 	 * also call kuhl_update_model(). */
 	kuhl_update_model(ret, 0, -1);
 
+	/* The loader sets the matrices of the geometry directly. */
+	kuhl_geometry_registry_sync(ret, KG_FULL_LIST);
+
 	/* Calculate bounding box information for the model */
 	float bboxLocal[6];
 	kuhl_private_calc_bbox(scene->mRootNode, NULL, scene, bboxLocal);
@@ -3916,7 +9653,22 @@ void kuhl_make_geom_fit(kuhl_geometry *geom, const float bbox[6], const int sitO
 		// Store a copy of fit matrix so we can reuse it if kuhl_update_model() is called later.
 		mat4f_copy(geom->fitMatrix, fitMat);
 
-		mat4f_mult_mat4f_new(geom->matrix, fitMat, geom->matrix);
+		/* Packed meshes get their GeomTransform from the original
+		 * geometry objects. */
+		if(geom->multidraw)
+		{
+			for(kuhl_geometry *p = geom->multidraw->parts; p != NULL; p = p->next)
+			{
+				mat4f_copy(p->fitMatrix, fitMat);
+				mat4f_mult_mat4f_new(p->matrix, fitMat, p->matrix);
+				kuhl_registry_store(p);
+			}
+		}
+		else
+		{
+			mat4f_mult_mat4f_new(geom->matrix, fitMat, geom->matrix);
+			kuhl_registry_store(geom);
+		}
 		geom = geom->next;
 	} while(geom != NULL);
 
@@ -30,6 +30,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h> // uint64_t
 #include <GLFW/glfw3.h>
 
 
@@ -53,6 +54,8 @@
 #include "kuhl-config.h"
 #include "kuhl-nodep.h"
 #include "msg.h"
+#include "list.h"
+#include "kuhl-mesh.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -71,6 +74,7 @@ extern "C" {
 #define MAX_BONES 128
 #define MAX_ATTRIBUTES 16
 #define MAX_TEXTURES 8
+#define MAX_INSTANCE_ATTRIBUTES 4
 	
 typedef struct
 {
@@ -78,6 +82,7 @@ typedef struct
 	unsigned int mesh; /**< The bones in this struct are associated with this matrix index */
 	const struct aiBone *boneList[MAX_BONES];
 	float matrices[MAX_BONES][16]; /**< Transformation matrices for each bone */
+	unsigned int generation; /**< Changes whenever the matrices change so that an unchanged bone palette isn't sent to the GLSL program again */
 } kuhl_bonemat;
 
 /** This enum is used by some kuhl_geometry related functions */
@@ -85,25 +90,256 @@ enum
 { /* Options used for some kuhl_geometry functions */
 	KG_NONE = 0,     /**< No options */
 	KG_WARN = 1,     /**< Warn if GLSL variable is missing */
-	KG_FULL_LIST = 2 /**< Apply to entire list of kuhl_geometry objects */
+	KG_FULL_LIST = 2, /**< Apply to entire list of kuhl_geometry objects */
+	KG_DYNAMIC = 4,  /**< Attribute will be changed every frame, see kuhl_geometry_attrib() */
+	KG_HALF = 8,     /**< Store attribute as 16-bit floats */
+	KG_PACKED = 16,  /**< Store a 3 or 4 component attribute with values between -1 and 1 in 32 bits (GL_INT_2_10_10_10_REV) */
+	KG_NORM16 = 32,  /**< Store values between -1 and 1 as normalized 16-bit integers */
+	KG_SHADOW = 64   /**< Keep a copy of the attribute in RAM that is read and changed instead of the buffer, see kuhl_geometry_attrib_get_range() */
 };
 
+/** Options for kuhl_load_model_options() */
+enum
+{
+	KL_NONE = 0,      /**< No options */
+	KL_MULTIDRAW = 1, /**< Pack meshes that share a program and textures into one set of buffers drawn with glMultiDrawElementsIndirect(). */
+	KL_INTERLEAVE = 2, /**< Store all vertex attributes of each mesh in one interleaved buffer, see kuhl_geometry_interleave(). */
+	KL_COMPACT = 4,    /**< Store vertex attributes with smaller types, see kuhl_load_model_options(). */
+	KL_LOD = 8,        /**< Generate simplified versions of each mesh, see kuhl_geometry_lod_generate(). */
+	KL_OPTIMIZE = 16,  /**< Reorder triangles and vertices of each mesh so they are drawn faster, see kuhl_geometry_optimize(). */
+	KL_MESHLETS = 32   /**< Split large meshes into meshlets that can be culled separately, see kuhl_geometry_meshlets(). */
+};
+
+/** Shader storage buffer binding point that per-draw data is bound
+ * to when a kuhl_geometry created with KL_MULTIDRAW is drawn. */
+#define KUHL_MULTIDRAW_BINDING 0
+
+/** Uniform buffer binding point of the KuhlFrame uniform block. viewmat
+ * fills in the block for each viewport in viewmat_get() and
+ * kuhl_create_program() connects the block to this binding point in
+ * any program that declares it:
+
+\verbatim
+layout(std140) uniform KuhlFrame
+{
+	mat4 View;
+	mat4 Projection;
+	mat4 ViewInverse;
+	mat4 ProjectionInverse;
+	vec4 EyePosition; // camera position in world coordinates (w=1)
+	vec4 Viewport;    // x, y, width, height in pixels
+	float Time;       // seconds, same on all DGR hosts
+};
+\endverbatim
+ *
+ * Use viewmat_frame_override() to draw with other matrices (for
+ * example, labels drawn in normalized device coordinates). Programs
+ * used with viewmat_begin_stereo() declare an array of two blocks
+ * instead; the second block is connected to KUHL_FRAME_BINDING+1.
+ */
+#define KUHL_FRAME_BINDING 0
+
+/** Number of copies of a KG_DYNAMIC attribute that are kept in its
+ * buffer. The CPU writes one copy while the GPU may still be reading
+ * the others. */
+#define KUHL_RING_SLICES 3
+
+/** Storage for a vertex attribute that was created with
+ * KG_DYNAMIC. The buffer holds KUHL_RING_SLICES copies of the
+ * attribute. Each time the attribute changes, the next copy is
+ * written and drawn from. */
+typedef struct
+{
+	GLfloat *data; /**< Copy of the attribute in RAM that kuhl_geometry_attrib_get() returns */
+	int dirty; /**< Set if data may have changed since it was copied into the buffer */
+	GLubyte *mapped; /**< Persistent mapping of the entire buffer (NULL if glBufferStorage() isn't available) */
+	GLsizeiptr slice_size; /**< Size of one copy of the attribute in bytes */
+	unsigned int slice; /**< Copy that is currently used for drawing */
+	GLsync fences[KUHL_RING_SLICES]; /**< Signaled when the GPU has finished drawing with each copy */
+} kuhl_attrib_ring;
+
+/** Number of separate ranges of vertices that are remembered as
+ * changed in a KG_SHADOW attribute. Additional ranges are merged with
+ * the closest one. */
+#define KUHL_SHADOW_RANGES 4
+
+/** Copy in RAM of a vertex attribute that was created with
+ * KG_SHADOW. Changed vertices are copied into the attribute's buffer
+ * with glBufferSubData() the next time the geometry is drawn. */
+typedef struct
+{
+	GLfloat *data; /**< vertex_count*components floats that kuhl_geometry_attrib_get_range() returns */
+	GLuint dirty_first[KUHL_SHADOW_RANGES]; /**< First vertex in each range that has changed */
+	GLuint dirty_count[KUHL_SHADOW_RANGES]; /**< Number of vertices in each range that has changed */
+	unsigned int dirty_ranges; /**< Number of ranges that have changed since the buffer was updated */
+} kuhl_attrib_shadow;
+
 /** There is an array of kuhl_attrib structs inside of
  * kuhl_geometry to store all vertex attribute information */
 typedef struct
 {
 	char*    name; /**< GLSL variable name the attribute information should be linked with. */
 	GLuint   bufferobject; /**< OpenGL buffer the attribute is stored in */
+	GLfloat* mapped; /**< Pointer returned by glMapBuffer() if kuhl_geometry_attrib_get() mapped the buffer, NULL otherwise. */
+	GLint    location; /**< Location of the attribute in the geometry's GLSL program */
+	GLuint   components; /**< Number of values per vertex */
+	GLenum   type; /**< How the values are stored in bufferobject: GL_FLOAT, GL_HALF_FLOAT, GL_SHORT (KG_NORM16) or GL_INT_2_10_10_10_REV (KG_PACKED) */
+	GLsizei  vertex_size; /**< Bytes used by one vertex of this attribute in bufferobject */
+	GLsizei  stride; /**< Bytes from the start of one vertex to the next in bufferobject (0 if the attribute is tightly packed in its own buffer) */
+	GLsizeiptr offset; /**< Byte offset of the first vertex in bufferobject */
+	kuhl_attrib_ring *ring; /**< Set if the attribute was created with KG_DYNAMIC, NULL otherwise. */
+	kuhl_attrib_shadow *shadow; /**< Set if the attribute was created with KG_SHADOW, NULL otherwise. */
 } kuhl_attrib;
 
+/** A vertex attribute that has one value per instance instead of one
+ * value per vertex. See kuhl_geometry_instance_attrib(). */
+typedef struct
+{
+	char*  name; /**< GLSL variable name the attribute is linked with. */
+	GLuint bufferobject; /**< OpenGL buffer the attribute is stored in */
+	GLint  location; /**< Location of the attribute in the geometry's GLSL program (a mat4 uses 4 locations) */
+	GLuint components; /**< Floats per instance: 1, 2, 3, 4 or 16 (mat4) */
+	GLuint count; /**< Number of instances that the buffer has room for */
+	kuhl_attrib_ring *ring; /**< Set if the attribute was created with KG_DYNAMIC, NULL otherwise. */
+} kuhl_instance_attrib;
+
 /** There is an array of kuhl_texture structs inside of
  * kuhl_geometry. */
 typedef struct
 {
 	char* name; /**< GLSL variable name the texture should be linked with. */
 	GLuint textureId; /**< OpenGL texture id/name of the texture */
+	GLint location; /**< Location of the sampler in the geometry's GLSL program (-1 if inactive). */
 } kuhl_texture;
+
+/** Uniform locations that kuhl_geometry_draw() sets. They are looked
+ * up once per program instead of once per draw. */
+typedef struct
+{
+	GLuint program; /**< Program the locations were resolved in (0 if not resolved yet). */
+	unsigned int generation; /**< Program generation when the locations were resolved, see kuhl_program_relinked(). */
+	GLint hasTex; /**< Location of HasTex */
+	GLint boneMat; /**< Location of BoneMat */
+	GLint numBones; /**< Location of NumBones */
+	GLint geomTransform; /**< Location of GeomTransform */
+	GLint modelView; /**< Location of ModelView (only set by kuhl_drawlist_draw()) */
+	int hasTexValue; /**< 1 if a texture named 'tex' is active in the program */
+} kuhl_uniform_locations;
+
+/** Largest number of programs other than geom->program that a
+ * kuhl_geometry keeps a vertex array object for, see
+ * kuhl_geometry_draw_with_program(). */
+#define KUHL_MAX_PROGRAM_VAOS 4
+
+/** A vertex array object that connects the attributes of a
+ * kuhl_geometry to a program other than the geometry's own program,
+ * see kuhl_geometry_draw_with_program(). */
+typedef struct
+{
+	GLuint program; /**< Program that the attributes are connected to */
+	unsigned int generation; /**< Program generation when the locations were resolved, see kuhl_program_relinked(). */
+	GLuint vao; /**< Vertex array object for the program */
+	GLint attrib_locations[MAX_ATTRIBUTES]; /**< Location of each attribute in the program (-1 if inactive) */
+	GLint instance_locations[MAX_INSTANCE_ATTRIBUTES]; /**< Location of each per-instance attribute in the program (-1 if inactive) */
+	GLint texture_locations[MAX_TEXTURES]; /**< Location of each texture's sampler in the program (-1 if inactive) */
+	kuhl_uniform_locations locations; /**< Uniform locations in the program */
+	unsigned long last_used; /**< When the vertex array object was last drawn, used to pick one to replace */
+} kuhl_program_vao;
 	
+/** Information needed to draw several meshes that were packed into a
+ * single kuhl_geometry with one glMultiDrawElementsIndirect()
+ * call. The vertex program reads the GeomTransform for each mesh from
+ * a shader storage buffer:
+ *
+ * struct KuhlDraw { mat4 GeomTransform; ivec4 Material; };
+ * layout(std430, binding=0) buffer KuhlDrawData { KuhlDraw kuhlDraws[]; };
+ * in uint in_DrawID;
+ *
+ * and uses kuhlDraws[in_DrawID]. See samples/viewer-multidraw.vert. */
+typedef struct
+{
+	GLuint indirect_bufferobject; /**< GL_DRAW_INDIRECT_BUFFER with one command per mesh */
+	GLuint draw_bufferobject;     /**< GL_SHADER_STORAGE_BUFFER with GeomTransform and material index for each mesh */
+	GLuint drawid_bufferobject;   /**< Per-instance in_DrawID attribute (0, 1, 2, ...) */
+	unsigned int count; /**< Number of meshes/draw commands */
+	void *drawdata; /**< Copy of the data in draw_bufferobject */
+	struct _kuhl_geometry_ *parts; /**< The original geometry (without any OpenGL objects). Their matrix fields are used as GeomTransform. */
+} kuhl_multidraw;
+
+/** Largest number of levels of detail that a kuhl_geometry can
+ * have, including the original mesh. */
+#define KUHL_MAX_LODS 8
+
+/** One level of detail of a kuhl_geometry. */
+typedef struct
+{
+	GLuint count; /**< Number of indices in this level */
+	GLuint first; /**< Position in the index buffer of the first index of this level */
+	float error; /**< Distance between this level and the original mesh (before the geometry's matrix is applied). This is the root-mean-square distance to the planes of the original triangles near the most changed vertex, so some parts of the surface may move further. */
+} kuhl_lod_level;
+
+/** Simplified versions of a kuhl_geometry created by
+ * kuhl_geometry_lod_generate(). The indices of every level are stored
+ * one after another in the geometry's index buffer. Level 0 is the
+ * original mesh. */
+typedef struct
+{
+	kuhl_lod_level levels[KUHL_MAX_LODS]; /**< Levels ordered from most to least detailed */
+	unsigned int count; /**< Number of levels, including level 0 */
+	unsigned int current; /**< Level that is drawn, see kuhl_geometry_lod_select() */
+	float center[3]; /**< Center of a sphere that contains the geometry */
+	float radius; /**< Radius of the bounding sphere */
+} kuhl_lod;
+
+/** Meshlets of a kuhl_geometry and the ranges of the index buffer
+ * that are drawn after culling them, see kuhl_geometry_meshlets() and
+ * kuhl_geometry_meshlets_cull(). */
+typedef struct
+{
+	kuhl_meshlet *meshlets; /**< Meshlets in the order that they are stored in the index buffer */
+	unsigned int count; /**< Number of meshlets */
+	GLsizei *draw_counts; /**< Number of indices in each range of visible meshlets */
+	const GLvoid **draw_offsets; /**< Byte offset of each range in the index buffer */
+	GLsizei draw_ranges; /**< Number of ranges to draw */
+	int culled; /**< Set if the ranges were filled in by kuhl_geometry_meshlets_cull() and haven't been drawn yet */
+} kuhl_meshlets;
+
+/** Refers to a kuhl_geometry in the geometry registry. Unlike a
+ * pointer, a handle to geometry that was deleted is detected:
+ * kuhl_geometry_handle_lookup() returns NULL for it. The lower
+ * KUHL_GEOMETRY_HANDLE_SLOT_BITS bits are the registry slot and the
+ * upper bits count how many times the slot was used. A slot is
+ * retired instead of being used again when the count runs out, so an
+ * old handle never matches newer geometry. 0 is never a valid
+ * handle. */
+typedef uint64_t kuhl_geometry_handle;
+
+/** One of the geometry objects that kuhl_geometry_batch_static()
+ * merged into a batch. */
+typedef struct
+{
+	unsigned int index; /**< Position of the original geometry in the array passed to kuhl_geometry_batch_static() */
+	kuhl_geometry_handle source; /**< Handle of the original geometry */
+	GLuint first; /**< Position of the piece's first index in the index buffer */
+	GLuint count; /**< Number of indices in the piece */
+	float aabbox[6]; /**< Bounding box of the piece's transformed vertices (xmin, xmax, ymin, ymax, zmin, zmax) */
+	int hidden; /**< Set by kuhl_geometry_batch_hide() */
+} kuhl_batch_piece;
+
+/** The pieces of a geometry created by kuhl_geometry_batch_static()
+ * and the ranges of the index buffer that are drawn when some of them
+ * are hidden. */
+typedef struct
+{
+	kuhl_batch_piece *pieces; /**< Pieces in the order that they are stored in the index buffer */
+	unsigned int count; /**< Number of pieces */
+	unsigned int hidden_count; /**< Number of hidden pieces (the whole index buffer is drawn if 0) */
+	GLsizei *draw_counts; /**< Number of indices in each range of visible pieces */
+	const GLvoid **draw_offsets; /**< Byte offset of each range in the index buffer */
+	GLsizei draw_ranges; /**< Number of ranges to draw */
+	int ranges_valid; /**< Set if the ranges match the hidden flags of the pieces */
+} kuhl_batch;
+
 /** The kuhl_geometry struct is used to quickly draw 3D objects in
  * OpenGL 3.0. For more information, see the example programs and the
  * documentation for kuhl_geometry_new() and kuhl_geometry_draw(). The
@@ -119,25 +355,108 @@ typedef struct _kuhl_geometry_
 
 	kuhl_attrib attribs[MAX_ATTRIBUTES]; /**< A list of attributes, to add or modify an attribute, use kuhl_geometry_attrib(). */
 	unsigned int attrib_count; /**< Number of attributes in this geometry */
+	GLuint interleaved_bufferobject; /**< Buffer shared by attributes that were interleaved with kuhl_geometry_interleave() (0 if none) */
+
+	kuhl_instance_attrib instance_attribs[MAX_INSTANCE_ATTRIBUTES]; /**< Per-instance attributes, see kuhl_geometry_instance_attrib(). */
+	unsigned int instance_attrib_count; /**< Number of per-instance attributes in this geometry */
 
 	kuhl_texture textures[MAX_TEXTURES];
 	unsigned int texture_count;
 
+	kuhl_uniform_locations locations; /**< Cached uniform locations for the current program. */
+	kuhl_program_vao *program_vaos; /**< Vertex array objects for other programs (NULL if there are none), see kuhl_geometry_draw_with_program(). */
+	unsigned int program_vao_count; /**< Number of vertex array objects in program_vaos */
+
 	GLuint indices_len; /**< How many indices are there? - Set by kuhl_geometry_indices(). */
 	GLuint indices_bufferobject; /**< ID of buffer holding indices. - Set by kuhl_geometry_indices(). */
+	GLenum indices_type; /**< GL_UNSIGNED_SHORT or GL_UNSIGNED_INT - Set by kuhl_geometry_indices(). */
 
 	float matrix[16]; /**< A matrix that all of this geometry should be transformed by. Appears in GLSL as GeomTransform. */
 	float fitMatrix[16];
+	float decodeMatrix[16]; /**< Converts positions stored with KG_NORM16 back into model coordinates. Already included in matrix. */
+	float aabbox[6]; /**< Bounding box of in_Position before matrix is applied (xmin, xmax, ymin, ymax, zmin, zmax). */
+	int aabbox_valid; /**< 1 if aabbox is set, 0 if the bounds of the geometry are unknown. */
 	int has_been_drawn; /**< Has this piece of geometry been drawn yet? */
 	
 	struct aiNode *assimp_node; /**< Assimp node that this kuhl_geometry object was created from. */
 	struct aiScene *assimp_scene; /**< Assimp scene that this kuhl_geometry object is a part of. */
 	kuhl_bonemat *bones; /**< Information about bones in the model */
+	int material_index; /**< Index of the model's material that this geometry uses (-1 if unknown) */
+	kuhl_multidraw *multidraw; /**< If not NULL, this geometry contains several packed meshes. */
+
+	GLuint occlusion_query; /**< Query used by kuhl_geometry_draw_occlusion() (0 if not created yet) */
+	struct _kuhl_geometry_ *occlusion_proxy; /**< Bounding box drawn in occlusion_query (NULL if not created yet) */
+	kuhl_lod *lod; /**< Levels of detail (NULL if there are none), see kuhl_geometry_lod_generate(). */
+	kuhl_meshlets *meshlets; /**< Meshlets of the most detailed level (NULL if there are none), see kuhl_geometry_meshlets(). */
+	kuhl_batch *batch; /**< Pieces that this geometry was merged from (NULL if it isn't a batch), see kuhl_geometry_batch_static(). */
+	struct _kuhl_shared_buffers_ *shared; /**< Set if the vertex and index buffers may be used by other geometry, see kuhl_geometry_share(). */
+	kuhl_geometry_handle handle; /**< This geometry's entry in the geometry registry (0 if it has none), see kuhl_geometry_registry_get(). */
 
 	struct _kuhl_geometry_ *next; /**< A kuhl_geometry object can be a linked list. */
 	
 } kuhl_geometry;
 
+/** The draw-related values of every kuhl_geometry that has been
+ * created with kuhl_geometry_new() and not deleted yet. The values
+ * are stored in parallel arrays so that code which examines many
+ * objects reads contiguous memory. kuhl_geometry_draw(),
+ * kuhl_geometry_draw_culled() and kuhl_geometry_count() use these
+ * arrays instead of following the next pointers of a list. The slot
+ * of a geometry is geom->handle & KUHL_GEOMETRY_HANDLE_SLOT_MASK.
+ * Unused slots have geom[slot] set to NULL. See
+ * kuhl_geometry_registry_get(). */
+typedef struct
+{
+	unsigned int slots; /**< Length of each array */
+	unsigned int count; /**< Number of geometry objects in the registry */
+	kuhl_geometry * const *geom; /**< The geometry in each slot */
+	const kuhl_geometry_handle *handle; /**< The current handle for each slot */
+	const GLuint *vao;
+	const GLuint *program;
+	const GLuint *vertex_count;
+	const GLuint *indices_len;
+	const float (*matrix)[16]; /**< geom->matrix, updated by the library functions that change it */
+	const float (*aabbox)[6];
+	const int *aabbox_valid;
+} kuhl_geometry_registry;
+
+/** Bits of a kuhl_geometry_handle that contain the registry slot. The
+ * remaining 32 bits count how many times the slot has been used. */
+#define KUHL_GEOMETRY_HANDLE_SLOT_BITS 32
+#define KUHL_GEOMETRY_HANDLE_SLOT_MASK 0xffffffffu
+
+/** Vertex and index buffers that are drawn by more than one
+ * kuhl_geometry, see kuhl_geometry_share(). The buffers are deleted
+ * when the last kuhl_geometry that uses them is deleted. */
+typedef struct _kuhl_shared_buffers_
+{
+	unsigned int refcount; /**< Number of kuhl_geometry objects that use the buffers */
+	GLuint buffers[MAX_ATTRIBUTES+1]; /**< Vertex and index buffers */
+	unsigned int buffer_count; /**< Number of buffers */
+	char *key; /**< Name the model loader finds these buffers by (file, mesh and options), NULL if they aren't cached */
+	kuhl_geometry *source; /**< Copy of the attribute, index and LOD information that the model loader shares with meshes that it loads later (NULL if not cached) */
+} kuhl_shared_buffers;
+
+/** One piece of geometry in a kuhl_drawlist. */
+typedef struct
+{
+	kuhl_geometry *geom; /**< Geometry to draw (geom->next is ignored) */
+	float geomTransform[16]; /**< GeomTransform to use (copied from geom->matrix when added) */
+	float modelview[16]; /**< ModelView to use */
+	int hasModelview; /**< Set if modelview should be sent to the ModelView uniform */
+	unsigned int order; /**< Order the item was added in */
+} kuhl_drawlist_item;
+
+/** A kuhl_drawlist collects geometry that should be drawn and then
+ * draws it sorted by program, textures and vertex array object so
+ * that there are as few OpenGL state changes as possible. See
+ * kuhl_drawlist_new(), kuhl_drawlist_add() and kuhl_drawlist_draw(). */
+typedef struct
+{
+	list *items; /**< List of kuhl_drawlist_item structs */
+	int sorted; /**< Set if items are already sorted */
+} kuhl_drawlist;
+
 
 /** Call kuhl_errorcheck() with no parameters frequently for easy
  * OpenGL error checking. OpenGL doesn't report errors by
@@ -150,29 +469,48 @@ typedef struct _kuhl_geometry_
  * One alternative way to carefully check for errors is to set up a
  * OpenGL context with debugging enabled and then use
  * glDebugMessageCallback() to ask OpenGL to call a function that you
- * write every time an error occurs. We aren't using this seemingly
- * easier callback approach because it doesn't make it easy to narrow
- * down the line(s) of code causing an error.
+ * write every time an error occurs. We don't use this approach by
+ * default because it doesn't make it easy to narrow down the line(s)
+ * of code causing an error.
+ *
+ * However, glGetError() can cause the driver to synchronize with the
+ * GPU, and the library calls kuhl_errorcheck() many times for every
+ * piece of geometry that it draws. If KUHL_NO_ERRORCHECK is defined
+ * (set the KUHL_ERRORCHECK cmake option to OFF), kuhl_errorcheck()
+ * compiles to nothing and errors are instead reported by the debug
+ * callback (see the "gl.debug" config setting). You can still call
+ * kuhl_errorcheckFileLine() directly in that case.
  */
+#ifdef KUHL_NO_ERRORCHECK
+#define kuhl_errorcheck() ((void)0)
+#else
 #define kuhl_errorcheck() kuhl_errorcheckFileLine(__FILE__, __LINE__, __func__)
+#endif
 
 
 
 	
 // kuhl_errorcheck() calls this C function:
 int kuhl_errorcheckFileLine(const char *file, int line, const char *func);
-// kuhl_malloc() calls this C function:
-void* kuhl_mallocFileLine(size_t size, const char *file, int line);
 
 GLFWwindow* kuhl_get_window();
 void kuhl_ogl_init(int *argcp, char **argv, int width, int height, int oglProfile, int msaaSamples);
 
+void kuhl_gl_state_invalidate(void);
+void kuhl_gl_state_restore(int enable);
+void kuhl_gl_use_program(GLuint program);
+void kuhl_gl_bind_vertex_array(GLuint vao);
+void kuhl_gl_active_texture(GLenum texture);
+void kuhl_gl_bind_texture(GLuint unit, GLuint texture);
+
 GLuint kuhl_create_shader(const char *filename, GLuint shader_type);
 GLuint kuhl_create_program(const char *vertexFilename, const char *fragFilename);
 void kuhl_delete_program(GLuint program);
+void kuhl_program_relinked(GLuint program);
 void kuhl_print_program_log(GLuint program);
 void kuhl_print_program_info(GLuint program);
 GLint kuhl_get_uniform(const char *uniformName);
+void kuhl_uniform_stats(long *issued, long *skipped);
 GLint kuhl_get_attribute(GLuint program, const char *attributeName);
 
 
@@ -187,13 +525,47 @@ int kuhl_geometry_collide(kuhl_geometry *geom1, float mat1[16],
 void kuhl_geometry_new(kuhl_geometry *geom, GLuint program, unsigned int vertexCount, GLint primitive_type);
 void kuhl_geometry_draw_instanced(kuhl_geometry *geom, GLsizei instances);
 void kuhl_geometry_draw(kuhl_geometry *geom);
+void kuhl_geometry_draw_with_program(kuhl_geometry *geom, GLuint program);
+void kuhl_geometry_draw_occlusion(kuhl_geometry *geom);
+void kuhl_occlusion_stats(long *visible, long *occluded, long *pending);
+int kuhl_geometry_draw_culled(kuhl_geometry *geom, const float modelview[16], const float projection[16], int *culled);
+void kuhl_geometry_lod_generate(kuhl_geometry *geom, float maxError, int kg_options);
+void kuhl_geometry_lod_select(kuhl_geometry *geom, const float modelview[16], const float projection[16], int viewportHeight, int kg_options);
+int kuhl_geometry_lod_save(const kuhl_geometry *geom, const char *filename, float maxError);
+int kuhl_geometry_lod_load(kuhl_geometry *geom, const char *filename, float maxError);
+void kuhl_geometry_optimize(kuhl_geometry *geom, int kg_options);
+void kuhl_geometry_weld(kuhl_geometry *geom, float epsilon, int kg_options);
+void kuhl_geometry_meshlets(kuhl_geometry *geom, int kg_options);
+int kuhl_geometry_meshlets_cull(kuhl_geometry *geom, const float modelview[16], const float projection[16], int cullBackFaces, int kg_options);
+void kuhl_frustum_planes(float planes[6][4], const float mat[16]);
+int kuhl_bbox_frustum_cull(unsigned char *visible, const float *bboxes, int count, float planes[6][4]);
+kuhl_drawlist* kuhl_drawlist_new(void);
+void kuhl_drawlist_add(kuhl_drawlist *dl, kuhl_geometry *geom, const float modelview[16], int kg_options);
+void kuhl_drawlist_draw(kuhl_drawlist *dl);
+void kuhl_drawlist_draw_instanced(kuhl_drawlist *dl, GLsizei instances);
+void kuhl_drawlist_clear(kuhl_drawlist *dl);
+void kuhl_drawlist_delete(kuhl_drawlist *dl);
 void kuhl_geometry_delete(kuhl_geometry *geom);
+void kuhl_geometry_share(kuhl_geometry *geom, kuhl_geometry *source, GLuint program);
 unsigned int kuhl_geometry_count(const kuhl_geometry *geom);
+kuhl_geometry* kuhl_geometry_batch_static(kuhl_geometry **geoms, const float *matrices, unsigned int count);
+int kuhl_geometry_batch_hide(kuhl_geometry *batches, unsigned int index, int hidden);
+int kuhl_geometry_batch_pick(const kuhl_geometry *batches, const float origin[3], const float direction[3], float *distance);
+const kuhl_geometry_registry* kuhl_geometry_registry_get(void);
+kuhl_geometry* kuhl_geometry_handle_lookup(kuhl_geometry_handle handle);
+void kuhl_geometry_registry_sync(kuhl_geometry *geom, int kg_options);
 
 void kuhl_geometry_program(kuhl_geometry *geom, GLuint program, int kg_options);
 GLfloat* kuhl_geometry_attrib_get(kuhl_geometry *geom, const char *name, GLint *size);
+GLfloat* kuhl_geometry_attrib_get_strided(kuhl_geometry *geom, const char *name, GLint *size, GLint *stride);
+GLfloat* kuhl_geometry_attrib_get_range(kuhl_geometry *geom, const char *name, GLuint firstVertex, GLuint vertexCount, GLint *size);
 void kuhl_geometry_indices(kuhl_geometry *geom, GLuint *indices, GLuint indexCount);
 void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint components, const char* name, int kg_options);
+void kuhl_geometry_attrib_dynamic(kuhl_geometry *geom, const char *name, int kg_options);
+void kuhl_geometry_attrib_shadow(kuhl_geometry *geom, const char *name, int kg_options);
+void kuhl_geometry_interleave(kuhl_geometry *geom, int kg_options);
+void kuhl_geometry_instance_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint instanceCount, GLuint components, const char *name, int kg_options);
+void kuhl_geometry_instance_attrib_update(kuhl_geometry *geom, const GLfloat *data, GLuint instanceCount, const char *name, int kg_options);
 void kuhl_geometry_texture(kuhl_geometry *geom, GLuint texture, const char* name, int kg_options);
 
 
@@ -211,6 +583,7 @@ void kuhl_video_record(const char *fileLabel, int fps);
 
 void kuhl_update_model(kuhl_geometry *first_geom, unsigned int animationNum, float time);
 kuhl_geometry* kuhl_load_model(const char *modelFilename, const char *textureDirname, GLuint program, float bbox[6]);
+kuhl_geometry* kuhl_load_model_options(const char *modelFilename, const char *textureDirname, GLuint program, float bbox[6], int kl_options);
 
 void kuhl_bbox_fit(float result[16], const float bbox[6], int sitOnXZPlane);
 void kuhl_make_geom_fit(kuhl_geometry *geom, const float bbox[6], const int sitOnXZPlane, const int x, const int y, const int z);
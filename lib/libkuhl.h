@@ -18,6 +18,7 @@
 #include "kalman.h"
 #include "keyboard.h"
 #include "kuhl-config.h"
+#include "kuhl-mesh.h"
 #include "kuhl-nodep.h"
 #include "kuhl-util.h"	
 #include "list.h"
@@ -9,6 +9,7 @@
 
 #include "windows-compat.h"
 #include <stdlib.h>
+#include <string.h>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
@@ -37,6 +38,27 @@
 static dispmode *display;
 static camcontrol *controller;
 
+/** Contents of the KuhlFrame uniform block (see KUHL_FRAME_BINDING)
+ * in std140 layout. */
+typedef struct
+{
+	float view[16];
+	float projection[16];
+	float viewInverse[16];
+	float projectionInverse[16];
+	float eyePosition[4];
+	float viewport[4];
+	float time;
+	float padding[3];
+} viewmat_frame_block;
+
+static GLuint viewmat_frame_ubo = 0; /**< Buffer holding two KuhlFrame blocks per viewport (see viewmat_frame_update()) */
+static GLint viewmat_frame_stride = 0; /**< Bytes between the blocks in viewmat_frame_ubo */
+static int viewmat_frame_count = 0; /**< Number of blocks that fit in viewmat_frame_ubo */
+static double viewmat_frame_time = 0; /**< Time for the current frame, see viewmat_begin_frame() */
+static int viewmat_frame_viewport = 0; /**< Viewport that is being drawn */
+static int viewmat_frame_stereo = 0; /**< 1 between viewmat_begin_stereo() and viewmat_end_stereo() */
+
 
 /** The display mode specifies how images are drawn to the screen. */
 typedef enum
@@ -125,6 +147,15 @@ float viewmat_window_aspect_ratio(void)
 /** Should be called prior to rendering a frame. */
 void viewmat_begin_frame(void)
 {
+	/* The program may have changed OpenGL state that libkuhl doesn't
+	 * know about since the last frame. */
+	kuhl_gl_state_invalidate();
+
+	/* Make sure that all DGR hosts put the same time in the KuhlFrame
+	 * uniform block. */
+	viewmat_frame_time = glfwGetTime();
+	dgr_setget("!!viewmatTime", &viewmat_frame_time, sizeof(double));
+
 	display->begin_frame();
 }
 
@@ -152,6 +183,8 @@ void viewmat_end_frame(void)
  */
 void viewmat_begin_eye(int viewportID)
 {
+	kuhl_gl_state_invalidate();
+	viewmat_frame_viewport = viewportID;
 	display->begin_eye(viewportID);
 }
 
@@ -402,6 +435,114 @@ void viewmat_get_pos(float pos[3], viewmat_eye eye)
 
 
 
+/** Fills in a KuhlFrame uniform block and binds it to
+ * KUHL_FRAME_BINDING so that any GLSL program that uses the block gets
+ * the camera information without the matrices being sent to each
+ * program. The block holds the frame time, so it is uploaded every
+ * time this is called.
+ *
+ * Each viewport has two blocks in the buffer so that drawing the
+ * second eye doesn't have to wait for the first eye: Block viewportID
+ * holds the matrices from viewmat_get() and block
+ * viewmat_num_viewports()+viewportID holds the matrices from
+ * viewmat_frame_override().
+ *
+ * @param viewmatrix The view matrix for the block.
+ * @param projmatrix The projection matrix for the block.
+ * @param viewport The viewport x, y, width and height.
+ * @param slot Which block in the buffer to fill in.
+ */
+static void viewmat_frame_update(const float viewmatrix[16], const float projmatrix[16], const int viewport[4], int slot)
+{
+	if(slot < 0)
+		return;
+
+	if(slot >= viewmat_frame_count)
+	{
+		int count = display->num_viewports()*2;
+		if(count <= slot)
+			count = slot+1;
+		GLint align = 256;
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+		viewmat_frame_stride = (GLint) ((sizeof(viewmat_frame_block)+align-1)/align*align);
+
+		if(viewmat_frame_ubo == 0)
+			glGenBuffers(1, &viewmat_frame_ubo);
+		glBindBuffer(GL_UNIFORM_BUFFER, viewmat_frame_ubo);
+		glBufferData(GL_UNIFORM_BUFFER, viewmat_frame_stride*count, NULL, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		viewmat_frame_count = count;
+	}
+
+	viewmat_frame_block block;
+	memset(&block, 0, sizeof(block));
+	mat4f_copy(block.view, viewmatrix);
+	mat4f_copy(block.projection, projmatrix);
+	mat4f_invert_new(block.viewInverse, viewmatrix);
+	mat4f_invert_new(block.projectionInverse, projmatrix);
+	mat4f_getColumn(block.eyePosition, block.viewInverse, 3);
+	for(int i=0; i<4; i++)
+		block.viewport[i] = (float) viewport[i];
+	block.time = (float) viewmat_frame_time;
+
+	GLintptr offset = viewmat_frame_stride*slot;
+	glBindBuffer(GL_UNIFORM_BUFFER, viewmat_frame_ubo);
+	glBufferSubData(GL_UNIFORM_BUFFER, offset, sizeof(block), &block);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferRange(GL_UNIFORM_BUFFER, KUHL_FRAME_BINDING, viewmat_frame_ubo, offset, sizeof(block));
+	kuhl_errorcheck();
+}
+
+/** Binds one of the blocks filled in by viewmat_frame_update().
+ *
+ * @param slot The block to bind.
+ * @param binding The uniform buffer binding point to bind it to.
+ */
+static void viewmat_frame_bind(int slot, GLuint binding)
+{
+	if(slot >= viewmat_frame_count)
+		return;
+	glBindBufferRange(GL_UNIFORM_BUFFER, binding, viewmat_frame_ubo,
+	                  viewmat_frame_stride*slot, sizeof(viewmat_frame_block));
+}
+
+/** Replaces the KuhlFrame uniform block of the viewport being drawn
+ * with one that holds the given matrices. This is useful for things
+ * that aren't drawn with the camera from viewmat_get(), such as labels
+ * drawn directly in normalized device coordinates (pass an identity
+ * matrix for both). Programs that use the block draw with these
+ * matrices until viewmat_frame_restore() or viewmat_get() is
+ * called. During viewmat_begin_stereo(), both eyes get the matrices.
+ *
+ * @param viewmatrix The view matrix to put in the block.
+ *
+ * @param projmatrix The projection matrix to put in the block.
+ */
+void viewmat_frame_override(const float viewmatrix[16], const float projmatrix[16])
+{
+	int viewport[4];
+	display->get_viewport(viewport, viewmat_frame_viewport);
+	viewmat_frame_update(viewmatrix, projmatrix, viewport,
+	                     display->num_viewports()+viewmat_frame_viewport);
+	if(viewmat_frame_stereo)
+		viewmat_frame_bind(display->num_viewports()+viewmat_frame_viewport,
+		                   KUHL_FRAME_BINDING+1);
+}
+
+/** Binds the KuhlFrame uniform block that viewmat_get() filled in for
+ * the viewport being drawn again after viewmat_frame_override(). */
+void viewmat_frame_restore(void)
+{
+	if(viewmat_frame_stereo)
+	{
+		viewmat_frame_bind(0, KUHL_FRAME_BINDING);
+		viewmat_frame_bind(1, KUHL_FRAME_BINDING+1);
+	}
+	else
+		viewmat_frame_bind(viewmat_frame_viewport, KUHL_FRAME_BINDING);
+	kuhl_errorcheck();
+}
+
 /** Get a 4x4 view matrix. Some types of systems also need to update
  * the frustum based on where the virtual camera is. For example, on
  * the IVS display wall, the frustum is adjusted dynamically based on
@@ -512,6 +653,11 @@ viewmat_eye viewmat_get(float viewmatrix[16], float projmatrix[16], int viewport
 
 	/* Sanity checks */
 	viewmat_validate_ipd(viewmatrix, viewportID);
+
+	/* Make the matrices available to GLSL programs that use the
+	 * KuhlFrame uniform block. */
+	viewmat_frame_viewport = viewportID;
+	viewmat_frame_update(viewmatrix, projmatrix, viewport, viewportID);
 	return eye;
 }
 
@@ -529,6 +675,93 @@ void viewmat_get_viewport(int viewportValue[4], int viewportNum)
 }
 
 
+/** Checks if both eyes can be drawn at the same time with
+    viewmat_begin_stereo(). This requires a display mode that puts
+    both eyes in the same window (such as the side-by-side HMD mode)
+    and the GL_ARB_shader_viewport_layer_array extension so that the
+    vertex program can pick the viewport. glViewportIndexedf() also
+    needs OpenGL 4.1 or GL_ARB_viewport_array. It can be turned off with
+    viewmat.singlepass=0 in the config file. Must be called after
+    viewmat_init().
+
+    @return 1 if viewmat_begin_stereo() can be used, 0 otherwise.
+*/
+int viewmat_stereo_supported(void)
+{
+	if(display == NULL || display->num_viewports() != 2 ||
+	   !display->single_pass_stereo())
+		return 0;
+	if(!GLEW_ARB_shader_viewport_layer_array ||
+	   !(GLEW_VERSION_4_1 || GLEW_ARB_viewport_array))
+		return 0;
+	return kuhl_config_boolean("viewmat.singlepass", 1, 1);
+}
+
+/** Prepares to draw both eyes at once. This can be used instead of
+    the viewmat_begin_eye()/viewmat_end_eye() loop to submit the scene
+    once instead of once per eye. Viewport 0 and 1 are set up as
+    OpenGL viewports 0 and 1 with glViewportIndexedf(). The program
+    should draw 2 instances of everything and use gl_InstanceID to
+    choose the matrices for the eye and to set gl_ViewportIndex. For
+    example:
+
+\verbatim
+#extension GL_ARB_shader_viewport_layer_array : require
+uniform mat4 ModelView[2];
+layout(std140) uniform KuhlFrame { ... } Frame[2];
+...
+int eye = gl_InstanceID % 2;
+gl_ViewportIndex = eye;
+mat4 projection = eye == 0 ? Frame[0].Projection : Frame[1].Projection;
+gl_Position = projection * ModelView[eye] * GeomTransform * vec4(in_Position, 1);
+\endverbatim
+
+    The KuhlFrame uniform block for viewport 0 is bound to
+    KUHL_FRAME_BINDING and the block for viewport 1 to
+    KUHL_FRAME_BINDING+1, which is where kuhl_create_program() connects
+    the two elements of a KuhlFrame block array.
+
+    Call viewmat_end_stereo() when finished drawing.
+
+    @param viewmatrix To be filled in with the view matrices for viewport 0 and 1.
+
+    @param projmatrix To be filled in with the projection matrices for viewport 0 and 1.
+
+    @return 1 if the matrices were filled in and both eyes should be
+    drawn at once. 0 if viewmat_stereo_supported() is false; the
+    caller should draw each eye separately.
+*/
+int viewmat_begin_stereo(float viewmatrix[2][16], float projmatrix[2][16])
+{
+	if(!viewmat_stereo_supported())
+		return 0;
+
+	kuhl_gl_state_invalidate();
+	for(int i=0; i<2; i++)
+	{
+		int viewport[4];
+		display->get_viewport(viewport, i);
+		glViewportIndexedf(i, (float) viewport[0], (float) viewport[1],
+		                   (float) viewport[2], (float) viewport[3]);
+		viewmat_get(viewmatrix[i], projmatrix[i], i);
+	}
+	viewmat_frame_stereo = 1;
+	viewmat_frame_restore();
+	return 1;
+}
+
+/** Should be called after drawing both eyes following
+ * viewmat_begin_stereo(). */
+void viewmat_end_stereo(void)
+{
+	viewmat_frame_stereo = 0;
+
+	/* glViewport() sets all of the viewports. */
+	int width, height;
+	viewmat_window_size(&width, &height);
+	glViewport(0, 0, width, height);
+}
+
 /** Returns the number of viewports that viewmat has.
 
     @return The number of viewports that viewmat has.
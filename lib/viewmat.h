@@ -50,11 +50,17 @@ int viewmat_get_framebuffer(int viewportID);
 void viewmat_init(const float pos[3], const float look[3], const float up[3]);
 void viewmat_get_pos(float pos[3], viewmat_eye eye);
 viewmat_eye viewmat_get(float viewmatrix[16], float projmatrix[16], int viewportNum);
+void viewmat_frame_override(const float viewmatrix[16], const float projmatrix[16]);
+void viewmat_frame_restore(void);
 
 int viewmat_num_viewports(void);
 void viewmat_get_viewport(int viewportValue[4], int viewportNum);
 
 void viewmat_get_frustum(float frustum[6], int viewportID);
+
+int viewmat_stereo_supported(void);
+int viewmat_begin_stereo(float viewmatrix[2][16], float projmatrix[2][16]);
+void viewmat_end_stereo(void);
 void viewmat_get_master_frustum(float frustum[6]);
 
 #ifdef __cplusplus
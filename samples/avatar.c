@@ -163,11 +163,8 @@ void display()
 
 		glUseProgram(program);
 		kuhl_errorcheck();
-		/* Send the perspective projection matrix to the vertex program. */
-		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
-		                   1, // number of 4x4 float matrices
-		                   0, // transpose
-		                   perspective); // value
+		/* The vertex program gets the projection matrix from the
+		 * KuhlFrame uniform block that viewmat_get() filled in. */
 
 		/* Send the modelview matrix to the vertex program. */
 		glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
@@ -228,7 +225,7 @@ void display()
 			/* Make sure we don't use a projection matrix */
 			float identity[16];
 			mat4f_identity(identity);
-			glUniformMatrix4fv(kuhl_get_uniform("Projection"), 1, 0, identity);
+			viewmat_frame_override(identity, identity);
 
 			/* Don't use depth testing and make sure we use the texture
 			 * rendering style */
@@ -236,6 +233,7 @@ void display()
 			glUniform1i(kuhl_get_uniform("renderStyle"), 1);
 			kuhl_geometry_draw(fpsgeom); /* Draw the quad */
 			glEnable(GL_DEPTH_TEST);
+			viewmat_frame_restore();
 			kuhl_errorcheck();
 		}
 
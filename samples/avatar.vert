@@ -12,8 +12,20 @@ in vec4 in_BoneWeight;
 uniform mat4 BoneMat[128];
 uniform int NumBones;
 
+/* Camera information filled in by viewmat (see KUHL_FRAME_BINDING
+ * in kuhl-util.h). */
+layout(std140) uniform KuhlFrame
+{
+	mat4 View;
+	mat4 Projection;
+	mat4 ViewInverse;
+	mat4 ProjectionInverse;
+	vec4 EyePosition;
+	vec4 Viewport;
+	float Time;
+};
+
 uniform mat4 ModelView;
-uniform mat4 Projection;
 uniform mat4 GeomTransform;
 
 
@@ -402,7 +402,7 @@ void keyboard(GLFWwindow* window, int key, int scancode, int action, int mods)
 }
 
 
-void draw_target(float viewMat[16], float perspective[16], int trialNum)
+void draw_target(float viewMat[16], int trialNum)
 {
 	/* Draw the target model */
 	float targ_position[3];
@@ -414,8 +414,6 @@ void draw_target(float viewMat[16], float perspective[16], int trialNum)
 	// modelview = viewMat * modelMat * scaleMat
 	mat4f_mult_mat4f_many(modelview, viewMat, modelMat, scaleMat, NULL);
 	
-	glUniformMatrix4fv(kuhl_get_uniform("Projection"), 1, 0,
-	                   perspective);
 	glUniformMatrix4fv(kuhl_get_uniform("ModelView"), 1, // number of 4x4 float matrices
 	                   0, // transpose
 	                   modelview); // value
@@ -471,11 +469,8 @@ void display()
 		viewmat_get(viewMat, perspective, viewportID);
 		glUseProgram(program);
 		kuhl_errorcheck();
-		/* Send the perspective projection matrix to the vertex program. */
-		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
-			1, // number of 4x4 float matrices
-			0, // transpose
-			perspective); // value
+		/* The vertex program gets the projection matrix from the
+		 * KuhlFrame uniform block that viewmat_get() filled in. */
 
 		//Rotate the room based on the hardcoded room offset angle.
 		float offsetRot[16];
@@ -514,17 +509,16 @@ void display()
 		{
 			/* Draw all the targets */
 			for(int i=0; i<num_trials; i++)
-				draw_target(viewMat, perspective, i);
+				draw_target(viewMat, i);
 
 			float transMat[16],modelview[16];
 			mat4f_translateVec_new(transMat, start_pos);
 			mat4f_mult_mat4f_new(modelview, viewMat, transMat);
 			glUniformMatrix4fv(kuhl_get_uniform("ModelView"),1,0,modelview);
-			glUniformMatrix4fv(kuhl_get_uniform("Projection"),1,0,perspective);
 			kuhl_geometry_draw(origingeom);
 		}
 		else if(showing_target)
-			draw_target(viewMat, perspective, current_trial);
+			draw_target(viewMat, current_trial);
 
 		if(blank_screen)
 		{
@@ -0,0 +1,173 @@
+/* Copyright (c) 2026 agent. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Measures how much CPU time kuhl_geometry_draw() takes for
+ * each piece of geometry that it draws. Run this program once when
+ * libkuhl is compiled normally and once when it is compiled with the
+ * KUHL_ERRORCHECK cmake option set to OFF to see how much time the
+ * glGetError() calls in kuhl_errorcheck() cost.
+ *
+ * The program also times glGetError() by itself since some drivers
+ * must wait for the GPU before they can answer it.
+ *
+ * @author agent
+ */
+
+#include "libkuhl.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+static GLuint program = 0; /**< id value for the GLSL program */
+
+/** Number of quads drawn every frame. Each one is a separate
+ * kuhl_geometry so that each one requires a separate draw call. */
+#define NUM_QUADS 2000
+static kuhl_geometry quads[NUM_QUADS];
+
+/** Number of frames to average over before printing results. */
+#define FRAMES_PER_REPORT 100
+
+static long drawMicroseconds = 0;   /**< Time spent in kuhl_geometry_draw() since the last report */
+static long errorMicroseconds = 0;  /**< Time spent in glGetError() since the last report */
+static int frameCount = 0;
+
+/* Called by GLFW whenever a key is pressed. */
+void keyboard(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+	/* If the library handles this keypress, return */
+	if (kuhl_keyboard_handler(window, key, scancode, action, mods))
+		return;
+}
+
+/** Draws the 3D scene. */
+void display()
+{
+	viewmat_begin_frame();
+	for(int viewportID=0; viewportID<viewmat_num_viewports(); viewportID++)
+	{
+		viewmat_begin_eye(viewportID);
+
+		int viewport[4]; // x,y of lower left corner, width, height
+		viewmat_get_viewport(viewport, viewportID);
+		glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+		glScissor(viewport[0], viewport[1], viewport[2], viewport[3]);
+		glEnable(GL_SCISSOR_TEST);
+		glClearColor(.2,.2,.2,0); // set clear color to grey
+		glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+		glDisable(GL_SCISSOR_TEST);
+		glEnable(GL_DEPTH_TEST); // turn on depth testing
+		kuhl_errorcheck();
+
+		float viewMat[16], perspective[16];
+		viewmat_get(viewMat, perspective, viewportID);
+
+		glUseProgram(program);
+		glUniformMatrix4fv(kuhl_get_uniform("ModelView"), 1, 0, viewMat);
+		kuhl_errorcheck();
+
+		/* Make sure that the GPU isn't busy with earlier work so that
+		 * we only measure the time it takes to submit the draw
+		 * calls. */
+		glFinish();
+
+		long start = kuhl_microseconds();
+		for(int i=0; i<NUM_QUADS; i++)
+			kuhl_geometry_draw(&quads[i]);
+		drawMicroseconds += kuhl_microseconds() - start;
+
+		/* Time the same number of glGetError() calls that
+		 * kuhl_errorcheck() would make if it were called once per
+		 * draw. */
+		start = kuhl_microseconds();
+		for(int i=0; i<NUM_QUADS; i++)
+			glGetError();
+		errorMicroseconds += kuhl_microseconds() - start;
+
+		glUseProgram(0);
+		viewmat_end_eye(viewportID);
+	}
+	viewmat_end_frame();
+	kuhl_errorcheck();
+
+	frameCount++;
+	if(frameCount == FRAMES_PER_REPORT)
+	{
+		long draws = (long) NUM_QUADS * FRAMES_PER_REPORT * viewmat_num_viewports();
+#ifdef KUHL_NO_ERRORCHECK
+		const char *mode = "KUHL_ERRORCHECK=OFF";
+#else
+		const char *mode = "KUHL_ERRORCHECK=ON";
+#endif
+		msg(MSG_INFO, "%s: %.3f microseconds per kuhl_geometry_draw(), %.3f microseconds per glGetError()",
+		    mode, drawMicroseconds / (double) draws, errorMicroseconds / (double) draws);
+		/* Most of the uniform variables that kuhl_geometry_draw()
+		 * sets have the same value for every quad. */
+		long issued, skipped;
+		kuhl_uniform_stats(&issued, &skipped);
+		msg(MSG_INFO, "%.2f glUniform*() calls made and %.2f skipped per kuhl_geometry_draw()",
+		    issued / (double) draws, skipped / (double) draws);
+		drawMicroseconds = 0;
+		errorMicroseconds = 0;
+		frameCount = 0;
+	}
+}
+
+void init_geometryQuad(kuhl_geometry *geom, GLuint prog, float x, float y)
+{
+	kuhl_geometry_new(geom, prog, 4, GL_TRIANGLES);
+
+	GLfloat vertexPositions[] = {x,      y,      0,
+	                             x+.01f, y,      0,
+	                             x+.01f, y+.01f, 0,
+	                             x,      y+.01f, 0 };
+	kuhl_geometry_attrib(geom, vertexPositions, 3, "in_Position", KG_WARN);
+
+	GLuint indexData[] = { 0, 1, 2,
+	                       0, 2, 3 };
+	kuhl_geometry_indices(geom, indexData, 6);
+	kuhl_errorcheck();
+}
+
+int main(int argc, char** argv)
+{
+	/* Initialize GLFW and GLEW */
+	kuhl_ogl_init(&argc, argv, 512, 512, 32, 4);
+
+	glfwSetKeyCallback(kuhl_get_window(), keyboard);
+
+	/* Don't wait for vsync so we aren't limited to the refresh rate. */
+	glfwSwapInterval(0);
+
+	program = kuhl_create_program("triangle.vert", "triangle.frag");
+	glUseProgram(program);
+	glUniform1i(kuhl_get_uniform("red"), 0);
+	glUseProgram(0);
+	kuhl_errorcheck();
+
+	int perRow = 50;
+	for(int i=0; i<NUM_QUADS; i++)
+		init_geometryQuad(&quads[i], program, (i%perRow)*.02f-.5f, (i/perRow)*.02f-.5f);
+
+	dgr_init();     /* Initialize DGR based on config file. */
+
+	float initCamPos[3]  = {0,0,2}; // location of camera
+	float initCamLook[3] = {0,0,0}; // a point the camera is facing at
+	float initCamUp[3]   = {0,1,0}; // a vector indicating which direction is up
+	viewmat_init(initCamPos, initCamLook, initCamUp);
+
+	while(!glfwWindowShouldClose(kuhl_get_window()))
+	{
+		display();
+		kuhl_errorcheck();
+
+		/* process events (keyboard, mouse, etc) */
+		glfwPollEvents();
+	}
+	exit(EXIT_SUCCESS);
+}
@@ -37,12 +37,13 @@ static particle **particles;
 void explode()
 {
 	kuhl_geometry *g = modelgeom;
-	for(unsigned int i=0; i<kuhl_geometry_count(modelgeom); i++)
+	for(unsigned int i=0; g != NULL; i++)
 	{
-		/* Get the normal information from each of the vertices. */
+		/* Get the normal information from each of the vertices
+		 * (from RAM, we don't change them). */
 		GLint numFloats = 0;
-		GLfloat *norm = kuhl_geometry_attrib_get(g, "in_Normal",
-		                                         &numFloats);
+		GLfloat *norm = kuhl_geometry_attrib_get_range(g, "in_Normal",
+		                                               0, 0, &numFloats);
 		
 		/* Calculate the velocity of each vertex when the explosion occurs */
 		for(unsigned int j=0; j<g->vertex_count; j++)
@@ -72,7 +73,7 @@ void explode()
 void update()
 {
 	kuhl_geometry *g = modelgeom;
-	for(unsigned int i=0; i<kuhl_geometry_count(modelgeom); i++)
+	for(unsigned int i=0; g != NULL; i++)
 	{
 		int numFloats = 0;
 		GLfloat *pos = kuhl_geometry_attrib_get(g, "in_Position",
@@ -186,11 +187,8 @@ void display()
 
 		glUseProgram(program);
 		kuhl_errorcheck();
-		/* Send the perspective projection matrix to the vertex program. */
-		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
-		                   1, // number of 4x4 float matrices
-		                   0, // transpose
-		                   perspective); // value
+		/* The vertex program gets the projection matrix from the
+		 * KuhlFrame uniform block that viewmat_get() filled in. */
 
 		/* Send the modelview matrix to the vertex program. */
 		glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
@@ -274,6 +272,12 @@ int main(int argc, char** argv)
 	modelgeom = kuhl_load_model(modelFilename, modelTexturePath, program, bbox);
 	// Scale/translate model so it fits in 1x1x1 box and is sitting on the origin.
 	kuhl_make_geom_fit(modelgeom, bbox, 1, 0,0,0);
+	/* We change the vertex positions every frame. Store them so that
+	 * we can update them without waiting for the GPU. */
+	kuhl_geometry_attrib_dynamic(modelgeom, "in_Position", KG_FULL_LIST);
+	/* Keep a copy of the normals so that reading them doesn't
+	 * require waiting for the GPU. */
+	kuhl_geometry_attrib_shadow(modelgeom, "in_Normal", KG_FULL_LIST);
 
 	/* Count the number of kuhl_geometry objects for this model */
 	unsigned int geomCount = kuhl_geometry_count(modelgeom);
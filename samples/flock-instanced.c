@@ -5,9 +5,10 @@
 
 /** @file Draws a single model repeatedly using INSTANCING. A special
  * draw call is used that draws the same object repeatedly using one
- * call. The only difference between the different objects is that
- * gl_InstanceID is set in the GLSL program an integer that starts at
- * 0 and increments for each of the different objects.
+ * call. Each instance gets its own transformation matrix from a
+ * per-instance attribute (see kuhl_geometry_instance_attrib()). The
+ * matrices are computed on the CPU and streamed to the GPU every
+ * frame, but all of the models are still drawn with one draw call.
  *
  * Details: https://learnopengl.com/Advanced-OpenGL/Instancing
  *
@@ -44,6 +45,15 @@ static const float initCamUp[3]   = {0,1,0};
 
 #define NUM_MODELS 5000
 
+/** The transform of each instance, sent to the in_InstanceMatrix
+ * attribute every frame. */
+static float instanceMatrix[NUM_MODELS][16];
+
+/** The path each instance flies along: It circles around the Y axis
+ * with this radius, height, speed (degrees/second) and starting
+ * angle. */
+static float orbit[NUM_MODELS][4];
+
 #define GLSL_VERT_FILE "flock-instanced.vert"
 #define GLSL_FRAG_FILE "viewer.frag"
 
@@ -129,11 +139,8 @@ void display()
 
 		glUseProgram(program);
 		kuhl_errorcheck();
-		/* Send the perspective projection matrix to the vertex program. */
-		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
-		                   1, // number of 4x4 float matrices
-		                   0, // transpose
-		                   perspective); // value
+		/* The vertex program gets the projection matrix from the
+		 * KuhlFrame uniform block that viewmat_get() filled in. */
 
 		glUniform1i(kuhl_get_uniform("renderStyle"), renderStyle);
 
@@ -145,10 +152,12 @@ void display()
 		                   0, // transpose
 		                   modelview); // value
 
-		/* Send an array containing positions of each instance and draw
-		 * many instances of the model with one draw call. */
+		/* Draw many instances of the model with one draw call. Each
+		 * one is transformed by its own in_InstanceMatrix. */
+		glUniform1i(kuhl_get_uniform("Instanced"), 1);
 		kuhl_errorcheck();
 		kuhl_geometry_draw_instanced(modelgeom, NUM_MODELS);
+		glUniform1i(kuhl_get_uniform("Instanced"), 0);
 		kuhl_errorcheck();
 
 		// aspect ratio will be zero when the program starts (and FPS hasn't been computed yet)
@@ -166,7 +175,7 @@ void display()
 			/* Make sure we don't use a projection matrix */
 			float identity[16];
 			mat4f_identity(identity);
-			glUniformMatrix4fv(kuhl_get_uniform("Projection"), 1, 0, identity);
+			viewmat_frame_override(identity, identity);
 
 			/* Don't use depth testing and make sure we use the texture
 			 * rendering style */
@@ -174,6 +183,7 @@ void display()
 			glUniform1i(kuhl_get_uniform("renderStyle"), 1);
 			kuhl_geometry_draw(fpsgeom); /* Draw the quad */
 			glEnable(GL_DEPTH_TEST);
+			viewmat_frame_restore();
 			kuhl_errorcheck();
 		}
 
@@ -188,6 +198,18 @@ void display()
 	dgr_setget("time", &time, sizeof(double));
 	kuhl_update_model(modelgeom, 0, fmod(time,10));
 
+	/* Move each of the models along its orbit. The new matrices are
+	 * copied to the GPU the next time the model is drawn. */
+	for(int i=0; i<NUM_MODELS; i++)
+	{
+		float angle = orbit[i][3] + orbit[i][2]*(float)time;
+		float rotate[16], translate[16];
+		mat4f_rotateAxis_new(rotate, angle, 0,1,0);
+		mat4f_translate_new(translate, 0, orbit[i][1], orbit[i][0]);
+		mat4f_mult_mat4f_new(instanceMatrix[i], rotate, translate);
+	}
+	kuhl_geometry_instance_attrib_update(modelgeom, instanceMatrix[0], NUM_MODELS, "in_InstanceMatrix", KG_FULL_LIST);
+
 	viewmat_end_frame();
 
 	/* Check for errors. If there are errors, consider adding more
@@ -225,6 +247,19 @@ int main(int argc, char** argv)
 	// scale model so it fits in 1x1x1 box centered at origin.
 	kuhl_make_geom_fit(modelgeom, bbox, 0, 0,0,0);
 
+	/* Give each model a random orbit and add a per-instance matrix
+	 * attribute to every piece of the model. KG_DYNAMIC lets us
+	 * replace the matrices every frame without waiting for the GPU. */
+	for(int i=0; i<NUM_MODELS; i++)
+	{
+		orbit[i][0] = drand48()*25+1;
+		orbit[i][1] = drand48()*50-25;
+		orbit[i][2] = (drand48()*2-1) * 30;
+		orbit[i][3] = drand48()*360;
+		mat4f_identity(instanceMatrix[i]);
+	}
+	kuhl_geometry_instance_attrib(modelgeom, instanceMatrix[0], NUM_MODELS, 16, "in_InstanceMatrix", KG_WARN | KG_DYNAMIC | KG_FULL_LIST);
+
 	while(!glfwWindowShouldClose(kuhl_get_window()))
 	{
 		display();
@@ -5,13 +5,28 @@ in vec2 in_TexCoord; /* Texture coordinate */
 in vec3 in_Normal;   /* Normal vector at this vertex (object coordinates) */
 in vec3 in_Color;    /* Vertex color */
 
+in mat4 in_InstanceMatrix; /* Transform for this instance */
+uniform int Instanced; /* Is in_InstanceMatrix set? */
+
 in vec4 in_BoneIndex;
 in vec4 in_BoneWeight;
 uniform mat4 BoneMat[128];
 uniform int NumBones;
 
+/* Camera information filled in by viewmat (see KUHL_FRAME_BINDING
+ * in kuhl-util.h). */
+layout(std140) uniform KuhlFrame
+{
+	mat4 View;
+	mat4 Projection;
+	mat4 ViewInverse;
+	mat4 ProjectionInverse;
+	vec4 EyePosition;
+	vec4 Viewport;
+	float Time;
+};
+
 uniform mat4 ModelView;
-uniform mat4 Projection;
 uniform mat4 GeomTransform;
 
 out vec2 out_TexCoord;
@@ -19,37 +34,18 @@ out vec3 out_Color;
 out vec3 out_Normal_CC;   // normal vector (camera coordinates)
 out vec3 out_Position_CC; // vertex position (camera coordinates)
 
-// https://stackoverflow.com/q/12964279
-// https://www.wolframalpha.com/input?i=plot%28+mod%28+sin%28x*12.9898+%2B+y*78.233%29+*+43758.5453%2C1%29x%3D0..2%2C+y%3D0..2%29
-float rand(vec2 co){
-  return fract(sin(dot(co.xy ,vec2(12.9898,78.233))) * 43758.5453);
-}
-
-vec4 getRandomPosition()
-{
-	vec3 pos;
-	pos.x = rand(vec2(gl_InstanceID, 0));
-	pos.y = rand(vec2(gl_InstanceID, 1));
-	pos.z = rand(vec2(gl_InstanceID, 2));
-
-	pos = pos * 50 - 25;
-	return vec4(pos, 1);
-}
-
 void main()
 {
 	// Copy texture coordinates and color to fragment program
 	out_TexCoord = in_TexCoord;
 	out_Color = in_Color;
 
-	// Get random position from instance ID
-	mat4 randomPosMat = mat4(1); // identity
-	// If instance ID is 1, don't translate. This allows normal draw
-	// calls without instances to be drawn without the extra random
-	// transformation applied. In flock-instanced, it makes the FPS
-	// display correctly.
-	if(gl_InstanceID > 0)
-		randomPosMat[3] = getRandomPosition();  // set 4th column
+	// Get the transform for this instance. Geometry that isn't drawn
+	// with instances (the FPS label in flock-instanced) doesn't have
+	// the in_InstanceMatrix attribute, so it isn't transformed.
+	mat4 instanceMat = mat4(1); // identity
+	if(Instanced != 0)
+		instanceMat = in_InstanceMatrix;
 
 	/* Calculate the actual modelview matrix: */
 	mat4 actualModelView;
@@ -61,13 +57,13 @@ void main()
 		         in_BoneWeight.y * BoneMat[int(in_BoneIndex.y)] +
 		         in_BoneWeight.z * BoneMat[int(in_BoneIndex.z)] +
 		         in_BoneWeight.w * BoneMat[int(in_BoneIndex.w)];
-		actualModelView = ModelView * randomPosMat * m;
+		actualModelView = ModelView * instanceMat * m;
 	}
 	else
 		/* If we have a model without animation/bones in it, we simply
 		 * need to account for the GeomTransform matrix embedded in
 		 * the 3D model. */
-		actualModelView = ModelView * randomPosMat * GeomTransform;
+		actualModelView = ModelView * instanceMat * GeomTransform;
 
 
 	mat3 NormalMat = transpose(inverse(mat3(actualModelView)));
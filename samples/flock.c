@@ -25,6 +25,7 @@
 #include <GLFW/glfw3.h>
 
 static GLuint program = 0; /**< id value for the GLSL program */
+static GLuint modelProgram = 0; /**< GLSL program used to draw the model */
 
 static kuhl_geometry *fpsgeom = NULL;
 static kuhl_geometry *modelgeom = NULL;
@@ -48,6 +49,10 @@ static float positions[NUM_MODELS][3];
 
 #define GLSL_VERT_FILE "viewer.vert"
 #define GLSL_FRAG_FILE "viewer.frag"
+/* Used instead of GLSL_VERT_FILE to draw the model if OpenGL 4.3 is
+ * available so all of the meshes in the model are drawn with one
+ * glMultiDrawElementsIndirect() call. */
+#define GLSL_MULTIDRAW_VERT_FILE "viewer-multidraw.vert"
 
 /* Called by GLFW whenever a key is pressed. */
 void keyboard(GLFWwindow* window, int key, int scancode, int action, int mods)
@@ -130,13 +135,10 @@ void display()
 		float viewMat[16], perspective[16];
 		viewmat_get(viewMat, perspective, viewportID);
 
-		glUseProgram(program);
+		glUseProgram(modelProgram);
 		kuhl_errorcheck();
-		/* Send the perspective projection matrix to the vertex program. */
-		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
-		                   1, // number of 4x4 float matrices
-		                   0, // transpose
-		                   perspective); // value
+		/* The vertex program gets the projection matrix from the
+		 * KuhlFrame uniform block that viewmat_get() filled in. */
 
 		glUniform1i(kuhl_get_uniform("renderStyle"), renderStyle);
 
@@ -162,6 +164,7 @@ void display()
 		// aspect ratio will be zero when the program starts (and FPS hasn't been computed yet)
 		if(dgr_is_master())
 		{
+			glUseProgram(program);
 			float stretchLabel[16];
 			mat4f_scale_new(stretchLabel, 1/16.0f / viewmat_window_aspect_ratio(), 1/16.0f, 1.0f);
 			
@@ -174,7 +177,7 @@ void display()
 			/* Make sure we don't use a projection matrix */
 			float identity[16];
 			mat4f_identity(identity);
-			glUniformMatrix4fv(kuhl_get_uniform("Projection"), 1, 0, identity);
+			viewmat_frame_override(identity, identity);
 
 			/* Don't use depth testing and make sure we use the texture
 			 * rendering style */
@@ -182,6 +185,7 @@ void display()
 			glUniform1i(kuhl_get_uniform("renderStyle"), 1);
 			kuhl_geometry_draw(fpsgeom); /* Draw the quad */
 			glEnable(GL_DEPTH_TEST);
+			viewmat_frame_restore();
 			kuhl_errorcheck();
 		}
 
@@ -219,6 +223,14 @@ int main(int argc, char** argv)
 	/* Compile and link a GLSL program composed of a vertex shader and
 	 * a fragment shader. */
 	program = kuhl_create_program(GLSL_VERT_FILE, GLSL_FRAG_FILE);
+	int loadOptions = KL_NONE;
+	if(GLEW_VERSION_4_3)
+	{
+		modelProgram = kuhl_create_program(GLSL_MULTIDRAW_VERT_FILE, GLSL_FRAG_FILE);
+		loadOptions = KL_MULTIDRAW;
+	}
+	else
+		modelProgram = program;
 
 	dgr_init();     /* Initialize DGR based on environment variables. */
 	viewmat_init(initCamPos, initCamLook, initCamUp);
@@ -230,7 +242,7 @@ int main(int argc, char** argv)
 	// Load the model from the file
 	const char *modelFile = "../models/duck/duck.dae";
 	float bbox[6];
-	modelgeom = kuhl_load_model(modelFile, NULL, program, bbox);
+	modelgeom = kuhl_load_model_options(modelFile, NULL, modelProgram, bbox, loadOptions);
 	// scale model so it fits in 1x1x1 box centered at origin.
 	kuhl_make_geom_fit(modelgeom, bbox, 0, 0,0,0);
 
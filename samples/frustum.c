@@ -126,11 +126,10 @@ void display()
 		glUseProgram(program);
 		kuhl_errorcheck();
 		
-		/* Send the perspective projection matrix to the vertex program. */
-		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
-		                   1, // number of 4x4 float matrices
-		                   0, // transpose
-		                   perspective); // value
+		/* Send the perspective projection matrix to the vertex
+		 * program. We don't use viewmat_get(), so we fill in the
+		 * KuhlFrame uniform block ourselves. */
+		viewmat_frame_override(viewMat, perspective);
 		/* Send the modelview matrix to the vertex program. */
 		glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
 		                   1, // number of 4x4 float matrices
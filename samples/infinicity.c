@@ -33,6 +33,14 @@ static float CamPos[3]  = {12.5,10,30}; // location of camera
 static float CamLook[3] = {12.5,1,0}; // a point the camera is facing at
 static float CamUp[3]   = {0,1,0}; // a vector indicating which direction is up
 static float renderCheck = 0;	
+static int drawnCount = 0;  /**< Buildings drawn since the last report */
+static int culledCount = 0; /**< Buildings skipped by frustum culling since the last report */
+static int useOcclusion = 0; /**< Use occlusion queries instead of frustum culling (toggle with 'o') */
+static int useBatches = 0; /**< Draw the buildings merged by kuhl_geometry_batch_static() (toggle with 'm') */
+static kuhl_geometry *batches = NULL; /**< All of the building parts merged into a few geometry objects */
+static int batchRow[400]; /**< Row (j) of each building part passed to kuhl_geometry_batch_static() */
+static unsigned int batchCount = 0; /**< Number of building parts passed to kuhl_geometry_batch_static() */
+static int batchRowsShown = -1; /**< Number of rows that are not hidden in the batches */
 /* Called by GLFW whenever a key is pressed. */
 void keyboard(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
@@ -77,6 +85,32 @@ void keyboard(GLFWwindow* window, int key, int scancode, int action, int mods)
 		}
 	}
 
+	if(key == GLFW_KEY_O && action == GLFW_PRESS){
+		useOcclusion = !useOcclusion;
+		printf("Occlusion queries: %s\n", useOcclusion ? "on" : "off (frustum culling)");
+	}
+
+	if(key == GLFW_KEY_M && action == GLFW_PRESS){
+		useBatches = !useBatches;
+		printf("Batched buildings: %s\n", useBatches ? "on" : "off");
+	}
+
+}
+
+/** Draws part of a building. Buildings are drawn from front to back,
+ * so occlusion queries can skip buildings hidden behind closer
+ * ones. Otherwise, buildings outside of the view frustum are
+ * skipped. */
+void drawBuildingPart(kuhl_geometry *geom, const float modelview[16], const float perspective[16])
+{
+	if(useOcclusion)
+		kuhl_geometry_draw_occlusion(geom);
+	else
+	{
+		int culled = 0;
+		drawnCount += kuhl_geometry_draw_culled(geom, modelview, perspective, &culled);
+		culledCount += culled;
+	}
 }
 
 /** Draws the 3D scene. */
@@ -155,14 +189,11 @@ void display()
 		glUseProgram(program);
 		kuhl_errorcheck();
 		
-		/* Send the perspective projection matrix to the vertex program. */
-		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
-		                   1, // number of 4x4 float matrices
-		                   0, // transpose
-		                   perspective); // value
+		/* The vertex program gets the projection matrix from the
+		 * KuhlFrame uniform block that viewmat_get() filled in. */
 		/* Send the modelview matrix to the vertex program. */
 		float modelview[16];
-		for(int i=0; i < 10; i++)
+		for(int i=0; i < 10 && !useBatches; i++)
 		{
 			for(int j=0; j < rowNum; j++)
             {
@@ -182,15 +213,33 @@ void display()
 
 			kuhl_errorcheck();
 			if(isComplex[i][j] == 1){
-				kuhl_geometry_draw(&buildingTop[i][j]); 
-				kuhl_geometry_draw(&windowTop[i][j]);
+				drawBuildingPart(&buildingTop[i][j], modelview, perspective);
+				drawBuildingPart(&windowTop[i][j], modelview, perspective);
 				kuhl_errorcheck();
 			}
-			kuhl_geometry_draw(&buildingBottom[i][j]); 
-			kuhl_geometry_draw(&windowBottom[i][j]);
+			drawBuildingPart(&buildingBottom[i][j], modelview, perspective);
+			drawBuildingPart(&windowBottom[i][j], modelview, perspective);
 			kuhl_errorcheck();
 			}
 		}
+		if(useBatches)
+		{
+			/* The vertices in the batches are already scaled and
+			 * translated. Hide the rows that aren't drawn without
+			 * batches. */
+			int rowsShown = rowNum < 10 ? (int) ceilf(rowNum) : 10;
+			if(rowsShown < 0)
+				rowsShown = 0;
+			if(rowsShown != batchRowsShown)
+			{
+				for(unsigned int k=0; k < batchCount; k++)
+					kuhl_geometry_batch_hide(batches, k, batchRow[k] >= rowsShown);
+				batchRowsShown = rowsShown;
+			}
+			glUniformMatrix4fv(kuhl_get_uniform("ModelView"), 1, 0, viewMat);
+			kuhl_geometry_draw(batches);
+			kuhl_errorcheck();
+		}
 		glUseProgram(0); // stop using a GLSL program.
 		glUseProgram(programTex);
 
@@ -199,10 +248,6 @@ void display()
 		mat4f_translate_new(translateGround, 0, 0, 3 *floor(renderCheck));
 		float modelViewRoad[16];
 		mat4f_mult_mat4f_many(modelViewRoad, viewMat, translateGround, scaleMat, NULL);
-		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
-		                   1, // number of 4x4 float matrices
-		                   0, // transpose
-		                   perspective); // value
 		glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
 			                   1, // number of 4x4 float matrices
 			                   0, // transpose
@@ -219,6 +264,26 @@ void display()
 	} // finish viewport loop
 	viewmat_end_frame();
 
+	/* Report how many objects were skipped once per second. */
+	static long lastReport = 0;
+	long now = kuhl_milliseconds();
+	if(now - lastReport > 1000)
+	{
+		if(useBatches)
+			msg(MSG_INFO, "Batches: %u draw calls per eye for the buildings", kuhl_geometry_count(batches));
+		else if(useOcclusion)
+		{
+			long visible, occluded, pending;
+			kuhl_occlusion_stats(&visible, &occluded, &pending);
+			msg(MSG_INFO, "Occlusion queries: %ld visible, %ld occluded, %ld not ready", visible, occluded, pending);
+		}
+		else
+			msg(MSG_INFO, "Frustum culling: drew %d objects, culled %d objects", drawnCount, culledCount);
+		drawnCount = 0;
+		culledCount = 0;
+		lastReport = now;
+	}
+
 	/* Check for errors. If there are errors, consider adding more
 	 * calls to kuhl_errorcheck() in your code. */
 	kuhl_errorcheck();
@@ -599,6 +664,32 @@ int main(int argc, char** argv){
 	}
 
 
+	/* Merge all of the building parts into a few geometry objects
+	 * that can be drawn with a few draw calls. Rows are added one
+	 * after another so that hiding the last rows leaves one range of
+	 * each batch to draw. */
+	kuhl_geometry *parts[400];
+	float partMatrices[400*16];
+	float scaleMat[16];
+	mat4f_scale_new(scaleMat, 3, 3, 3);
+	for(int j = 0; j < 10; j++){
+		for(int i = 0; i < 10; i++){
+			kuhl_geometry *cell[4] = { &buildingBottom[i][j], &windowBottom[i][j],
+			                           &buildingTop[i][j], &windowTop[i][j] };
+			float translateMat[16];
+			mat4f_translate_new(translateMat, i, 0, -j+10);
+			for(int k = 0; k < (isComplex[i][j] == 1 ? 4 : 2); k++){
+				parts[batchCount] = cell[k];
+				mat4f_mult_mat4f_new(partMatrices+batchCount*16, scaleMat, translateMat);
+				batchRow[batchCount] = j;
+				batchCount++;
+			}
+		}
+	}
+	batches = kuhl_geometry_batch_static(parts, partMatrices, batchCount);
+	msg(MSG_INFO, "Merged %u building parts into %u batches (press 'm' to draw them).",
+	    batchCount, kuhl_geometry_count(batches));
+
 	init_ground(&ground, programTex);
 
 	glUseProgram(0); // stop using a GLSL program.
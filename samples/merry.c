@@ -182,11 +182,8 @@ void display()
 		glUseProgram(program);
 		kuhl_errorcheck();
 		
-		/* Send the perspective projection matrix to the vertex program. */
-		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
-		                   1, // number of 4x4 float matrices
-		                   0, // transpose
-		                   perspective); // value
+		/* The vertex program gets the projection matrix from the
+		 * KuhlFrame uniform block that viewmat_get() filled in. */
 	
 
 		//place the hippo in the scene
@@ -12,7 +12,19 @@ in vec3 in_Normal;
 out vec4 out_Position_CC;
 out vec3 out_Normal_CC;
 
-uniform mat4 Projection;
+/* Camera information filled in by viewmat (see KUHL_FRAME_BINDING
+ * in kuhl-util.h). */
+layout(std140) uniform KuhlFrame
+{
+	mat4 View;
+	mat4 Projection;
+	mat4 ViewInverse;
+	mat4 ProjectionInverse;
+	vec4 EyePosition;
+	vec4 Viewport;
+	float Time;
+};
+
 uniform mat4 ModelView;
 uniform mat4 ModelViewHippo;
 uniform mat4 ModelViewCow;
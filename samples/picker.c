@@ -94,11 +94,8 @@ void display()
 		glUseProgram(program);
 		kuhl_errorcheck();
 		
-		/* Send the perspective projection matrix to the vertex program. */
-		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
-		                   1, // number of 4x4 float matrices
-		                   0, // transpose
-		                   perspective); // value
+		/* The vertex program gets the projection matrix from the
+		 * KuhlFrame uniform block that viewmat_get() filled in. */
 		/* Send the modelview matrix to the vertex program. */
 		glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
 		                   1, // number of 4x4 float matrices
@@ -127,8 +124,7 @@ void display()
 			 * use any matrices. */
 			float identity[16];
 			mat4f_identity(identity);
-			glUniformMatrix4fv(kuhl_get_uniform("Projection"),
-			                   1, 0, identity);
+			viewmat_frame_override(identity, identity);
 			glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
 			                   1, 0, identity);
 
@@ -137,6 +133,7 @@ void display()
 			glDisable(GL_DEPTH_TEST);
 			kuhl_geometry_draw(&cursor);
 			glEnable(GL_DEPTH_TEST);
+			viewmat_frame_restore();
 
 			/* When we render images on the Oculus, we are rendering
 			 * into a multisampled framebuffer object, and we can't
@@ -125,11 +125,10 @@ void display()
 		glUseProgram(program);
 		kuhl_errorcheck();
 		
-		/* Send the perspective projection matrix to the vertex program. */
-		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
-		                   1, // number of 4x4 float matrices
-		                   0, // transpose
-		                   perspective); // value
+		/* Send the perspective projection matrix to the vertex
+		 * program. It replaces the one that viewmat_get() put in the
+		 * KuhlFrame uniform block. */
+		viewmat_frame_override(viewMat, perspective);
 		/* Send the modelview matrix to the vertex program. */
 		glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
 		                   1, // number of 4x4 float matrices
@@ -175,6 +174,7 @@ void display()
 		/* Stop rendering to texture */
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 		glUseProgram(0);
+		viewmat_frame_restore();
 		kuhl_errorcheck();
 		
 #if USE_MSAA==1
@@ -199,11 +199,8 @@ void display()
 		glUseProgram(program);
 		kuhl_errorcheck();
 		
-		/* Send the perspective projection matrix to the vertex program. */
-		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
-		                   1, // number of 4x4 float matrices
-		                   0, // transpose
-		                   perspective); // value
+		/* The vertex program gets the projection matrix from the
+		 * KuhlFrame uniform block that viewmat_get() filled in. */
 		/* Send the modelview matrix to the vertex program. */
 		glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
 		                   1, // number of 4x4 float matrices
@@ -221,10 +218,6 @@ void display()
 		float modelviewCloud[16];
 		mat4f_mult_mat4f_new(modelviewCloud, viewMat, scaleMatrix);
 
-		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
-		                   1, // number of 4x4 float matrices
-		                   0, // transpose
-		                   perspective); // value
 		/* Send the modelview matrix to the vertex program. */
 		glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
 		                   1, // number of 4x4 float matrices
@@ -292,6 +285,10 @@ void init_surface(kuhl_geometry *geom, GLuint prog){
 
 	free(vertexData);
 
+	/* Each grid vertex is repeated by up to six triangles. Store it
+	 * once and draw the triangles with indices instead. */
+	kuhl_geometry_weld(geom, 0, KG_NONE);
+
 	/* Load the texture. It will be bound to texId */	
 	GLuint texId = 0;
 	GLuint texId1 = 0;
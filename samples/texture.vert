@@ -3,8 +3,20 @@
 in vec3 in_Position;
 in vec2 in_TexCoord;
 
+/* Camera information filled in by viewmat (see KUHL_FRAME_BINDING
+ * in kuhl-util.h). */
+layout(std140) uniform KuhlFrame
+{
+	mat4 View;
+	mat4 Projection;
+	mat4 ViewInverse;
+	mat4 ProjectionInverse;
+	vec4 EyePosition;
+	vec4 Viewport;
+	float Time;
+};
+
 uniform mat4 ModelView;
-uniform mat4 Projection;
 
 out vec2 out_TexCoord;
 
@@ -0,0 +1,67 @@
+#version 430 // GLSL 430 = OpenGL 4.3
+
+/* This vertex program is the same as viewer.vert except that it is
+ * intended for models loaded with kuhl_load_model_options() and the
+ * KL_MULTIDRAW option. Several meshes are drawn with one draw call
+ * and each mesh gets its GeomTransform from a shader storage buffer
+ * instead of a uniform variable. Meshes with bones are not packed and
+ * can't be drawn with this program. */
+
+in vec3 in_Position; /* Position of vertex (object coordinates) */
+in vec2 in_TexCoord; /* Texture coordinate */
+in vec3 in_Normal;   /* Normal vector at this vertex (object coordinates) */
+in vec3 in_Color;    /* Vertex color */
+in uint in_DrawID;   /* Which mesh this vertex belongs to */
+
+struct KuhlDraw
+{
+	mat4 GeomTransform;
+	ivec4 Material; /* x = index of the material in the model file */
+};
+layout(std430, binding = 0) buffer KuhlDrawData
+{
+	KuhlDraw kuhlDraws[];
+};
+
+/* Camera information filled in by viewmat once per viewport (see
+ * KUHL_FRAME_BINDING in kuhl-util.h). The projection matrix doesn't
+ * need to be sent to this program. */
+layout(std140) uniform KuhlFrame
+{
+	mat4 View;
+	mat4 Projection;
+	mat4 ViewInverse;
+	mat4 ProjectionInverse;
+	vec4 EyePosition;
+	vec4 Viewport;
+	float Time;
+};
+
+uniform mat4 ModelView;
+
+out vec2 out_TexCoord;
+out vec3 out_Color;
+out vec3 out_Normal_CC;   // normal vector (camera coordinates)
+out vec3 out_Position_CC; // vertex position (camera coordinates)
+
+void main() 
+{
+	// Copy texture coordinates and color to fragment program
+	out_TexCoord = in_TexCoord;
+	out_Color = in_Color;
+
+	/* Calculate the actual modelview matrix: */
+	mat4 actualModelView = ModelView * kuhlDraws[in_DrawID].GeomTransform;
+
+	mat3 NormalMat = transpose(inverse(mat3(actualModelView)));
+	
+	// Transform normal from object coordinates to camera coordinates
+	out_Normal_CC = normalize(NormalMat * in_Normal);
+
+	// Transform vertex from object to unhomogenized Normalized Device
+	// Coordinates (NDC).
+	gl_Position = Projection * actualModelView * vec4(in_Position, 1);
+
+	// Calculate the position of the vertex in camera coordinates:
+	out_Position_CC = vec3(actualModelView * vec4(in_Position, 1));
+}
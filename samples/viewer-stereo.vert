@@ -0,0 +1,83 @@
+#version 410 // GLSL 410 = OpenGL 4.1
+#extension GL_ARB_shader_viewport_layer_array : require
+
+/* This vertex program is the same as viewer.vert except that it can
+ * draw both eyes of a stereo display at once (see
+ * viewmat_begin_stereo()). Every object is drawn with two instances:
+ * Instance 0 uses ModelView[0] and the camera information in Frame[0]
+ * and is drawn in viewport 0; instance 1 is drawn in viewport 1. When
+ * an object is drawn normally (one instance), it works just like
+ * viewer.vert. */
+
+in vec3 in_Position; /* Position of vertex (object coordinates) */
+in vec2 in_TexCoord; /* Texture coordinate */
+in vec3 in_Normal;   /* Normal vector at this vertex (object coordinates) */
+in vec3 in_Color;    /* Vertex color */
+
+in vec4 in_BoneIndex;
+in vec4 in_BoneWeight;
+uniform mat4 BoneMat[128];
+uniform int NumBones;
+
+/* Camera information filled in by viewmat for each eye (see
+ * KUHL_FRAME_BINDING in kuhl-util.h). */
+layout(std140) uniform KuhlFrame
+{
+	mat4 View;
+	mat4 Projection;
+	mat4 ViewInverse;
+	mat4 ProjectionInverse;
+	vec4 EyePosition;
+	vec4 Viewport;
+	float Time;
+} Frame[2];
+
+uniform mat4 ModelView[2];
+uniform mat4 GeomTransform;
+
+out vec2 out_TexCoord;
+out vec3 out_Color;
+out vec3 out_Normal_CC;   // normal vector (camera coordinates)
+out vec3 out_Position_CC; // vertex position (camera coordinates)
+
+void main() 
+{
+	int eye = gl_InstanceID % 2;
+	gl_ViewportIndex = eye;
+
+	// Copy texture coordinates and color to fragment program
+	out_TexCoord = in_TexCoord;
+	out_Color = in_Color;
+
+	/* Calculate the actual modelview matrix: */
+	mat4 actualModelView;
+	if(NumBones > 0)
+	{
+		/* If we have an animated model/character that contains bones,
+		   we need to account for the bone matrices. */
+		mat4 m = in_BoneWeight.x * BoneMat[int(in_BoneIndex.x)] +
+		         in_BoneWeight.y * BoneMat[int(in_BoneIndex.y)] +
+		         in_BoneWeight.z * BoneMat[int(in_BoneIndex.z)] +
+		         in_BoneWeight.w * BoneMat[int(in_BoneIndex.w)];
+		actualModelView = ModelView[eye] * m;
+	}
+	else
+		/* If we have a model without animation/bones in it, we simply
+		 * need to account for the GeomTransform matrix embedded in
+		 * the 3D model. */
+		actualModelView = ModelView[eye] * GeomTransform;
+
+	mat3 NormalMat = transpose(inverse(mat3(actualModelView)));
+	
+	// Transform normal from object coordinates to camera coordinates
+	out_Normal_CC = normalize(NormalMat * in_Normal);
+
+	// Transform vertex from object to unhomogenized Normalized Device
+	// Coordinates (NDC). Arrays of uniform blocks can't be indexed by
+	// a value that changes within a draw call.
+	mat4 projection = eye == 0 ? Frame[0].Projection : Frame[1].Projection;
+	gl_Position = projection * actualModelView * vec4(in_Position, 1);
+
+	// Calculate the position of the vertex in camera coordinates:
+	out_Position_CC = vec3(actualModelView * vec4(in_Position, 1));
+}
@@ -23,6 +23,7 @@ static int renderStyle = 2;
 static kuhl_geometry *fpsgeom = NULL;
 static kuhl_geometry *modelgeom  = NULL;
 static kuhl_geometry *origingeom = NULL;
+static kuhl_drawlist *modeldrawlist = NULL; /**< Meshes in modelgeom sorted to reduce state changes */
 
 /** The following variable toggles the display an "origin+axis" marker
  * which draws a small box at the origin and draws lines of length 1
@@ -30,6 +31,14 @@ static kuhl_geometry *origingeom = NULL;
  * marker, the marker will be in object, world, etc coordinates. */
 static int showOrigin=0; // was --origin option used?
 
+/** Set if simplified versions of the model are drawn when it is far
+ * away (see kuhl_geometry_lod_generate()). */
+static int useLod=0; // was --lod option used?
+
+/** Set if parts of large meshes that are out of view are not drawn
+ * (see kuhl_geometry_meshlets()). */
+static int useMeshlets=0; // was --meshlets option used?
+
 
 /** Initial position of the camera. 1.55 is a good approximate
  * eyeheight in meters.*/
@@ -46,6 +55,12 @@ static const float initCamUp[3]   = {0.0f,1.0f,0.0f};
 
 #define GLSL_VERT_FILE "viewer.vert"
 #define GLSL_FRAG_FILE "viewer.frag"
+/* Used instead of GLSL_VERT_FILE if both eyes of a stereo display can
+ * be drawn at once (see viewmat_begin_stereo()). */
+#define GLSL_STEREO_VERT_FILE "viewer-stereo.vert"
+
+/** Set if both eyes are drawn at once. */
+static int stereo = 0;
 
 /* Called by GLFW whenever a key is pressed. */
 void keyboard(GLFWwindow* window, int key, int scancode, int action, int mods)
@@ -63,7 +78,7 @@ void keyboard(GLFWwindow* window, int key, int scancode, int action, int mods)
 		{
 			// Reload GLSL program from disk
 			kuhl_delete_program(program);
-			program = kuhl_create_program(GLSL_VERT_FILE, GLSL_FRAG_FILE);
+			program = kuhl_create_program(stereo ? GLSL_STEREO_VERT_FILE : GLSL_VERT_FILE, GLSL_FRAG_FILE);
 			/* Apply the program to the model geometry */
 			kuhl_geometry_program(modelgeom, program, KG_FULL_LIST);
 			/* and the fps label*/
@@ -96,6 +111,86 @@ void keyboard(GLFWwindow* window, int key, int scancode, int action, int mods)
 
 
 
+/** Calculates the modelview matrix that places the FPS label in the
+ * upper left corner of the screen (when no projection matrix is
+ * used). */
+void labelModelview(float modelview[16])
+{
+	float labelHeight = 1/16.0f; // height (percentage of window height)
+	float labelPadding = 0.01f;  // space around label
+
+	float stretchLabel[16];
+	mat4f_scale_new(stretchLabel,
+	                labelHeight / viewmat_window_aspect_ratio(),
+	                labelHeight, 1.0f);
+
+	/* Position label in the upper left corner of the screen */
+	float transLabel[16];
+	mat4f_translate_new(transLabel, -1+labelPadding,
+	                    1-labelHeight-labelPadding, 0.0f);
+	mat4f_mult_mat4f_new(modelview, transLabel, stretchLabel);
+}
+
+/** Draws the scene for both eyes at once. Each object is drawn with
+ * two instances, one for each eye (see viewer-stereo.vert), so the
+ * scene is only submitted to OpenGL once.
+ *
+ * @param viewMat The view matrices for viewport 0 and 1.
+ * @param perspective The projection matrices for viewport 0 and 1.
+ */
+void display_stereo(float viewMat[2][16], float perspective[2][16])
+{
+	/* Both eyes are in the same window, so we can clear them at once. */
+	glClearColor(.2f,.2f,.2f,0.0f); // set clear color to grey
+	glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+	glEnable(GL_DEPTH_TEST); // turn on depth testing
+	glEnable(GL_BLEND);
+	glBlendEquationSeparate(GL_FUNC_ADD, GL_FUNC_ADD);
+	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ZERO);
+	kuhl_errorcheck();
+
+	glUseProgram(program);
+	/* Send both eyes' modelview matrices to the vertex program. The
+	 * projection matrices are in the KuhlFrame uniform blocks that
+	 * viewmat_begin_stereo() filled in. */
+	glUniformMatrix4fv(kuhl_get_uniform("ModelView"), 2, 0, viewMat[0]);
+	glUniform1i(kuhl_get_uniform("renderStyle"), renderStyle);
+	kuhl_errorcheck();
+
+	/* Both eyes are nearly at the same place, so one level of detail
+	 * works for both of them. */
+	if(useLod)
+	{
+		int viewport[4];
+		viewmat_get_viewport(viewport, 0);
+		kuhl_geometry_lod_select(modelgeom, viewMat[0], perspective[0], viewport[3], KG_FULL_LIST);
+	}
+	kuhl_drawlist_clear(modeldrawlist);
+	kuhl_drawlist_add(modeldrawlist, modelgeom, NULL, KG_FULL_LIST);
+	kuhl_drawlist_draw_instanced(modeldrawlist, 2);
+	if(showOrigin && origingeom != NULL)
+		kuhl_geometry_draw_instanced(origingeom, 2);
+	kuhl_errorcheck();
+
+	if(dgr_is_master())
+	{
+		float modelview[2][16], identity[16];
+		labelModelview(modelview[0]);
+		mat4f_copy(modelview[1], modelview[0]);
+		mat4f_identity(identity);
+		glUniformMatrix4fv(kuhl_get_uniform("ModelView"), 2, 0, modelview[0]);
+		viewmat_frame_override(identity, identity);
+
+		glDisable(GL_DEPTH_TEST);
+		glUniform1i(kuhl_get_uniform("renderStyle"), 1);
+		kuhl_geometry_draw_instanced(fpsgeom, 2);
+		glEnable(GL_DEPTH_TEST);
+		viewmat_frame_restore();
+		kuhl_errorcheck();
+	}
+	glUseProgram(0);
+}
+
 /** Draws the 3D scene. */
 void display()
 {
@@ -130,7 +225,13 @@ void display()
 	 * run twice for HMDs (once for the left eye and once for the
 	 * right). */
 	viewmat_begin_frame();
-	for(int viewportID=0; viewportID<viewmat_num_viewports(); viewportID++)
+	float stereoView[2][16], stereoPerspective[2][16];
+	if(stereo && viewmat_begin_stereo(stereoView, stereoPerspective))
+	{
+		display_stereo(stereoView, stereoPerspective);
+		viewmat_end_stereo();
+	}
+	else for(int viewportID=0; viewportID<viewmat_num_viewports(); viewportID++)
 	{
 		viewmat_begin_eye(viewportID);
 
@@ -166,11 +267,8 @@ void display()
 
 		glUseProgram(program);
 		kuhl_errorcheck();
-		/* Send the perspective projection matrix to the vertex program. */
-		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
-		                   1, // number of 4x4 float matrices
-		                   0, // transpose
-		                   perspective); // value
+		/* The vertex program gets the projection matrix from the
+		 * KuhlFrame uniform block that viewmat_get() filled in. */
 
 		/* Send the modelview matrix to the vertex program. */
 		glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
@@ -181,7 +279,18 @@ void display()
 		glUniform1i(kuhl_get_uniform("renderStyle"), renderStyle);
 
 		kuhl_errorcheck();
-		kuhl_geometry_draw(modelgeom); /* Draw the model */
+		/* Draw the model. Models can contain many meshes which share
+		 * a small number of textures, so we let the draw list sort
+		 * them to avoid unnecessary state changes. */
+		if(useLod)
+			kuhl_geometry_lod_select(modelgeom, viewMat, perspective, viewport[3], KG_FULL_LIST);
+		/* This program doesn't enable GL_CULL_FACE, so only meshlets
+		 * outside of the view frustum are culled. */
+		if(useMeshlets)
+			kuhl_geometry_meshlets_cull(modelgeom, viewMat, perspective, 0, KG_FULL_LIST);
+		kuhl_drawlist_clear(modeldrawlist);
+		kuhl_drawlist_add(modeldrawlist, modelgeom, NULL, KG_FULL_LIST);
+		kuhl_drawlist_draw(modeldrawlist);
 		kuhl_errorcheck();
 		if(showOrigin && origingeom != NULL)
 		{
@@ -212,26 +321,14 @@ void display()
 		// aspect ratio will be zero when the program starts (and FPS hasn't been computed yet)
 		if(dgr_is_master())
 		{
-			float labelHeight = 1/16.0f; // height (percentage of window height)
-			float labelPadding = 0.01f;  // space around label
-				
-			float stretchLabel[16];
-			mat4f_scale_new(stretchLabel,
-			                labelHeight / viewmat_window_aspect_ratio(),
-			                labelHeight, 1.0f);
-			
-			/* Position label in the upper left corner of the screen */
-			float transLabel[16];
-			mat4f_translate_new(transLabel, -1+labelPadding,
-			                    1-labelHeight-labelPadding, 0.0f);
 			float modelview[16];
-			mat4f_mult_mat4f_new(modelview, transLabel, stretchLabel);
+			labelModelview(modelview);
 			glUniformMatrix4fv(kuhl_get_uniform("ModelView"), 1, 0, modelview);
 
 			/* Make sure we don't use a projection matrix */
 			float identity[16];
 			mat4f_identity(identity);
-			glUniformMatrix4fv(kuhl_get_uniform("Projection"), 1, 0, identity);
+			viewmat_frame_override(identity, identity);
 
 			/* Don't use depth testing and make sure we use the texture
 			 * rendering style */
@@ -239,6 +336,7 @@ void display()
 			glUniform1i(kuhl_get_uniform("renderStyle"), 1);
 			kuhl_geometry_draw(fpsgeom); /* Draw the quad */
 			glEnable(GL_DEPTH_TEST);
+			viewmat_frame_restore();
 			kuhl_errorcheck();
 		}
 
@@ -282,6 +380,10 @@ int main(int argc, char** argv)
 			fitToView = 1;
 		else if(strcmp(argv[currentArgIndex], "--origin") == 0)
 			showOrigin = 1;
+		else if(strcmp(argv[currentArgIndex], "--lod") == 0)
+			useLod = 1;
+		else if(strcmp(argv[currentArgIndex], "--meshlets") == 0)
+			useMeshlets = 1;
 		else if(modelFilename == NULL)
 		{
 			modelFilename = argv[currentArgIndex];
@@ -308,11 +410,13 @@ int main(int argc, char** argv)
 	if(modelFilename == NULL || usageError)
 	{
 		printf("Usage:\n"
-		       "%s [--fit] [--origin] modelFile     - Textures are assumed to be in the same directory as the model.\n"
+		       "%s [--fit] [--origin] [--lod] [--meshlets] modelFile     - Textures are assumed to be in the same directory as the model.\n"
 		       "- or -\n"
-		       "%s [--fit] [--origin] modelFile texturePath\n"
+		       "%s [--fit] [--origin] [--lod] [--meshlets] modelFile texturePath\n"
 		       "If the optional --fit parameter is included, the model will be scaled and translated to fit within the approximate view of the camera\n"
-		       "If the optional --origin parameter is included, a box will is drawn at the origin and unit-length lines are drawn down each axis.\n",
+		       "If the optional --origin parameter is included, a box will is drawn at the origin and unit-length lines are drawn down each axis.\n"
+		       "If the optional --lod parameter is included, simplified versions of the model are drawn when it is far away.\n"
+		       "If the optional --meshlets parameter is included, parts of large meshes that are out of view are not drawn.\n",
 		       argv[0], argv[0]);
 		exit(EXIT_FAILURE);
 	}
@@ -322,21 +426,32 @@ int main(int argc, char** argv)
 	glfwSetKeyCallback(kuhl_get_window(), keyboard);
 	// glfwSetFramebufferSizeCallback(window, reshape);
 
-	/* Compile and link a GLSL program composed of a vertex shader and
-	 * a fragment shader. */
-	program = kuhl_create_program(GLSL_VERT_FILE, GLSL_FRAG_FILE);
-
 	dgr_init();     /* Initialize DGR based on environment variables. */
 
 	viewmat_init(initCamPos, initCamLook, initCamUp);
 
+	/* Compile and link a GLSL program composed of a vertex shader and
+	 * a fragment shader. If the display has two eyes that can be
+	 * drawn at once, use a vertex shader that can do that. */
+	stereo = viewmat_stereo_supported();
+	program = kuhl_create_program(stereo ? GLSL_STEREO_VERT_FILE : GLSL_VERT_FILE, GLSL_FRAG_FILE);
+
 	// Clear the screen while things might be loading
 	glClearColor(.2f,.2f,.2f,1.0f);
 	glClear(GL_COLOR_BUFFER_BIT);
 
 	// Load the model from the file
 	float bbox[6];
-	modelgeom = kuhl_load_model(modelFilename, modelTexturePath, program, bbox);
+	/* Store the vertex attributes of each mesh in a single buffer
+	 * using smaller types where possible, and order them so that
+	 * they are drawn quickly. */
+	int kl_options = KL_INTERLEAVE | KL_COMPACT | KL_OPTIMIZE;
+	if(useLod)
+		kl_options |= KL_LOD;
+	if(useMeshlets)
+		kl_options |= KL_MESHLETS;
+	modelgeom = kuhl_load_model_options(modelFilename, modelTexturePath, program, bbox, kl_options);
+	modeldrawlist = kuhl_drawlist_new();
 
 	// Modify the GeomTransform matrix in the geometry object so that
 	// the object fits in a 1x1x1 box sitting on top of the location